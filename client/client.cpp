@@ -0,0 +1,129 @@
+// Mini-Shell-client: runs command lines in a shell started with "Mini-Shell --serve <address>".
+//
+//   Mini-Shell-client <address> <command...>   run one command, exit with its status
+//   Mini-Shell-client <address>                run the lines read from stdin over one session
+//   Mini-Shell-client <address> --stop         stop the server
+//
+// -n <count> before the command repeats it and reports the mean round trip on stderr.
+//
+// Build: g++ -std=c++17 -O2 client.cpp -o Mini-Shell-client
+//        cl /std:c++17 /O2 /EHsc client.cpp /Fe:Mini-Shell-client.exe
+#include "../shell_ipc.h" // Protocol and sockets shared with the server
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace {
+
+void printUsage() {
+    std::cerr << "Usage: Mini-Shell-client <address> [-n count] [command...]" << '\n';
+    std::cerr << "       Mini-Shell-client <address> --stop" << '\n';
+    std::cerr << "  <address> is the server's socket path or tcp:<port>." << '\n';
+    std::cerr << "  Without a command, each line read from stdin is sent as one request." << '\n';
+}
+
+// Quotes an argument so the shell's tokenizer reads it back as one token. Single quotes keep
+// text literal; an apostrophe inside one is written as "'" right next to the quoted parts.
+std::string quoteArgument(const std::string& arg) {
+    if (!arg.empty() && arg.find_first_of(" \t\r\n\"'") == std::string::npos)
+        return arg;
+    std::string quoted = "'";
+    for (char c : arg) {
+        if (c == '\'')
+            quoted += "'\"'\"'";
+        else
+            quoted += c;
+    }
+    quoted += '\'';
+    return quoted;
+}
+
+// Sends one command line and copies the reply to stdout/stderr. Returns the command's status,
+// or -1 if the connection failed.
+int runCommand(ipc::Socket server, const std::string& line, bool print) {
+    if (!ipc::writeFrame(server, ipc::Command, line.data(), line.size()))
+        return -1;
+    uint8_t type = 0;
+    std::string payload;
+    while (ipc::readFrame(server, type, payload)) {
+        if (type == ipc::Status) {
+            std::cout.flush();
+            return static_cast<int>(ipc::decodeStatus(payload));
+        }
+        if (!print)
+            continue;
+        if (type == ipc::Err) {
+            std::cout.flush();
+            std::cerr.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        }
+        else {
+            std::cout.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        }
+    }
+    return -1;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 2;
+    }
+    std::string address = argv[1];
+    int first = 2;
+    long repeat = 1;
+    if (argc > 3 && std::string(argv[2]) == "-n") {
+        repeat = std::max(1L, std::atol(argv[3]));
+        first = 4;
+    }
+    std::string command;
+    for (int i = first; i < argc; i++) {
+        if (!command.empty())
+            command += ' ';
+        command += quoteArgument(argv[i]);
+    }
+
+    std::string error;
+    ipc::Socket server = ipc::startup() ? ipc::connectTo(address, error) : ipc::InvalidSocket;
+    if (server == ipc::InvalidSocket) {
+        std::cerr << "Error: cannot connect to " << address << ": " << error << '\n';
+        return 2;
+    }
+
+    int status = 0;
+    if (command == "--stop") {
+        status = ipc::writeFrame(server, ipc::Stop, nullptr, 0) ? 0 : 1;
+    }
+    else if (!command.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < repeat && status >= 0; i++)
+            status = runCommand(server, command, i + 1 == repeat);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (repeat > 1 && status >= 0)
+            std::cerr << repeat << " requests, " << seconds * 1e6 / repeat << " us per round trip" << '\n';
+    }
+    else {
+        std::string line;
+        while (status >= 0 && std::getline(std::cin, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            size_t begin = line.find_first_not_of(" \t");
+            if (begin == std::string::npos)
+                continue;
+            if (line.compare(begin, std::string::npos, "exit") == 0)
+                break;
+            int result = runCommand(server, line, true);
+            status = result < 0 ? result : std::max(status, result);
+        }
+    }
+    ipc::closeSocket(server);
+    if (status < 0) {
+        std::cerr << "Error: connection to " << address << " lost" << '\n';
+        return 2;
+    }
+    return status;
+}
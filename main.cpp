@@ -1,594 +1,8884 @@
 #include <iostream>
 #include <filesystem>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <sstream>
+#include <iomanip>
 #include <fstream>
-#include <windows.h>
-#include <urlmon.h>
 #include <map>
+#include <bitset>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <memory>
 #include <set>
+#include <tuple>
 #include <exception>
+#include <stdexcept>
 #include <algorithm>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h> // before windows.h, for shell_ipc.h
+#include <windows.h>
+#include <urlmon.h>
 #include <shellapi.h> // Needed for ShellExecuteA
-
+#include <io.h> // _isatty
+#include <psapi.h> // GetProcessMemoryInfo
 #pragma comment(lib, "urlmon.lib")
+#pragma comment(lib, "psapi.lib")
+#else
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <cerrno>
+extern char** environ;
+#endif
+#include "module_api.h"
+#include "shell_ipc.h"
+
 namespace fs = std::filesystem;
 
-// Helper function to trim whitespace from a string
-std::string trim(const std::string& s) {
-	auto start = s.begin();
-	while (start != s.end() && std::isspace(*start)) {
-		start++;
-	}
-	auto end = s.end();
-	do {
-		end--;
-	} while (std::distance(start, end) > 0 && std::isspace(*end));
-	return std::string(start, end + 1);
-}
+//------------------------------------------------------------
+// Platform Layer
+//------------------------------------------------------------
 
-// Module interface
-class Module {
-public:
-	virtual void execute(const std::vector<std::string>& args) = 0;
-	virtual std::string getVersion() const = 0; // Get version info
-	virtual ~Module() {}
+// Everything the shell needs from the OS beyond the C++ standard library. Windows is the
+// primary target; the POSIX backend loads modules as .so files so the shell also builds on Linux.
+namespace platform {
+
+// One entry of readDirectory(). size and mtime (seconds since 1970) are only filled in when
+// asked for, except where the directory listing provides them anyway (Windows).
+struct DirectoryEntry {
+	enum Type { File, Directory, Link, Other };
+	std::string name;
+	Type type = Other;
+	unsigned long long size = 0;
+	long long mtime = 0;
 };
 
-// Module Manager
-class ModuleManager {
-public:
-	static ModuleManager& getInstance() {
-		static ModuleManager instance;
-		return instance;
+#ifdef _WIN32
+typedef HANDLE FileHandle;
+typedef HANDLE ProcessHandle;
+const FileHandle InvalidFile = INVALID_HANDLE_VALUE;
+#else
+typedef int FileHandle;
+typedef pid_t ProcessHandle;
+const FileHandle InvalidFile = -1;
+#endif
+
+// CPU time used so far and the peak resident memory, from processUsage().
+struct ProcessUsage {
+	double userSeconds = 0;
+	double systemSeconds = 0;
+	unsigned long long peakResident = 0;   // bytes
+};
+
+// Standard streams of a child process; InvalidFile inherits the shell's own.
+struct StdioHandles {
+	FileHandle in = InvalidFile;
+	FileHandle out = InvalidFile;
+	FileHandle err = InvalidFile;
+};
+
+#ifdef _WIN32
+typedef HMODULE LibraryHandle;
+const char* const LibraryExtension = ".dll";
+
+LibraryHandle openLibrary(const std::string& path) {
+	return LoadLibraryA(path.c_str());
+}
+
+void* findSymbol(LibraryHandle library, const char* name) {
+	return reinterpret_cast<void*>(GetProcAddress(library, name));
+}
+
+void closeLibrary(LibraryHandle library) {
+	FreeLibrary(library);
+}
+
+// Reason for the last failed openLibrary().
+std::string libraryError() {
+	return "error " + std::to_string(GetLastError());
+}
+
+// Run a program (searched in PATH) and wait for it. Returns its exit code, or -1 if it could
+// not be started. Arguments are quoted but must not contain quotes themselves.
+int runProcess(const std::vector<std::string>& args) {
+	std::string commandLine;
+	for (const auto& arg : args) {
+		if (!commandLine.empty())
+			commandLine += ' ';
+		commandLine += '"' + arg + '"';
 	}
+	STARTUPINFOA startup = {};
+	startup.cb = sizeof(startup);
+	PROCESS_INFORMATION process = {};
+	if (!CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, FALSE, CREATE_NO_WINDOW, nullptr, nullptr, &startup, &process))
+		return -1;
+	WaitForSingleObject(process.hProcess, INFINITE);
+	DWORD code = 1;
+	GetExitCodeProcess(process.hProcess, &code);
+	CloseHandle(process.hThread);
+	CloseHandle(process.hProcess);
+	return static_cast<int>(code);
+}
 
-	// Ensure that the "modules" directory exists
-	void ensureModulesDirectoryExists() {
-		try {
-			if (!fs::exists("modules")) {
-				fs::create_directory("modules");
-			}
+// Download url to path; resume continues a partial file. Uses curl.exe (shipped with
+// Windows 10 1803 and later) and falls back to URLDownloadToFileA, which cannot resume.
+bool downloadFile(const std::string& url, const std::string& path, bool resume) {
+	std::vector<std::string> args = { "curl.exe", "-fsSL", "-o", path, url };
+	if (resume)
+		args.insert(args.begin() + 2, { "-C", "-" });
+	int code = runProcess(args);
+	if (code == -1)
+		return SUCCEEDED(URLDownloadToFileA(nullptr, url.c_str(), path.c_str(), 0, nullptr));
+	return code == 0;
+}
+
+// Start a program (or open a document) without waiting for it.
+bool openPath(const std::string& path) {
+	HINSTANCE result = ShellExecuteA(NULL, "open", path.c_str(), NULL, NULL, SW_SHOWNORMAL);
+	return reinterpret_cast<INT_PTR>(result) > 32;
+}
+
+bool stdinIsTerminal() {
+	return _isatty(_fileno(stdin)) != 0;
+}
+
+void clearScreen() {
+	system("cls");
+}
+
+unsigned long processId() {
+	return GetCurrentProcessId();
+}
+
+// CPU time of the shell process and its peak working set.
+bool processUsage(ProcessUsage& usage) {
+	FILETIME created, exited, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+		return false;
+	auto seconds = [](const FILETIME& time) {
+		return (static_cast<double>(time.dwHighDateTime) * 4294967296.0 + time.dwLowDateTime) * 1e-7;
+	};
+	usage.userSeconds = seconds(user);
+	usage.systemSeconds = seconds(kernel);
+	PROCESS_MEMORY_COUNTERS memory;
+	usage.peakResident = GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory)) ? memory.PeakWorkingSetSize : 0;
+	return true;
+}
+
+// Both ends are private to the shell; startProcess() passes them on explicitly.
+bool createPipe(FileHandle& readEnd, FileHandle& writeEnd) {
+	return CreatePipe(&readEnd, &writeEnd, nullptr, 0) != 0;
+}
+
+void closeFile(FileHandle file) {
+	CloseHandle(file);
+}
+
+// Returns the number of bytes read, 0 at the end of the data, or -1 on error.
+long long readFile(FileHandle file, char* buffer, size_t size) {
+	DWORD count = 0;
+	if (!ReadFile(file, buffer, static_cast<DWORD>(size), &count, nullptr))
+		return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+	return count;
+}
+
+FileHandle openNullDevice() {
+	return CreateFileA("NUL", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+}
+
+// Quote an argument the way the C runtime splits command lines: backslashes are literal
+// except in front of a quote.
+std::string quoteArgument(const std::string& arg) {
+	if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string::npos)
+		return arg;
+	std::string quoted = "\"";
+	for (size_t i = 0;; i++) {
+		size_t backslashes = 0;
+		while (i < arg.size() && arg[i] == '\\') {
+			backslashes++;
+			i++;
 		}
-		catch (const std::exception& e) {
-			std::cerr << "Error creating 'modules' folder: " << e.what() << std::endl;
+		if (i == arg.size()) {
+			quoted.append(backslashes * 2, '\\');
+			break;
 		}
+		quoted.append(arg[i] == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+		quoted += arg[i];
 	}
+	return quoted + '"';
+}
 
-	// Download a module (if not already downloaded)
-	void downloadModule(const std::string& moduleName) {
-		try {
-			ensureModulesDirectoryExists();
-			std::string moduleDir = "modules/" + moduleName;
-			std::string filePath = moduleDir + "/" + moduleName + ".dll";
-			std::string url = "https://github.com/DrJegesmedve/Mini-Shell/raw/main/modules/" + moduleName + "/" + moduleName + ".dll";
+// Start args[0] (searched in PATH) with the given standard streams. The child inherits
+// inheritable copies of exactly those three handles (PROC_THREAD_ATTRIBUTE_HANDLE_LIST), so
+// processes started at the same time from other threads cannot pick up each other's pipes.
+bool startProcess(const std::vector<std::string>& args, const StdioHandles& stdio, ProcessHandle& process, std::string& error) {
+	if (args.empty()) {
+		error = "no program given";
+		return false;
+	}
+	std::string commandLine;
+	for (const auto& arg : args) {
+		if (!commandLine.empty())
+			commandLine += ' ';
+		commandLine += quoteArgument(arg);
+	}
+	const FileHandle requested[3] = { stdio.in, stdio.out, stdio.err };
+	const DWORD standardIds[3] = { STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE };
+	HANDLE inherited[3] = {};
+	std::vector<HANDLE> handleList;
+	HANDLE self = GetCurrentProcess();
+	for (int i = 0; i < 3; i++) {
+		HANDLE source = requested[i] != InvalidFile ? requested[i] : GetStdHandle(standardIds[i]);
+		if (source && source != INVALID_HANDLE_VALUE &&
+			DuplicateHandle(self, source, self, &inherited[i], 0, TRUE, DUPLICATE_SAME_ACCESS))
+			handleList.push_back(inherited[i]);
+		else
+			inherited[i] = nullptr;
+	}
 
-			if (fs::exists(filePath)) {
-				std::cerr << "Error: Module already installed" << std::endl;
-				return;
-			}
+	STARTUPINFOEXA startup = {};
+	startup.StartupInfo.cb = sizeof(startup);
+	startup.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+	startup.StartupInfo.hStdInput = inherited[0];
+	startup.StartupInfo.hStdOutput = inherited[1];
+	startup.StartupInfo.hStdError = inherited[2];
+	SIZE_T attributeSize = 0;
+	InitializeProcThreadAttributeList(nullptr, 1, 0, &attributeSize);
+	std::vector<char> attributeBuffer(attributeSize);
+	auto attributes = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributeBuffer.data());
+	if (!handleList.empty() && InitializeProcThreadAttributeList(attributes, 1, 0, &attributeSize)) {
+		if (UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, handleList.data(),
+			handleList.size() * sizeof(HANDLE), nullptr, nullptr))
+			startup.lpAttributeList = attributes;
+		else
+			DeleteProcThreadAttributeList(attributes);
+	}
+	PROCESS_INFORMATION info = {};
+	BOOL created = CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, !handleList.empty(),
+		startup.lpAttributeList ? EXTENDED_STARTUPINFO_PRESENT : 0, nullptr, nullptr, &startup.StartupInfo, &info);
+	DWORD code = GetLastError();
+	if (startup.lpAttributeList)
+		DeleteProcThreadAttributeList(attributes);
+	for (HANDLE handle : handleList)
+		CloseHandle(handle);
+	if (!created) {
+		error = "error " + std::to_string(code);
+		return false;
+	}
+	CloseHandle(info.hThread);
+	process = info.hProcess;
+	return true;
+}
 
-			fs::create_directories(moduleDir);
-			HRESULT hr = URLDownloadToFileA(nullptr, url.c_str(), filePath.c_str(), 0, nullptr);
-			if (SUCCEEDED(hr)) {
-				std::cout << "Module installed" << std::endl;
-			}
-			else {
-				std::cerr << "Download error" << std::endl;
-			}
-		}
-		catch (const std::exception& e) {
-			std::cerr << "Exception while downloading module: " << e.what() << std::endl;
-		}
+// Wait for a process started by startProcess() and release it. Returns its exit code.
+int waitProcess(ProcessHandle process) {
+	WaitForSingleObject(process, INFINITE);
+	DWORD code = 1;
+	GetExitCodeProcess(process, &code);
+	CloseHandle(process);
+	return static_cast<int>(code);
+}
+
+// Stop a process started by startProcess() that has not been waited for yet.
+void terminateProcess(ProcessHandle process) {
+	TerminateProcess(process, 1);
+}
+
+// True (and the exit code, the process released) once a process started by startProcess()
+// has ended; does not wait.
+bool processExited(ProcessHandle process, int& code) {
+	if (WaitForSingleObject(process, 0) != WAIT_OBJECT_0)
+		return false;
+	DWORD exitCode = 1;
+	GetExitCodeProcess(process, &exitCode);
+	CloseHandle(process);
+	code = static_cast<int>(exitCode);
+	return true;
+}
+
+bool processAlive(unsigned long pid) {
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(pid));
+	if (!process)
+		return false;
+	bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+	return alive;
+}
+
+std::string executablePath() {
+	char path[MAX_PATH];
+	DWORD length = GetModuleFileNameA(nullptr, path, MAX_PATH);
+	return length > 0 && length < MAX_PATH ? std::string(path, length) : std::string();
+}
+
+// Named shared memory (in the session namespace). The creator sizes it; other processes open
+// it by name. The object lives until the last view is closed, so unlink() has nothing to do.
+class SharedMemory {
+public:
+	SharedMemory() : mapping(nullptr), view(nullptr), length(0) {}
+
+	~SharedMemory() {
+		if (view)
+			UnmapViewOfFile(view);
+		if (mapping)
+			CloseHandle(mapping);
 	}
 
-	// Load a module into the session
-	void loadModule(const std::string& moduleName) {
-		try {
-			ensureModulesDirectoryExists();
-			std::string modulePath = "modules/" + moduleName + "/" + moduleName + ".dll";
-			if (!fs::exists(modulePath)) {
-				std::cerr << "Module load error: " << moduleName << " module does not installed." << std::endl;
-				return;
-			}
-			HMODULE hModule = LoadLibraryA(modulePath.c_str());
-			if (hModule) {
-				typedef Module* (*CreateModuleFunc)();
-				CreateModuleFunc createModule = (CreateModuleFunc)GetProcAddress(hModule, "createModule");
-				if (createModule) {
-					if (modules.find(moduleName) != modules.end()) {
-						delete modules[moduleName];
-					}
-					modules[moduleName] = createModule();
-					loadedModules.insert(moduleName);
-					std::cout << "Module loaded" << std::endl;
-				}
-				else {
-					std::cerr << "Module load error: createModule function not found." << std::endl;
-					FreeLibrary(hModule);
-				}
-			}
-			else {
-				std::cerr << "Module load error: " << modulePath << std::endl;
-			}
-		}
-		catch (const std::exception& e) {
-			std::cerr << "Exception while loading module: " << e.what() << std::endl;
+	bool create(const std::string& name, size_t size, std::string& error) {
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+			static_cast<DWORD>(static_cast<unsigned long long>(size) >> 32), static_cast<DWORD>(size), ("Local\\" + name).c_str());
+		if (mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+			CloseHandle(mapping);
+			mapping = nullptr;
+			SetLastError(ERROR_ALREADY_EXISTS);
 		}
+		return map(size, error);
 	}
 
-	// Load all modules from the "modules" folder
-	void loadAllModules() {
-		try {
-			ensureModulesDirectoryExists();
-			if (!fs::exists("modules") || fs::is_empty("modules")) {
-				std::cerr << "Error: No available module" << std::endl;
-				return;
-			}
-			for (const auto& entry : fs::directory_iterator("modules")) {
-				if (entry.is_directory()) {
-					std::string moduleName = entry.path().filename().string();
-					loadModule(moduleName);
-				}
-			}
-		}
-		catch (const std::exception& e) {
-			std::cerr << "Unknown Error while loading modules: " << e.what() << std::endl;
-		}
+	bool open(const std::string& name, size_t size, std::string& error) {
+		mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, ("Local\\" + name).c_str());
+		return map(size, error);
 	}
 
-	// Update a module (only if it is already downloaded). Note: After update, it is not automatically loaded.
-	void updateModule(const std::string& moduleName) {
-		try {
-			ensureModulesDirectoryExists();
-			std::string filePath = "modules/" + moduleName + "/" + moduleName + ".dll";
-			if (!fs::exists(filePath)) {
-				std::cerr << "ERROR: Module is not available" << std::endl;
-				return;
-			}
+	void unlink() {}
 
-			fs::remove(filePath);
-			std::string url = "https://github.com/DrJegesmedve/Mini-Shell/raw/main/modules/" + moduleName + "/" + moduleName + ".dll";
-			HRESULT hr = URLDownloadToFileA(nullptr, url.c_str(), filePath.c_str(), 0, nullptr);
-			if (SUCCEEDED(hr)) {
-				std::cout << "Module updated" << std::endl;
-			}
-			else {
-				std::cerr << "Module update error" << std::endl;
-			}
-		}
-		catch (const std::exception& e) {
-			std::cerr << "Exception while updating module: " << e.what() << std::endl;
+	char* data() const { return view; }
+	size_t size() const { return length; }
+
+private:
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	bool map(size_t size, std::string& error) {
+		if (mapping)
+			view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+		if (!view) {
+			error = "error " + std::to_string(GetLastError());
+			return false;
 		}
+		length = size;
+		return true;
 	}
 
-	// Update all downloaded modules
-	void updateAllModules() {
-		try {
-			ensureModulesDirectoryExists();
-			if (!fs::exists("modules") || fs::is_empty("modules")) {
-				std::cerr << "ERROR: No available modules" << std::endl;
-				return;
-			}
-			for (const auto& entry : fs::directory_iterator("modules")) {
-				if (entry.is_directory()) {
-					std::string moduleName = entry.path().filename().string();
-					updateModule(moduleName);
-				}
-			}
-		}
-		catch (const std::exception& e) {
-			std::cerr << "Unknown Error (module update): " << e.what() << std::endl;
+	HANDLE mapping;
+	char* view;
+	size_t length;
+};
+
+// Named counting semaphore for waking a process that waits on shared memory.
+class NamedSemaphore {
+public:
+	NamedSemaphore() : handle(nullptr) {}
+
+	~NamedSemaphore() {
+		if (handle)
+			CloseHandle(handle);
+	}
+
+	bool create(const std::string& name, std::string& error) {
+		handle = CreateSemaphoreA(nullptr, 0, 0x7fffffff, ("Local\\" + name).c_str());
+		if (handle && GetLastError() == ERROR_ALREADY_EXISTS) {
+			CloseHandle(handle);
+			handle = nullptr;
+			SetLastError(ERROR_ALREADY_EXISTS);
 		}
+		if (!handle)
+			error = "error " + std::to_string(GetLastError());
+		return handle != nullptr;
 	}
 
-	// Delete a module: remove the DLL and the entire module folder from the filesystem
-	void removeModule(const std::string& moduleName) {
-		try {
-			ensureModulesDirectoryExists();
-			std::string moduleFolder = "modules/" + moduleName;
-			if (fs::exists(moduleFolder)) {
-				fs::remove_all(moduleFolder);
-				std::cout << "Module deleted" << std::endl;
-				if (modules.find(moduleName) != modules.end()) {
-					delete modules[moduleName];
-					modules.erase(moduleName);
-				}
-				loadedModules.erase(moduleName);
-			}
-			else {
-				std::cerr << "ERROR: Module is not available" << std::endl;
-			}
+	bool open(const std::string& name, std::string& error) {
+		handle = OpenSemaphoreA(SEMAPHORE_MODIFY_STATE | SYNCHRONIZE, FALSE, ("Local\\" + name).c_str());
+		if (!handle)
+			error = "error " + std::to_string(GetLastError());
+		return handle != nullptr;
+	}
+
+	void unlink() {}
+
+	void post() { ReleaseSemaphore(handle, 1, nullptr); }
+
+	// Returns false if the timeout passed first.
+	bool wait(int timeoutMs) { return WaitForSingleObject(handle, static_cast<DWORD>(timeoutMs)) == WAIT_OBJECT_0; }
+
+private:
+	NamedSemaphore(const NamedSemaphore&) = delete;
+	NamedSemaphore& operator=(const NamedSemaphore&) = delete;
+
+	HANDLE handle;
+};
+
+const char PathSeparator = '\\';
+
+// Append the entries of a directory (without "." and ".."). FindFirstFileEx with large
+// fetch buffers returns sizes and times with the names, so withStat costs nothing here.
+bool readDirectory(const std::string& path, bool withStat, std::vector<DirectoryEntry>& entries, std::string& error) {
+	(void)withStat;
+	std::string pattern = path;
+	if (!pattern.empty() && pattern.back() != '\\' && pattern.back() != '/')
+		pattern += '\\';
+	pattern += '*';
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileExA(pattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+	if (find == INVALID_HANDLE_VALUE) {
+		DWORD code = GetLastError();
+		if (code == ERROR_FILE_NOT_FOUND)
+			return true;
+		error = "error " + std::to_string(code);
+		return false;
+	}
+	do {
+		if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0)
+			continue;
+		DirectoryEntry entry;
+		entry.name = data.cFileName;
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+			entry.type = DirectoryEntry::Link;
+		else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			entry.type = DirectoryEntry::Directory;
+		else
+			entry.type = DirectoryEntry::File;
+		entry.size = (static_cast<unsigned long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+		unsigned long long ticks = (static_cast<unsigned long long>(data.ftLastWriteTime.dwHighDateTime) << 32) |
+			data.ftLastWriteTime.dwLowDateTime;
+		entry.mtime = static_cast<long long>(ticks / 10000000ULL) - 11644473600LL; // 100 ns ticks since 1601
+		entries.push_back(std::move(entry));
+	} while (FindNextFileA(find, &data));
+	FindClose(find);
+	return true;
+}
+
+// Identity and last write time (ns since 1970) of a directory. The write time changes when
+// an entry is added, removed or renamed. Windows has no cheap file id here, so id is 0.
+bool statDirectory(const std::string& path, unsigned long long& id, long long& mtime) {
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data) || !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		return false;
+	unsigned long long ticks = (static_cast<unsigned long long>(data.ftLastWriteTime.dwHighDateTime) << 32) |
+		data.ftLastWriteTime.dwLowDateTime;
+	id = 0;
+	mtime = (static_cast<long long>(ticks) - 116444736000000000LL) * 100; // 100 ns ticks since 1601
+	return true;
+}
+
+// Read-only view of a whole file. Small files are read into a buffer (mapping costs more
+// than copying a few pages); larger ones are memory-mapped.
+class MappedFile {
+public:
+	MappedFile() : view(nullptr), length(0), mapping(nullptr) {}
+
+	~MappedFile() {
+		if (mapping) {
+			UnmapViewOfFile(view);
+			CloseHandle(mapping);
 		}
-		catch (const std::exception& e) {
-			std::cerr << "Exception while deleting module: " << e.what() << std::endl;
+	}
+
+	bool open(const std::string& path, std::string& error) {
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			error = "error " + std::to_string(GetLastError());
+			return false;
 		}
+		bool ok = load(file, error);
+		CloseHandle(file);
+		return ok;
 	}
 
-	// Delete all modules (remove the entire modules folder content)
-	void removeAllModules() {
-		try {
-			ensureModulesDirectoryExists();
-			if (!fs::exists("modules") || fs::is_empty("modules")) {
-				std::cerr << "ERROR: No available module" << std::endl;
-				return;
-			}
-			for (const auto& entry : fs::directory_iterator("modules")) {
-				if (entry.is_directory()) {
-					std::string moduleName = entry.path().filename().string();
-					removeModule(moduleName);
-				}
+	const char* data() const { return view; }
+	size_t size() const { return length; }
+
+private:
+	bool load(HANDLE file, std::string& error) {
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize)) {
+			error = "error " + std::to_string(GetLastError());
+			return false;
+		}
+		length = static_cast<size_t>(fileSize.QuadPart);
+		if (length < MapThreshold) {
+			buffer.resize(length);
+			DWORD read = 0;
+			if (length && !ReadFile(file, &buffer[0], static_cast<DWORD>(length), &read, nullptr)) {
+				error = "error " + std::to_string(GetLastError());
+				return false;
 			}
+			length = read;
+			view = buffer.data();
+			return true;
 		}
-		catch (const std::exception& e) {
-			std::cerr << "Unknown Error while deleting modules: " << e.what() << std::endl;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+			view = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		if (!view) {
+			error = "error " + std::to_string(GetLastError());
+			return false;
 		}
+		return true;
 	}
 
-	const std::map<std::string, Module*>& getModules() const {
-		return modules;
+	static const size_t MapThreshold = 64 * 1024;
+
+	const char* view;
+	size_t length;
+	HANDLE mapping;
+	std::string buffer;
+};
+
+// Reports changes below a directory (recursively). wait() appends the changed paths relative
+// to the directory with '/' separators; an empty path means events were lost.
+class DirectoryWatcher {
+public:
+	DirectoryWatcher() : handle(INVALID_HANDLE_VALUE) {
+		overlapped = OVERLAPPED();
 	}
 
-	void cleanupModules() {
-		try {
-			ensureModulesDirectoryExists();
-			if (!fs::exists("modules")) return;
-			std::map<std::string, std::string> latestVersions;
-			for (const auto& entry : fs::directory_iterator("modules")) {
-				if (entry.is_directory()) {
-					std::string moduleName = entry.path().filename().string();
-					std::string modulePath = "modules/" + moduleName + "/" + moduleName + ".dll";
-					if (fs::exists(modulePath)) {
-						latestVersions[moduleName] = modulePath;
-					}
-				}
-			}
-			for (const auto& entry : fs::directory_iterator("modules")) {
-				if (entry.is_directory()) {
-					std::string moduleName = entry.path().filename().string();
-					std::string modulePath = "modules/" + moduleName + "/" + moduleName + ".dll";
-					if (latestVersions.find(moduleName) != latestVersions.end() && latestVersions[moduleName] != modulePath) {
-						fs::remove(modulePath);
-					}
-				}
-			}
+	~DirectoryWatcher() {
+		if (handle != INVALID_HANDLE_VALUE) {
+			CancelIoEx(handle, &overlapped);
+			DWORD bytes = 0;
+			GetOverlappedResult(handle, &overlapped, &bytes, TRUE);
+			CloseHandle(handle);
 		}
-		catch (const std::exception& e) {
-			std::cerr << "Unknown Error during cleanup: " << e.what() << std::endl;
+		if (overlapped.hEvent)
+			CloseHandle(overlapped.hEvent);
+	}
+
+	bool open(const std::string& directory, std::string& error) {
+		handle = CreateFileA(directory.c_str(), FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+		if (handle == INVALID_HANDLE_VALUE) {
+			error = "cannot watch " + directory + " (error " + std::to_string(GetLastError()) + ")";
+			return false;
 		}
+		overlapped.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+		if (!overlapped.hEvent || !arm()) {
+			error = "ReadDirectoryChangesW failed (error " + std::to_string(GetLastError()) + ")";
+			return false;
+		}
+		return true;
 	}
 
-	void executeModule(const std::string& moduleName, const std::vector<std::string>& args) {
-		try {
-			auto it = modules.find(moduleName);
-			if (it == modules.end() || it->second == nullptr) {
-				std::cerr << "ERROR: Module is not loaded" << std::endl;
-				return;
+	void wait(int timeoutMs, std::vector<std::string>& changed) {
+		if (WaitForSingleObject(overlapped.hEvent, timeoutMs) != WAIT_OBJECT_0)
+			return;
+		DWORD bytes = 0;
+		if (GetOverlappedResult(handle, &overlapped, &bytes, FALSE) && bytes > 0) {
+			const char* p = buffer;
+			for (;;) {
+				const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(p);
+				int wideLength = static_cast<int>(info->FileNameLength / sizeof(WCHAR));
+				int length = WideCharToMultiByte(CP_UTF8, 0, info->FileName, wideLength, nullptr, 0, nullptr, nullptr);
+				std::string path(length, '\0');
+				WideCharToMultiByte(CP_UTF8, 0, info->FileName, wideLength, &path[0], length, nullptr, nullptr);
+				std::replace(path.begin(), path.end(), '\\', '/');
+				changed.push_back(path);
+				if (info->NextEntryOffset == 0)
+					break;
+				p += info->NextEntryOffset;
 			}
-			it->second->execute(args);
 		}
-		catch (const std::exception& e) {
-			std::cerr << "Exception while executing module: " << e.what() << std::endl;
-		}
-		catch (...) {
-			std::cerr << "Unknown Error while running module command" << std::endl;
+		else {
+			changed.push_back(""); // buffer overflow: the caller has to rescan
 		}
+		ResetEvent(overlapped.hEvent);
+		if (!arm())
+			changed.push_back("");
 	}
 
 private:
-	ModuleManager() {
-		try {
-			ensureModulesDirectoryExists();
-			cleanupModules();
-		}
-		catch (const std::exception& e) {
-			std::cerr << "Exception during ModuleManager initialization: " << e.what() << std::endl;
-		}
+	DirectoryWatcher(const DirectoryWatcher&) = delete;
+	DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+	bool arm() {
+		return ReadDirectoryChangesW(handle, buffer, sizeof(buffer), TRUE,
+			FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE,
+			nullptr, &overlapped, nullptr) != 0;
 	}
-	ModuleManager(const ModuleManager&) = delete;
-	ModuleManager& operator=(const ModuleManager&) = delete;
 
-	std::map<std::string, Module*> modules;
-	std::set<std::string> loadedModules;
-};
-
-void printShellHelp() {
-	std::cout << "Shell commands:" << std::endl;
-	std::cout << "  exit                        - Exit the shell" << std::endl;
-	std::cout << "  help[/h/?]                  - Display help" << std::endl;
-	std::cout << "  version[/v/-v]              - Display shell version" << std::endl;
-	std::cout << "  install[/dwl]               - Download module(s)" << std::endl;
-	std::cout << "  load                        - Load module(s)" << std::endl;
-	std::cout << "  update[/up]                 - Update module(s)" << std::endl;
-	std::cout << "  delete[/del]                - Delete module(s)" << std::endl;
-	std::cout << "  ls [attribute]              - List modules or directory contents" << std::endl;
-	std::cout << "     Use 'mods/modules/ext':  list modules." << std::endl;
-	std::cout << "     Use 'drive:' or 'd:'     followed by a drive letter (e.g. ls drive:C) to list a drive." << std::endl;
-	std::cout << "     Use 'loc:'               followed by a path (e.g. ls loc:\"C:\\My Folder\") to list that directory." << std::endl;
-	std::cout << "  run <executable_path>       - Run an executable file" << std::endl;
-	std::cout << "  c or clear                  - Clear the screen" << std::endl;
-	std::cout << "  rb                          - Reboot the shell (clear screen and reload modules)" << std::endl;
-	std::cout << "  <module_name> [args]        - Run a module with arguments (use -v for version)" << std::endl;
-}
-
-int main() {
-	setlocale(LC_ALL, "English");
-	std::string command;
-	while (true) {
-		std::cout << "> ";
-		std::getline(std::cin, command);
-		if (command.empty())
-			continue;
+	HANDLE handle;
+	OVERLAPPED overlapped;
+	alignas(DWORD) char buffer[64 * 1024];
+};
+
+// Keyboard input for the line editor. enable() turns off line input and echo and turns on
+// virtual terminal sequences both ways, so keys arrive as the same bytes as on a POSIX
+// terminal; the destructor restores the console modes.
+class RawTerminal {
+public:
+	RawTerminal() : input(GetStdHandle(STD_INPUT_HANDLE)), output(GetStdHandle(STD_OUTPUT_HANDLE)),
+		enabled(false), inputMode(0), outputMode(0), begin(0), end(0) {}
 
-		// Tokenize the command (splitting by whitespace)
-		std::vector<std::string> tokens;
-		std::istringstream iss(command);
-		std::string token;
-		while (iss >> token) {
-			tokens.push_back(token);
+	~RawTerminal() {
+		if (enabled) {
+			SetConsoleMode(input, inputMode);
+			SetConsoleMode(output, outputMode);
 		}
-		if (tokens.empty())
-			continue;
+	}
 
-		std::string mainCommand = tokens[0];
+	bool enable() {
+		if (!GetConsoleMode(input, &inputMode) || !GetConsoleMode(output, &outputMode))
+			return false;
+		DWORD raw = (inputMode & ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT | ENABLE_PROCESSED_INPUT)) | ENABLE_VIRTUAL_TERMINAL_INPUT;
+		if (!SetConsoleMode(input, raw))
+			return false;
+		if (!SetConsoleMode(output, outputMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING)) {
+			SetConsoleMode(input, inputMode);
+			return false;
+		}
+		enabled = true;
+		return true;
+	}
 
-		// Shell built-in commands
-		if (mainCommand == "exit") {
-			break;
+	// Next input byte, or -1 at the end of input. Ctrl+Z reads as Ctrl+D.
+	int readByte() {
+		if (begin == end) {
+			DWORD count = 0;
+			if (!ReadFile(input, buffer, sizeof(buffer), &count, nullptr) || count == 0)
+				return -1;
+			begin = 0;
+			end = count;
 		}
-		else if (mainCommand == "help" || mainCommand == "h" || mainCommand == "?") {
-			printShellHelp();
+		unsigned char c = static_cast<unsigned char>(buffer[begin++]);
+		return c == 26 ? 4 : c;
+	}
+
+	// True while bytes that arrived together (a paste, an escape sequence) are still buffered.
+	bool pending() const { return begin != end; }
+
+	// Columns of the console window (80 if unknown).
+	size_t width() const {
+		CONSOLE_SCREEN_BUFFER_INFO info;
+		if (GetConsoleScreenBufferInfo(output, &info) && info.srWindow.Right > info.srWindow.Left)
+			return static_cast<size_t>(info.srWindow.Right - info.srWindow.Left + 1);
+		return 80;
+	}
+
+private:
+	RawTerminal(const RawTerminal&) = delete;
+	RawTerminal& operator=(const RawTerminal&) = delete;
+
+	HANDLE input;
+	HANDLE output;
+	bool enabled;
+	DWORD inputMode;
+	DWORD outputMode;
+	DWORD begin;
+	DWORD end;
+	char buffer[256];
+};
+#else
+typedef void* LibraryHandle;
+const char* const LibraryExtension = ".so";
+
+LibraryHandle openLibrary(const std::string& path) {
+	return dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+}
+
+void* findSymbol(LibraryHandle library, const char* name) {
+	return dlsym(library, name);
+}
+
+void closeLibrary(LibraryHandle library) {
+	dlclose(library);
+}
+
+std::string libraryError() {
+	const char* error = dlerror();
+	return error ? error : "unknown error";
+}
+
+// Pipe ends are close-on-exec; startProcess() passes them on explicitly.
+bool createPipe(FileHandle& readEnd, FileHandle& writeEnd) {
+	int fds[2];
+#ifdef __linux__
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		return false;
+#else
+	if (pipe(fds) != 0)
+		return false;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+	readEnd = fds[0];
+	writeEnd = fds[1];
+	return true;
+}
+
+void closeFile(FileHandle file) {
+	close(file);
+}
+
+// Returns the number of bytes read, 0 at the end of the data, or -1 on error.
+long long readFile(FileHandle file, char* buffer, size_t size) {
+	for (;;) {
+		ssize_t count = read(file, buffer, size);
+		if (count >= 0 || errno != EINTR)
+			return count;
+	}
+}
+
+FileHandle openNullDevice() {
+	return ::open("/dev/null", O_RDWR | O_CLOEXEC);
+}
+
+// Start args[0] (searched in PATH) with the given standard streams.
+bool startProcess(const std::vector<std::string>& args, const StdioHandles& stdio, ProcessHandle& process, std::string& error) {
+	if (args.empty()) {
+		error = "no program given";
+		return false;
+	}
+	std::vector<char*> argv;
+	for (const auto& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	const FileHandle requested[3] = { stdio.in, stdio.out, stdio.err };
+	for (int fd = 0; fd < 3; fd++) {
+		if (requested[fd] != InvalidFile)
+			posix_spawn_file_actions_adddup2(&actions, requested[fd], fd);
+	}
+	int result = posix_spawnp(&process, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (result != 0) {
+		error = strerror(result);
+		return false;
+	}
+	return true;
+}
+
+// Wait for a process started by startProcess(). Returns its exit code (128 + the signal
+// number if it was killed), or -1 if it cannot be waited for.
+int waitProcess(ProcessHandle process) {
+	int status = 0;
+	while (waitpid(process, &status, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Stop a process started by startProcess() that has not been waited for yet.
+void terminateProcess(ProcessHandle process) {
+	kill(process, SIGTERM);
+}
+
+// True (and the exit code, the process reaped) once a process started by startProcess() has
+// ended; does not wait.
+bool processExited(ProcessHandle process, int& code) {
+	int status = 0;
+	if (waitpid(process, &status, WNOHANG) != process)
+		return false;
+	code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	return true;
+}
+
+bool processAlive(unsigned long pid) {
+	return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+}
+
+std::string executablePath() {
+	std::error_code ec;
+	fs::path path = fs::read_symlink("/proc/self/exe", ec);
+	return ec ? std::string() : path.string();
+}
+
+// Named shared memory (shm_open). The creator sizes it; other processes open it by name.
+// unlink() removes the name once everyone has it open; the memory lives until the last
+// mapping goes.
+class SharedMemory {
+public:
+	SharedMemory() : view(nullptr), length(0) {}
+
+	~SharedMemory() {
+		if (view)
+			munmap(view, length);
+	}
+
+	bool create(const std::string& name, size_t size, std::string& error) {
+		path = "/" + name;
+		int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd >= 0 && ftruncate(fd, static_cast<off_t>(size)) != 0) {
+			close(fd);
+			shm_unlink(path.c_str());
+			fd = -1;
 		}
-		else if (mainCommand == "version" || mainCommand == "v" || mainCommand == "-v") {
-			std::cout << "Shell Version 1.2.0" << std::endl;
+		return map(fd, size, error);
+	}
+
+	bool open(const std::string& name, size_t size, std::string& error) {
+		path = "/" + name;
+		return map(shm_open(path.c_str(), O_RDWR | O_CLOEXEC, 0), size, error);
+	}
+
+	void unlink() {
+		if (!path.empty())
+			shm_unlink(path.c_str());
+		path.clear();
+	}
+
+	char* data() const { return view; }
+	size_t size() const { return length; }
+
+private:
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	bool map(int fd, size_t size, std::string& error) {
+		if (fd < 0) {
+			error = strerror(errno);
+			return false;
 		}
-		else if (mainCommand == "c" || mainCommand == "clear") {
-			system("cls");
+		void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		int mapError = errno;
+		close(fd);
+		if (address == MAP_FAILED) {
+			error = strerror(mapError);
+			return false;
 		}
-		else if (mainCommand == "rb") {
-			system("cls");
-			std::cout << "Rebooting shell and reloading modules..." << std::endl;
-			ModuleManager::getInstance().loadAllModules();
+		view = static_cast<char*>(address);
+		length = size;
+		return true;
+	}
+
+	std::string path;   // until unlink()
+	char* view;
+	size_t length;
+};
+
+// Named counting semaphore for waking a process that waits on shared memory. unlink()
+// removes the name once everyone has it open.
+class NamedSemaphore {
+public:
+	NamedSemaphore() : semaphore(SEM_FAILED) {}
+
+	~NamedSemaphore() {
+		if (semaphore != SEM_FAILED)
+			sem_close(semaphore);
+	}
+
+	bool create(const std::string& name, std::string& error) {
+		path = "/" + name;
+		semaphore = sem_open(path.c_str(), O_CREAT | O_EXCL, 0600, 0);
+		if (semaphore == SEM_FAILED)
+			error = strerror(errno);
+		return semaphore != SEM_FAILED;
+	}
+
+	bool open(const std::string& name, std::string& error) {
+		path = "/" + name;
+		semaphore = sem_open(path.c_str(), 0);
+		if (semaphore == SEM_FAILED)
+			error = strerror(errno);
+		return semaphore != SEM_FAILED;
+	}
+
+	void unlink() {
+		if (!path.empty())
+			sem_unlink(path.c_str());
+		path.clear();
+	}
+
+	void post() { sem_post(semaphore); }
+
+	// Returns false if the timeout passed first.
+	bool wait(int timeoutMs) {
+		timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeoutMs / 1000;
+		deadline.tv_nsec += static_cast<long>(timeoutMs % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
 		}
-		else if (mainCommand == "ls") {
-			// Enhanced ls command: list modules or directory contents
-			if (tokens.size() >= 2) {
-				std::string param = tokens[1];
-				if (param.rfind("drive:", 0) == 0 || param.rfind("d:", 0) == 0) {
-					std::string driveLetter;
-					if (param.rfind("drive:", 0) == 0)
-						driveLetter = param.substr(6);
-					else
-						driveLetter = param.substr(2);
-					std::string path = driveLetter + ":\\";
-					std::cout << "Listing drive " << driveLetter << ":" << std::endl;
-					try {
-						for (auto& entry : fs::directory_iterator(path)) {
-							std::cout << entry.path().filename().string() << std::endl;
-						}
-					}
-					catch (const std::exception& e) {
-						std::cerr << "Error listing drive: " << e.what() << std::endl;
-					}
-				}
-				else if (param.rfind("loc:", 0) == 0) {
-					std::string location = param.substr(4);
-					// Remove surrounding quotes if any
-					if ((location.front() == '\'' && location.back() == '\'') ||
-						(location.front() == '"' && location.back() == '"')) {
-						location = location.substr(1, location.size() - 2);
-					}
-					std::cout << "Listing location: " << location << std::endl;
-					try {
-						for (auto& entry : fs::directory_iterator(location)) {
-							std::cout << entry.path().filename().string() << std::endl;
-						}
-					}
-					catch (const std::exception& e) {
-						std::cerr << "Error listing location: " << e.what() << std::endl;
-					}
-				}
-				else if (param == "mods" || param == "modules" || param == "ext") {
-					if (fs::exists("modules") && !fs::is_empty("modules")) {
-						for (const auto& entry : fs::directory_iterator("modules")) {
-							if (entry.is_directory()) {
-								std::cout << "- " << entry.path().filename().string() << std::endl;
-							}
-						}
-					}
-					else {
-						std::cerr << "Error: No available module" << std::endl;
-					}
-				}
-				else {
-					// Treat parameter as a directory path
-					std::string path = param;
-					std::cout << "Listing location: " << path << std::endl;
-					try {
-						for (auto& entry : fs::directory_iterator(path)) {
-							std::cout << entry.path().filename().string() << std::endl;
-						}
-					}
-					catch (const std::exception& e) {
-						std::cerr << "Error listing location: " << e.what() << std::endl;
-					}
-				}
+		while (sem_timedwait(semaphore, &deadline) != 0) {
+			if (errno != EINTR)
+				return false;
+		}
+		return true;
+	}
+
+private:
+	NamedSemaphore(const NamedSemaphore&) = delete;
+	NamedSemaphore& operator=(const NamedSemaphore&) = delete;
+
+	std::string path;   // until unlink()
+	sem_t* semaphore;
+};
+
+// Start args[0] (searched in PATH). Returns the child pid, or -1 if it could not be started.
+pid_t spawn(const std::vector<std::string>& args) {
+	pid_t pid;
+	std::string error;
+	return startProcess(args, StdioHandles(), pid, error) ? pid : -1;
+}
+
+// Run a program (searched in PATH) and wait for it. Returns its exit code, or -1 if it could
+// not be started.
+int runProcess(const std::vector<std::string>& args) {
+	pid_t pid = spawn(args);
+	return pid < 0 ? -1 : waitProcess(pid);
+}
+
+// Download url to path with curl; resume continues a partial file.
+bool downloadFile(const std::string& url, const std::string& path, bool resume) {
+	std::vector<std::string> args = { "curl", "-fsSL", "-o", path, url };
+	if (resume)
+		args.insert(args.begin() + 2, { "-C", "-" });
+	return runProcess(args) == 0;
+}
+
+bool openPath(const std::string& path) {
+	// Reap programs opened earlier so they do not linger as zombies. Only those: other
+	// children belong to commands (possibly background jobs) that wait for them.
+	static std::mutex openedMutex;
+	static std::vector<pid_t> opened;
+	std::lock_guard<std::mutex> lock(openedMutex);
+	opened.erase(std::remove_if(opened.begin(), opened.end(),
+		[](pid_t pid) { return waitpid(pid, nullptr, WNOHANG) != 0; }), opened.end());
+	pid_t pid = spawn({ path });
+	if (pid > 0)
+		opened.push_back(pid);
+	return pid > 0;
+}
+
+bool stdinIsTerminal() {
+	return isatty(STDIN_FILENO) != 0;
+}
+
+void clearScreen() {
+	std::cout << "\x1b[2J\x1b[H" << std::flush;
+}
+
+unsigned long processId() {
+	return static_cast<unsigned long>(getpid());
+}
+
+// CPU time of the shell and of the children it has waited for, and the shell's peak
+// resident set.
+bool processUsage(ProcessUsage& usage) {
+	struct rusage self, children;
+	if (getrusage(RUSAGE_SELF, &self) != 0 || getrusage(RUSAGE_CHILDREN, &children) != 0)
+		return false;
+	auto seconds = [](const struct timeval& time) { return time.tv_sec + time.tv_usec * 1e-6; };
+	usage.userSeconds = seconds(self.ru_utime) + seconds(children.ru_utime);
+	usage.systemSeconds = seconds(self.ru_stime) + seconds(children.ru_stime);
+#ifdef __APPLE__
+	usage.peakResident = static_cast<unsigned long long>(self.ru_maxrss);
+#else
+	usage.peakResident = static_cast<unsigned long long>(self.ru_maxrss) * 1024;
+#endif
+	return true;
+}
+
+const char PathSeparator = '/';
+
+DirectoryEntry::Type entryType(mode_t mode) {
+	if (S_ISREG(mode))
+		return DirectoryEntry::File;
+	if (S_ISDIR(mode))
+		return DirectoryEntry::Directory;
+	if (S_ISLNK(mode))
+		return DirectoryEntry::Link;
+	return DirectoryEntry::Other;
+}
+
+// Append the entries of a directory (without "." and ".."). Names and types come from the
+// directory listing itself; entries are only stat'ed (relative to the open directory, so the
+// path is not resolved again) when withStat is set or the file system does not report types.
+bool readDirectory(const std::string& path, bool withStat, std::vector<DirectoryEntry>& entries, std::string& error) {
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		error = strerror(errno);
+		return false;
+	}
+	auto add = [&](const char* name, unsigned char type) {
+		if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+			return;
+		DirectoryEntry entry;
+		entry.name = name;
+		switch (type) {
+		case DT_REG: entry.type = DirectoryEntry::File; break;
+		case DT_DIR: entry.type = DirectoryEntry::Directory; break;
+		case DT_LNK: entry.type = DirectoryEntry::Link; break;
+		default: break;
+		}
+		struct stat info;
+		if ((withStat || type == DT_UNKNOWN) && fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+			entry.type = entryType(info.st_mode);
+			entry.size = static_cast<unsigned long long>(info.st_size);
+			entry.mtime = static_cast<long long>(info.st_mtime);
+		}
+		entries.push_back(std::move(entry));
+	};
+	bool ok = true;
+#ifdef __linux__
+	// getdents64 returns as many entries as fit in the buffer per system call.
+	struct LinuxDirent64 {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+	alignas(LinuxDirent64) char buffer[32 * 1024];
+	for (;;) {
+		long count = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+		if (count <= 0) {
+			if (count < 0) {
+				error = strerror(errno);
+				ok = false;
 			}
-			else {
-				// No parameter provided: list current directory
-				std::string path = fs::current_path().string();
-				std::cout << "Listing current directory: " << path << std::endl;
-				try {
-					for (auto& entry : fs::directory_iterator(path)) {
-						std::cout << entry.path().filename().string() << std::endl;
-					}
-				}
-				catch (const std::exception& e) {
-					std::cerr << "Error listing current directory: " << e.what() << std::endl;
+			break;
+		}
+		for (long offset = 0; offset < count;) {
+			auto* record = reinterpret_cast<LinuxDirent64*>(buffer + offset);
+			add(record->d_name, record->d_type);
+			offset += record->d_reclen;
+		}
+	}
+	close(fd);
+#else
+	DIR* dir = fdopendir(fd);
+	if (!dir) {
+		error = strerror(errno);
+		close(fd);
+		return false;
+	}
+	while (dirent* record = readdir(dir))
+		add(record->d_name, record->d_type);
+	closedir(dir);
+#endif
+	return ok;
+}
+
+// Identity (inode) and last write time (ns since 1970) of a directory. The write time changes
+// when an entry is added, removed or renamed.
+bool statDirectory(const std::string& path, unsigned long long& id, long long& mtime) {
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+		return false;
+	id = static_cast<unsigned long long>(info.st_ino);
+#ifdef __linux__
+	mtime = static_cast<long long>(info.st_mtim.tv_sec) * 1000000000LL + info.st_mtim.tv_nsec;
+#else
+	mtime = static_cast<long long>(info.st_mtime) * 1000000000LL;
+#endif
+	return true;
+}
+
+// Read-only view of a whole file. Small files are read into a buffer (mapping costs more
+// than copying a few pages); larger ones are memory-mapped.
+class MappedFile {
+public:
+	MappedFile() : view(nullptr), length(0), mapped(false) {}
+
+	~MappedFile() {
+		if (mapped)
+			munmap(const_cast<char*>(view), length);
+	}
+
+	bool open(const std::string& path, std::string& error) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			error = strerror(errno);
+			return false;
+		}
+		bool ok = load(fd, error);
+		close(fd);
+		return ok;
+	}
+
+	const char* data() const { return view; }
+	size_t size() const { return length; }
+
+private:
+	bool load(int fd, std::string& error) {
+		struct stat info;
+		if (fstat(fd, &info) != 0) {
+			error = strerror(errno);
+			return false;
+		}
+		length = static_cast<size_t>(info.st_size);
+		if (length < MapThreshold) {
+			buffer.resize(length);
+			size_t total = 0;
+			while (total < length) {
+				ssize_t count = read(fd, &buffer[total], length - total);
+				if (count < 0 && errno == EINTR)
+					continue;
+				if (count < 0) {
+					error = strerror(errno);
+					return false;
 				}
+				if (count == 0)
+					break;
+				total += static_cast<size_t>(count);
 			}
+			length = total;
+			view = buffer.data();
+			return true;
 		}
-		else if (mainCommand == "run") {
-			// Run an executable file
-			if (tokens.size() < 2) {
-				std::cerr << "ERROR: run <executable_path>" << std::endl;
-			}
-			else {
-				std::string execPath;
-				for (size_t i = 1; i < tokens.size(); i++) {
-					if (!execPath.empty())
-						execPath += " ";
-					execPath += tokens[i];
-				}
-				// Remove surrounding quotes if any
-				if ((execPath.front() == '"' && execPath.back() == '"') ||
-					(execPath.front() == '\'' && execPath.back() == '\'')) {
-					execPath = execPath.substr(1, execPath.size() - 2);
-				}
-				std::cout << "Executing: " << execPath << std::endl;
-				HINSTANCE result = ShellExecuteA(NULL, "open", execPath.c_str(), NULL, NULL, SW_SHOWNORMAL);
-				if ((int)result <= 32) {
-					std::cerr << "Failed to execute: " << execPath << std::endl;
-				}
-			}
-		}
-		// Handle module-related commands: dwl, load, update/up, delete/del
-		else if (mainCommand == "dwl" || mainCommand == "install" || mainCommand == "load" || mainCommand == "update" ||
-			mainCommand == "up" || mainCommand == "delete" || mainCommand == "del") {
-			bool allFlag = false;
-			std::vector<std::string> moduleNames;
-			// Combine all arguments (after the command) into one string and split by commas
-			std::string argsCombined;
-			for (size_t i = 1; i < tokens.size(); i++) {
-				if (!argsCombined.empty())
-					argsCombined += " ";
-				argsCombined += tokens[i];
-			}
-			std::istringstream argStream(argsCombined);
-			std::string part;
-			while (std::getline(argStream, part, ',')) {
-				std::string mod = trim(part);
-				if (mod.empty())
+		void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (address == MAP_FAILED) {
+			error = strerror(errno);
+			return false;
+		}
+		madvise(address, length, MADV_SEQUENTIAL);
+		view = static_cast<const char*>(address);
+		mapped = true;
+		return true;
+	}
+
+	static const size_t MapThreshold = 64 * 1024;
+
+	const char* view;
+	size_t length;
+	bool mapped;
+	std::string buffer;
+};
+
+// Reports changes below a directory: the directory itself and its immediate subdirectories
+// are watched with inotify (new subdirectories are added as they appear). wait() appends the
+// changed paths relative to the directory; an empty path means events were lost.
+class DirectoryWatcher {
+public:
+	DirectoryWatcher() : fd(-1) {}
+
+	~DirectoryWatcher() {
+		if (fd >= 0)
+			close(fd);
+	}
+
+	bool open(const std::string& directory, std::string& error) {
+		root = directory;
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0 || !addWatch("")) {
+			error = "cannot watch " + directory + ": " + std::strerror(errno);
+			return false;
+		}
+		std::error_code ec;
+		for (const auto& entry : fs::directory_iterator(directory, ec)) {
+			if (entry.is_directory(ec))
+				addWatch(entry.path().filename().string());
+		}
+		return true;
+	}
+
+	void wait(int timeoutMs, std::vector<std::string>& changed) {
+		pollfd request = { fd, POLLIN, 0 };
+		if (poll(&request, 1, timeoutMs) <= 0)
+			return;
+		alignas(inotify_event) char buffer[64 * 1024];
+		for (;;) {
+			ssize_t length = read(fd, buffer, sizeof(buffer));
+			if (length <= 0)
+				break;
+			for (char* p = buffer; p < buffer + length;) {
+				const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+				p += sizeof(inotify_event) + event->len;
+				if (event->mask & IN_Q_OVERFLOW) {
+					changed.push_back("");
 					continue;
-				if (mod == "-all") {
-					allFlag = true;
-				}
-				else {
-					// If the token is a flag (starting with '-') and not "-all", skip for now
-					if (mod[0] == '-' && mod != "-all")
-						continue;
-					moduleNames.push_back(mod);
 				}
+				auto it = prefixes.find(event->wd);
+				if (it == prefixes.end())
+					continue;
+				std::string name = event->len ? event->name : "";
+				std::string path = it->second.empty() ? name : it->second + "/" + name;
+				if (it->second.empty() && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+					addWatch(name);
+				if (event->mask & IN_IGNORED)
+					prefixes.erase(it);
+				changed.push_back(path);
 			}
-			if (mainCommand == "dwl" || mainCommand == "install") {
-				if (allFlag) {
-					std::cerr << "Error: install[/dwl] -all is not supported." << std::endl;
-				}
-				else {
-					if (moduleNames.empty()) {
-						std::cerr << "ERROR: install[/dwl]  <module_name>[, module_name...]" << std::endl;
-					}
-					else {
-						for (const auto& mod : moduleNames) {
-							ModuleManager::getInstance().downloadModule(mod);
-						}
-					}
-				}
+		}
+	}
+
+private:
+	DirectoryWatcher(const DirectoryWatcher&) = delete;
+	DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+	bool addWatch(const std::string& relative) {
+		std::string path = relative.empty() ? root : root + "/" + relative;
+		int wd = inotify_add_watch(fd, path.c_str(),
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR);
+		if (wd < 0)
+			return false;
+		prefixes[wd] = relative;
+		return true;
+	}
+
+	int fd;
+	std::string root;
+	std::unordered_map<int, std::string> prefixes; // watch descriptor -> path below root
+};
+
+// Keyboard input for the line editor. enable() switches the terminal to byte-at-a-time input
+// without echo or signal keys (Ctrl+C arrives as a byte); the destructor restores the previous
+// mode. Mode changes wait for pending output but keep typed-ahead input.
+class RawTerminal {
+public:
+	RawTerminal() : enabled(false), begin(0), end(0) {}
+
+	~RawTerminal() {
+		if (enabled)
+			tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+	}
+
+	bool enable() {
+		if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0)
+			return false;
+		termios raw = saved;
+		raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+		raw.c_cflag |= CS8;
+		raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) != 0)
+			return false;
+		enabled = true;
+		return true;
+	}
+
+	// Next input byte, or -1 at the end of input.
+	int readByte() {
+		while (begin == end) {
+			ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+			if (count < 0 && errno == EINTR)
+				continue;
+			if (count <= 0)
+				return -1;
+			begin = 0;
+			end = static_cast<size_t>(count);
+		}
+		return static_cast<unsigned char>(buffer[begin++]);
+	}
+
+	// True while bytes that arrived together (a paste, an escape sequence) are still buffered.
+	bool pending() const { return begin != end; }
+
+	// Columns of the terminal window (80 if unknown).
+	size_t width() const {
+		winsize size;
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0)
+			return size.ws_col;
+		return 80;
+	}
+
+private:
+	RawTerminal(const RawTerminal&) = delete;
+	RawTerminal& operator=(const RawTerminal&) = delete;
+
+	bool enabled;
+	termios saved;
+	size_t begin;
+	size_t end;
+	char buffer[256];
+};
+#endif
+
+} // namespace platform
+
+// Helper function to trim whitespace from a string
+std::string trim(const std::string& s) {
+	auto start = s.begin();
+	while (start != s.end() && std::isspace(*start)) {
+		start++;
+	}
+	auto end = s.end();
+	do {
+		end--;
+	} while (std::distance(start, end) > 0 && std::isspace(*end));
+	return std::string(start, end + 1);
+}
+
+// Command tokens are views into the command line (see CommandTokenizer).
+typedef std::vector<std::string_view> Tokens;
+
+// Single-pass command tokenizer. The line is split in place: quotes are removed and escapes
+// resolved by compacting characters inside each token's own span, so tokens are views into
+// the line and nothing is copied. Reusing the token vector makes typical lines allocation-free.
+//  - whitespace separates tokens
+//  - "..." and '...' group text and may touch other text (loc:"C:\My Folder" is one token)
+//  - an unquoted ',' ends the current token and becomes a "," token of its own
+//  - a backslash escapes a following quote, comma or whitespace (and \" inside double quotes);
+//    any other backslash is literal so that Windows paths need no doubling
+//  - text inside single quotes is taken literally
+//  - a quote that is never closed is an ordinary character (echo don't)
+class CommandTokenizer {
+public:
+	static void tokenize(std::string& line, Tokens& tokens) {
+		tokens.clear();
+		char* data = &line[0];
+		size_t size = line.size();
+		size_t read = 0;
+		// Once a quote of one kind has no partner, no later one of that kind has either.
+		bool singleClosable = true, doubleClosable = true;
+		while (read < size) {
+			char c = data[read];
+			if (isSpace(c)) {
+				read++;
+				continue;
 			}
-			else if (mainCommand == "load") {
-				if (allFlag) {
-					ModuleManager::getInstance().loadAllModules();
-				}
-				else {
-					if (moduleNames.empty()) {
-						std::cerr << "ERROR: load <module_name>[, module_name...]" << std::endl;
-					}
-					else {
-						for (const auto& mod : moduleNames) {
-							ModuleManager::getInstance().loadModule(mod);
-						}
-					}
-				}
+			if (c == ',') {
+				tokens.emplace_back(data + read, 1);
+				read++;
+				continue;
 			}
-			else if (mainCommand == "update" || mainCommand == "up") {
-				if (allFlag) {
-					ModuleManager::getInstance().updateAllModules();
-				}
-				else {
-					if (moduleNames.empty()) {
-						std::cerr << "ERROR: update/up <module_name>[, module_name...]" << std::endl;
+			size_t start = read, write = read;
+			char quote = 0;
+			while (read < size) {
+				c = data[read];
+				if (quote) {
+					if (c == quote) {
+						quote = 0;
+						read++;
+					}
+					else if (quote == '"' && c == '\\' && read + 1 < size && data[read + 1] == '"') {
+						data[write++] = '"';
+						read += 2;
 					}
 					else {
-						for (const auto& mod : moduleNames) {
-							ModuleManager::getInstance().updateModule(mod);
-						}
+						data[write++] = data[read++];
 					}
+					continue;
 				}
-			}
-			else if (mainCommand == "delete" || mainCommand == "del") {
-				if (allFlag) {
-					ModuleManager::getInstance().removeAllModules();
-				}
-				else {
-					if (moduleNames.empty()) {
-						std::cerr << "ERROR: delete/del <module_name>[, module_name...]" << std::endl;
-					}
-					else {
-						for (const auto& mod : moduleNames) {
-							ModuleManager::getInstance().removeModule(mod);
-						}
+				if (c == '"' || c == '\'') {
+					bool& closable = c == '"' ? doubleClosable : singleClosable;
+					closable = closable && isClosed(data, size, read);
+					if (closable) {
+						quote = c;
+						read++;
+						continue;
 					}
 				}
+				if (isSpace(c) || c == ',')
+					break;
+				if (c == '\\' && read + 1 < size && isEscapable(data[read + 1])) {
+					data[write++] = data[read + 1];
+					read += 2;
+					continue;
+				}
+				data[write++] = data[read++];
 			}
+			tokens.emplace_back(data + start, write - start);
 		}
-		else {
-			// Assume it's a module execution command.
-			// Combine the entire command (splitting by commas for arguments and flags)
-			std::string argsCombined;
-			for (size_t i = 0; i < tokens.size(); i++) {
-				if (!argsCombined.empty())
-					argsCombined += " ";
-				argsCombined += tokens[i];
-			}
-			std::istringstream argStream(argsCombined);
-			std::vector<std::string> parts;
-			while (std::getline(argStream, token, ',')) {
-				std::string part = trim(token);
-				if (!part.empty())
-					parts.push_back(part);
-			}
-			bool versionFlag = false;
-			std::vector<std::string> moduleNames;
-			for (const auto& p : parts) {
-				if (p == "-v" || p == "v" || p == "version")
-					versionFlag = true;
-				else
-					moduleNames.push_back(p);
+	}
+
+private:
+	// Whether the quote at data[open] has a closing partner later in the line.
+	static bool isClosed(const char* data, size_t size, size_t open) {
+		char quote = data[open];
+		for (size_t i = open + 1; i < size; i++) {
+			if (data[i] == quote)
+				return true;
+			if (quote == '"' && data[i] == '\\' && i + 1 < size && data[i + 1] == '"')
+				i++;
+		}
+		return false;
+	}
+
+	static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+	static bool isEscapable(char c) { return c == '"' || c == '\'' || c == ',' || isSpace(c); }
+};
+
+// Manifest entry for an installed module: enough to route its command and report its version
+// without loading the library.
+struct ModuleRecord {
+	std::string name;               // directory under modules/
+	std::string path;               // library file
+	long long mtime = 0;            // library last write time (file clock ticks)
+	unsigned long long size = 0;    // library size in bytes
+	std::string command;            // command the module exports (ms_module_info::name)
+	std::string version;
+};
+
+bool statFile(const std::string& path, long long& mtime, unsigned long long& size) {
+	std::error_code ec;
+	auto time = fs::last_write_time(path, ec);
+	if (ec)
+		return false;
+	auto bytes = fs::file_size(path, ec);
+	if (ec)
+		return false;
+	mtime = static_cast<long long>(time.time_since_epoch().count());
+	size = static_cast<unsigned long long>(bytes);
+	return true;
+}
+
+// Commands report failure by writing to std::cerr, except for lines that start with
+// "Warning: ", which are notes that leave the command successful. Fed with stderr output in
+// pieces as it is written, this counts the lines that are error reports.
+class ErrorLineCounter {
+public:
+	ErrorLineCounter() : matched(0), decided(false) {}
+
+	// Number of error lines that the text starts.
+	size_t feed(const char* data, size_t size) {
+		static const char Prefix[] = "Warning: ";
+		const size_t PrefixLength = sizeof(Prefix) - 1;
+		size_t errors = 0;
+		for (size_t i = 0; i < size; i++) {
+			if (data[i] == '\n') {
+				matched = 0;
+				decided = false;
 			}
-			if (moduleNames.empty()) {
-				std::cerr << "ERROR: Invalid module command." << std::endl;
+			else if (decided) {
+				continue;
+			}
+			else if (data[i] == Prefix[matched]) {
+				decided = ++matched == PrefixLength;
 			}
 			else {
-				for (const auto& mod : moduleNames) {
-					if (ModuleManager::getInstance().getModules().find(mod) == ModuleManager::getInstance().getModules().end()) {
-						std::cerr << "Error: Module not loaded: " << mod << std::endl;
-					}
-					else {
-						if (versionFlag) {
-							std::cout << mod << " Version: "
-								<< ModuleManager::getInstance().getModules().at(mod)->getVersion()
-								<< std::endl;
-						}
-						else {
-							// Execute the module (extra arguments can be handled here)
-							ModuleManager::getInstance().executeModule(mod, {});
-						}
-					}
-				}
+				errors++;
+				decided = true;
 			}
 		}
+		return errors;
 	}
-	return 0;
+
+private:
+	size_t matched;     // characters of the prefix seen at the start of the current line
+	bool decided;       // the current line is known to be a warning or an error
+};
+
+// The background job (see JobManager) that the current thread works for: its cancellation
+// flag and the buffer that collects its output until it is shown. The prompt thread works
+// for no job. Code that hands work to other threads passes the job on with a Scope, so the
+// output and the cancellation of a job follow its work.
+class JobContext {
+public:
+	JobContext() : cancelRequested(false), live(false), errorWrites(0) {}
+
+	// Makes the current thread work for job (or for none) until the scope ends.
+	class Scope {
+	public:
+		explicit Scope(JobContext* job) : previous(slot()) { slot() = job; }
+		~Scope() { slot() = previous; }
+
+	private:
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+		JobContext* previous;
+	};
+
+	// Runs handler if the current thread's job is cancelled while the object exists, e.g. to
+	// stop child processes that a blocking wait depends on. Does nothing outside a job.
+	class CancelHandler {
+	public:
+		explicit CancelHandler(std::function<void()> handler) : job(slot()), handler(std::move(handler)) {
+			if (job)
+				job->addHandler(&this->handler);
+		}
+		~CancelHandler() {
+			if (job)
+				job->removeHandler(&handler);
+		}
+
+	private:
+		CancelHandler(const CancelHandler&) = delete;
+		CancelHandler& operator=(const CancelHandler&) = delete;
+		JobContext* job;
+		std::function<void()> handler;
+	};
+
+	static JobContext* current() { return slot(); }
+
+	// True once the job the current thread works for has been killed. Long loops poll this.
+	static bool cancelled() {
+		JobContext* job = slot();
+		return job && job->isCancelled();
+	}
+
+	bool isCancelled() const { return cancelRequested.load(std::memory_order_relaxed); }
+
+	void cancel() {
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelRequested = true;
+		for (std::function<void()>* handler : handlers)
+			(*handler)();
+	}
+
+	// Output of the job's threads (see JobOutputBuffer). It is kept until drain(), or written
+	// to console right away once the job is live.
+	void write(bool error, const char* data, size_t size, std::streambuf* console) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (error)
+			errorWrites += errorLines.feed(data, size);
+		if (live) {
+			console->sputn(data, static_cast<std::streamsize>(size));
+			return;
+		}
+		if (chunks.empty() || chunks.back().first != error)
+			chunks.emplace_back(error, std::string());
+		chunks.back().second.append(data, size);
+	}
+
+	// Show the output kept so far (on the prompt thread). With goLive, later output of the
+	// job is shown as it is written ("fg").
+	void drain(bool goLive) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& chunk : chunks) {
+			std::ostream& target = chunk.first ? std::cerr : std::cout;
+			target << chunk.second;
+			target.flush();
+		}
+		chunks.clear();
+		live = live || goLive;
+	}
+
+	bool wroteError() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return errorWrites > 0;
+	}
+
+	// Take the output kept so far, in write order (server sessions send it to their client).
+	std::vector<std::pair<bool, std::string>> takeOutput() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<std::pair<bool, std::string>> taken;
+		taken.swap(chunks);
+		return taken;
+	}
+
+private:
+	static JobContext*& slot() {
+		static thread_local JobContext* job = nullptr;
+		return job;
+	}
+
+	void addHandler(std::function<void()>* handler) {
+		std::lock_guard<std::mutex> lock(mutex);
+		handlers.push_back(handler);
+		if (cancelRequested)
+			(*handler)();
+	}
+
+	void removeHandler(std::function<void()>* handler) {
+		std::lock_guard<std::mutex> lock(mutex);
+		handlers.erase(std::find(handlers.begin(), handlers.end(), handler));
+	}
+
+	mutable std::mutex mutex;
+	std::atomic<bool> cancelRequested;
+	bool live;
+	size_t errorWrites;                                 // error lines, warnings not counted
+	ErrorLineCounter errorLines;
+	std::vector<std::pair<bool, std::string>> chunks;   // (is stderr, text) in write order
+	std::vector<std::function<void()>*> handlers;
+};
+
+// Run body(0..count-1) on a small pool (the caller is one of the threads). Used for loading
+// and fetching modules, which mostly wait on the disk, the network and module constructors,
+// so the pool is not limited to the core count. maxThreads, if given, sets the pool size.
+void parallelFor(size_t count, const std::function<void(size_t)>& body, size_t maxThreads = 0) {
+	const unsigned MinThreads = 4;
+	std::atomic<size_t> next(0);
+	JobContext* job = JobContext::current();
+	auto worker = [&]() {
+		JobContext::Scope scope(job);
+		for (size_t i = next++; i < count; i = next++)
+			body(i);
+	};
+	size_t threads = std::min<size_t>(count, maxThreads ? maxThreads : std::max(MinThreads, std::thread::hardware_concurrency()));
+	std::vector<std::thread> pool;
+	for (size_t t = 1; t < threads; t++)
+		pool.emplace_back(worker);
+	worker();
+	for (auto& thread : pool)
+		thread.join();
+}
+
+// Chrome trace-event recording ("trace on <file>"). Every thread records into a ring buffer of
+// its own, claimed on its first span and written without locks; buffers of finished threads
+// are reused. While tracing is off a span costs one relaxed atomic load.
+class Tracer {
+public:
+	struct Event {
+		char name[32];
+		char detail[48];
+		bool module;           // recorded by a module (ms::TraceSpan)
+		uint32_t thread;
+		uint64_t start;        // nanoseconds, see now()
+		uint64_t end;
+	};
+
+	static Tracer& getInstance() {
+		static Tracer instance;
+		return instance;
+	}
+
+	static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+	static uint64_t now() {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// Start a new trace that stop() hands to path; events of earlier traces are dropped.
+	void start(const std::string& path) {
+		std::lock_guard<std::mutex> lock(buffersMutex);
+		generation++;
+		origin = now();
+		tracePath = path;
+		active = true;
+	}
+
+	// Stop recording and return the trace's events in start order, once spans that are being
+	// written have landed.
+	std::vector<Event> stop(std::string& path, uint64_t& startTime) {
+		active = false;
+		std::lock_guard<std::mutex> lock(buffersMutex);
+		std::vector<Event> events;
+		for (const auto& buffer : buffers) {
+			while (buffer->writing)
+				std::this_thread::yield();
+			if (buffer->generation != generation)
+				continue;
+			uint64_t head = buffer->head.load(std::memory_order_acquire);
+			for (uint64_t i = head > Capacity ? head - Capacity : 0; i < head; i++)
+				events.push_back(buffer->events[i % Capacity]);
+		}
+		std::sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.start < b.start; });
+		path = tracePath;
+		startTime = origin;
+		return events;
+	}
+
+	// The writing flag and the second look at active pair up with stop(): either stop() sees
+	// the flag and waits, or the span sees tracing is off and is dropped.
+	void record(const char* name, std::string_view detail, uint64_t start, uint64_t end, bool module = false) {
+		Buffer* buffer = threadBuffer();
+		buffer->writing = true;
+		if (active) {
+			if (buffer->generation != generation) {
+				buffer->generation = generation;
+				buffer->head.store(0, std::memory_order_relaxed);
+			}
+			uint64_t head = buffer->head.load(std::memory_order_relaxed);
+			Event& event = buffer->events[head % Capacity];
+			copyText(event.name, sizeof(event.name), name);
+			copyText(event.detail, sizeof(event.detail), detail);
+			event.module = module;
+			event.thread = threadId();
+			event.start = start;
+			event.end = end;
+			buffer->head.store(head + 1, std::memory_order_release);
+		}
+		buffer->writing = false;
+	}
+
+private:
+	static const size_t Capacity = 16384;   // events kept per thread; older ones are overwritten
+
+	struct Buffer {
+		std::vector<Event> events = std::vector<Event>(Capacity);
+		std::atomic<uint64_t> head{ 0 };
+		std::atomic<bool> writing{ false };
+		std::atomic<bool> claimed{ true };
+		unsigned generation = 0;
+	};
+
+	// Gives the thread's buffer back when the thread ends.
+	struct Claim {
+		Buffer* buffer = nullptr;
+		~Claim() {
+			if (buffer)
+				buffer->claimed = false;
+		}
+	};
+
+	Tracer() : generation(0), origin(0) {}
+	Tracer(const Tracer&) = delete;
+	Tracer& operator=(const Tracer&) = delete;
+
+	static void copyText(char* target, size_t size, std::string_view text) {
+		size_t length = std::min(size - 1, text.size());
+		std::memcpy(target, text.data(), length);
+		target[length] = '\0';
+	}
+
+	static uint32_t threadId() {
+		static std::atomic<uint32_t> next(1);
+		static thread_local uint32_t id = next++;
+		return id;
+	}
+
+	Buffer* threadBuffer() {
+		static thread_local Claim claim;
+		if (claim.buffer)
+			return claim.buffer;
+		std::lock_guard<std::mutex> lock(buffersMutex);
+		for (const auto& buffer : buffers) {
+			bool released = false;
+			if (buffer->claimed.compare_exchange_strong(released, true)) {
+				claim.buffer = buffer.get();
+				return claim.buffer;
+			}
+		}
+		buffers.emplace_back(new Buffer());
+		claim.buffer = buffers.back().get();
+		return claim.buffer;
+	}
+
+	static std::atomic<bool> active;
+	std::mutex buffersMutex;
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	std::atomic<unsigned> generation;
+	uint64_t origin;
+	std::string tracePath;
+};
+
+std::atomic<bool> Tracer::active(false);
+
+// Records the time from construction to destruction as one span while tracing is on. detail
+// (e.g. the command or module name) must outlive the span.
+class TraceSpan {
+public:
+	explicit TraceSpan(const char* name, std::string_view detail = std::string_view())
+		: name(name), detail(detail), start(Tracer::enabled() ? Tracer::now() : 0) {}
+
+	~TraceSpan() {
+		if (start)
+			Tracer::getInstance().record(name, detail, start, Tracer::now());
+	}
+
+private:
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+	const char* name;
+	std::string_view detail;
+	uint64_t start;
+};
+
+// Work-stealing pool for CPU-bound work in modules, handed to them as ms_host_services (see
+// module_api.h). One worker per core; unlike the Executor, tasks are short and may spawn and
+// wait for further tasks. A worker keeps the tasks it spawns on its own deque and runs the
+// newest first, while idle workers take outside submissions from the shared queue or steal
+// the oldest task of another worker. A thread that waits for a task runs queued tasks in the
+// meantime, so nested parallel loops cannot run out of threads. Tasks run for the job of
+// the thread that submitted them.
+class TaskPool {
+public:
+	TaskPool() : TaskPool(std::max(1u, std::thread::hardware_concurrency())) {}
+
+	// A pool of the given size (module workers share the cores between their processes).
+	explicit TaskPool(size_t threads) : queueCount(std::max<size_t>(1, threads)), queues(new Queue[queueCount]), queued(0), stopping(false) {}
+
+	~TaskPool() { shutdown(); }
+
+	size_t threadCount() const { return queueCount; }
+
+	// The pool's part of the services table handed to modules.
+	void fillServices(ms_host_services& services) {
+		services.host = this;
+		services.thread_count = static_cast<uint32_t>(queueCount);
+		services.submit = &TaskPool::submitTask;
+		services.wait = &TaskPool::waitTask;
+		services.parallel_for = &TaskPool::parallelForTask;
+	}
+
+	// Run the queued tasks to the end and stop the workers. Later submissions run on the
+	// thread that waits for them.
+	void shutdown() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+			available.notify_all();
+		}
+		for (auto& worker : workers)
+			worker.join();
+		workers.clear();
+	}
+
+private:
+	struct Task {
+		ms_task_fn fn;
+		void* arg;
+		JobContext* job;
+		std::atomic<bool> done;
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task*> tasks;
+	};
+
+	// One parallel_for: chunks are handed out by an atomic counter to the caller and the
+	// helper tasks, so a helper that starts late simply finds less work.
+	struct Loop {
+		ms_range_fn fn;
+		void* arg;
+		size_t count;
+		size_t grain;
+		size_t chunks;
+		std::atomic<size_t> next;
+		JobContext* job;
+	};
+
+	TaskPool(const TaskPool&) = delete;
+	TaskPool& operator=(const TaskPool&) = delete;
+
+	// Index of the pool worker running on this thread, or -1.
+	static int& workerIndex() {
+		static thread_local int index = -1;
+		return index;
+	}
+
+	void start() {
+		std::lock_guard<std::mutex> lock(startMutex);
+		if (!workers.empty() || stopping)
+			return;
+		for (size_t i = 0; i < queueCount; i++)
+			workers.emplace_back(&TaskPool::work, this, static_cast<int>(i));
+		started = true;
+	}
+
+	Task* submit(ms_task_fn fn, void* arg) {
+		if (!started)
+			start();
+		if (stopping)
+			return nullptr;
+		Task* task = new Task{ fn, arg, JobContext::current(), { false } };
+		int self = workerIndex();
+		Queue& queue = self >= 0 ? queues[self] : shared;
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(task);
+		}
+		bool wakeWaiters;
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			queued++;
+			wakeWaiters = waiting > 0;
+		}
+		available.notify_one();
+		if (wakeWaiters)
+			progress.notify_all();
+		return task;
+	}
+
+	// Own tasks newest first, then outside submissions, then the oldest task of another worker.
+	Task* take(int self) {
+		if (self >= 0) {
+			Queue& own = queues[self];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty()) {
+				Task* task = own.tasks.back();
+				own.tasks.pop_back();
+				return taken(task);
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(shared.mutex);
+			if (!shared.tasks.empty()) {
+				Task* task = shared.tasks.front();
+				shared.tasks.pop_front();
+				return taken(task);
+			}
+		}
+		size_t first = self >= 0 ? self + 1 : 0;
+		for (size_t i = 0; i < queueCount; i++) {
+			size_t index = (first + i) % queueCount;
+			if (static_cast<int>(index) == self)
+				continue;
+			Queue& victim = queues[index];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				Task* task = victim.tasks.front();
+				victim.tasks.pop_front();
+				return taken(task);
+			}
+		}
+		return nullptr;
+	}
+
+	Task* taken(Task* task) {
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		queued--;
+		return task;
+	}
+
+	// done is stored before waiting is read, and a waiter counts itself before it checks done
+	// (both seq_cst), so either the waiter sees the task done or it gets notified.
+	void run(Task* task) {
+		{
+			JobContext::Scope scope(task->job);
+			task->fn(task->arg);
+		}
+		task->done.store(true);
+		if (waiting.load() > 0) {
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			progress.notify_all();
+		}
+	}
+
+	void work(int self) {
+		workerIndex() = self;
+		for (;;) {
+			if (Task* task = take(self)) {
+				run(task);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			available.wait(lock, [&]() { return stopping || queued > 0; });
+			if (stopping && queued == 0)
+				return;
+		}
+	}
+
+	// Runs queued tasks while the awaited one is pending. Once there is nothing left to take,
+	// sleeps until a task finishes or new work is queued instead of spinning on a core.
+	void wait(Task* task) {
+		while (!task->done.load()) {
+			if (Task* other = take(workerIndex())) {
+				run(other);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			waiting++;
+			progress.wait(lock, [&]() { return task->done.load() || queued > 0; });
+			waiting--;
+		}
+		delete task;
+	}
+
+	static void runChunks(void* arg) {
+		Loop* loop = static_cast<Loop*>(arg);
+		for (size_t chunk = loop->next++; chunk < loop->chunks; chunk = loop->next++) {
+			if (loop->job && loop->job->isCancelled())
+				return;
+			size_t begin = chunk * loop->grain;
+			loop->fn(loop->arg, begin, std::min(loop->count, begin + loop->grain));
+		}
+	}
+
+	void parallelFor(size_t count, size_t grain, ms_range_fn fn, void* arg) {
+		if (count == 0)
+			return;
+		Loop loop;
+		loop.fn = fn;
+		loop.arg = arg;
+		loop.count = count;
+		loop.grain = std::max<size_t>(1, grain);
+		loop.chunks = (count + loop.grain - 1) / loop.grain;
+		loop.next = 0;
+		loop.job = JobContext::current();
+		size_t helpers = std::min(loop.chunks, queueCount) - 1;
+		std::vector<Task*> tasks;
+		for (size_t i = 0; i < helpers; i++) {
+			if (Task* task = submit(&TaskPool::runChunks, &loop))
+				tasks.push_back(task);
+		}
+		runChunks(&loop);
+		for (Task* task : tasks)
+			wait(task);
+	}
+
+	static ms_task* submitTask(void* host, ms_task_fn fn, void* arg) {
+		return reinterpret_cast<ms_task*>(static_cast<TaskPool*>(host)->submit(fn, arg));
+	}
+
+	static void waitTask(void* host, ms_task* task) {
+		if (task)
+			static_cast<TaskPool*>(host)->wait(reinterpret_cast<Task*>(task));
+	}
+
+	static void parallelForTask(void* host, size_t count, size_t grain, ms_range_fn fn, void* arg) {
+		static_cast<TaskPool*>(host)->parallelFor(count, grain, fn, arg);
+	}
+
+	std::mutex startMutex;
+	std::atomic<bool> started{ false };
+	std::vector<std::thread> workers;
+	const size_t queueCount;           // one per worker
+	std::unique_ptr<Queue[]> queues;
+	Queue shared;                      // submissions from threads outside the pool
+	std::mutex sleepMutex;
+	std::condition_variable available;
+	std::condition_variable progress;  // a task finished or was queued; wakes threads in wait()
+	size_t queued;                     // tasks in all queues, guarded by sleepMutex
+	std::atomic<size_t> waiting{ 0 };  // threads sleeping in wait(), changed under sleepMutex
+	std::atomic<bool> stopping;
+};
+
+// Log-linear histogram of durations in nanoseconds in the style of HdrHistogram: 16 linear
+// sub-buckets per power of two, so every value is known to within 1/16. The counters are
+// relaxed atomics: recording never takes a lock, and any thread may record while another
+// reads.
+class LatencyHistogram {
+public:
+	LatencyHistogram() { reset(); }
+
+	void record(uint64_t nanoseconds) {
+		counts[bucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+		calls.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+		uint64_t previous = largest.load(std::memory_order_relaxed);
+		while (nanoseconds > previous && !largest.compare_exchange_weak(previous, nanoseconds, std::memory_order_relaxed)) {
+		}
+	}
+
+	uint64_t count() const { return calls.load(std::memory_order_relaxed); }
+	uint64_t total() const { return sum.load(std::memory_order_relaxed); }
+	uint64_t maximum() const { return largest.load(std::memory_order_relaxed); }
+
+	// Upper end of the bucket that holds quantile q (0..1), at most the largest value seen.
+	uint64_t percentile(double q) const {
+		uint64_t n = 0;
+		for (const auto& bucket : counts)
+			n += bucket.load(std::memory_order_relaxed);
+		if (n == 0)
+			return 0;
+		uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * n)));
+		uint64_t seen = 0;
+		for (int i = 0; i < BucketCount; i++) {
+			seen += counts[i].load(std::memory_order_relaxed);
+			if (seen >= rank)
+				return std::min(upperBound(i), maximum());
+		}
+		return maximum();
+	}
+
+	void reset() {
+		for (auto& bucket : counts)
+			bucket.store(0, std::memory_order_relaxed);
+		calls.store(0, std::memory_order_relaxed);
+		sum.store(0, std::memory_order_relaxed);
+		largest.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	static const int SubBits = 4;
+	static const int SubBuckets = 1 << SubBits;
+	static const int MaxShift = 40;                            // exact up to 2^45 ns (9.7 hours)
+	static const int BucketCount = (MaxShift + 2) * SubBuckets;
+
+	// Values below 16 get a bucket each; above that, the top 5 bits select it.
+	static int bucketOf(uint64_t value) {
+		if (value < SubBuckets)
+			return static_cast<int>(value);
+		int top = 0;
+		for (int step = 32; step > 0; step /= 2) {
+			if (value >> (top + step))
+				top += step;
+		}
+		int shift = top - SubBits;
+		if (shift > MaxShift)
+			return BucketCount - 1;
+		return (shift + 1) * SubBuckets + static_cast<int>((value >> shift) - SubBuckets);
+	}
+
+	static uint64_t upperBound(int bucket) {
+		if (bucket < SubBuckets)
+			return static_cast<uint64_t>(bucket);
+		int shift = bucket / SubBuckets - 1;
+		return ((static_cast<uint64_t>(SubBuckets + bucket % SubBuckets) + 1) << shift) - 1;
+	}
+
+	std::atomic<uint64_t> counts[BucketCount];
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> largest;
+};
+
+// Always-on latency statistics behind "stats": one histogram per command name (every command
+// line dispatched, including jobs) and one per module version (every module call, so a slower
+// new version shows up next to the old one). Lookups share a lock; only the first call of a
+// new name takes it exclusively.
+class CommandStats {
+public:
+	enum Kind { Command, ModuleCall };
+
+	struct Row {
+		Kind kind;
+		std::string name;
+		std::string version;
+		const LatencyHistogram* histogram;
+	};
+
+	static CommandStats& getInstance() {
+		static CommandStats instance;
+		return instance;
+	}
+
+	void record(Kind kind, const std::string& name, const std::string& version, std::chrono::steady_clock::duration elapsed) {
+		auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+		find(kind, name, version).record(static_cast<uint64_t>(std::max<long long>(0, nanoseconds)));
+	}
+
+	// Rows in name order; the histograms stay valid (reset() only zeroes them).
+	std::vector<Row> rows() const {
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		std::vector<Row> result;
+		for (const auto& entry : histograms)
+			result.push_back(Row{ entry.first.kind, entry.first.name, entry.first.version, entry.second.get() });
+		return result;
+	}
+
+	void reset() {
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		for (auto& entry : histograms)
+			entry.second->reset();
+	}
+
+private:
+	struct Key {
+		Kind kind;
+		std::string name;
+		std::string version;
+		bool operator<(const Key& other) const {
+			return std::tie(kind, name, version) < std::tie(other.kind, other.name, other.version);
+		}
+	};
+
+	CommandStats() {}
+	CommandStats(const CommandStats&) = delete;
+	CommandStats& operator=(const CommandStats&) = delete;
+
+	LatencyHistogram& find(Kind kind, const std::string& name, const std::string& version) {
+		Key key{ kind, name, version };
+		{
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			auto it = histograms.find(key);
+			if (it != histograms.end())
+				return *it->second;
+		}
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		std::unique_ptr<LatencyHistogram>& histogram = histograms[key];
+		if (!histogram)
+			histogram.reset(new LatencyHistogram());
+		return *histogram;
+	}
+
+	mutable std::shared_mutex mutex;
+	std::map<Key, std::unique_ptr<LatencyHistogram>> histograms;
+};
+
+std::string moduleLibraryPath(const std::string& moduleName) {
+	return "modules/" + moduleName + "/" + moduleName + platform::LibraryExtension;
+}
+
+// A batch owned by the host: a copy of the columns a pipeline stage emitted (ms_batch points
+// into module memory that is only valid during the emit call) and the views handed to the
+// stage that reads it. Names and string values share one buffer; every view points into
+// vector storage, so a RecordBatch can be moved without invalidating them.
+class RecordBatch {
+public:
+	RecordBatch() : rows(0) {}
+
+	// Copy a batch emitted by a module. Fails (and sets error) if it is malformed.
+	bool assign(const ms_batch& source, std::string& error) {
+		if (source.struct_size < sizeof(ms_batch) || (source.column_count > 0 && !source.columns)) {
+			error = "malformed batch";
+			return false;
+		}
+		size_t textSize = 0, doubleCount = 0, stringCount = 0;
+		for (size_t c = 0; c < source.column_count; c++) {
+			const ms_column& column = source.columns[c];
+			textSize += column.name.ptr ? column.name.len : 0;
+			if (column.type == MS_COLUMN_DOUBLE && (column.doubles || source.rows == 0)) {
+				doubleCount += source.rows;
+			}
+			else if (column.type == MS_COLUMN_STRING && (column.strings || source.rows == 0)) {
+				stringCount += source.rows;
+				for (size_t r = 0; r < source.rows; r++)
+					textSize += column.strings[r].ptr ? column.strings[r].len : 0;
+			}
+			else {
+				error = "malformed batch column " + std::to_string(c + 1);
+				return false;
+			}
+		}
+
+		rows = source.rows;
+		text.resize(textSize);
+		doubles.resize(doubleCount);
+		strings.resize(stringCount);
+		columns.resize(source.column_count);
+		size_t textUsed = 0, doublesUsed = 0, stringsUsed = 0;
+		auto copyText = [&](const ms_str& value) {
+			ms_str copy;
+			copy.len = value.ptr ? value.len : 0;
+			copy.ptr = text.data() + textUsed;
+			if (copy.len)
+				std::memcpy(text.data() + textUsed, value.ptr, copy.len);
+			textUsed += copy.len;
+			return copy;
+		};
+		for (size_t c = 0; c < source.column_count; c++) {
+			const ms_column& column = source.columns[c];
+			ms_column& target = columns[c];
+			target.name = copyText(column.name);
+			target.type = column.type;
+			target.doubles = nullptr;
+			target.strings = nullptr;
+			if (column.type == MS_COLUMN_DOUBLE) {
+				if (rows)
+					std::memcpy(doubles.data() + doublesUsed, column.doubles, rows * sizeof(double));
+				target.doubles = doubles.data() + doublesUsed;
+				doublesUsed += rows;
+			}
+			else {
+				for (size_t r = 0; r < rows; r++)
+					strings[stringsUsed + r] = copyText(column.strings[r]);
+				target.strings = strings.data() + stringsUsed;
+				stringsUsed += rows;
+			}
+		}
+		return true;
+	}
+
+	// Text a stage wrote to stdout: each '\n' terminated line of data[0..size) (and a final
+	// unterminated one) becomes a row of the string column "line".
+	void assignLines(const char* data, size_t size) {
+		static const char LineColumn[] = "line";
+		text.assign(LineColumn, LineColumn + sizeof(LineColumn) - 1);
+		text.insert(text.end(), data, data + size);
+		const char* base = text.data() + sizeof(LineColumn) - 1;
+		strings.clear();
+		for (size_t pos = 0; pos < size;) {
+			const void* nl = std::memchr(base + pos, '\n', size - pos);
+			size_t end = nl ? static_cast<const char*>(nl) - base : size;
+			ms_str line;
+			line.ptr = base + pos;
+			line.len = end > pos && base[end - 1] == '\r' ? end - pos - 1 : end - pos;
+			strings.push_back(line);
+			pos = end + 1;
+		}
+		rows = strings.size();
+		doubles.clear();
+		columns.resize(1);
+		columns[0].name.ptr = text.data();
+		columns[0].name.len = sizeof(LineColumn) - 1;
+		columns[0].type = MS_COLUMN_STRING;
+		columns[0].doubles = nullptr;
+		columns[0].strings = strings.data();
+	}
+
+	ms_batch view() const {
+		ms_batch batch;
+		batch.struct_size = sizeof(batch);
+		batch.rows = rows;
+		batch.column_count = columns.size();
+		batch.columns = columns.data();
+		return batch;
+	}
+
+private:
+	size_t rows;
+	std::vector<char> text;
+	std::vector<double> doubles;     // double columns, one after the other
+	std::vector<ms_str> strings;     // string columns, one after the other
+	std::vector<ms_column> columns;
+};
+
+// Bounded queue between two pipeline stages. push() blocks while the queue is full, so a
+// producer never runs more than Capacity batches ahead of its consumer and memory stays
+// bounded however much data flows through.
+class BatchChannel {
+public:
+	static const size_t Capacity = 16;
+
+	BatchChannel() : closed(false), stopped(false) {}
+
+	// Returns false once the consumer has stopped; the batch is dropped.
+	bool push(RecordBatch&& batch) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [&]() { return stopped || queue.size() < Capacity; });
+		if (stopped)
+			return false;
+		queue.push_back(std::move(batch));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// Returns false at the end of the input (queue empty and producer done).
+	bool pop(RecordBatch& batch) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [&]() { return closed || !queue.empty(); });
+		if (queue.empty())
+			return false;
+		batch = std::move(queue.front());
+		queue.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// Producer side: no more batches will follow.
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+
+	// Consumer side: nothing more will be read; unblocks the producer.
+	void stop() {
+		std::lock_guard<std::mutex> lock(mutex);
+		stopped = true;
+		queue.clear();
+		notFull.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable notEmpty, notFull;
+	std::deque<RecordBatch> queue;
+	bool closed, stopped;
+};
+
+// Host context of one module call inside a pipeline: serves the read/emit callbacks of
+// ms_call and routes the module's text. Text written to stdout becomes "line" rows for the
+// next stage if there is one and goes to the console otherwise; stderr always goes to the
+// console. Stages run on their own threads, so console writes are serialized.
+class PipelineStage {
+public:
+	PipelineStage(BatchChannel* input, BatchChannel* output, JobContext* job)
+		: input(input), output(output), job(job), instance(nullptr), wroteError(false) {}
+
+	bool hasInput() const { return input != nullptr; }
+	bool hasOutput() const { return output != nullptr; }
+
+	// Instance to run instead of the module's own (which another stage is using).
+	void* getInstance() const { return instance; }
+	void setInstance(void* value) { instance = value; }
+
+	bool getWroteError() const { return wroteError; }
+	JobContext* getJob() const { return job; }
+
+	// The call returned: pass on remaining text, end the output and release the producer.
+	void finish() {
+		if (output) {
+			if (!pendingText.empty())
+				pushText(pendingText.size());
+			output->close();
+		}
+		if (input)
+			input->stop();
+	}
+
+	static std::mutex& consoleMutex() {
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	static int cancelled(void* hostContext) {
+		JobContext* job = static_cast<PipelineStage*>(hostContext)->job;
+		return job && job->isCancelled() ? 1 : 0;
+	}
+
+	static int read(void* hostContext, ms_batch* batch) {
+		PipelineStage* stage = static_cast<PipelineStage*>(hostContext);
+		if (!batch || batch->struct_size < sizeof(ms_batch) || !stage->input)
+			return 0;
+		try {
+			if (!stage->input->pop(stage->current))
+				return 0;
+		}
+		catch (const std::exception& e) {
+			stage->reportError(std::string("pipeline read failed: ") + e.what());
+			return 0;
+		}
+		*batch = stage->current.view();
+		return 1;
+	}
+
+	static int emit(void* hostContext, const ms_batch* batch) {
+		PipelineStage* stage = static_cast<PipelineStage*>(hostContext);
+		if (!batch || !stage->output)
+			return 0;
+		try {
+			RecordBatch copy;
+			std::string error;
+			if (!copy.assign(*batch, error)) {
+				stage->reportError(error);
+				return 0;
+			}
+			// Text written before the batch stays in front of it.
+			if (!stage->pendingText.empty())
+				stage->pushText(stage->pendingText.size());
+			return stage->output->push(std::move(copy)) ? 1 : 0;
+		}
+		catch (const std::exception& e) {
+			stage->reportError(std::string("pipeline emit failed: ") + e.what());
+			return 0;
+		}
+	}
+
+	static void write(void* hostContext, int stream, const char* data, size_t len) {
+		PipelineStage* stage = static_cast<PipelineStage*>(hostContext);
+		try {
+			if (stream == MS_STREAM_ERR || !stage->output) {
+				std::ostream& target = stream == MS_STREAM_ERR ? std::cerr : std::cout;
+				std::lock_guard<std::mutex> lock(consoleMutex());
+				if (stream == MS_STREAM_ERR && len > 0)
+					stage->wroteError = true;
+				if (data)
+					target.write(data, static_cast<std::streamsize>(len));
+				else
+					target.flush();
+				return;
+			}
+			if (data)
+				stage->pendingText.append(data, len);
+			// Hand complete lines on in batches of a useful size, or whenever the module flushes.
+			if (!stage->pendingText.empty() && (!data || stage->pendingText.size() >= TextBatchSize)) {
+				size_t end = stage->pendingText.rfind('\n');
+				if (end != std::string::npos)
+					stage->pushText(end + 1);
+			}
+		}
+		catch (const std::exception&) {
+			// Out of memory while buffering text; the text is lost but the module keeps running.
+		}
+	}
+
+private:
+	static const size_t TextBatchSize = 64 * 1024;
+
+	void pushText(size_t size) {
+		RecordBatch batch;
+		batch.assignLines(pendingText.data(), size);
+		pendingText.erase(0, size);
+		output->push(std::move(batch));
+	}
+
+	void reportError(const std::string& message) {
+		std::lock_guard<std::mutex> lock(consoleMutex());
+		wroteError = true;
+		std::cerr << "Error: " << message << '\n';
+	}
+
+	BatchChannel* input;
+	BatchChannel* output;
+	JobContext* job;            // background job the pipeline runs for, if any
+	RecordBatch current;        // last batch handed to the module by read()
+	std::string pendingText;    // stdout text not yet passed on
+	void* instance;
+	bool wroteError;
+};
+
+// One loaded copy of a module library (see module_api.h) and the instance created by it.
+// The library is loaded from a private shadow copy, so the installed file can be replaced
+// (or rebuilt in place) while this copy is running, and a new version can be loaded beside it.
+// The destructor destroys the instance, releases the library and deletes the shadow copy.
+class LoadedModule {
+public:
+	~LoadedModule() {
+		if (instance)
+			entryPoints.destroy(instance);
+		if (library)
+			platform::closeLibrary(library);
+		std::error_code ec;
+		fs::remove(shadowPath, ec);
+	}
+
+	// Per-process folder for shadow copies.
+	static std::string shadowDirectory() {
+		return "modules.shadow/" + std::to_string(platform::processId());
+	}
+
+	// Copy the library, load the copy and create the instance. Fails (and sets error) if the
+	// library cannot be loaded, does not speak this host's ABI version, or changed while it
+	// was being copied.
+	static std::shared_ptr<LoadedModule> open(const ModuleRecord& record, std::string& error) {
+		static std::atomic<unsigned> sequence(0);
+		std::shared_ptr<LoadedModule> loaded(new LoadedModule());
+		{
+			TraceSpan span("checkFile", record.name);
+			if (!statFile(record.path, loaded->mtime, loaded->size)) {
+				error = record.path + " no longer exists";
+				return nullptr;
+			}
+			std::error_code ec;
+			fs::create_directories(shadowDirectory(), ec);
+			loaded->shadowPath = shadowDirectory() + "/" + record.name + "-" + std::to_string(++sequence) + platform::LibraryExtension;
+			if (!fs::copy_file(record.path, loaded->shadowPath, fs::copy_options::overwrite_existing, ec)) {
+				error = "cannot copy " + record.path + ": " + ec.message();
+				return nullptr;
+			}
+			long long mtime = 0;
+			unsigned long long size = 0;
+			if (!statFile(record.path, mtime, size) || mtime != loaded->mtime || size != loaded->size) {
+				error = record.path + " changed while it was being loaded";
+				return nullptr;
+			}
+		}
+
+		ms_module_info info;
+		{
+			TraceSpan span("loadLibrary", record.name);
+			loaded->library = openLibrary(loaded->shadowPath, info, loaded->entryPoints, error);
+		}
+		if (!loaded->library)
+			return nullptr;
+		loaded->version = info.version ? info.version : "unknown";
+		loaded->capabilities = info.capabilities;
+		{
+			TraceSpan span("createModule", record.name);
+			loaded->instance = loaded->entryPoints.create();
+		}
+		if (!loaded->instance) {
+			error = "ms_module_create failed";
+			return nullptr;
+		}
+		return loaded;
+	}
+
+	// Fill in command and version of a manifest record by loading the library just long
+	// enough to query it.
+	static bool inspect(ModuleRecord& record, std::string& error) {
+		ms_module_info info;
+		EntryPoints entryPoints;
+		platform::LibraryHandle library = openLibrary(record.path, info, entryPoints, error);
+		if (!library)
+			return false;
+		record.command = info.name && *info.name ? info.name : record.name;
+		record.version = info.version ? info.version : "unknown";
+		platform::closeLibrary(library);
+		return true;
+	}
+
+	const std::string& getVersion() const { return version; }
+	long long getMtime() const { return mtime; }
+	unsigned long long getSize() const { return size; }
+	uint32_t getCapabilities() const { return capabilities; }
+
+	// Additional instances, for running the module in more than one pipeline stage at once.
+	void* createInstance() { return entryPoints.create(); }
+	void destroyInstance(void* other) { entryPoints.destroy(other); }
+
+	// Runs the module with args[first..]. The arguments are passed as views into the
+	// tokens, so nothing is copied on the way in. services is the thread pool offered to
+	// the module. Inside a pipeline, stage provides the read/emit callbacks and takes the
+	// module's output.
+	// Background jobs, server sessions and pipeline stages may call the same module at once.
+	// Unless the module declares MS_CAP_THREAD_SAFE, calls on its instance are serialized.
+	int execute(const Tokens& args, size_t first, const ms_host_services* services, PipelineStage* stage = nullptr) {
+		const size_t StackArgs = 16;
+		size_t argc = args.size() > first ? args.size() - first : 0;
+		ms_str stackArgv[StackArgs];
+		std::vector<ms_str> heapArgv;
+		ms_str* argv = stackArgv;
+		if (argc > StackArgs) {
+			heapArgv.resize(argc);
+			argv = heapArgv.data();
+		}
+		for (size_t i = 0; i < argc; i++) {
+			argv[i].ptr = args[first + i].data();
+			argv[i].len = args[first + i].size();
+		}
+
+		CallOutput output;
+		output.job = JobContext::current();
+		ms_call call;
+		call.struct_size = sizeof(call);
+		call.argv = argv;
+		call.argc = argc;
+		call.host_ctx = &output;
+		call.write = &LoadedModule::write;
+		call.read = nullptr;
+		call.emit = nullptr;
+		call.cancelled = &LoadedModule::cancelled;
+		call.services = services;
+		std::unique_lock<std::mutex> exclusive(callMutex, std::defer_lock);
+		if (!stage) {
+			if (!(capabilities & MS_CAP_THREAD_SAFE))
+				exclusive.lock();
+			int status = entryPoints.execute(instance, &call);
+			if (exclusive.owns_lock())
+				exclusive.unlock();
+			if (status != 0 && !output.wroteError) {
+				std::cerr << "Error: module exited with status " << status << '\n';
+			}
+			return status;
+		}
+
+		call.host_ctx = stage;
+		call.write = &PipelineStage::write;
+		call.cancelled = &PipelineStage::cancelled;
+		if (stage->hasInput())
+			call.read = &PipelineStage::read;
+		if (stage->hasOutput())
+			call.emit = &PipelineStage::emit;
+		// A stage never waits for the shared instance: the call holding it may be a stage of
+		// another pipeline that is blocked on this one. It runs on an instance of its own instead.
+		void* target = stage->getInstance();
+		void* temporary = nullptr;
+		if (!target) {
+			target = instance;
+			if (!(capabilities & MS_CAP_THREAD_SAFE) && !exclusive.try_lock()) {
+				target = temporary = entryPoints.create();
+				if (!target) {
+					stage->finish();
+					std::lock_guard<std::mutex> lock(PipelineStage::consoleMutex());
+					std::cerr << "Error: ms_module_create failed" << '\n';
+					return 1;
+				}
+			}
+		}
+		int status = entryPoints.execute(target, &call);
+		if (exclusive.owns_lock())
+			exclusive.unlock();
+		if (temporary)
+			entryPoints.destroy(temporary);
+		stage->finish();
+		std::lock_guard<std::mutex> lock(PipelineStage::consoleMutex());
+		if (status != 0 && !stage->getWroteError()) {
+			std::cerr << "Error: module exited with status " << status << '\n';
+		}
+		return status;
+	}
+
+private:
+	struct EntryPoints {
+		ms_module_create_fn create = nullptr;
+		ms_module_execute_fn execute = nullptr;
+		ms_module_destroy_fn destroy = nullptr;
+	};
+
+	struct CallOutput {
+		bool wroteError = false;
+		JobContext* job = nullptr;   // background job the call runs for, if any
+	};
+
+	LoadedModule() : library(nullptr), instance(nullptr), capabilities(0), mtime(0), size(0) {}
+	LoadedModule(const LoadedModule&) = delete;
+	LoadedModule& operator=(const LoadedModule&) = delete;
+
+	// Load a library, resolve the entry points and check the ABI version.
+	static platform::LibraryHandle openLibrary(const std::string& path, ms_module_info& info,
+		EntryPoints& entryPoints, std::string& error) {
+		platform::LibraryHandle library = platform::openLibrary(path);
+		if (!library) {
+			error = path + " (" + platform::libraryError() + ")";
+			return nullptr;
+		}
+		ms_module_query_fn query = (ms_module_query_fn)platform::findSymbol(library, "ms_module_query");
+		entryPoints.create = (ms_module_create_fn)platform::findSymbol(library, "ms_module_create");
+		entryPoints.execute = (ms_module_execute_fn)platform::findSymbol(library, "ms_module_execute");
+		entryPoints.destroy = (ms_module_destroy_fn)platform::findSymbol(library, "ms_module_destroy");
+		info = ms_module_info();
+		info.struct_size = sizeof(info);
+		if (!query || !entryPoints.create || !entryPoints.execute || !entryPoints.destroy) {
+			error = "ms_module_* entry points not found (module built for an older shell?)";
+		}
+		else if (query(MS_MODULE_ABI_VERSION, &info) != 0 || info.abi_version != MS_MODULE_ABI_VERSION) {
+			error = "module ABI version " + std::to_string(info.abi_version) +
+				", shell expects " + std::to_string(MS_MODULE_ABI_VERSION);
+		}
+		else if (!(info.capabilities & MS_CAP_EXECUTE)) {
+			error = "module has no executable commands";
+		}
+		else {
+			return library;
+		}
+		platform::closeLibrary(library);
+		return nullptr;
+	}
+
+	static int cancelled(void* hostContext) {
+		JobContext* job = static_cast<CallOutput*>(hostContext)->job;
+		return job && job->isCancelled() ? 1 : 0;
+	}
+
+	static void write(void* hostContext, int stream, const char* data, size_t len) {
+		std::ostream& target = stream == MS_STREAM_ERR ? std::cerr : std::cout;
+		if (!data) {
+			target.flush();
+			return;
+		}
+		if (stream == MS_STREAM_ERR && len > 0)
+			static_cast<CallOutput*>(hostContext)->wroteError = true;
+		target.write(data, static_cast<std::streamsize>(len));
+	}
+
+	platform::LibraryHandle library;
+	EntryPoints entryPoints;
+	void* instance;
+	uint32_t capabilities;      // MS_CAP_* bits from ms_module_query
+	std::mutex callMutex;       // held around calls on instance unless MS_CAP_THREAD_SAFE
+	std::string shadowPath;
+	std::string version;
+	long long mtime;            // stamp of the installed file this copy was made from
+	unsigned long long size;
+};
+
+// An installed module. The library is loaded on first use. The running copy is held through
+// a shared_ptr that is swapped atomically on reload, and every call keeps its own reference,
+// so a reload never waits for a running command and the old copy is unloaded when the last
+// call using it returns.
+class Module {
+public:
+	explicit Module(const ModuleRecord& record) : record(record) {}
+
+	// The record is only changed on the main thread (see ModuleManager).
+	const ModuleRecord& getRecord() const { return record; }
+
+	std::string getVersion() const {
+		std::shared_ptr<LoadedModule> loaded = std::atomic_load(&current);
+		return loaded ? loaded->getVersion() : record.version;
+	}
+
+	bool isLoaded() const { return std::atomic_load(&current) != nullptr; }
+	std::shared_ptr<LoadedModule> getLoaded() const { return std::atomic_load(&current); }
+
+	// Load the library and create the instance; does nothing if already loaded.
+	bool load(std::string& error) {
+		std::lock_guard<std::mutex> lock(loadMutex);
+		if (std::atomic_load(&current))
+			return true;
+		std::shared_ptr<LoadedModule> loaded = LoadedModule::open(record, error);
+		if (!loaded)
+			return false;
+		std::atomic_store(&current, loaded);
+		return true;
+	}
+
+	// Load the installed file beside the running copy and switch over to it. On failure the
+	// running copy stays in place.
+	bool reload(std::string& error) {
+		std::lock_guard<std::mutex> lock(loadMutex);
+		std::shared_ptr<LoadedModule> loaded = LoadedModule::open(record, error);
+		if (!loaded)
+			return false;
+		std::atomic_store(&current, loaded);
+		return true;
+	}
+
+	void unload() {
+		std::lock_guard<std::mutex> lock(loadMutex);
+		std::atomic_store(&current, std::shared_ptr<LoadedModule>());
+	}
+
+	// Copy version and file stamp of the running copy into the record. Returns true if the
+	// record changed (the manifest needs to be written).
+	bool syncRecord() {
+		std::shared_ptr<LoadedModule> loaded = std::atomic_load(&current);
+		if (!loaded || (loaded->getMtime() == record.mtime && loaded->getSize() == record.size && loaded->getVersion() == record.version))
+			return false;
+		record.mtime = loaded->getMtime();
+		record.size = loaded->getSize();
+		record.version = loaded->getVersion();
+		return true;
+	}
+
+	int execute(const Tokens& args, size_t first, const ms_host_services* services) {
+		std::shared_ptr<LoadedModule> loaded = std::atomic_load(&current);
+		if (!loaded) {
+			std::cerr << "ERROR: Module is not loaded" << '\n';
+			return 1;
+		}
+		return loaded->execute(args, first, services);
+	}
+
+private:
+	Module(const Module&) = delete;
+	Module& operator=(const Module&) = delete;
+
+	ModuleRecord record;
+	std::shared_ptr<LoadedModule> current;   // accessed with std::atomic_load/atomic_store
+	std::mutex loadMutex;                    // serializes load/reload/unload of this module
+};
+
+// One stage of a module pipeline: the running copy of its module and its arguments.
+struct PipelinePart {
+	std::string command;                    // as typed, for messages
+	std::string module;                     // module name, for stats and the trace
+	std::shared_ptr<LoadedModule> loaded;
+	Tokens args;
+	void* extraInstance = nullptr;
+};
+
+// Runs the stages of a module pipeline: every stage runs on its own thread and passes column
+// batches (or its text, as "line" rows) to the next one through a bounded channel, so the
+// stages overlap instead of each waiting for the whole output of the previous one. A stage
+// that stops early (e.g. on an error) makes the emit calls of its producer fail, which lets
+// that producer stop too. A module used twice gets a second instance. The shell runs
+// pipelines with this, and so do module workers under "isolate".
+void runPipelineStages(std::vector<PipelinePart>& parts, const ms_host_services* services) {
+	for (size_t s = 1; s < parts.size(); s++) {
+		if (!(parts[s].loaded->getCapabilities() & MS_CAP_PIPE_INPUT)) {
+			std::cerr << "Error: " << parts[s].command << " does not read pipeline input" << '\n';
+			return;
+		}
+	}
+
+	std::vector<BatchChannel> channels(parts.size() - 1);
+	std::vector<std::unique_ptr<PipelineStage>> contexts;
+	for (size_t s = 0; s < parts.size(); s++) {
+		contexts.emplace_back(new PipelineStage(s > 0 ? &channels[s - 1] : nullptr,
+			s + 1 < parts.size() ? &channels[s] : nullptr, JobContext::current()));
+		for (size_t other = 0; other < s; other++) {
+			if (parts[other].loaded == parts[s].loaded) {
+				parts[s].extraInstance = parts[s].loaded->createInstance();
+				if (!parts[s].extraInstance) {
+					std::cerr << "Error: ms_module_create failed for " << parts[s].command << '\n';
+					for (PipelinePart& part : parts) {
+						if (part.extraInstance)
+							part.loaded->destroyInstance(part.extraInstance);
+					}
+					return;
+				}
+				contexts[s]->setInstance(parts[s].extraInstance);
+				break;
+			}
+		}
+	}
+
+	auto runStage = [&](size_t s) {
+		JobContext::Scope scope(contexts[s]->getJob());
+		try {
+			TraceSpan span("executeModule", parts[s].module);
+			auto start = std::chrono::steady_clock::now();
+			parts[s].loaded->execute(parts[s].args, 0, services, contexts[s].get());
+			CommandStats::getInstance().record(CommandStats::ModuleCall, parts[s].module,
+				parts[s].loaded->getVersion(), std::chrono::steady_clock::now() - start);
+		}
+		catch (const std::exception& e) {
+			contexts[s]->finish();
+			std::lock_guard<std::mutex> lock(PipelineStage::consoleMutex());
+			std::cerr << "Exception while executing module: " << e.what() << '\n';
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t s = 0; s + 1 < parts.size(); s++)
+		threads.emplace_back(runStage, s);
+	runStage(parts.size() - 1);
+	for (auto& thread : threads)
+		thread.join();
+	for (PipelinePart& part : parts) {
+		if (part.extraInstance) {
+			part.loaded->destroyInstance(part.extraInstance);
+			part.extraInstance = nullptr;
+		}
+	}
+}
+
+//------------------------------------------------------------
+// Module Workers
+//------------------------------------------------------------
+
+// "isolate on": module calls run in a pool of worker processes (the shell itself, started with
+// --module-worker), so a module that crashes or hangs takes down one worker instead of the
+// shell, and calls that run at the same time (background jobs, server sessions) spread over
+// processes. A module pipeline runs whole in one worker, so its column batches pass between
+// the stages inside that process as they do in the shell and never cross the rings. Each
+// worker shares one memory segment with the shell: a header and two rings,
+// requests (shell to worker) and responses, each with a single producer and consumer. Request
+// arguments are written once into the ring and handed to the module as views into it; module
+// output is written straight into response records, which the shell passes on from where they
+// lie. A side that finds nothing to do spins for a moment, then sleeps on its semaphore after
+// announcing it in the header; the other side posts the semaphore only then.
+
+// Read and write positions of one ring. Positions only grow (the offset is position modulo
+// the capacity, a power of two). Each sits on its own cache line.
+struct RingState {
+	alignas(64) std::atomic<uint64_t> head;   // consumer
+	alignas(64) std::atomic<uint64_t> tail;   // producer
+};
+
+// Start of a worker's shared memory; the request ring's data follows, then the response ring's.
+struct WorkerSegment {
+	static const uint32_t Magic = 0x4b574d53;
+	static const size_t RequestCapacity = 256 * 1024;
+	static const size_t ResponseCapacity = 4 * 1024 * 1024;
+
+	static size_t totalSize() { return sizeof(WorkerSegment) + RequestCapacity + ResponseCapacity; }
+	char* requestData() { return reinterpret_cast<char*>(this) + sizeof(WorkerSegment); }
+	char* responseData() { return requestData() + RequestCapacity; }
+
+	uint32_t magic;
+	uint32_t headerSize;                              // sizeof(WorkerSegment) of the shell
+	alignas(64) std::atomic<uint32_t> shellSleeping;  // set while the shell waits on its semaphore
+	alignas(64) std::atomic<uint32_t> workerSleeping;
+	alignas(64) std::atomic<uint64_t> cancelCall;     // number of the call the shell wants stopped
+	RingState requests;
+	RingState responses;
+};
+
+enum WorkerMessage : uint32_t {
+	MessagePad,     // fills the end of a ring; skipped
+	MessageReady,   // worker started: uint64 process id
+	MessageCall,    // see ModuleWorker::call
+	MessagePing,    // echoed back as MessagePong (isolate bench)
+	MessagePong,
+	MessageStop,
+	MessageOut,     // module output
+	MessageErr,
+	MessageDone     // int32 status
+};
+
+// One direction of a worker's shared memory. A record is an 8-byte header (payload size,
+// type) and the payload, padded to 8 bytes. Records never wrap: when the end of the ring is
+// too short, a pad record fills it and the record starts over at offset 0. The producer
+// reserves space and fills the payload in place before commit() publishes it; the consumer
+// reads it in place until release().
+class SharedRing {
+public:
+	static const size_t HeaderSize = 8;
+
+	SharedRing() : state(nullptr), data(nullptr), capacity(0), reserved(0) {}
+	SharedRing(RingState* state, char* data, size_t capacity) : state(state), data(data), capacity(capacity), reserved(0) {}
+
+	// Payloads up to this size always fit into an empty ring.
+	size_t maxPayload() const { return capacity / 2 - HeaderSize; }
+
+	// Space for a payload of size bytes, or nullptr while the ring is too full.
+	char* reserve(size_t size) {
+		uint64_t tail = state->tail.load(std::memory_order_relaxed);
+		uint64_t offset = tail & (capacity - 1);
+		uint64_t need = align(HeaderSize + size);
+		uint64_t pad = capacity - offset < need ? capacity - offset : 0;
+		if (capacity - (tail - state->head.load(std::memory_order_acquire)) < pad + need)
+			return nullptr;
+		if (pad) {
+			writeHeader(offset, MessagePad, pad - HeaderSize);
+			tail += pad;
+			offset = 0;
+		}
+		reserved = tail;
+		return data + offset + HeaderSize;
+	}
+
+	// Publishes the record reserved last, with size bytes (at most the reserved size).
+	void commit(uint32_t type, size_t size) {
+		writeHeader(reserved & (capacity - 1), type, size);
+		state->tail.store(reserved + align(HeaderSize + size), std::memory_order_release);
+	}
+
+	// The oldest record, or false if there is none.
+	bool peek(uint32_t& type, char*& payload, size_t& size) {
+		for (;;) {
+			uint64_t head = state->head.load(std::memory_order_relaxed);
+			if (head == state->tail.load(std::memory_order_acquire))
+				return false;
+			char* record = data + (head & (capacity - 1));
+			uint32_t header[2];
+			std::memcpy(header, record, sizeof(header));
+			if (header[1] != MessagePad) {
+				size = header[0];
+				type = header[1];
+				payload = record + HeaderSize;
+				return true;
+			}
+			state->head.store(head + HeaderSize + header[0], std::memory_order_release);
+		}
+	}
+
+	// Frees the record returned by peek().
+	void release() {
+		uint64_t head = state->head.load(std::memory_order_relaxed);
+		uint32_t size;
+		std::memcpy(&size, data + (head & (capacity - 1)), sizeof(size));
+		state->head.store(head + align(HeaderSize + size), std::memory_order_release);
+	}
+
+private:
+	static uint64_t align(uint64_t size) { return (size + 7) & ~uint64_t(7); }
+
+	void writeHeader(uint64_t offset, uint32_t type, uint64_t size) {
+		uint32_t header[2] = { static_cast<uint32_t>(size), type };
+		std::memcpy(data + offset, header, sizeof(header));
+	}
+
+	RingState* state;
+	char* data;
+	size_t capacity;
+	uint64_t reserved;   // position of the record being filled
+};
+
+// Wake-ups between shell and worker. wakePeer() follows a commit or release that the other
+// side may be waiting for; waitUntil() waits until ready() holds. Announcing sleep, checking
+// again and the waker's check of the flag are sequentially consistent, so a wake-up is never
+// lost; a stale post only costs one extra check.
+const auto WorkerSpinTime = std::chrono::microseconds(50);
+const int WorkerPollMs = 100;
+
+void wakePeer(std::atomic<uint32_t>& sleeping, platform::NamedSemaphore& semaphore) {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(0))
+		semaphore.post();
+}
+
+// poll() runs while nothing arrives (about every WorkerPollMs); returning false gives up.
+template <typename Ready, typename Poll>
+bool waitUntil(Ready ready, std::atomic<uint32_t>& sleeping, platform::NamedSemaphore& semaphore, Poll poll) {
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 1;; i++) {
+		if (ready())
+			return true;
+		if (i % 64 == 0) {
+			if (std::chrono::steady_clock::now() - start > WorkerSpinTime)
+				break;
+			std::this_thread::yield();
+		}
+	}
+	for (;;) {
+		sleeping.store(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (ready()) {
+			sleeping.store(0, std::memory_order_relaxed);
+			return true;
+		}
+		semaphore.wait(WorkerPollMs);
+		sleeping.store(0, std::memory_order_relaxed);
+		if (ready())
+			return true;
+		if (!poll())
+			return false;
+	}
+}
+
+// One module call sent to a worker: a single command, or one stage of a pipeline.
+struct WorkerCall {
+	const ModuleRecord* record;
+	std::string_view command;       // as typed, for messages
+	const std::string_view* args;
+	size_t argc;
+};
+
+// Names of a worker's semaphores, from the name passed on its command line.
+std::string semaphoreName(const std::string& name, const char* role) {
+	return name + "-" + role;
+}
+
+// The shell's end of one worker process. A worker runs one call at a time; ModuleWorkers
+// hands each worker to one thread at a time.
+class ModuleWorker {
+public:
+	~ModuleWorker() {
+		if (!running)
+			return;
+		char* payload = nullptr;
+		bool sent = waitUntil([&] { return (payload = requests.reserve(0)) != nullptr; },
+			segment->shellSleeping, shellBell, [] { return false; });
+		if (sent) {
+			requests.commit(MessageStop, 0);
+			wakePeer(segment->workerSleeping, workerBell);
+		}
+		std::string error;
+		for (int i = 0; i < 50 && alive(error); i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		kill();
+	}
+
+	// Starts a worker with a pool of threads for the modules it runs.
+	static std::unique_ptr<ModuleWorker> start(size_t threads, std::string& error) {
+		static std::atomic<unsigned> sequence(0);
+		std::unique_ptr<ModuleWorker> worker(new ModuleWorker());
+		std::string name = "mini-shell-" + std::to_string(platform::processId()) + "-" + std::to_string(++sequence);
+		if (!worker->memory.create(name, WorkerSegment::totalSize(), error) ||
+			!worker->shellBell.create(semaphoreName(name, "shell"), error) ||
+			!worker->workerBell.create(semaphoreName(name, "worker"), error) ||
+			!worker->cancelBell.create(semaphoreName(name, "cancel"), error)) {
+			worker->unlinkNames();
+			error = "cannot create shared memory for a module worker: " + error;
+			return nullptr;
+		}
+		WorkerSegment* segment = new (worker->memory.data()) WorkerSegment();
+		segment->magic = WorkerSegment::Magic;
+		segment->headerSize = sizeof(WorkerSegment);
+		worker->segment = segment;
+		worker->requests = SharedRing(&segment->requests, segment->requestData(), WorkerSegment::RequestCapacity);
+		worker->responses = SharedRing(&segment->responses, segment->responseData(), WorkerSegment::ResponseCapacity);
+
+		std::vector<std::string> args = { platform::executablePath(), "--module-worker", name,
+			std::to_string(threads), std::to_string(platform::processId()) };
+		bool started = platform::startProcess(args, platform::StdioHandles(), worker->process, error);
+		worker->running = started;
+		uint32_t type = 0;
+		char* payload = nullptr;
+		size_t size = 0;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		bool ready = started && waitUntil([&] { return worker->responses.peek(type, payload, size); },
+			segment->shellSleeping, worker->shellBell, [&] {
+				return worker->alive(error) && std::chrono::steady_clock::now() < deadline;
+			});
+		worker->unlinkNames();   // both sides have them open now (or never will)
+		if (!ready || type != MessageReady || size != sizeof(uint64_t)) {
+			if (error.empty())
+				error = "no answer";
+			error = "cannot start a module worker: " + error;
+			return nullptr;
+		}
+		uint64_t pid = 0;
+		std::memcpy(&pid, payload, sizeof(pid));
+		worker->pid = static_cast<unsigned long>(pid);
+		worker->responses.release();
+		return worker;
+	}
+
+	unsigned long getPid() const { return pid; }
+
+	// Runs the call (several calls run as the stages of a pipeline) and passes its output on to
+	// std::cout and std::cerr. Returns false if the worker was lost on the way (it crashed, or
+	// was stopped because the call hung after being cancelled or ran past timeout); the error
+	// is reported.
+	bool call(const std::vector<WorkerCall>& calls, double timeoutSeconds, int& status) {
+		// Payload: call number (8 bytes) and stage count (4 bytes), then for each stage mtime
+		// and size (8 bytes each), argument count (4 bytes), then name, path, command and the
+		// arguments, each as a 4-byte length and the bytes.
+		std::string label;
+		size_t size = 8 + 4;
+		for (const WorkerCall& stage : calls) {
+			label += (label.empty() ? "" : " | ") + stage.record->name;
+			size += 2 * 8 + 4 + 4 + stage.record->name.size() + 4 + stage.record->path.size() + 4 + stage.command.size();
+			for (size_t i = 0; i < stage.argc; i++)
+				size += 4 + stage.args[i].size();
+		}
+		status = 1;
+		if (size > requests.maxPayload()) {
+			std::cerr << "Error: arguments are too long for a module worker" << '\n';
+			return true;
+		}
+		auto start = std::chrono::steady_clock::now();
+		std::string error;
+		char* out = nullptr;
+		if (!waitUntil([&] { return (out = requests.reserve(size)) != nullptr; },
+			segment->shellSleeping, shellBell, [&] { return alive(error); }))
+			return lost(label, error);
+		uint64_t number = ++callNumber;
+		put(out, number);
+		put(out, static_cast<uint32_t>(calls.size()));
+		for (const WorkerCall& stage : calls) {
+			put(out, static_cast<uint64_t>(stage.record->mtime));
+			put(out, static_cast<uint64_t>(stage.record->size));
+			put(out, static_cast<uint32_t>(stage.argc));
+			put(out, stage.record->name);
+			put(out, stage.record->path);
+			put(out, stage.command);
+			for (size_t i = 0; i < stage.argc; i++)
+				put(out, stage.args[i]);
+		}
+		requests.commit(MessageCall, size);
+		wakePeer(segment->workerSleeping, workerBell);
+
+		auto cancelTime = std::chrono::steady_clock::time_point();
+		auto poll = [&] {
+			auto now = std::chrono::steady_clock::now();
+			if (!alive(error))
+				return false;
+			if (JobContext::cancelled() && cancelTime == std::chrono::steady_clock::time_point()) {
+				segment->cancelCall.store(number);
+				cancelBell.post();
+				cancelTime = now;
+			}
+			if (cancelTime != std::chrono::steady_clock::time_point() && now - cancelTime > std::chrono::milliseconds(CancelGraceMs)) {
+				error = "did not stop after being cancelled";
+				return false;
+			}
+			if (timeoutSeconds > 0 && now - start > std::chrono::duration<double>(timeoutSeconds)) {
+				error = "timed out after " + formatSeconds(timeoutSeconds);
+				return false;
+			}
+			return true;
+		};
+		for (;;) {
+			uint32_t type = 0;
+			char* payload = nullptr;
+			size_t length = 0;
+			if (!waitUntil([&] { return responses.peek(type, payload, length); },
+				segment->shellSleeping, shellBell, poll))
+				return lost(label, error);
+			if (type == MessageOut)
+				std::cout.write(payload, static_cast<std::streamsize>(length));
+			else if (type == MessageErr)
+				std::cerr.write(payload, static_cast<std::streamsize>(length));
+			else if (type == MessageDone && length == sizeof(int32_t))
+				std::memcpy(&status, payload, sizeof(int32_t));
+			responses.release();
+			wakePeer(segment->workerSleeping, workerBell);
+			if (type == MessageDone)
+				break;
+		}
+		return true;
+	}
+
+	// One round trip of a ping carrying bytes of payload each way ("isolate bench").
+	bool ping(size_t bytes, std::string& error) {
+		char* out = nullptr;
+		if (!waitUntil([&] { return (out = requests.reserve(bytes)) != nullptr; },
+			segment->shellSleeping, shellBell, [&] { return alive(error); }))
+			return false;
+		std::memset(out, 'p', bytes);
+		requests.commit(MessagePing, bytes);
+		wakePeer(segment->workerSleeping, workerBell);
+		uint32_t type = 0;
+		char* payload = nullptr;
+		size_t length = 0;
+		if (!waitUntil([&] { return responses.peek(type, payload, length); },
+			segment->shellSleeping, shellBell, [&] { return alive(error); }))
+			return false;
+		bool echoed = type == MessagePong && length == bytes && (bytes == 0 || payload[bytes - 1] == 'p');
+		responses.release();
+		if (!echoed)
+			error = "unexpected reply";
+		return echoed;
+	}
+
+	size_t maxPayload() const { return std::min(requests.maxPayload(), responses.maxPayload()); }
+
+private:
+	static const int CancelGraceMs = 2000;
+
+	ModuleWorker() : segment(nullptr), process(), running(false), pid(0), callNumber(0) {}
+	ModuleWorker(const ModuleWorker&) = delete;
+	ModuleWorker& operator=(const ModuleWorker&) = delete;
+
+	static std::string formatSeconds(double seconds) {
+		std::ostringstream text;
+		text << seconds << " s";
+		return text.str();
+	}
+
+	static void put(char*& out, uint64_t value) {
+		std::memcpy(out, &value, sizeof(value));
+		out += sizeof(value);
+	}
+
+	static void put(char*& out, uint32_t value) {
+		std::memcpy(out, &value, sizeof(value));
+		out += sizeof(value);
+	}
+
+	static void put(char*& out, std::string_view text) {
+		put(out, static_cast<uint32_t>(text.size()));
+		std::memcpy(out, text.data(), text.size());
+		out += text.size();
+	}
+
+	// False (with the reason) once the process has ended.
+	bool alive(std::string& error) {
+		int code = 0;
+		if (running && platform::processExited(process, code)) {
+			running = false;
+			error = "crashed (exit code " + std::to_string(code) + ")";
+		}
+		return running;
+	}
+
+	bool lost(const std::string& module, const std::string& error) {
+		std::cerr << "Error: the worker running " << module << " " << error << "; it is replaced" << '\n';
+		kill();
+		return false;
+	}
+
+	void kill() {
+		if (running) {
+			platform::terminateProcess(process);
+			platform::waitProcess(process);
+			running = false;
+		}
+		// The worker could not remove its shadow copies itself.
+		std::error_code ec;
+		if (pid)
+			fs::remove_all("modules.shadow/" + std::to_string(pid), ec);
+	}
+
+	void unlinkNames() {
+		memory.unlink();
+		shellBell.unlink();
+		workerBell.unlink();
+		cancelBell.unlink();
+	}
+
+	platform::SharedMemory memory;
+	platform::NamedSemaphore shellBell;    // posted by the worker when the shell may go on
+	platform::NamedSemaphore workerBell;   // posted by the shell when the worker may go on
+	platform::NamedSemaphore cancelBell;   // posted by the shell to cancel the running call
+	WorkerSegment* segment;
+	SharedRing requests;
+	SharedRing responses;
+	platform::ProcessHandle process;
+	bool running;
+	unsigned long pid;
+	uint64_t callNumber;
+};
+
+// The pool behind "isolate". Workers start with "isolate on"; a call takes an idle one (or
+// waits for one) and gives it back afterwards. A lost worker is replaced when it is next
+// needed.
+class ModuleWorkers {
+public:
+	static ModuleWorkers& getInstance() {
+		static ModuleWorkers instance;
+		return instance;
+	}
+
+	bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	void start(size_t count) {
+		stop();
+		std::lock_guard<std::mutex> lock(mutex);
+		target = count;
+		threadsPerWorker = std::max<size_t>(1, std::thread::hardware_concurrency() / count);
+		std::string error;
+		for (size_t i = 0; i < count; i++) {
+			std::unique_ptr<ModuleWorker> worker = ModuleWorker::start(threadsPerWorker, error);
+			if (!worker) {
+				std::cerr << "Error: " << error << '\n';
+				break;
+			}
+			idle.push_back(std::move(worker));
+			workerCount++;
+		}
+		enabled = workerCount > 0;
+		if (enabled)
+			std::cout << "Module calls run in " << workerCount << (workerCount == 1 ? " worker process" : " worker processes") << '\n';
+	}
+
+	// Stops the idle workers now and busy ones when their call returns.
+	void stop() {
+		std::vector<std::unique_ptr<ModuleWorker>> stopping;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			enabled = false;
+			stopping.swap(idle);
+			workerCount -= stopping.size();
+			available.notify_all();
+		}
+	}
+
+	void setTimeout(double seconds) {
+		std::lock_guard<std::mutex> lock(mutex);
+		timeoutSeconds = seconds;
+	}
+
+	void printStatus() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::ostringstream text;
+		if (!enabled) {
+			text << "Module isolation is off" << '\n';
+		}
+		else {
+			text << "Module isolation is on: " << workerCount << " of " << target << " workers ("
+				<< workerCount - idle.size() << " busy), " << threadsPerWorker << " threads each" << '\n';
+		}
+		text << calls << " calls, " << replaced << " workers replaced, timeout ";
+		if (timeoutSeconds > 0)
+			text << timeoutSeconds << " s" << '\n';
+		else
+			text << "none" << '\n';
+		std::cout << text.str();
+	}
+
+	// Runs the call in a worker, or the calls as a pipeline. Returns false if isolation is off
+	// (the caller runs them in process).
+	bool execute(const std::vector<WorkerCall>& calls) {
+		double timeout = 0;
+		std::unique_ptr<ModuleWorker> worker = acquire(timeout);
+		if (!worker)
+			return isEnabled();
+		int status = 0;
+		bool kept = worker->call(calls, timeout, status);
+		giveBack(std::move(worker), kept);
+		return true;
+	}
+
+	bool execute(const ModuleRecord& record, const Tokens& args, size_t first) {
+		size_t argc = args.size() > first ? args.size() - first : 0;
+		return execute(std::vector<WorkerCall>{ WorkerCall{ &record, record.command, args.data() + first, argc } });
+	}
+
+	// "isolate bench": round trips of an empty message (or of bytes each way) through the rings
+	// of one worker, which is started for the purpose if isolation is off. The first tenth
+	// warms up caches and page mappings and is not recorded.
+	bool benchmark(size_t count, size_t bytes, LatencyHistogram& histogram, unsigned long& pid) {
+		double timeout = 0;
+		std::unique_ptr<ModuleWorker> worker = isEnabled() ? acquire(timeout) : nullptr;
+		bool pooled = worker != nullptr;
+		std::string error;
+		if (!worker)
+			worker = ModuleWorker::start(1, error);
+		if (!worker) {
+			std::cerr << "Error: " << error << '\n';
+			return false;
+		}
+		pid = worker->getPid();
+		bool ok = bytes <= worker->maxPayload();
+		if (!ok)
+			std::cerr << "Error: at most " << worker->maxPayload() << " bytes per message" << '\n';
+		for (size_t i = 0; ok && i < count + count / 10 && !JobContext::cancelled(); i++) {
+			auto start = std::chrono::steady_clock::now();
+			ok = worker->ping(bytes, error);
+			auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			if (ok && i >= count / 10)
+				histogram.record(static_cast<uint64_t>(elapsed));
+			if (!ok && !error.empty())
+				std::cerr << "Error: module worker " << error << '\n';
+		}
+		if (pooled)
+			giveBack(std::move(worker), ok || error.empty());
+		return ok;
+	}
+
+private:
+	ModuleWorkers() : enabled(false), target(0), workerCount(0), threadsPerWorker(1), timeoutSeconds(0), calls(0), replaced(0) {}
+	ModuleWorkers(const ModuleWorkers&) = delete;
+	ModuleWorkers& operator=(const ModuleWorkers&) = delete;
+
+	std::unique_ptr<ModuleWorker> acquire(double& timeout) {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			if (!enabled)
+				return nullptr;
+			if (!idle.empty()) {
+				std::unique_ptr<ModuleWorker> worker = std::move(idle.back());
+				idle.pop_back();
+				timeout = timeoutSeconds;
+				calls++;
+				return worker;
+			}
+			if (workerCount < target) {
+				workerCount++;
+				replaced++;
+				size_t threads = threadsPerWorker;
+				lock.unlock();
+				std::string error;
+				std::unique_ptr<ModuleWorker> worker = ModuleWorker::start(threads, error);
+				lock.lock();
+				if (worker) {
+					timeout = timeoutSeconds;
+					calls++;
+					return worker;
+				}
+				workerCount--;
+				std::cerr << "Error: " << error << '\n';
+				return nullptr;
+			}
+			available.wait(lock);
+		}
+	}
+
+	void giveBack(std::unique_ptr<ModuleWorker> worker, bool kept) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (kept && enabled && workerCount <= target) {
+			idle.push_back(std::move(worker));
+		}
+		else {
+			workerCount--;
+			worker.reset();
+		}
+		available.notify_one();
+	}
+
+	std::atomic<bool> enabled;
+	std::mutex mutex;
+	std::condition_variable available;
+	std::vector<std::unique_ptr<ModuleWorker>> idle;
+	size_t target;             // workers wanted
+	size_t workerCount;        // workers running, idle or busy
+	size_t threadsPerWorker;   // each worker's thread pool; together they fill the cores
+	double timeoutSeconds;     // per call; 0 for none
+	uint64_t calls;
+	uint64_t replaced;
+};
+
+// Worker side: std::cout and std::cerr write into response records. A record is filled in
+// place and sent when the module flushes, when it is full, or when the output switches to the
+// other stream (which keeps the order of the two).
+class WorkerOutput {
+public:
+	WorkerOutput(SharedRing& ring, WorkerSegment* segment, platform::NamedSemaphore& shellBell,
+		platform::NamedSemaphore& workerBell, unsigned long shellPid)
+		: out(*this, MessageOut), err(*this, MessageErr), ring(ring), segment(segment), shellBell(shellBell),
+		workerBell(workerBell), shellPid(shellPid), record(nullptr), used(0), capacity(0), type(0) {}
+
+	std::streambuf* outBuffer() { return &out; }
+	std::streambuf* errBuffer() { return &err; }
+
+	void write(uint32_t stream, const char* data, size_t size) {
+		while (size > 0) {
+			if (record && type != stream)
+				flush();
+			if (!record) {
+				capacity = std::min(RecordSize, ring.maxPayload());
+				record = reserve(capacity);
+				used = 0;
+				type = stream;
+			}
+			size_t take = std::min(size, capacity - used);
+			std::memcpy(record + used, data, take);
+			used += take;
+			data += take;
+			size -= take;
+			if (used == capacity)
+				flush();
+		}
+	}
+
+	void flush() {
+		if (!record)
+			return;
+		ring.commit(type, used);
+		record = nullptr;
+		wakePeer(segment->shellSleeping, shellBell);
+	}
+
+	// Waits for room in the ring; exits if the shell is gone.
+	char* reserve(size_t size) {
+		char* space = nullptr;
+		if (!waitUntil([&] { return (space = ring.reserve(size)) != nullptr; },
+			segment->workerSleeping, workerBell, [&] { return platform::processAlive(shellPid); }))
+			std::_Exit(1);
+		return space;
+	}
+
+private:
+	static const size_t RecordSize = 64 * 1024;
+
+	class Stream : public std::streambuf {
+	public:
+		Stream(WorkerOutput& owner, uint32_t type) : owner(owner), type(type) {}
+
+	protected:
+		int_type overflow(int_type c) override {
+			if (c != traits_type::eof()) {
+				char ch = static_cast<char>(c);
+				owner.write(type, &ch, 1);
+			}
+			return traits_type::not_eof(c);
+		}
+
+		std::streamsize xsputn(const char* s, std::streamsize n) override {
+			owner.write(type, s, static_cast<size_t>(n));
+			return n;
+		}
+
+		int sync() override {
+			owner.flush();
+			return 0;
+		}
+
+	private:
+		WorkerOutput& owner;
+		uint32_t type;
+	};
+
+	Stream out;
+	Stream err;
+	SharedRing& ring;
+	WorkerSegment* segment;
+	platform::NamedSemaphore& shellBell;
+	platform::NamedSemaphore& workerBell;
+	unsigned long shellPid;
+	char* record;        // being filled, not yet committed
+	size_t used;
+	size_t capacity;
+	uint32_t type;
+};
+
+// "--module-worker <name> <threads> <shell pid>": the worker process. Serves requests until
+// the shell sends a stop or goes away. Loaded modules are kept between calls and reloaded
+// when the installed library changes.
+int runModuleWorker(const std::string& name, size_t threads, unsigned long shellPid) {
+	platform::SharedMemory memory;
+	platform::NamedSemaphore shellBell, workerBell, cancelBell;
+	std::string error;
+	if (!memory.open(name, WorkerSegment::totalSize(), error) || !shellBell.open(semaphoreName(name, "shell"), error) ||
+		!workerBell.open(semaphoreName(name, "worker"), error) || !cancelBell.open(semaphoreName(name, "cancel"), error)) {
+		std::cerr << "Error: module worker cannot open " << name << ": " << error << '\n';
+		return 1;
+	}
+	WorkerSegment* segment = reinterpret_cast<WorkerSegment*>(memory.data());
+	if (segment->magic != WorkerSegment::Magic || segment->headerSize != sizeof(WorkerSegment)) {
+		std::cerr << "Error: module worker " << name << " was started by a different shell" << '\n';
+		return 1;
+	}
+	SharedRing requests(&segment->requests, segment->requestData(), WorkerSegment::RequestCapacity);
+	SharedRing responses(&segment->responses, segment->responseData(), WorkerSegment::ResponseCapacity);
+	WorkerOutput output(responses, segment, shellBell, workerBell, shellPid);
+
+	// Modules get a thread pool of their own, without tracing (the shell's trace is in
+	// another process): the table ends before the tracing fields.
+	TaskPool pool(threads);
+	ms_host_services services = ms_host_services();
+	services.struct_size = offsetof(ms_host_services, tracing);
+	pool.fillServices(services);
+
+	// Cancellation arrives while the main thread is inside the module.
+	std::mutex callMutex;
+	JobContext* runningJob = nullptr;
+	uint64_t runningCall = 0;
+	std::atomic<bool> finished(false);
+	std::thread canceller([&] {
+		while (!finished) {
+			if (!cancelBell.wait(WorkerPollMs))
+				continue;
+			std::lock_guard<std::mutex> lock(callMutex);
+			if (runningJob && segment->cancelCall.load() == runningCall)
+				runningJob->cancel();
+		}
+	});
+
+	std::streambuf* originalOut = std::cout.rdbuf(output.outBuffer());
+	std::streambuf* originalErr = std::cerr.rdbuf(output.errBuffer());
+	struct Loaded {
+		std::string path;
+		std::shared_ptr<LoadedModule> module;
+	};
+	std::map<std::string, Loaded> loaded;
+	uint64_t pid = platform::processId();
+	std::memcpy(output.reserve(sizeof(pid)), &pid, sizeof(pid));
+	responses.commit(MessageReady, sizeof(pid));
+	wakePeer(segment->shellSleeping, shellBell);
+
+	for (;;) {
+		uint32_t type = 0;
+		char* payload = nullptr;
+		size_t size = 0;
+		if (!waitUntil([&] { return requests.peek(type, payload, size); },
+			segment->workerSleeping, workerBell, [&] { return platform::processAlive(shellPid); }))
+			break;
+		if (type == MessageStop)
+			break;
+		if (type == MessagePing) {
+			std::memcpy(output.reserve(size), payload, size);
+			responses.commit(MessagePong, size);
+			requests.release();
+			wakePeer(segment->shellSleeping, shellBell);
+			continue;
+		}
+		if (type != MessageCall) {
+			requests.release();
+			continue;
+		}
+
+		// The arguments stay in the ring, where the module reads them, until the call returns.
+		const char* in = payload;
+		auto get64 = [&in] { uint64_t value; std::memcpy(&value, in, sizeof(value)); in += sizeof(value); return value; };
+		auto get32 = [&in] { uint32_t value; std::memcpy(&value, in, sizeof(value)); in += sizeof(value); return value; };
+		auto getText = [&] { uint32_t length = get32(); std::string_view text(in, length); in += length; return text; };
+		uint64_t number = get64();
+		uint32_t stageCount = get32();
+		std::vector<PipelinePart> parts;
+		bool resolved = true;
+		for (uint32_t s = 0; s < stageCount; s++) {
+			ModuleRecord record;
+			record.mtime = static_cast<long long>(get64());
+			record.size = get64();
+			uint32_t argc = get32();
+			record.name = std::string(getText());
+			record.path = std::string(getText());
+			PipelinePart part;
+			part.command = std::string(getText());
+			part.module = record.name;
+			for (uint32_t i = 0; i < argc; i++)
+				part.args.push_back(getText());
+			Loaded& entry = loaded[record.name];
+			if (!entry.module || entry.path != record.path || entry.module->getMtime() != record.mtime || entry.module->getSize() != record.size) {
+				entry.module.reset();
+				entry.module = LoadedModule::open(record, error);
+				entry.path = record.path;
+				if (!entry.module)
+					std::cerr << "Error: cannot load module " << record.name << ": " << error << '\n';
+			}
+			part.loaded = entry.module;
+			resolved = resolved && part.loaded;
+			parts.push_back(std::move(part));
+		}
+
+		int32_t status = 1;
+		if (resolved && !parts.empty()) {
+			JobContext job;
+			{
+				std::lock_guard<std::mutex> lock(callMutex);
+				runningJob = &job;
+				runningCall = number;
+			}
+			if (segment->cancelCall.load() == number) // cancelled before it started
+				job.cancel();
+			JobContext::Scope scope(&job);
+			try {
+				if (parts.size() == 1) {
+					status = parts[0].loaded->execute(parts[0].args, 0, &services);
+				}
+				else {
+					runPipelineStages(parts, &services);
+					status = 0;
+				}
+			}
+			catch (const std::exception& e) {
+				std::cerr << "Exception while executing module: " << e.what() << '\n';
+			}
+			std::lock_guard<std::mutex> lock(callMutex);
+			runningJob = nullptr;
+		}
+		parts.clear();
+		std::cout.flush();
+		std::cerr.flush();
+		std::memcpy(output.reserve(sizeof(status)), &status, sizeof(status));
+		responses.commit(MessageDone, sizeof(status));
+		requests.release();
+		wakePeer(segment->shellSleeping, shellBell);
+	}
+
+	finished = true;
+	cancelBell.post();
+	canceller.join();
+	loaded.clear();
+	pool.shutdown();
+	std::cout.rdbuf(originalOut);
+	std::cerr.rdbuf(originalErr);
+	std::error_code ec;
+	fs::remove_all(LoadedModule::shadowDirectory(), ec);
+	return 0;
+}
+
+//------------------------------------------------------------
+// SHA-256
+//------------------------------------------------------------
+
+// FIPS 180-4 SHA-256, used to verify downloaded modules against the repository index.
+class Sha256 {
+public:
+	Sha256() : length(0), used(0) {
+		static const uint32_t initial[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+		std::copy(initial, initial + 8, state);
+	}
+
+	void update(const unsigned char* data, size_t size) {
+		length += size;
+		if (used > 0) {
+			size_t take = std::min(size, sizeof(block) - used);
+			std::memcpy(block + used, data, take);
+			used += take;
+			data += take;
+			size -= take;
+			if (used < sizeof(block))
+				return;
+			compress(block);
+			used = 0;
+		}
+		for (; size >= sizeof(block); data += sizeof(block), size -= sizeof(block))
+			compress(data);
+		std::memcpy(block, data, size);
+		used = size;
+	}
+
+	// Lowercase hex digest; the object cannot be updated afterwards.
+	std::string finish() {
+		uint64_t bits = length * 8;
+		unsigned char padding[72] = { 0x80 };
+		size_t padLength = (used < 56 ? 56 : 120) - used;
+		update(padding, padLength);
+		unsigned char lengthBytes[8];
+		for (int i = 0; i < 8; i++)
+			lengthBytes[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+		update(lengthBytes, 8);
+		static const char digits[] = "0123456789abcdef";
+		std::string hex;
+		for (uint32_t word : state) {
+			for (int shift = 28; shift >= 0; shift -= 4)
+				hex += digits[(word >> shift) & 0xf];
+		}
+		return hex;
+	}
+
+private:
+	static uint32_t rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+	void compress(const unsigned char* chunk) {
+		static const uint32_t k[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) {
+			w[i] = (uint32_t(chunk[4 * i]) << 24) | (uint32_t(chunk[4 * i + 1]) << 16) |
+				(uint32_t(chunk[4 * i + 2]) << 8) | uint32_t(chunk[4 * i + 3]);
+		}
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i++) {
+			uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+			uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t used;
+};
+
+bool sha256File(const std::string& path, std::string& digest) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		return false;
+	Sha256 hash;
+	std::vector<char> buffer(1 << 16);
+	while (in) {
+		in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		hash.update(reinterpret_cast<const unsigned char*>(buffer.data()), static_cast<size_t>(in.gcount()));
+	}
+	if (in.bad())
+		return false;
+	digest = hash.finish();
+	return true;
+}
+
+//------------------------------------------------------------
+// Module Store
+//------------------------------------------------------------
+
+// Content-addressed store for module libraries. Every version ever installed is kept once as
+// modules.store/<sha256><ext>, however many modules or versions share it. A module folder
+// then holds a small ref file, modules/<name>/<name>.ref, instead of the library: the digest
+// of the active version on the first line, followed by the versions that were active before
+// it, most recent first. Switching versions or rolling back rewrites that file and nothing
+// else. Folders that contain a plain <name><ext> library (built locally, or installed before
+// the store existed) keep working; the store takes them over on their next install/update.
+class ModuleStore {
+public:
+	static constexpr const char* Directory = "modules.store";
+	static const size_t MaxHistory = 8; // versions listed in a ref file, including the active one
+
+	static std::string refPath(const std::string& moduleName) {
+		return "modules/" + moduleName + "/" + moduleName + ".ref";
+	}
+
+	static std::string blobPath(const std::string& digest) {
+		return std::string(Directory) + "/" + digest + platform::LibraryExtension;
+	}
+
+	// Library that is active for a module: the blob named by its ref file, otherwise the
+	// plain library in its folder. Returns false if the module has neither.
+	static bool resolve(const std::string& moduleName, std::string& path) {
+		std::vector<std::string> versions;
+		if (readRef(moduleName, versions)) {
+			path = blobPath(versions.front());
+			return true;
+		}
+		path = moduleLibraryPath(moduleName);
+		std::error_code ec;
+		return fs::exists(path, ec);
+	}
+
+	// Versions from the ref file, active first. False if there is no (valid) ref file.
+	static bool readRef(const std::string& moduleName, std::vector<std::string>& versions) {
+		versions.clear();
+		std::ifstream in(refPath(moduleName));
+		std::string line;
+		while (in && std::getline(in, line)) {
+			line = trim(line);
+			if (isDigest(line))
+				versions.push_back(line);
+		}
+		return !versions.empty();
+	}
+
+	// Move file (whose SHA-256 is digest) into the store and make it the module's active
+	// version. A blob that is already stored is reused and file is dropped.
+	static bool commit(const std::string& moduleName, const std::string& file, const std::string& digest, std::string& error) {
+		std::error_code ec;
+		fs::create_directories(Directory, ec);
+		std::string blob = blobPath(digest);
+		if (fs::exists(blob, ec)) {
+			fs::remove(file, ec);
+		}
+		else {
+			fs::rename(file, blob, ec);
+			if (ec) {
+				error = "cannot store " + blob + ": " + ec.message();
+				return false;
+			}
+		}
+		if (!activate(moduleName, digest, error))
+			return false;
+		// The ref file takes precedence over a plain library, which is now just dead weight.
+		fs::remove(moduleLibraryPath(moduleName), ec);
+		return true;
+	}
+
+	// Make a stored version active. The ref file is replaced by rename, so readers see either
+	// the old or the new pointer.
+	static bool activate(const std::string& moduleName, const std::string& digest, std::string& error) {
+		std::error_code ec;
+		if (!fs::exists(blobPath(digest), ec)) {
+			error = "version " + digest.substr(0, 12) + " is not in the store";
+			return false;
+		}
+		std::vector<std::string> versions;
+		readRef(moduleName, versions);
+		versions.erase(std::remove(versions.begin(), versions.end(), digest), versions.end());
+		versions.insert(versions.begin(), digest);
+		if (versions.size() > MaxHistory)
+			versions.resize(MaxHistory);
+
+		std::string path = refPath(moduleName);
+		std::string temporary = path + ".tmp";
+		{
+			std::ofstream out(temporary, std::ios::trunc);
+			for (const auto& version : versions)
+				out << version << '\n';
+			if (!out) {
+				error = "cannot write " + temporary;
+				return false;
+			}
+		}
+		fs::rename(temporary, path, ec);
+		if (ec) {
+			error = "cannot replace " + path + ": " + ec.message();
+			return false;
+		}
+		return true;
+	}
+
+	// Resolve a digest prefix (as shown by "versions") among a module's stored versions.
+	static bool findVersion(const std::string& moduleName, const std::string& prefix, std::string& digest, std::string& error) {
+		std::vector<std::string> versions;
+		if (!readRef(moduleName, versions)) {
+			error = moduleName + " has no stored versions";
+			return false;
+		}
+		digest.clear();
+		for (const auto& version : versions) {
+			if (version.compare(0, prefix.size(), prefix) != 0)
+				continue;
+			if (!digest.empty()) {
+				error = "version prefix " + prefix + " is ambiguous";
+				return false;
+			}
+			digest = version;
+		}
+		if (digest.empty()) {
+			error = "no version of " + moduleName + " starts with " + prefix;
+			return false;
+		}
+		return true;
+	}
+
+	// Delete blobs that no ref file mentions. Returns the number of blobs and bytes freed.
+	static void collectGarbage(size_t& removed, unsigned long long& bytes) {
+		removed = 0;
+		bytes = 0;
+		std::set<std::string> referenced;
+		std::error_code ec;
+		for (const auto& entry : fs::directory_iterator("modules", ec)) {
+			std::vector<std::string> versions;
+			if (entry.is_directory(ec) && readRef(entry.path().filename().string(), versions))
+				referenced.insert(versions.begin(), versions.end());
+		}
+		for (const auto& entry : fs::directory_iterator(Directory, ec)) {
+			std::string digest = entry.path().stem().string();
+			if (referenced.count(digest) || entry.path().extension() != platform::LibraryExtension)
+				continue;
+			std::error_code removeError;
+			unsigned long long size = entry.file_size(removeError);
+			if (fs::remove(entry.path(), removeError)) {
+				removed++;
+				bytes += size;
+			}
+		}
+	}
+
+private:
+	static bool isDigest(const std::string& text) {
+		return text.size() == 64 && std::all_of(text.begin(), text.end(),
+			[](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+	}
+};
+
+//------------------------------------------------------------
+// Module Repository
+//------------------------------------------------------------
+
+// Where install and update fetch modules from: a URL (fetched with curl), or a local folder
+// or file:// URL, laid out like the modules folder. A source may provide an index,
+// SHA256SUMS, in sha256sum format ("<hex digest>  math/math.dll"). With an index, modules
+// whose active version already has the listed digest are not transferred, downloads are
+// verified before they replace anything, and interrupted transfers are resumed. Fetched
+// libraries go into the ModuleStore; a version that is already stored is activated without
+// a transfer.
+class ModuleRepository {
+public:
+	static constexpr const char* DefaultSource = "https://github.com/DrJegesmedve/Mini-Shell/raw/main/modules";
+	static constexpr const char* SourceConfigPath = "modules.source";
+	static constexpr const char* IndexName = "SHA256SUMS";
+
+	enum class Outcome { UpToDate, Installed, Updated, Failed };
+
+	struct Transfer {
+		std::string name;
+		Outcome outcome = Outcome::Failed;
+		std::string error;
+		unsigned long long bytes = 0;
+		bool fromStore = false;  // activated a stored version, nothing was transferred
+	};
+
+	explicit ModuleRepository(const std::string& source) : source(source), hasIndex(false) {}
+
+	// The source set with "source <url|folder>", or DefaultSource.
+	static std::string configuredSource() {
+		std::ifstream in(SourceConfigPath);
+		std::string line;
+		if (in && std::getline(in, line) && !trim(line).empty())
+			return trim(line);
+		return DefaultSource;
+	}
+
+	static bool configureSource(const std::string& newSource) {
+		std::error_code ec;
+		if (newSource.empty() || newSource == DefaultSource)
+			return fs::remove(SourceConfigPath, ec) || !ec;
+		std::ofstream out(SourceConfigPath, std::ios::trunc);
+		out << newSource << '\n';
+		return static_cast<bool>(out);
+	}
+
+	// Fetch and parse the index. Without one, fetch() still works but transfers every module
+	// and cannot verify or resume.
+	bool loadIndex(std::string& error) {
+		std::string temporary = (fs::temp_directory_path() / ("minishell-index-" + std::to_string(platform::processId()))).string();
+		bool fetched = fetchFile(IndexName, temporary, false, error);
+		std::ifstream in(temporary);
+		std::string line;
+		while (fetched && std::getline(in, line)) {
+			// "<digest>  <path>" or "<digest> *<path>" (binary mode marker)
+			size_t space = line.find(' ');
+			if (space != 64 || line.size() < 67)
+				continue;
+			std::string path = line.substr(line[65] == '*' || line[65] == ' ' ? 66 : 65);
+			if (!path.empty() && path.back() == '\r')
+				path.pop_back();
+			size_t slash = path.find('/');
+			if (slash == std::string::npos || path.substr(slash + 1) != path.substr(0, slash) + platform::LibraryExtension)
+				continue;
+			std::string digest = line.substr(0, 64);
+			std::transform(digest.begin(), digest.end(), digest.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+			index[path.substr(0, slash)] = digest;
+		}
+		in.close();
+		std::error_code ec;
+		fs::remove(temporary, ec);
+		if (!fetched) {
+			error = "no " + std::string(IndexName) + " at " + source;
+			return false;
+		}
+		hasIndex = true;
+		return true;
+	}
+
+	// Modules listed in the index, in name order.
+	std::vector<std::string> indexedModules() const {
+		std::vector<std::string> names;
+		for (const auto& entry : index)
+			names.push_back(entry.first);
+		return names;
+	}
+
+	// Fetch the named modules concurrently. For install a module must not be installed yet,
+	// for update it must be. Results are in the order of names.
+	std::vector<Transfer> fetch(const std::vector<std::string>& names, bool install) const {
+		std::vector<Transfer> results(names.size());
+		parallelFor(names.size(), [&](size_t i) { results[i] = transfer(names[i], install); });
+		return results;
+	}
+
+private:
+	bool isLocal() const {
+		return source.find("://") == std::string::npos || source.rfind("file://", 0) == 0;
+	}
+
+	std::string localPath(const std::string& relative) const {
+		std::string base = source.rfind("file://", 0) == 0 ? source.substr(7) : source;
+#ifdef _WIN32
+		if (base.size() >= 3 && base[0] == '/' && base[2] == ':')
+			base.erase(0, 1); // file:///C:/mirror
+#endif
+		return base + "/" + relative;
+	}
+
+	// Copy or download source/relative to destination. resume continues a partial
+	// destination file instead of starting over.
+	bool fetchFile(const std::string& relative, const std::string& destination, bool resume, std::string& error) const {
+		if (!isLocal()) {
+			if (platform::downloadFile(source + "/" + relative, destination, resume))
+				return true;
+			error = "download of " + relative + " failed";
+			return false;
+		}
+		std::string from = localPath(relative);
+		std::ifstream in(from, std::ios::binary);
+		std::error_code ec;
+		uintmax_t total = fs::file_size(from, ec);
+		if (!in || ec) {
+			error = "cannot read " + from;
+			return false;
+		}
+		uintmax_t offset = resume ? fs::file_size(destination, ec) : 0;
+		if (ec || offset > total)
+			offset = 0;
+		std::ofstream out(destination, std::ios::binary | (offset > 0 ? std::ios::app : std::ios::trunc));
+		in.seekg(static_cast<std::streamoff>(offset));
+		std::vector<char> buffer(1 << 20);
+		while (in && out) {
+			in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+			out.write(buffer.data(), in.gcount());
+		}
+		if (in.bad() || !out) {
+			error = "cannot copy " + from + " to " + destination;
+			return false;
+		}
+		return true;
+	}
+
+	// Worker thread: bring one module up to date. The file is fetched to <library>.part and
+	// committed to the store only when complete (and verified, if there is an index), so a
+	// failed transfer never leaves the module missing or half written. A .part
+	// file left by an interrupted transfer is continued; if the result does not match the
+	// index it is discarded and fetched once more from scratch.
+	Transfer transfer(const std::string& name, bool install) const {
+		Transfer result;
+		result.name = name;
+		std::string target;
+		std::error_code ec;
+		bool installed = ModuleStore::resolve(name, target);
+		if (install && installed) {
+			result.error = "already installed";
+			return result;
+		}
+		if (!install && !installed) {
+			result.error = "not installed";
+			return result;
+		}
+
+		std::string digest;
+		if (hasIndex) {
+			auto it = index.find(name);
+			if (it == index.end()) {
+				result.error = "not in the repository index";
+				return result;
+			}
+			digest = it->second;
+			std::vector<std::string> versions;
+			std::string current;
+			if (ModuleStore::readRef(name, versions))
+				current = versions.front();
+			else if (installed)
+				sha256File(target, current);
+			if (installed && current == digest) {
+				result.outcome = Outcome::UpToDate;
+				return result;
+			}
+			if (fs::exists(ModuleStore::blobPath(digest), ec)) {
+				fs::create_directories("modules/" + name, ec);
+				if (ModuleStore::activate(name, digest, result.error)) {
+					result.outcome = installed ? Outcome::Updated : Outcome::Installed;
+					result.fromStore = true;
+				}
+				return result;
+			}
+		}
+
+		fs::create_directories("modules/" + name, ec);
+		std::string part = moduleLibraryPath(name) + ".part";
+		std::string relative = name + "/" + name + platform::LibraryExtension;
+		for (int attempt = 0; attempt < 2; attempt++) {
+			bool resume = hasIndex && attempt == 0;
+			if (!resume)
+				fs::remove(part, ec);
+			if (!fetchFile(relative, part, resume, result.error))
+				return result; // the partial file stays for the next attempt to resume
+			std::string received;
+			if (!sha256File(part, received) || (hasIndex && received != digest)) {
+				result.error = "checksum mismatch for " + relative;
+				fs::remove(part, ec);
+				continue;
+			}
+			if (!ModuleStore::commit(name, part, received, result.error))
+				return result;
+			result.outcome = installed ? Outcome::Updated : Outcome::Installed;
+			result.bytes = fs::file_size(ModuleStore::blobPath(received), ec);
+			result.error.clear();
+			return result;
+		}
+		return result;
+	}
+
+	std::string source;
+	bool hasIndex;
+	std::map<std::string, std::string> index; // module name -> SHA-256 of its library
+};
+
+// Command Registry: maps every builtin name and alias, and every loaded module name,
+// to its handler so that dispatch is a single hash lookup.
+class CommandRegistry {
+public:
+	// Handlers receive the full token list; tokens[0] is the command name as typed.
+	typedef std::function<void(const Tokens& tokens)> Handler;
+
+	struct Entry {
+		std::string name;    // key of the table entry (the name or alias as registered)
+		Handler handler;     // set for builtins
+		Module* module;      // set for loaded modules
+	};
+
+	static CommandRegistry& getInstance() {
+		static CommandRegistry instance;
+		return instance;
+	}
+
+	// Register a builtin under all of its names. The usage column and description are
+	// shown by help; detail lines are printed verbatim below them.
+	void registerBuiltin(const std::vector<std::string>& names, const std::string& usage, const std::string& description,
+		Handler handler, const std::vector<std::string>& details = {}) {
+		for (const auto& name : names) {
+			Entry& entry = insert(name);
+			entry.handler = handler;
+			entry.module = nullptr;
+		}
+		helpLines.push_back(formatHelpLine(usage, description));
+		helpLines.insert(helpLines.end(), details.begin(), details.end());
+	}
+
+	// Modules share the table with builtins; a builtin name always wins.
+	void registerModule(const std::string& name, Module* module) {
+		auto it = commands.find(name);
+		if (it != commands.end() && it->second->handler) {
+			std::cerr << "Warning: module " << name << " is shadowed by a shell command" << '\n';
+			return;
+		}
+		insert(name).module = module;
+	}
+
+	void unregisterModule(const std::string& name) {
+		auto it = commands.find(name);
+		if (it != commands.end() && !it->second->handler) {
+			commands.erase(it);
+		}
+	}
+
+	const Entry* find(std::string_view name) const {
+		auto it = commands.find(name);
+		return it == commands.end() ? nullptr : it->second.get();
+	}
+
+	// Every registered name and alias, unordered (for tab completion).
+	std::vector<std::string> names() const {
+		std::vector<std::string> result;
+		result.reserve(commands.size());
+		for (const auto& entry : commands)
+			result.emplace_back(entry.first);
+		return result;
+	}
+
+	void printHelp() const {
+		std::cout << "Shell commands:" << '\n';
+		for (const auto& line : helpLines) {
+			std::cout << line << '\n';
+		}
+	}
+
+	// Help line for commands that are handled outside the table (e.g. module calls).
+	void addHelpLine(const std::string& usage, const std::string& description) {
+		helpLines.push_back(formatHelpLine(usage, description));
+	}
+
+private:
+	CommandRegistry() {}
+	CommandRegistry(const CommandRegistry&) = delete;
+	CommandRegistry& operator=(const CommandRegistry&) = delete;
+
+	static std::string formatHelpLine(const std::string& usage, const std::string& description) {
+		std::string line = "  " + usage;
+		if (line.size() < 30)
+			line.resize(30, ' ');
+		else
+			line += " ";
+		return line + "- " + description;
+	}
+
+	// Keys view the name stored in their own (heap allocated, hence stable) entry, which lets
+	// lookups take a string_view token without building a std::string.
+	Entry& insert(const std::string& name) {
+		auto it = commands.find(name);
+		if (it != commands.end())
+			return *it->second;
+		std::unique_ptr<Entry> entry(new Entry());
+		entry->name = name;
+		entry->module = nullptr;
+		Entry& result = *entry;
+		commands.emplace(std::string_view(result.name), std::move(entry));
+		return result;
+	}
+
+	std::unordered_map<std::string_view, std::unique_ptr<Entry>> commands;
+	std::vector<std::string> helpLines;
+};
+
+// Module Manager
+//
+// Installed modules are listed in a manifest (ManifestPath) holding each module's name,
+// library path, mtime, size, command and version. At startup the manifest is trusted as long
+// as the modules directory has not changed since it was written, so startup reads one file
+// no matter how many modules are installed; libraries are loaded on a module's first use.
+class ModuleManager {
+public:
+	static ModuleManager& getInstance() {
+		static ModuleManager instance;
+		return instance;
+	}
+
+	// Ensure that the "modules" directory exists
+	void ensureModulesDirectoryExists() {
+		try {
+			if (!fs::exists("modules")) {
+				fs::create_directory("modules");
+			}
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Error creating 'modules' folder: " << e.what() << '\n';
+		}
+	}
+
+	// Load (or reload) a module now instead of on its first use
+	void loadModule(const std::string& moduleName) {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		try {
+			ensureModulesDirectoryExists();
+			std::string path;
+			if (!ModuleStore::resolve(moduleName, path)) {
+				std::cerr << "Module load error: " << moduleName << " module does not installed." << '\n';
+				return;
+			}
+			auto it = modules.find(moduleName);
+			if (it == modules.end()) {
+				// Installed behind the shell's back; pick it up first.
+				refreshManifest();
+				it = modules.find(moduleName);
+				if (it == modules.end())
+					return;
+			}
+			LoadResult result = loadLibrary(it->second, true);
+			bool stale = false;
+			if (!finishLoad(it->second, result, stale)) {
+				std::cerr << "Module load error: " << result.error << '\n';
+				return;
+			}
+			if (stale)
+				refreshManifest();
+			std::cout << "Module loaded (" << result.milliseconds << " ms)" << '\n';
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Exception while loading module: " << e.what() << '\n';
+		}
+	}
+
+	// Rescan the "modules" folder and (re)load every module in it. Libraries are loaded and
+	// their instances created on a worker pool; results are reported in name order with the
+	// time each module took, so a slow plugin stands out. Loaded modules keep running until
+	// their new copy is ready.
+	void loadAllModules() {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		try {
+			ensureModulesDirectoryExists();
+			refreshManifest();
+			if (modules.empty()) {
+				std::cerr << "Error: No available module" << '\n';
+				return;
+			}
+			auto start = std::chrono::steady_clock::now();
+			std::vector<Module*> pending;
+			for (const auto& entry : modules) {
+				pending.push_back(entry.second);
+			}
+			std::vector<LoadResult> results(pending.size());
+			parallelFor(pending.size(), [&](size_t i) { results[i] = loadLibrary(pending[i], true); });
+
+			size_t loaded = 0;
+			bool stale = false;
+			for (size_t i = 0; i < pending.size(); i++) {
+				const std::string& name = pending[i]->getRecord().name;
+				if (finishLoad(pending[i], results[i], stale)) {
+					std::cout << "Module loaded: " << name << " (" << results[i].milliseconds << " ms)" << '\n';
+					loaded++;
+				}
+				else {
+					std::cerr << "Module load error: " << name << ": " << results[i].error << '\n';
+				}
+			}
+			if (stale)
+				refreshManifest();
+			std::cout << "Loaded " << loaded << " of " << pending.size() << " modules in "
+				<< millisecondsSince(start) << " ms" << '\n';
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Unknown Error while loading modules: " << e.what() << '\n';
+		}
+	}
+
+	// Install (install = true) or update modules from the configured source; "-all" means
+	// every module in the repository index, or every installed module. Transfers run
+	// concurrently (see ModuleRepository); a loaded module switches to its new version
+	// right away.
+	void fetchModules(std::vector<std::string> names, bool all, bool install) {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		try {
+			ensureModulesDirectoryExists();
+			ModuleRepository repository(ModuleRepository::configuredSource());
+			std::string error;
+			if (!repository.loadIndex(error)) {
+				if (all && install) {
+					std::cerr << "Error: install -all needs a repository index (" << error << ")" << '\n';
+					return;
+				}
+				std::cerr << "Warning: " << error << "; downloading without verification" << '\n';
+			}
+			if (all && install) {
+				std::vector<std::string> installed = installedModules();
+				for (const auto& name : repository.indexedModules()) {
+					if (!std::binary_search(installed.begin(), installed.end(), name))
+						names.push_back(name);
+				}
+			}
+			else if (all) {
+				names = installedModules();
+			}
+			if (names.empty()) {
+				if (all && install)
+					std::cout << "All modules in the index are installed" << '\n';
+				else
+					std::cerr << "ERROR: No available modules" << '\n';
+				return;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			std::vector<ModuleRepository::Transfer> results = repository.fetch(names, install);
+			size_t changed = 0;
+			unsigned long long bytes = 0;
+			for (const auto& result : results) {
+				switch (result.outcome) {
+				case ModuleRepository::Outcome::UpToDate:
+					std::cout << result.name << ": up to date" << '\n';
+					continue;
+				case ModuleRepository::Outcome::Failed:
+					std::cerr << "Error: " << result.name << ": " << result.error << '\n';
+					continue;
+				case ModuleRepository::Outcome::Installed:
+				case ModuleRepository::Outcome::Updated:
+					std::cout << result.name << (result.outcome == ModuleRepository::Outcome::Installed ? ": installed (" : ": updated (");
+					if (result.fromStore)
+						std::cout << "from the store)" << '\n';
+					else
+						std::cout << result.bytes << " bytes)" << '\n';
+					changed++;
+					bytes += result.bytes;
+					break;
+				}
+				// Loaded modules run from a shadow copy, so the installed file was free to replace.
+				auto it = modules.find(result.name);
+				if (it != modules.end() && it->second->isLoaded()) {
+					LoadResult load = loadLibrary(it->second, true);
+					bool stale = false;
+					if (!finishLoad(it->second, load, stale))
+						std::cerr << "Module load error: " << load.error << '\n';
+				}
+			}
+			if (changed > 0)
+				refreshManifest();
+			std::cout << (install ? "Installed " : "Updated ") << changed << " of " << results.size() << " modules ("
+				<< bytes << " bytes) in " << millisecondsSince(start) << " ms" << '\n';
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Exception while fetching modules: " << e.what() << '\n';
+		}
+	}
+
+	void installModules(const std::vector<std::string>& names, bool all) {
+		fetchModules(names, all, true);
+	}
+
+	void updateModules(const std::vector<std::string>& names, bool all) {
+		fetchModules(names, all, false);
+	}
+
+	// Delete a module: remove the library and the entire module folder from the filesystem
+	void removeModule(const std::string& moduleName) {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		try {
+			ensureModulesDirectoryExists();
+			std::string moduleFolder = "modules/" + moduleName;
+			if (fs::exists(moduleFolder)) {
+				auto it = modules.find(moduleName);
+				if (it != modules.end()) {
+					std::unique_lock<std::shared_mutex> table = lockTable();
+					std::lock_guard<std::mutex> lock(modulesMutex);
+					CommandRegistry::getInstance().unregisterModule(it->second->getRecord().command);
+					delete it->second;
+					modules.erase(it);
+				}
+				fs::remove_all(moduleFolder);
+				std::cout << "Module deleted" << '\n';
+				refreshManifest();
+			}
+			else {
+				std::cerr << "ERROR: Module is not available" << '\n';
+			}
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Exception while deleting module: " << e.what() << '\n';
+		}
+	}
+
+	// Delete all modules (remove the entire modules folder content)
+	void removeAllModules() {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		try {
+			ensureModulesDirectoryExists();
+			if (!fs::exists("modules") || fs::is_empty("modules")) {
+				std::cerr << "ERROR: No available module" << '\n';
+				return;
+			}
+			for (const auto& entry : fs::directory_iterator("modules")) {
+				if (entry.is_directory()) {
+					std::string moduleName = entry.path().filename().string();
+					removeModule(moduleName);
+				}
+			}
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Unknown Error while deleting modules: " << e.what() << '\n';
+		}
+	}
+
+	// "versions <module>": stored versions, active first.
+	void listVersions(const std::string& moduleName) {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		std::vector<std::string> versions;
+		if (!ModuleStore::readRef(moduleName, versions)) {
+			std::cerr << "Error: " << moduleName << " has no stored versions" << '\n';
+			return;
+		}
+		for (size_t i = 0; i < versions.size(); i++) {
+			std::error_code ec;
+			uintmax_t size = fs::file_size(ModuleStore::blobPath(versions[i]), ec);
+			std::cout << (i == 0 ? "* " : "  ") << versions[i].substr(0, 12) << "  ";
+			if (ec)
+				std::cout << "(missing from the store)";
+			else
+				std::cout << size << " bytes";
+			std::cout << '\n';
+		}
+	}
+
+	// Make another stored version active: the one before the current ("rollback <module>")
+	// or one given by digest prefix ("switch <module> <version>").
+	void switchVersion(const std::string& moduleName, const std::string& prefix) {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		try {
+			std::vector<std::string> versions;
+			std::string digest, error;
+			if (prefix.empty()) {
+				if (!ModuleStore::readRef(moduleName, versions) || versions.size() < 2) {
+					std::cerr << "Error: " << moduleName << " has no earlier version to roll back to" << '\n';
+					return;
+				}
+				digest = versions[1];
+			}
+			else if (!ModuleStore::findVersion(moduleName, prefix, digest, error)) {
+				std::cerr << "Error: " << error << '\n';
+				return;
+			}
+			if (!ModuleStore::activate(moduleName, digest, error)) {
+				std::cerr << "Error: " << error << '\n';
+				return;
+			}
+			refreshManifest();
+			std::cout << moduleName << ": now at " << digest.substr(0, 12) << '\n';
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Exception while switching module version: " << e.what() << '\n';
+		}
+	}
+
+	void collectGarbage() {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		size_t removed = 0;
+		unsigned long long bytes = 0;
+		ModuleStore::collectGarbage(removed, bytes);
+		std::cout << "Removed " << removed << " unreferenced module versions (" << bytes << " bytes)" << '\n';
+	}
+
+	// Names of the module folders that contain a library.
+	static std::vector<std::string> installedModules() {
+		std::vector<std::string> names;
+		std::error_code ec;
+		for (const auto& entry : fs::directory_iterator("modules", ec)) {
+			std::string name = entry.path().filename().string();
+			std::string path;
+			if (entry.is_directory(ec) && ModuleStore::resolve(name, path))
+				names.push_back(name);
+		}
+		std::sort(names.begin(), names.end());
+		return names;
+	}
+
+	// Commands that run modules hold this shared while they use Module pointers from the
+	// registry (a background job may be installing or deleting modules meanwhile); changes to
+	// the module table take it exclusively, so no module is deleted under a running call.
+	std::shared_mutex& getTableLock() { return tableMutex; }
+
+	// All installed modules by directory name, loaded or not.
+	const std::map<std::string, Module*>& getModules() const {
+		return modules;
+	}
+
+	// Run an already resolved module (the command registry hands out the instance directly)
+	// with args[first..], loading it first if this is its first use. The call's latency is
+	// recorded for "stats" under the module's running version.
+	void executeModule(Module* module, const Tokens& args, size_t first) {
+		try {
+			ModuleWorkers& workers = ModuleWorkers::getInstance();
+			if (workers.isEnabled()) {
+				auto start = std::chrono::steady_clock::now();
+				TraceSpan span("executeModule (isolated)", module->getRecord().name);
+				if (workers.execute(module->getRecord(), args, first)) {
+					CommandStats::getInstance().record(CommandStats::ModuleCall, module->getRecord().name,
+						module->getVersion(), std::chrono::steady_clock::now() - start);
+					return;
+				}
+			}
+			if (ensureLoaded(module)) {
+				auto start = std::chrono::steady_clock::now();
+				TraceSpan span("executeModule", module->getRecord().name);
+				module->execute(args, first, &hostServices);
+				CommandStats::getInstance().record(CommandStats::ModuleCall, module->getRecord().name,
+					module->getVersion(), std::chrono::steady_clock::now() - start);
+			}
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Exception while executing module: " << e.what() << '\n';
+		}
+		catch (...) {
+			std::cerr << "Unknown Error while running module command" << '\n';
+		}
+	}
+
+	// The running copy of a module, loaded first if this is its first use; null (after
+	// reporting the error) if it cannot be loaded.
+	std::shared_ptr<LoadedModule> acquire(Module* module) {
+		try {
+			if (ensureLoaded(module))
+				return module->getLoaded();
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Exception while loading module: " << e.what() << '\n';
+		}
+		return nullptr;
+	}
+
+	// Rebuild the manifest from the "modules" folder. Libraries whose path, mtime and size
+	// match the current entry are not opened again; new or changed ones are queried once.
+	void refreshManifest() {
+		std::lock_guard<std::recursive_mutex> management(managementMutex);
+		std::map<std::string, ModuleRecord> found;
+		std::vector<ModuleRecord> changed;
+		try {
+			for (const auto& entry : fs::directory_iterator("modules")) {
+				if (!entry.is_directory())
+					continue;
+				ModuleRecord record;
+				record.name = entry.path().filename().string();
+				if (!ModuleStore::resolve(record.name, record.path) || !statFile(record.path, record.mtime, record.size))
+					continue;
+				auto it = modules.find(record.name);
+				if (it != modules.end() && sameFile(it->second->getRecord(), record)) {
+					found[record.name] = it->second->getRecord();
+				}
+				else {
+					changed.push_back(record);
+				}
+			}
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Error scanning modules: " << e.what() << '\n';
+			return;
+		}
+
+		// Opening a library is the slow part of a rescan, so new and changed ones are queried
+		// in parallel; warnings come out in directory order.
+		std::vector<std::string> errors(changed.size());
+		parallelFor(changed.size(), [&](size_t i) {
+			if (!LoadedModule::inspect(changed[i], errors[i]) && errors[i].empty())
+				errors[i] = "cannot query module";
+		});
+		for (size_t i = 0; i < changed.size(); i++) {
+			if (errors[i].empty())
+				found[changed[i].name] = changed[i];
+			else
+				std::cerr << "Warning: skipping module " << changed[i].name << ": " << errors[i] << '\n';
+		}
+		adopt(found);
+		writeManifest();
+	}
+
+	// Watch mode: a background thread follows changes in the "modules" folder. A rebuilt
+	// library of a loaded module is loaded beside the running copy and swapped in (see
+	// Module::reload); new and removed modules are picked up by a rescan before the next
+	// command. Nothing is done on the watcher thread that touches the module table, the
+	// registry or the console; it leaves that to applyWatchEvents() on the main thread.
+	bool startWatching() {
+		if (watchThread.joinable())
+			return true;
+		ensureModulesDirectoryExists();
+		std::unique_ptr<platform::DirectoryWatcher> watcher(new platform::DirectoryWatcher());
+		std::string error;
+		if (!watcher->open("modules", error)) {
+			std::cerr << "Error: " << error << '\n';
+			return false;
+		}
+		stopWatch = false;
+		watchThread = std::thread(&ModuleManager::watchLoop, this, std::move(watcher));
+		return true;
+	}
+
+	void stopWatching() {
+		if (!watchThread.joinable())
+			return;
+		stopWatch = true;
+		watchThread.join();
+	}
+
+	bool isWatching() const {
+		return watchThread.joinable();
+	}
+
+	// Report what the watcher did since the last call and bring the module table and the
+	// manifest up to date. Called before every command; costs one atomic load when idle.
+	void applyWatchEvents() {
+		if (!watchActivity.exchange(false))
+			return;
+		// A background install or update is changing the modules; try again after the next command.
+		std::unique_lock<std::recursive_mutex> management(managementMutex, std::try_to_lock);
+		if (!management) {
+			watchActivity = true;
+			return;
+		}
+		std::vector<WatchMessage> messages;
+		{
+			std::lock_guard<std::mutex> lock(messagesMutex);
+			messages.swap(watchMessages);
+		}
+		for (const auto& message : messages) {
+			(message.error ? std::cerr : std::cout) << message.text << '\n';
+		}
+		bool stale = false;
+		for (const auto& entry : modules) {
+			if (entry.second->syncRecord())
+				stale = true;
+		}
+		if (rescanRequested.exchange(false) || stale)
+			refreshManifest();
+	}
+
+	// Thread pool and tracing that module calls get through ms_call::services.
+	const ms_host_services* getHostServices() const { return &hostServices; }
+
+	// Stop the watcher and release every module. Called before main() returns, while the
+	// modules' own static data is still alive.
+	void shutdown() {
+		stopWatching();
+		taskPool.shutdown();
+		std::unique_lock<std::shared_mutex> table = lockTable();
+		std::lock_guard<std::mutex> lock(modulesMutex);
+		for (auto& entry : modules) {
+			CommandRegistry::getInstance().unregisterModule(entry.second->getRecord().command);
+			delete entry.second;
+		}
+		modules.clear();
+		std::error_code ec;
+		fs::remove_all(LoadedModule::shadowDirectory(), ec);
+	}
+
+private:
+	ModuleManager() : stopWatch(false), rescanRequested(false), watchActivity(false) {
+		hostServices = ms_host_services();
+		hostServices.struct_size = sizeof(hostServices);
+		taskPool.fillServices(hostServices);
+		hostServices.tracing = [](void*) { return Tracer::enabled() ? 1 : 0; };
+		hostServices.trace_now = [](void*) { return Tracer::now(); };
+		hostServices.trace_span = [](void*, const char* name, uint64_t start, uint64_t end) {
+			Tracer::getInstance().record(name ? name : "", std::string_view(), start, end, true);
+		};
+		try {
+			ensureModulesDirectoryExists();
+			removeStaleShadowCopies();
+			std::map<std::string, ModuleRecord> records;
+			if (readManifest(records)) {
+				adopt(records);
+			}
+			else {
+				refreshManifest();
+			}
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Exception during ModuleManager initialization: " << e.what() << '\n';
+		}
+	}
+	ModuleManager(const ModuleManager&) = delete;
+	ModuleManager& operator=(const ModuleManager&) = delete;
+
+	// Kept next to (not inside) the modules folder: writing it must not change the folder's
+	// timestamp, which is what tells a current manifest from a stale one.
+	static constexpr const char* ManifestPath = "modules.manifest";
+	static constexpr const char* ManifestHeader = "# Mini-Shell module manifest v1";
+
+	static long long directoryStamp() {
+		return static_cast<long long>(fs::last_write_time("modules").time_since_epoch().count());
+	}
+
+	static bool sameFile(const ModuleRecord& a, const ModuleRecord& b) {
+		return a.path == b.path && a.mtime == b.mtime && a.size == b.size;
+	}
+
+	struct LoadResult {
+		bool ok = false;
+		std::string error;
+		double milliseconds = 0;
+	};
+
+	static double millisecondsSince(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Load one module's library and create its instance (replace: load a new copy even if
+	// one is running). Touches nothing but the module itself, so different modules can be
+	// loaded on different threads; finishLoad() applies the result on the main thread.
+	static LoadResult loadLibrary(Module* module, bool replace) {
+		TraceSpan span("loadModule", module->getRecord().name);
+		LoadResult result;
+		auto start = std::chrono::steady_clock::now();
+		result.ok = replace ? module->reload(result.error) : module->load(result.error);
+		result.milliseconds = millisecondsSince(start);
+		return result;
+	}
+
+	// A library that changed since the manifest was written is loaded anyway; its entry is
+	// updated and stale is set so the caller can rewrite the manifest.
+	static bool finishLoad(Module* module, const LoadResult& result, bool& stale) {
+		if (!result.ok)
+			return false;
+		if (module->syncRecord())
+			stale = true;
+		return true;
+	}
+
+	struct WatchMessage {
+		bool error;
+		std::string text;
+	};
+
+	// Builds tend to write a library in several steps, so changes are acted on once the
+	// folder has been quiet for WatchSettleTime.
+	void watchLoop(std::unique_ptr<platform::DirectoryWatcher> watcher) {
+		const auto WatchSettleTime = std::chrono::milliseconds(300);
+		std::set<std::string> changedModules;
+		bool rescan = false;
+		auto lastEvent = std::chrono::steady_clock::now();
+		while (!stopWatch) {
+			std::vector<std::string> changed;
+			watcher->wait(100, changed);
+			for (const auto& path : changed) {
+				size_t slash = path.find('/');
+				if (slash == std::string::npos) {
+					rescan = true; // lost events, or a module folder added or removed
+					continue;
+				}
+				std::string name = path.substr(0, slash);
+				if (path.compare(slash + 1, std::string::npos, name + platform::LibraryExtension) == 0)
+					changedModules.insert(name);
+				else if (path.compare(slash + 1, std::string::npos, name + ".ref") == 0)
+					rescan = true; // switched to another stored version
+
+			}
+			if (!changed.empty()) {
+				lastEvent = std::chrono::steady_clock::now();
+				continue;
+			}
+			if ((changedModules.empty() && !rescan) || std::chrono::steady_clock::now() - lastEvent < WatchSettleTime)
+				continue;
+			for (const auto& name : changedModules)
+				reloadChanged(name);
+			if (rescan)
+				rescanRequested = true;
+			changedModules.clear();
+			rescan = false;
+			watchActivity = true;
+		}
+	}
+
+	// Watcher thread: swap in the new build of a loaded module. Modules that are not loaded
+	// only need their manifest entry refreshed, which the next rescan does.
+	void reloadChanged(const std::string& name) {
+		std::lock_guard<std::mutex> lock(modulesMutex);
+		auto it = modules.find(name);
+		if (it == modules.end() || !it->second->isLoaded()) {
+			rescanRequested = true;
+			return;
+		}
+		LoadResult result = loadLibrary(it->second, true);
+		WatchMessage message;
+		message.error = !result.ok;
+		if (result.ok)
+			message.text = "Module reloaded: " + name + " (" + it->second->getVersion() + ", " +
+				std::to_string(static_cast<long long>(result.milliseconds)) + " ms)";
+		else
+			message.text = "Warning: keeping the running " + name + " module, reload failed: " + result.error;
+		std::lock_guard<std::mutex> messagesLock(messagesMutex);
+		watchMessages.push_back(message);
+	}
+
+	// Shadow copies left behind by shells that did not exit cleanly. Copies still in use by
+	// another running shell cannot be deleted on Windows and are skipped.
+	static void removeStaleShadowCopies() {
+		std::error_code ec;
+		for (const auto& entry : fs::directory_iterator("modules.shadow", ec)) {
+			std::error_code removeError;
+			for (const auto& file : fs::directory_iterator(entry.path(), removeError))
+				fs::remove(file.path(), removeError);
+			fs::remove(entry.path(), removeError);
+		}
+	}
+
+	// Load a module on first use. Runs while the caller holds the table lock shared, so a
+	// stale manifest is rewritten later by applyWatchEvents() rather than here.
+	bool ensureLoaded(Module* module) {
+		if (module->isLoaded())
+			return true;
+		LoadResult result = loadLibrary(module, false);
+		bool stale = false;
+		if (!finishLoad(module, result, stale)) {
+			std::cerr << "Module load error: " << result.error << '\n';
+			return false;
+		}
+		if (stale) {
+			rescanRequested = true;
+			watchActivity = true;
+		}
+		return true;
+	}
+
+	// Exclusive hold of the table lock, for changing the module table.
+	std::unique_lock<std::shared_mutex> lockTable() {
+		std::unique_lock<std::shared_mutex> table(tableMutex, std::try_to_lock);
+		if (!table) {
+			std::cout << "Waiting for running module commands to finish..." << '\n';
+			table.lock();
+		}
+		return table;
+	}
+
+	// Make the module table (and the command registry) match the given records. Unchanged
+	// modules keep their instance, so a rescan does not unload anything that is in use.
+	void adopt(const std::map<std::string, ModuleRecord>& records) {
+		std::unique_lock<std::shared_mutex> table = lockTable();
+		std::lock_guard<std::mutex> lock(modulesMutex);
+		CommandRegistry& registry = CommandRegistry::getInstance();
+		for (auto it = modules.begin(); it != modules.end();) {
+			auto found = records.find(it->first);
+			if (found != records.end() && sameFile(found->second, it->second->getRecord())) {
+				++it;
+				continue;
+			}
+			registry.unregisterModule(it->second->getRecord().command);
+			delete it->second;
+			it = modules.erase(it);
+		}
+		for (const auto& entry : records) {
+			if (modules.find(entry.first) != modules.end())
+				continue;
+			const CommandRegistry::Entry* existing = registry.find(entry.second.command);
+			if (existing && existing->module) {
+				std::cerr << "Warning: skipping module " << entry.first << ": command " << entry.second.command
+					<< " is already provided by another module" << '\n';
+				continue;
+			}
+			Module* module = new Module(entry.second);
+			modules[entry.first] = module;
+			registry.registerModule(entry.second.command, module);
+		}
+	}
+
+	// Read the manifest if it is current. Format: a header line, a "stamp" line with the
+	// modules folder timestamp, then one tab separated line per module:
+	//   name  path  mtime  size  command  version
+	bool readManifest(std::map<std::string, ModuleRecord>& records) {
+		std::ifstream in(ManifestPath);
+		std::string line;
+		if (!in || !std::getline(in, line) || line != ManifestHeader)
+			return false;
+		if (!std::getline(in, line) || line.rfind("stamp ", 0) != 0)
+			return false;
+		try {
+			if (std::stoll(line.substr(6)) != directoryStamp())
+				return false;
+			while (std::getline(in, line)) {
+				std::vector<std::string> fields;
+				size_t start = 0;
+				for (size_t tab; (tab = line.find('\t', start)) != std::string::npos && fields.size() < 5; start = tab + 1)
+					fields.push_back(line.substr(start, tab - start));
+				fields.push_back(line.substr(start));
+				if (fields.size() != 6)
+					return false;
+				ModuleRecord record;
+				record.name = fields[0];
+				record.path = fields[1];
+				record.mtime = std::stoll(fields[2]);
+				record.size = std::stoull(fields[3]);
+				record.command = fields[4];
+				record.version = fields[5];
+				records[record.name] = record;
+			}
+		}
+		catch (const std::exception&) {
+			return false;
+		}
+		return true;
+	}
+
+	// Written to a temporary file and renamed over the old one, so readers never see half a manifest.
+	void writeManifest() {
+		try {
+			std::string temporary = std::string(ManifestPath) + ".tmp";
+			{
+				std::ofstream out(temporary, std::ios::trunc);
+				out << ManifestHeader << '\n';
+				out << "stamp " << directoryStamp() << '\n';
+				for (const auto& entry : modules) {
+					const ModuleRecord& r = entry.second->getRecord();
+					out << r.name << '\t' << r.path << '\t' << r.mtime << '\t' << r.size << '\t'
+						<< r.command << '\t' << r.version << '\n';
+				}
+				if (!out)
+					throw std::runtime_error("cannot write " + temporary);
+			}
+			fs::rename(temporary, ManifestPath);
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Warning: module manifest not saved: " << e.what() << '\n';
+		}
+	}
+
+	std::map<std::string, Module*> modules;
+	std::mutex modulesMutex;     // held by the watcher while it uses the table; main thread holds it to change the table
+	std::shared_mutex tableMutex;            // see getTableLock()
+	std::recursive_mutex managementMutex;    // serializes install/update/load/delete/... across jobs
+
+	TaskPool taskPool;
+	ms_host_services hostServices;
+	std::thread watchThread;
+	std::atomic<bool> stopWatch;
+	std::atomic<bool> rescanRequested;
+	std::atomic<bool> watchActivity;
+	std::mutex messagesMutex;
+	std::vector<WatchMessage> watchMessages;
+};
+
+//------------------------------------------------------------
+// Directory Listing
+//------------------------------------------------------------
+
+// Glob match of a file name: '*' any run of characters, '?' one character, [abc] / [a-z] /
+// [!abc] one character from (or not from) a set. Case-insensitive on Windows.
+bool globMatch(std::string_view pattern, std::string_view name) {
+	auto same = [](char a, char b) {
+#ifdef _WIN32
+		return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+#else
+		return a == b;
+#endif
+	};
+	size_t p = 0, n = 0, starP = std::string_view::npos, starN = 0;
+	while (n < name.size()) {
+		if (p < pattern.size() && pattern[p] == '*') {
+			starP = p++;
+			starN = n;
+			continue;
+		}
+		if (p < pattern.size() && pattern[p] == '[') {
+			size_t q = p + 1;
+			bool negate = q < pattern.size() && (pattern[q] == '!' || pattern[q] == '^');
+			if (negate)
+				q++;
+			bool found = false;
+			size_t setStart = q;
+			while (q < pattern.size() && (pattern[q] != ']' || q == setStart)) {
+				if (q + 2 < pattern.size() && pattern[q + 1] == '-' && pattern[q + 2] != ']') {
+					if (pattern[q] <= name[n] && name[n] <= pattern[q + 2])
+						found = true;
+					q += 3;
+				}
+				else {
+					if (same(pattern[q], name[n]))
+						found = true;
+					q++;
+				}
+			}
+			if (q < pattern.size() && found != negate) {
+				p = q + 1;
+				n++;
+				continue;
+			}
+		}
+		else if (p < pattern.size() && (pattern[p] == '?' || same(pattern[p], name[n]))) {
+			p++;
+			n++;
+			continue;
+		}
+		if (starP == std::string_view::npos)
+			return false;
+		p = starP + 1;
+		n = ++starN;
+	}
+	while (p < pattern.size() && pattern[p] == '*')
+		p++;
+	return p == pattern.size();
+}
+
+// What "ls" prints and how. Size and age predicates use find(1) conventions: "+N" more
+// than, "-N" less than, "N" exactly; they only match files.
+struct ListOptions {
+	struct Predicate {
+		char op = 0;            // '+', '-', '=' or 0 when unused
+		long long value = 0;
+
+		bool matches(long long x) const {
+			return op == '+' ? x > value : op == '-' ? x < value : x == value;
+		}
+	};
+
+	bool recursive = false;
+	std::string namePattern;    // glob on the entry name; empty matches everything
+	char type = 0;              // 'f', 'd', 'l' or 0 for any
+	Predicate size;             // bytes
+	Predicate age;              // whole days since the last write
+	char sort = 0;              // 'n' name, 's' size (largest first), 't' time (newest first)
+
+	bool needsStat() const { return size.op || age.op || sort == 's' || sort == 't'; }
+
+	// Parse "-name <glob>", "-type <f|d|l>", "-size <[+-]N[k|M|G]>", "-mtime <[+-]days>"
+	// or "-sort <name|size|time>". Returns false on a bad value.
+	bool set(std::string_view option, std::string_view value) {
+		if (option == "-name") {
+			namePattern = std::string(value);
+			return true;
+		}
+		if (option == "-type") {
+			if (value != "f" && value != "d" && value != "l")
+				return false;
+			type = value[0];
+			return true;
+		}
+		if (option == "-sort") {
+			if (value != "name" && value != "size" && value != "time")
+				return false;
+			sort = value == "name" ? 'n' : value == "size" ? 's' : 't';
+			return true;
+		}
+		if (option == "-size" || option == "-mtime") {
+			Predicate& predicate = option == "-size" ? size : age;
+			predicate.op = '=';
+			if (!value.empty() && (value[0] == '+' || value[0] == '-')) {
+				predicate.op = value[0];
+				value.remove_prefix(1);
+			}
+			std::string number(value);
+			char* end = nullptr;
+			predicate.value = std::strtoll(number.c_str(), &end, 10);
+			if (end == number.c_str() || predicate.value < 0)
+				return false;
+			std::string unit(end);
+			if (option == "-size" && !unit.empty()) {
+				const std::string units = "kMG";
+				size_t scale = unit.size() == 1 ? units.find(unit[0]) : std::string::npos;
+				if (scale == std::string::npos)
+					return false;
+				predicate.value <<= 10 * (scale + 1);
+			}
+			else if (!unit.empty()) {
+				return false;
+			}
+			return true;
+		}
+		return false;
+	}
+};
+
+// Visits a tree of directories on a pool of threads. Each worker owns a deque of directories
+// still to visit: it takes work from the back of its own deque (depth first, so it stays near
+// what it just read) and steals from the front of the others' when it runs dry (the oldest,
+// usually largest, subtrees). The visitor handles one directory and appends the ones to visit
+// next; it is told which worker calls it, so it can keep per-worker results without locking.
+// A worker that finds nothing to take sleeps until directories are queued or the traversal
+// is done.
+class TreeTraversal {
+public:
+	typedef std::function<void(size_t worker, const std::string& directory, std::vector<std::string>& subdirectories)> Visitor;
+
+	static size_t defaultThreads() { return std::max(4u, std::thread::hardware_concurrency()); }
+
+	explicit TreeTraversal(size_t threadCount) : pending(0), queued(0), waiting(0) {
+		for (size_t i = 0; i < std::max<size_t>(threadCount, 1); i++)
+			queues.emplace_back(new Queue());
+	}
+
+	size_t threadCount() const { return queues.size(); }
+
+	void run(std::vector<std::string> roots, const Visitor& visit) {
+		pending = roots.size();
+		queued = roots.size();
+		for (auto& root : roots)
+			queues[0]->directories.push_back(std::move(root));
+		parallelFor(queues.size(), [&](size_t self) { work(self, visit); });
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::string> directories;
+	};
+
+	void work(size_t self, const Visitor& visit) {
+		std::string directory;
+		std::vector<std::string> subdirectories;
+		for (;;) {
+			if (take(self, directory)) {
+				subdirectories.clear();
+				// A cancelled job drains the queues without visiting anything more.
+				if (!JobContext::cancelled())
+					visit(self, directory, subdirectories);
+				if (!subdirectories.empty()) {
+					pending += subdirectories.size();
+					queued += subdirectories.size();
+					{
+						Queue& own = *queues[self];
+						std::lock_guard<std::mutex> lock(own.mutex);
+						for (auto& path : subdirectories)
+							own.directories.push_back(std::move(path));
+					}
+					wakeWaiting();
+				}
+				if (--pending == 0)
+					wakeWaiting();
+			}
+			else if (pending == 0) {
+				return;
+			}
+			else {
+				std::unique_lock<std::mutex> lock(sleepMutex);
+				waiting++;
+				available.wait(lock, [&] { return pending == 0 || queued > 0; });
+				waiting--;
+			}
+		}
+	}
+
+	// queued and pending are changed before waiting is read, and a worker counts itself as
+	// waiting before it checks them (all seq_cst), so a wake-up is never lost.
+	void wakeWaiting() {
+		if (waiting > 0) {
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			available.notify_all();
+		}
+	}
+
+	bool take(size_t self, std::string& directory) {
+		{
+			Queue& own = *queues[self];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.directories.empty()) {
+				directory = std::move(own.directories.back());
+				own.directories.pop_back();
+				queued--;
+				return true;
+			}
+		}
+		for (size_t i = 1; i < queues.size(); i++) {
+			Queue& victim = *queues[(self + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.directories.empty()) {
+				directory = std::move(victim.directories.front());
+				victim.directories.pop_front();
+				queued--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::atomic<size_t> pending;    // directories queued or being visited
+	std::atomic<size_t> queued;     // directories in the queues
+	std::atomic<size_t> waiting;    // workers asleep in work(), changed under sleepMutex
+	std::mutex sleepMutex;
+	std::condition_variable available;
+};
+
+// Lists a directory tree for "ls" with a TreeTraversal. Matches are formatted into a
+// per-worker buffer that is written out in large blocks, or collected and sorted at the end
+// when a sort order is given.
+class DirectoryWalker {
+public:
+	explicit DirectoryWalker(const ListOptions& options) : options(options), collecting(false) {
+		now = static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count());
+	}
+
+	// Returns false (after reporting the error) if root itself cannot be read. Errors in
+	// subdirectories are reported and skipped.
+	bool run(const std::string& root, const std::string& what) {
+		if (!walk(root, what))
+			return false;
+		if (!options.sort) {
+			for (auto& worker : workers)
+				write(worker->output);
+			return true;
+		}
+		std::vector<Match> matches = takeMatches();
+		char sort = options.sort;
+		std::sort(matches.begin(), matches.end(), [sort](const Match& a, const Match& b) {
+			if (sort == 's' && a.size != b.size)
+				return a.size > b.size;
+			if (sort == 't' && a.mtime != b.mtime)
+				return a.mtime > b.mtime;
+			return a.path < b.path;
+		});
+		std::string output;
+		for (const auto& match : matches) {
+			output += match.path;
+			output += '\n';
+			if (output.size() >= FlushSize)
+				write(output);
+		}
+		write(output);
+		return true;
+	}
+
+	// Like run(), but returns the matching paths (relative to root, sorted) instead of printing them.
+	bool collect(const std::string& root, const std::string& what, std::vector<std::string>& paths) {
+		collecting = true;
+		if (!walk(root, what))
+			return false;
+		for (auto& match : takeMatches())
+			paths.push_back(std::move(match.path));
+		std::sort(paths.begin(), paths.end());
+		return true;
+	}
+
+private:
+	static const size_t FlushSize = 64 * 1024;
+
+	struct Match {
+		std::string path;
+		unsigned long long size;
+		long long mtime;
+	};
+
+	struct Worker {
+		std::string output;
+		std::vector<Match> matches;
+	};
+
+	bool walk(const std::string& root, const std::string& what) {
+		this->root = root;
+		TreeTraversal traversal(options.recursive ? TreeTraversal::defaultThreads() : 1);
+		workers.clear();
+		for (size_t i = 0; i < traversal.threadCount(); i++)
+			workers.emplace_back(new Worker());
+
+		std::vector<platform::DirectoryEntry> entries;
+		std::vector<std::string> subdirectories;
+		std::string error;
+		if (!platform::readDirectory(root, options.needsStat(), entries, error)) {
+			std::cerr << "Error listing " << what << ": " << error << '\n';
+			return false;
+		}
+		visit(*workers[0], "", entries, subdirectories);
+		// Subdirectory paths are relative to the root.
+		traversal.run(std::move(subdirectories), [this](size_t worker, const std::string& directory, std::vector<std::string>& next) {
+			std::vector<platform::DirectoryEntry> entries;
+			std::string error;
+			if (platform::readDirectory(fullPath(directory), options.needsStat(), entries, error))
+				visit(*workers[worker], directory, entries, next);
+			else
+				report("Error listing " + fullPath(directory) + ": " + error);
+		});
+		return true;
+	}
+
+	std::vector<Match> takeMatches() {
+		std::vector<Match> matches;
+		for (auto& worker : workers) {
+			matches.insert(matches.end(), std::make_move_iterator(worker->matches.begin()),
+				std::make_move_iterator(worker->matches.end()));
+			worker->matches.clear();
+		}
+		return matches;
+	}
+
+	void visit(Worker& worker, const std::string& directory, std::vector<platform::DirectoryEntry>& entries,
+		std::vector<std::string>& subdirectories) {
+		for (auto& entry : entries) {
+			std::string path = directory.empty() ? entry.name : directory + platform::PathSeparator + entry.name;
+			if (matches(entry)) {
+				if (options.sort || collecting) {
+					worker.matches.push_back({ path, entry.size, entry.mtime });
+				}
+				else {
+					worker.output += path;
+					worker.output += '\n';
+					if (worker.output.size() >= FlushSize)
+						write(worker.output);
+				}
+			}
+			// Symbolic links are listed but not followed, so cycles cannot occur.
+			if (options.recursive && entry.type == platform::DirectoryEntry::Directory)
+				subdirectories.push_back(std::move(path));
+		}
+	}
+
+	bool matches(const platform::DirectoryEntry& entry) const {
+		if (options.type) {
+			char type = entry.type == platform::DirectoryEntry::File ? 'f' :
+				entry.type == platform::DirectoryEntry::Directory ? 'd' :
+				entry.type == platform::DirectoryEntry::Link ? 'l' : 0;
+			if (type != options.type)
+				return false;
+		}
+		if ((options.size.op || options.age.op) && entry.type != platform::DirectoryEntry::File)
+			return false;
+		if (options.size.op && !options.size.matches(static_cast<long long>(entry.size)))
+			return false;
+		if (options.age.op && !options.age.matches((now - entry.mtime) / 86400))
+			return false;
+		return options.namePattern.empty() || globMatch(options.namePattern, entry.name);
+	}
+
+	std::string fullPath(const std::string& directory) const {
+		if (!root.empty() && (root.back() == '/' || root.back() == platform::PathSeparator))
+			return root + directory;
+		return root + platform::PathSeparator + directory;
+	}
+
+	void write(std::string& text) {
+		if (text.empty())
+			return;
+		std::lock_guard<std::mutex> lock(outputMutex);
+		std::cout.write(text.data(), static_cast<std::streamsize>(text.size()));
+		text.clear();
+	}
+
+	void report(const std::string& message) {
+		std::lock_guard<std::mutex> lock(outputMutex);
+		std::cerr << message << '\n';
+	}
+
+	const ListOptions& options;
+	bool collecting;
+	std::string root;
+	long long now;
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::mutex outputMutex;
+};
+
+//------------------------------------------------------------
+// Content Search
+//------------------------------------------------------------
+
+// Extended regular expression for "grep": literals, '.', [classes] (ranges, [^...]), the
+// escapes \d \w \s \D \W \S, groups, '|', '*', '+' and '?'; '^' and '$' anchor only at the
+// ends of the pattern. The pattern is compiled to a Thompson NFA, which runs as a DFA whose
+// states are built the first time they are reached and cached. The cache makes an instance
+// unsafe to share between threads; copy it instead.
+class Regex {
+public:
+	// Throws std::runtime_error on a syntax error.
+	Regex(std::string_view pattern, bool ignoreCase) : anchoredStart(false), anchoredEnd(false), ignoreCase(ignoreCase) {
+		if (!pattern.empty() && pattern[0] == '^') {
+			anchoredStart = true;
+			pattern.remove_prefix(1);
+		}
+		if (!pattern.empty() && pattern.back() == '$') {
+			size_t escapes = 0;
+			while (escapes + 1 < pattern.size() && pattern[pattern.size() - 2 - escapes] == '\\')
+				escapes++;
+			if (escapes % 2 == 0) {
+				anchoredEnd = true;
+				pattern.remove_suffix(1);
+			}
+		}
+		text = pattern;
+		position = 0;
+		Fragment whole = parseAlternation();
+		if (position < text.size())
+			throw std::runtime_error("unmatched ')'");
+		int match = addNode(Node::Match);
+		nodes[whole.end].out = match;
+		start = whole.start;
+		text = std::string_view();
+		resetCache();
+	}
+
+	// Calls onLine(begin, end) for every line in [begin, end) that contains a match (end
+	// excludes the '\n'). Stops early when onLine returns false.
+	template <class OnLine>
+	void scan(const char* begin, const char* end, OnLine onLine) {
+		const char* line = begin;
+		int state = 0;
+		const char* found[MaxFirstBytes] = {};  // next occurrence of each firstBytes entry
+		for (const char* p = begin; p < end; p++) {
+			if (state == 0 && !firstBytes.empty()) {
+				// Nothing is under way, so skip (with memchr) to the next byte that can start a match.
+				const char* candidate = end;
+				for (size_t i = 0; i < firstBytes.size(); i++) {
+					if (found[i] < p) {
+						found[i] = static_cast<const char*>(memchr(p, firstBytes[i], static_cast<size_t>(end - p)));
+						if (!found[i])
+							found[i] = end;
+					}
+					candidate = std::min(candidate, found[i]);
+				}
+				if (candidate == end)
+					return;
+				const char* q = candidate;
+				while (q > p && q[-1] != '\n')
+					q--;
+				if (q > p)
+					line = q; // skipped past the end of the current line
+				p = candidate;
+			}
+			unsigned char c = static_cast<unsigned char>(*p);
+			if (c == '\n') {
+				if (flags[state] & Accepting && !onLine(line, p))
+					return;
+				line = p + 1;
+				state = 0;
+				continue;
+			}
+			int next = table[static_cast<size_t>(state) * 256 + c];
+			state = next >= 0 ? next : transition(state, c);
+			unsigned char flag = flags[state];
+			if ((flag & Accepting && !anchoredEnd) || flag & Dead) {
+				const char* lineEnd = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+				if (!lineEnd)
+					lineEnd = end;
+				if (flag & Accepting && !onLine(line, lineEnd))
+					return;
+				if (lineEnd == end)
+					return;
+				p = lineEnd; // the loop steps over the '\n'
+				line = lineEnd + 1;
+				state = 0;
+			}
+		}
+		if (line < end && flags[state] & Accepting)
+			onLine(line, end);
+	}
+
+private:
+	struct Node {
+		enum Kind { Set, Epsilon, Match };
+		Kind kind;
+		std::bitset<256> set;   // bytes accepted by a Set node
+		int out = -1;
+		int out1 = -1;          // second branch of an Epsilon node
+	};
+
+	// Part of the NFA under construction; end is an Epsilon node whose out is still open.
+	struct Fragment {
+		int start;
+		int end;
+	};
+
+	enum { Accepting = 1, Dead = 2 };
+	static const size_t MaxStates = 2048;
+	static const size_t MaxFirstBytes = 3;
+
+	int addNode(Node::Kind kind) {
+		nodes.push_back(Node());
+		nodes.back().kind = kind;
+		return static_cast<int>(nodes.size() - 1);
+	}
+
+	Fragment parseAlternation() {
+		Fragment left = parseConcatenation();
+		while (position < text.size() && text[position] == '|') {
+			position++;
+			Fragment right = parseConcatenation();
+			int split = addNode(Node::Epsilon), join = addNode(Node::Epsilon);
+			nodes[split].out = left.start;
+			nodes[split].out1 = right.start;
+			nodes[left.end].out = join;
+			nodes[right.end].out = join;
+			left = { split, join };
+		}
+		return left;
+	}
+
+	Fragment parseConcatenation() {
+		Fragment result = { -1, -1 };
+		while (position < text.size() && text[position] != '|' && text[position] != ')') {
+			Fragment next = parseRepeat();
+			if (result.start < 0) {
+				result = next;
+			}
+			else {
+				nodes[result.end].out = next.start;
+				result.end = next.end;
+			}
+		}
+		if (result.start < 0) {
+			int empty = addNode(Node::Epsilon);
+			result = { empty, empty };
+		}
+		return result;
+	}
+
+	Fragment parseRepeat() {
+		Fragment atom = parseAtom();
+		while (position < text.size() && (text[position] == '*' || text[position] == '+' || text[position] == '?')) {
+			char op = text[position++];
+			int split = addNode(Node::Epsilon), join = addNode(Node::Epsilon);
+			nodes[split].out = atom.start;
+			nodes[split].out1 = join;
+			nodes[atom.end].out = op == '?' ? join : split;
+			atom = { op == '+' ? atom.start : split, join };
+		}
+		return atom;
+	}
+
+	Fragment parseAtom() {
+		char c = text[position++];
+		std::bitset<256> set;
+		switch (c) {
+		case '(': {
+			Fragment group = parseAlternation();
+			if (position >= text.size() || text[position] != ')')
+				throw std::runtime_error("missing ')'");
+			position++;
+			return group;
+		}
+		case '*': case '+': case '?':
+			throw std::runtime_error(std::string("nothing to repeat before '") + c + "'");
+		case '[':
+			set = parseClass();
+			break;
+		case '.':
+			set.set();
+			set.reset('\n');
+			break;
+		case '\\':
+			if (position >= text.size())
+				throw std::runtime_error("trailing backslash");
+			set = parseEscape(text[position++], ignoreCase);
+			break;
+		default:
+			set.set(static_cast<unsigned char>(c));
+			if (ignoreCase)
+				foldCase(set);
+			break;
+		}
+		int node = addNode(Node::Set), end = addNode(Node::Epsilon);
+		nodes[node].set = set;
+		nodes[node].out = end;
+		return { node, end };
+	}
+
+	// Adds the other case of every letter in set (-i). Sets are folded before they are
+	// negated, so [^a] matches neither 'a' nor 'A'.
+	static void foldCase(std::bitset<256>& set) {
+		for (int b = 'A'; b <= 'Z'; b++) {
+			if (set[b] || set[b + 32]) {
+				set.set(b);
+				set.set(b + 32);
+			}
+		}
+	}
+
+	static std::bitset<256> parseEscape(char c, bool ignoreCase) {
+		std::bitset<256> set;
+		char lower = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+		if (lower == 'd' || lower == 'w' || lower == 's') {
+			for (int b = 0; b < 256; b++) {
+				bool member = lower == 'd' ? std::isdigit(b) != 0 :
+					lower == 'w' ? (std::isalnum(b) != 0 || b == '_') : std::isspace(b) != 0;
+				set[b] = member;
+			}
+			if (ignoreCase)
+				foldCase(set);
+			if (c != lower) {
+				set.flip();
+				set.reset('\n');
+			}
+		}
+		else if (c == 't') {
+			set.set('\t');
+		}
+		else {
+			set.set(static_cast<unsigned char>(c));
+			if (ignoreCase)
+				foldCase(set);
+		}
+		return set;
+	}
+
+	std::bitset<256> parseClass() {
+		std::bitset<256> set;
+		bool negate = position < text.size() && text[position] == '^';
+		if (negate)
+			position++;
+		size_t first = position;
+		for (;;) {
+			if (position >= text.size())
+				throw std::runtime_error("missing ']'");
+			char c = text[position];
+			if (c == ']' && position > first)
+				break;
+			position++;
+			if (c == '\\' && position < text.size()) {
+				set |= parseEscape(text[position++], ignoreCase);
+				continue;
+			}
+			if (position + 1 < text.size() && text[position] == '-' && text[position + 1] != ']') {
+				unsigned char last = static_cast<unsigned char>(text[position + 1]);
+				for (int b = static_cast<unsigned char>(c); b <= last; b++)
+					set.set(b);
+				position += 2;
+				continue;
+			}
+			set.set(static_cast<unsigned char>(c));
+		}
+		position++;
+		if (ignoreCase)
+			foldCase(set);
+		if (negate) {
+			set.flip();
+			set.reset('\n');
+		}
+		return set;
+	}
+
+	// Adds the Set and Match nodes reachable from node through Epsilon nodes.
+	void addClosure(int node, std::vector<int>& result) {
+		if (node < 0 || visited[node] == generation)
+			return;
+		visited[node] = generation;
+		if (nodes[node].kind == Node::Epsilon) {
+			addClosure(nodes[node].out, result);
+			addClosure(nodes[node].out1, result);
+		}
+		else {
+			result.push_back(node);
+		}
+	}
+
+	int addState(std::vector<int>& set) {
+		std::sort(set.begin(), set.end());
+		auto found = stateIndex.find(set);
+		if (found != stateIndex.end())
+			return found->second;
+		unsigned char flag = set.empty() ? Dead : 0;
+		for (int node : set) {
+			if (nodes[node].kind == Node::Match)
+				flag |= Accepting;
+		}
+		int index = static_cast<int>(states.size());
+		states.push_back(set);
+		flags.push_back(flag);
+		table.resize(table.size() + 256, -1);
+		stateIndex.emplace(std::move(set), index);
+		return index;
+	}
+
+	// State 0 is the start state.
+	void resetCache() {
+		states.clear();
+		flags.clear();
+		table.clear();
+		stateIndex.clear();
+		visited.assign(nodes.size(), 0);
+		generation = 1;
+		std::vector<int> initial;
+		addClosure(start, initial);
+		addState(initial);
+
+		// Bytes that can begin a match, when there are few of them (and the empty string
+		// does not match, which would make every line match).
+		firstBytes.clear();
+		if (anchoredStart || flags[0] & Accepting)
+			return;
+		std::bitset<256> first;
+		for (int node : states[0])
+			first |= nodes[node].set;
+		if (first.count() > MaxFirstBytes)
+			return;
+		for (int b = 0; b < 256; b++) {
+			if (first[b])
+				firstBytes.push_back(static_cast<char>(b));
+		}
+	}
+
+	int transition(int state, unsigned char c) {
+		std::vector<int> next;
+		generation++;
+		for (int node : states[state]) {
+			if (nodes[node].kind == Node::Set && nodes[node].set[c])
+				addClosure(nodes[node].out, next);
+		}
+		if (!anchoredStart)
+			addClosure(start, next); // a match may also begin at the next byte
+		if (states.size() >= MaxStates) {
+			resetCache();
+			return addState(next);
+		}
+		int target = addState(next);
+		table[static_cast<size_t>(state) * 256 + c] = target;
+		return target;
+	}
+
+	bool anchoredStart, anchoredEnd, ignoreCase;
+	std::vector<Node> nodes;
+	int start;
+	std::string_view text;      // pattern being parsed (constructor only)
+	size_t position;
+
+	std::vector<std::vector<int>> states;
+	std::vector<unsigned char> flags;
+	std::vector<int> table;     // states x 256 bytes, -1 until computed
+	std::map<std::vector<int>, int> stateIndex;
+	std::vector<char> firstBytes;
+	std::vector<unsigned> visited;
+	unsigned generation;
+};
+
+struct SearchOptions {
+	bool ignoreCase = false;
+	bool fixed = false;         // the pattern is a literal string
+	bool lineNumbers = false;
+	bool filesOnly = false;
+	bool countOnly = false;
+	std::string namePattern;    // only search files whose name matches this glob
+};
+
+// "grep": searches a file, or every file below a directory, for lines that match a pattern.
+// Files are split between worker threads; each file's output is buffered and written in path
+// order as soon as the files before it are done, so results stream without interleaving.
+class ContentSearch {
+public:
+	// Throws std::runtime_error if the pattern is not a valid Regex.
+	ContentSearch(const std::string& pattern, const SearchOptions& options) : pattern(pattern), options(options) {
+		const char* const special = "\\^$.[]|()*+?";
+		literal = !options.ignoreCase && (options.fixed || pattern.find_first_of(special) == std::string::npos);
+		std::string expression;
+		for (char c : pattern) {
+			if (options.fixed && std::strchr(special, c))
+				expression += '\\';
+			expression += c;
+		}
+		compiled.reset(new Regex(options.fixed ? expression : pattern, options.ignoreCase));
+	}
+
+	// Searches path (a file or a directory tree). Matches below a directory are printed with
+	// their path relative to it, prefixed with the directory when pathGiven is set; a file
+	// searched on its own is not named, like grep does.
+	void run(const std::string& path, bool pathGiven) {
+		std::error_code ec;
+		if (!fs::is_directory(path, ec)) {
+			std::string output;
+			bool ok = searchFile(path, "", *compiled, output);
+			(ok ? std::cout : std::cerr) << output;
+			return;
+		}
+		ListOptions listOptions;
+		listOptions.recursive = true;
+		listOptions.type = 'f';
+		listOptions.namePattern = options.namePattern;
+		DirectoryWalker walker(listOptions);
+		std::vector<std::string> files;
+		if (!walker.collect(path, "location", files))
+			return;
+
+		std::string prefix;
+		if (pathGiven) {
+			prefix = path;
+			if (prefix.back() != '/' && prefix.back() != platform::PathSeparator)
+				prefix += platform::PathSeparator;
+		}
+		std::vector<std::string> results(files.size());
+		std::vector<char> done(files.size(), 0);  // 1 searched, 2 failed (results holds the error)
+		size_t nextToWrite = 0;
+		std::mutex outputMutex;
+		std::atomic<size_t> nextFile(0);
+		size_t threadCount = std::max(4u, std::thread::hardware_concurrency());
+		parallelFor(std::min(threadCount, files.size()), [&](size_t) {
+			Regex regex(*compiled);
+			for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+				std::string label = prefix + files[i];
+				bool ok = JobContext::cancelled() || searchFile(label, label, regex, results[i]);
+				std::lock_guard<std::mutex> lock(outputMutex);
+				done[i] = ok ? 1 : 2;
+				while (nextToWrite < files.size() && done[nextToWrite]) {
+					std::string& output = results[nextToWrite];
+					std::ostream& stream = done[nextToWrite] == 1 ? std::cout : std::cerr;
+					stream.write(output.data(), static_cast<std::streamsize>(output.size()));
+					std::string().swap(output);
+					nextToWrite++;
+				}
+			}
+		});
+	}
+
+private:
+	// Appends the report for one file to output (label is empty for a lone file). Returns
+	// false, with the error message in output, if the file cannot be read.
+	bool searchFile(const std::string& path, const std::string& label, Regex& regex, std::string& output) {
+		platform::MappedFile file;
+		std::string error;
+		if (!file.open(path, error)) {
+			output = "Error searching " + path + ": " + error + '\n';
+			return false;
+		}
+		const char* begin = file.data();
+		const char* end = begin + file.size();
+		bool binary = memchr(begin, 0, std::min<size_t>(file.size(), 8192)) != nullptr;
+		bool stopAtFirst = options.filesOnly || (binary && !options.countOnly);
+		size_t count = 0, lineNumber = 1;
+		const char* counted = begin;
+		auto onLine = [&](const char* line, const char* lineEnd) {
+			count++;
+			if (stopAtFirst || options.countOnly)
+				return !stopAtFirst;
+			if (!label.empty()) {
+				output += label;
+				output += ':';
+			}
+			if (options.lineNumbers) {
+				lineNumber += static_cast<size_t>(std::count(counted, line, '\n'));
+				counted = line;
+				output += std::to_string(lineNumber);
+				output += ':';
+			}
+			output.append(line, lineEnd);
+			output += '\n';
+			return true;
+		};
+		if (literal)
+			scanLiteral(begin, end, onLine);
+		else
+			regex.scan(begin, end, onLine);
+
+		if (options.countOnly) {
+			if (!label.empty())
+				output += label + ':';
+			output += std::to_string(count) + '\n';
+		}
+		else if (count && options.filesOnly) {
+			output += (label.empty() ? path : label) + '\n';
+		}
+		else if (count && binary) {
+			output += "Binary file " + (label.empty() ? path : label) + " matches\n";
+		}
+		return true;
+	}
+
+	// Finds candidates with memchr on the first byte of the pattern (memchr is vectorized by
+	// the C library) and confirms them with memcmp; a matching line is reported once and the
+	// search continues after it.
+	template <class OnLine>
+	void scanLiteral(const char* begin, const char* end, OnLine onLine) {
+		size_t length = pattern.size();
+		if (length == 0) {
+			scanAllLines(begin, end, onLine);
+			return;
+		}
+		const char* p = begin;
+		while (static_cast<size_t>(end - p) >= length) {
+			const char* candidate = static_cast<const char*>(memchr(p, pattern[0], static_cast<size_t>(end - p) - length + 1));
+			if (!candidate)
+				return;
+			if (memcmp(candidate + 1, pattern.data() + 1, length - 1) != 0) {
+				p = candidate + 1;
+				continue;
+			}
+			const char* line = candidate;
+			while (line > begin && line[-1] != '\n')
+				line--;
+			const char* lineEnd = static_cast<const char*>(memchr(candidate, '\n', static_cast<size_t>(end - candidate)));
+			if (!lineEnd)
+				lineEnd = end;
+			if (!onLine(line, lineEnd) || lineEnd == end)
+				return;
+			p = lineEnd + 1;
+		}
+	}
+
+	// The empty pattern matches every line.
+	template <class OnLine>
+	static void scanAllLines(const char* begin, const char* end, OnLine onLine) {
+		const char* line = begin;
+		while (line < end) {
+			const char* lineEnd = static_cast<const char*>(memchr(line, '\n', static_cast<size_t>(end - line)));
+			if (!lineEnd)
+				lineEnd = end;
+			if (!onLine(line, lineEnd))
+				return;
+			line = lineEnd + 1;
+		}
+	}
+
+	std::string pattern;
+	SearchOptions options;
+	bool literal;
+	std::unique_ptr<Regex> compiled;
+};
+
+//------------------------------------------------------------
+// Disk Usage
+//------------------------------------------------------------
+
+// "du": size and file count of a directory tree, traversed with a TreeTraversal. What each
+// directory holds directly (file bytes, file count, subdirectory names) is kept in du.cache,
+// keyed by the directory's path, identity and last write time; adding, removing or renaming an
+// entry changes the write time. On a rerun an unchanged directory is only stat'ed: its own
+// totals come from the cache and its subdirectories are visited without reading it. A file
+// rewritten in place does not touch its directory, so "du -f" rescans everything.
+class DiskUsage {
+public:
+	static constexpr const char* CachePath = "du.cache";
+	static constexpr const char* CacheHeader = "# Mini-Shell du cache v1";
+
+	struct Totals {
+		unsigned long long bytes = 0;
+		unsigned long long files = 0;
+		unsigned long long directories = 0;
+	};
+
+	DiskUsage() : cacheChanged(false), readCount(0), cachedCount(0) {}
+
+	// Prints the totals of path and of its subdirectories down to depth levels below it.
+	bool run(const std::string& path, int depth, bool fullScan) {
+		auto start = std::chrono::steady_clock::now();
+		std::error_code ec;
+		root = fs::absolute(path, ec).lexically_normal().string();
+		while (root.size() > 1 && (root.back() == '/' || root.back() == platform::PathSeparator) && root[root.size() - 2] != ':')
+			root.pop_back();
+		if (ec || !fs::is_directory(root, ec)) {
+			std::cerr << "Error: " << path << " is not a directory" << '\n';
+			return false;
+		}
+		this->fullScan = fullScan;
+		loadCache();
+		now = static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count());
+
+		TreeTraversal traversal(TreeTraversal::defaultThreads());
+		results.clear();
+		results.resize(traversal.threadCount());
+		traversal.run({ root }, [this](size_t worker, const std::string& directory, std::vector<std::string>& next) {
+			visit(worker, directory, next);
+		});
+
+		std::unordered_map<std::string, Entry> visited;
+		for (auto& list : results) {
+			for (auto& result : list)
+				visited.emplace(std::move(result.first), std::move(result.second));
+		}
+		if (!visited.count(root))
+			return false; // reported by visit()
+		std::unordered_map<std::string, Totals> totals = sum(visited);
+		updateCache(visited);
+		saveCache();
+
+		std::vector<std::string> shown;
+		for (const auto& entry : visited) {
+			if (levelsBelowRoot(entry.first) <= depth)
+				shown.push_back(entry.first);
+		}
+		std::sort(shown.begin(), shown.end());
+		for (const auto& directory : shown) {
+			const Totals& t = totals[directory];
+			std::string name = path + directory.substr(root.size());
+			std::cout << std::setw(10) << formatSize(t.bytes) << "  " << std::setw(9) << t.files << " files  " << name << '\n';
+		}
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		std::cout << totals[root].directories << " directories, " << readCount << " read, "
+			<< cachedCount << " from the cache, in " << milliseconds << " ms" << '\n';
+		return true;
+	}
+
+private:
+	struct Entry {
+		unsigned long long id = 0;
+		long long mtime = 0;            // 0 never matches, so the directory is read again
+		unsigned long long bytes = 0;   // files directly in the directory
+		unsigned long long files = 0;
+		std::vector<std::string> subdirectories;
+	};
+
+	// A directory written to within this window of the scan may change again within the same
+	// timestamp tick, so it is cached without a write time.
+	static const long long RacyWindow = 2000000000LL;
+
+	void visit(size_t worker, const std::string& directory, std::vector<std::string>& next) {
+		Entry entry;
+		if (!platform::statDirectory(directory, entry.id, entry.mtime)) {
+			report("Error reading " + directory);
+			return;
+		}
+		auto cached = fullScan ? cache.end() : cache.find(directory);
+		if (cached != cache.end() && entry.mtime != 0 && cached->second.mtime == entry.mtime && cached->second.id == entry.id) {
+			entry = cached->second;
+			cachedCount++;
+		}
+		else {
+			std::vector<platform::DirectoryEntry> entries;
+			std::string error;
+			if (!platform::readDirectory(directory, true, entries, error)) {
+				report("Error reading " + directory + ": " + error);
+				return;
+			}
+			for (auto& item : entries) {
+				if (item.type == platform::DirectoryEntry::File) {
+					entry.bytes += item.size;
+					entry.files++;
+				}
+				else if (item.type == platform::DirectoryEntry::Directory) {
+					entry.subdirectories.push_back(std::move(item.name));
+				}
+			}
+			if (now - entry.mtime < RacyWindow)
+				entry.mtime = 0;
+			readCount++;
+		}
+		for (const auto& name : entry.subdirectories)
+			next.push_back(join(directory, name));
+		results[worker].emplace_back(directory, std::move(entry));
+	}
+
+	// Totals of every visited directory, children first (a child's path is longer than its parent's).
+	static std::unordered_map<std::string, Totals> sum(const std::unordered_map<std::string, Entry>& visited) {
+		std::vector<const std::string*> order;
+		for (const auto& entry : visited)
+			order.push_back(&entry.first);
+		std::sort(order.begin(), order.end(), [](const std::string* a, const std::string* b) { return a->size() > b->size(); });
+		std::unordered_map<std::string, Totals> totals;
+		for (const std::string* directory : order) {
+			const Entry& entry = visited.at(*directory);
+			Totals t;
+			t.bytes = entry.bytes;
+			t.files = entry.files;
+			t.directories = 1;
+			for (const auto& name : entry.subdirectories) {
+				auto child = totals.find(join(*directory, name));
+				if (child != totals.end()) {
+					t.bytes += child->second.bytes;
+					t.files += child->second.files;
+					t.directories += child->second.directories;
+				}
+			}
+			totals[*directory] = t;
+		}
+		return totals;
+	}
+
+	// Replace what the cache holds below root with what was just visited.
+	void updateCache(std::unordered_map<std::string, Entry>& visited) {
+		for (auto it = cache.begin(); it != cache.end();) {
+			if (isBelowRoot(it->first) && !visited.count(it->first)) {
+				it = cache.erase(it);
+				cacheChanged = true;
+			}
+			else {
+				++it;
+			}
+		}
+		if (readCount)
+			cacheChanged = true;
+		for (auto& entry : visited)
+			cache[entry.first] = std::move(entry.second);
+	}
+
+	// Format: a header line, then one tab separated line per directory:
+	//   path  id  mtime  bytes  files  subdirectory...
+	void loadCache() {
+		cache.clear();
+		std::ifstream in(CachePath);
+		std::string line;
+		if (!in || !std::getline(in, line) || line != CacheHeader)
+			return;
+		try {
+			while (std::getline(in, line)) {
+				std::vector<std::string> fields;
+				size_t start = 0;
+				for (size_t tab; (tab = line.find('\t', start)) != std::string::npos; start = tab + 1)
+					fields.push_back(line.substr(start, tab - start));
+				fields.push_back(line.substr(start));
+				if (fields.size() < 5)
+					continue;
+				Entry entry;
+				entry.id = std::stoull(fields[1]);
+				entry.mtime = std::stoll(fields[2]);
+				entry.bytes = std::stoull(fields[3]);
+				entry.files = std::stoull(fields[4]);
+				entry.subdirectories.assign(fields.begin() + 5, fields.end());
+				cache[fields[0]] = std::move(entry);
+			}
+		}
+		catch (const std::exception&) {
+			cache.clear(); // unreadable cache: scan everything
+		}
+	}
+
+	// Written to a temporary file and renamed over the old one. Directories whose names
+	// contain tabs or newlines are left out and simply read every time.
+	void saveCache() {
+		if (!cacheChanged)
+			return;
+		try {
+			std::string temporary = std::string(CachePath) + ".tmp";
+			{
+				std::ofstream out(temporary, std::ios::trunc);
+				out << CacheHeader << '\n';
+				for (const auto& entry : cache) {
+					const Entry& e = entry.second;
+					bool storable = isStorable(entry.first);
+					for (const auto& name : e.subdirectories)
+						storable = storable && isStorable(name);
+					if (!storable)
+						continue;
+					out << entry.first << '\t' << e.id << '\t' << e.mtime << '\t' << e.bytes << '\t' << e.files;
+					for (const auto& name : e.subdirectories)
+						out << '\t' << name;
+					out << '\n';
+				}
+				if (!out)
+					throw std::runtime_error("cannot write " + temporary);
+			}
+			fs::rename(temporary, CachePath);
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Warning: du cache not saved: " << e.what() << '\n';
+		}
+	}
+
+	static bool isStorable(const std::string& text) {
+		return text.find_first_of("\t\n") == std::string::npos;
+	}
+
+	bool isBelowRoot(const std::string& directory) const {
+		if (directory.compare(0, root.size(), root) != 0)
+			return false;
+		return directory.size() == root.size() || directory[root.size()] == platform::PathSeparator || root.back() == platform::PathSeparator;
+	}
+
+	int levelsBelowRoot(const std::string& directory) const {
+		if (directory.size() == root.size())
+			return 0;
+		int levels = 1;
+		for (size_t i = root.size() + 1; i < directory.size(); i++) {
+			if (directory[i] == platform::PathSeparator)
+				levels++;
+		}
+		return levels;
+	}
+
+	static std::string join(const std::string& directory, const std::string& name) {
+		if (!directory.empty() && directory.back() == platform::PathSeparator)
+			return directory + name;
+		return directory + platform::PathSeparator + name;
+	}
+
+	static std::string formatSize(unsigned long long bytes) {
+		const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+		double value = static_cast<double>(bytes);
+		size_t unit = 0;
+		while (value >= 1024 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+			value /= 1024;
+			unit++;
+		}
+		std::ostringstream text;
+		text << std::fixed << std::setprecision(unit ? 1 : 0) << value << ' ' << units[unit];
+		return text.str();
+	}
+
+	void report(const std::string& message) {
+		std::lock_guard<std::mutex> lock(reportMutex);
+		std::cerr << message << '\n';
+	}
+
+	std::string root;
+	bool fullScan = false;
+	long long now = 0;
+	std::unordered_map<std::string, Entry> cache;    // read-only while the traversal runs
+	bool cacheChanged;
+	std::vector<std::vector<std::pair<std::string, Entry>>> results; // per worker
+	std::atomic<size_t> readCount;
+	std::atomic<size_t> cachedCount;
+	std::mutex reportMutex;
+};
+
+//------------------------------------------------------------
+// Processes
+//------------------------------------------------------------
+
+typedef std::vector<std::string> ProcessArgs;
+
+// "a | b | c" started as one unit: each stage's stdout feeds the next stage's stdin through
+// a pipe, without going through the shell or a file.
+class ProcessPipeline {
+public:
+	explicit ProcessPipeline(const std::vector<ProcessArgs>& stages) : stages(stages), waited(0), startedAll(false) {}
+	~ProcessPipeline() { wait(); }
+
+	// Splits tokens [first, last) at "|" tokens. Returns false if a stage is empty.
+	static bool parse(const Tokens& tokens, size_t first, size_t last, std::vector<ProcessArgs>& stages) {
+		stages.assign(1, ProcessArgs());
+		for (size_t i = first; i < last; i++) {
+			if (tokens[i] == "|") {
+				if (stages.back().empty())
+					return false;
+				stages.emplace_back();
+			}
+			else {
+				stages.back().emplace_back(tokens[i]);
+			}
+		}
+		return !stages.back().empty();
+	}
+
+	// stdio.in feeds the first stage, stdio.out receives the last stage's output and stdio.err
+	// the errors of every stage. If a stage cannot be started, the ones before it see the end
+	// of their output pipe and finish; wait() collects them.
+	bool start(const platform::StdioHandles& stdio, std::string& error) {
+		platform::FileHandle input = stdio.in;
+		bool ok = true;
+		for (size_t i = 0; i < stages.size() && ok; i++) {
+			platform::StdioHandles handles = stdio;
+			handles.in = input;
+			platform::FileHandle readEnd = platform::InvalidFile, writeEnd = platform::InvalidFile;
+			if (i + 1 < stages.size()) {
+				ok = platform::createPipe(readEnd, writeEnd);
+				if (!ok)
+					error = "cannot create a pipe";
+				handles.out = writeEnd;
+			}
+			platform::ProcessHandle process;
+			if (ok && platform::startProcess(stages[i], handles, process, error))
+				processes.push_back(process);
+			else if (ok)
+				error = stages[i][0] + ": " + error;
+			ok = ok && processes.size() == i + 1;
+			if (writeEnd != platform::InvalidFile)
+				platform::closeFile(writeEnd);
+			if (input != stdio.in)
+				platform::closeFile(input);
+			input = readEnd;
+		}
+		if (input != stdio.in && input != platform::InvalidFile)
+			platform::closeFile(input);
+		startedAll = ok;
+		return ok;
+	}
+
+	// Waits for every stage. Returns the exit code of the last one, or -1 if it did not start.
+	int wait() {
+		int code = -1;
+		for (size_t i = 0; i < processes.size(); i++) {
+			int stageCode = platform::waitProcess(processes[i]);
+			std::lock_guard<std::mutex> lock(mutex);
+			waited = i + 1;
+			if (i + 1 == stages.size())
+				code = stageCode;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		processes.clear();
+		waited = 0;
+		return startedAll ? code : -1;
+	}
+
+	// Stops the stages that have not been waited for yet. Called from another thread while
+	// wait() blocks, when the background job running the pipeline is killed.
+	void terminate() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = waited; i < processes.size(); i++)
+			platform::terminateProcess(processes[i]);
+	}
+
+private:
+	std::vector<ProcessArgs> stages;
+	std::vector<platform::ProcessHandle> processes;
+	size_t waited;              // processes[0..waited) have been waited for
+	std::mutex mutex;           // guards processes and waited against terminate()
+	bool startedAll;
+};
+
+void readAll(platform::FileHandle file, std::string& text) {
+	char buffer[64 * 1024];
+	for (long long count; (count = platform::readFile(file, buffer, sizeof(buffer))) > 0;)
+		text.append(buffer, static_cast<size_t>(count));
+}
+
+// Runs a pipeline with its stdout and stderr captured (stdin is the null device). Returns
+// the exit code of the last stage, or -1 with error set if the pipeline could not be started.
+int runCaptured(const std::vector<ProcessArgs>& stages, std::string& output, std::string& errors, std::string& error) {
+	platform::FileHandle outRead, outWrite, errRead, errWrite;
+	if (!platform::createPipe(outRead, outWrite)) {
+		error = "cannot create a pipe";
+		return -1;
+	}
+	if (!platform::createPipe(errRead, errWrite)) {
+		platform::closeFile(outRead);
+		platform::closeFile(outWrite);
+		error = "cannot create a pipe";
+		return -1;
+	}
+	platform::StdioHandles stdio;
+	stdio.in = platform::openNullDevice();
+	stdio.out = outWrite;
+	stdio.err = errWrite;
+	ProcessPipeline pipeline(stages);
+	bool started = pipeline.start(stdio, error);
+	JobContext::CancelHandler stop([&pipeline]() { pipeline.terminate(); });
+	if (stdio.in != platform::InvalidFile)
+		platform::closeFile(stdio.in);
+	platform::closeFile(outWrite);
+	platform::closeFile(errWrite);
+	// Both pipes are drained at once, so a child blocked on a full stderr pipe cannot stall stdout.
+	std::thread errorReader([&]() { readAll(errRead, errors); });
+	readAll(outRead, output);
+	errorReader.join();
+	platform::closeFile(outRead);
+	platform::closeFile(errRead);
+	int code = pipeline.wait();
+	return started ? code : -1;
+}
+
+// Split the arguments after the command ("a, b,c -all") into module names and the -all flag.
+void parseModuleList(const Tokens& tokens, bool& allFlag, std::vector<std::string>& moduleNames) {
+	allFlag = false;
+	for (size_t i = 1; i < tokens.size(); i++) {
+		std::string_view mod = tokens[i];
+		if (mod.empty() || mod == ",")
+			continue;
+		if (mod == "-all") {
+			allFlag = true;
+		}
+		else if (mod[0] != '-') {
+			// Other flags (starting with '-') are skipped for now
+			moduleNames.emplace_back(mod);
+		}
+	}
+}
+
+// Shared body of load/delete: "-all" or a comma separated list of modules.
+void runModuleListCommand(const Tokens& tokens, const std::string& usage,
+	void (ModuleManager::*single)(const std::string&), void (ModuleManager::*all)()) {
+	bool allFlag = false;
+	std::vector<std::string> moduleNames;
+	parseModuleList(tokens, allFlag, moduleNames);
+	ModuleManager& manager = ModuleManager::getInstance();
+	if (allFlag) {
+		if (all) {
+			(manager.*all)();
+		}
+		else {
+			std::cerr << "Error: " << usage << " -all is not supported." << '\n';
+		}
+	}
+	else if (moduleNames.empty()) {
+		std::cerr << "ERROR: " << usage << " <module_name>[, module_name...]" << '\n';
+	}
+	else {
+		for (const auto& mod : moduleNames) {
+			(manager.*single)(mod);
+		}
+	}
+}
+
+// Shared body of install/update, which handle the whole list at once so that the transfers
+// can run concurrently.
+void runModuleBatchCommand(const Tokens& tokens, const std::string& usage,
+	void (ModuleManager::*batch)(const std::vector<std::string>&, bool)) {
+	bool allFlag = false;
+	std::vector<std::string> moduleNames;
+	parseModuleList(tokens, allFlag, moduleNames);
+	if (!allFlag && moduleNames.empty()) {
+		std::cerr << "ERROR: " << usage << " <module_name>[, module_name...] | -all" << '\n';
+		return;
+	}
+	(ModuleManager::getInstance().*batch)(moduleNames, allFlag);
+}
+
+// "source" shows where modules are installed from, "source <url|folder>" changes it.
+void sourceCommand(const Tokens& tokens) {
+	if (tokens.size() < 2) {
+		std::cout << "Module source: " << ModuleRepository::configuredSource() << '\n';
+		return;
+	}
+	std::string source(tokens[1]);
+	if (source == "default")
+		source.clear();
+	while (source.size() > 1 && (source.back() == '/' || source.back() == '\\'))
+		source.pop_back();
+	if (!ModuleRepository::configureSource(source)) {
+		std::cerr << "Error: cannot save " << ModuleRepository::SourceConfigPath << '\n';
+		return;
+	}
+	std::cout << "Module source: " << ModuleRepository::configuredSource() << '\n';
+}
+
+void listDirectory(const std::string& path, const std::string& what, const ListOptions& options) {
+	try {
+		DirectoryWalker walker(options);
+		walker.run(path, what);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error listing " << what << ": " << e.what() << '\n';
+	}
+}
+
+void listCommand(const Tokens& tokens) {
+	// Enhanced ls command: list modules or directory contents
+	ListOptions options;
+	std::string param;
+	for (size_t i = 1; i < tokens.size(); i++) {
+		std::string_view token = tokens[i];
+		if (token == "-R" || token == "-r") {
+			options.recursive = true;
+		}
+		else if (token == "-name" || token == "-type" || token == "-size" || token == "-mtime" || token == "-sort") {
+			if (i + 1 >= tokens.size() || !options.set(token, tokens[i + 1])) {
+				std::cerr << "ERROR: invalid or missing value for ls " << token << '\n';
+				return;
+			}
+			i++;
+		}
+		else if (token.size() > 1 && token[0] == '-') {
+			std::cerr << "ERROR: unknown ls option " << token << '\n';
+			return;
+		}
+		else if (param.empty()) {
+			param = std::string(token);
+		}
+		else {
+			std::cerr << "ERROR: ls takes a single location" << '\n';
+			return;
+		}
+	}
+	if (param.empty()) {
+		// No parameter provided: list current directory
+		std::string path = fs::current_path().string();
+		std::cout << "Listing current directory: " << path << '\n';
+		listDirectory(path, "current directory", options);
+		return;
+	}
+	if (param.rfind("drive:", 0) == 0 || param.rfind("d:", 0) == 0) {
+		std::string driveLetter = param.substr(param.rfind("drive:", 0) == 0 ? 6 : 2);
+		std::cout << "Listing drive " << driveLetter << ":" << '\n';
+		listDirectory(driveLetter + ":\\", "drive", options);
+	}
+	else if (param.rfind("loc:", 0) == 0) {
+		std::string location = param.substr(4);
+		// Remove surrounding quotes if any
+		if (location.size() >= 2 && ((location.front() == '\'' && location.back() == '\'') ||
+			(location.front() == '"' && location.back() == '"'))) {
+			location = location.substr(1, location.size() - 2);
+		}
+		std::cout << "Listing location: " << location << '\n';
+		listDirectory(location, "location", options);
+	}
+	else if (param == "mods" || param == "modules" || param == "ext") {
+		if (fs::exists("modules") && !fs::is_empty("modules")) {
+			for (const auto& entry : fs::directory_iterator("modules")) {
+				if (entry.is_directory()) {
+					std::cout << "- " << entry.path().filename().string() << '\n';
+				}
+			}
+		}
+		else {
+			std::cerr << "Error: No available module" << '\n';
+		}
+	}
+	else {
+		// Treat parameter as a directory path
+		std::cout << "Listing location: " << param << '\n';
+		listDirectory(param, "location", options);
+	}
+}
+
+void grepCommand(const Tokens& tokens) {
+	SearchOptions options;
+	std::vector<std::string> operands;
+	for (size_t i = 1; i < tokens.size(); i++) {
+		std::string_view token = tokens[i];
+		if (!operands.empty() || token.size() < 2 || token[0] != '-') {
+			operands.emplace_back(token);
+		}
+		else if (token == "-name") {
+			if (i + 1 >= tokens.size()) {
+				std::cerr << "ERROR: missing value for grep -name" << '\n';
+				return;
+			}
+			options.namePattern = std::string(tokens[++i]);
+		}
+		else {
+			for (char flag : token.substr(1)) {
+				switch (flag) {
+				case 'i': options.ignoreCase = true; break;
+				case 'F': options.fixed = true; break;
+				case 'n': options.lineNumbers = true; break;
+				case 'l': options.filesOnly = true; break;
+				case 'c': options.countOnly = true; break;
+				default:
+					std::cerr << "ERROR: unknown grep option -" << flag << '\n';
+					return;
+				}
+			}
+		}
+	}
+	if (operands.empty() || operands.size() > 2) {
+		std::cerr << "ERROR: grep [-i] [-F] [-n] [-l] [-c] [-name <glob>] <pattern> [path]" << '\n';
+		return;
+	}
+	try {
+		ContentSearch search(operands[0], options);
+		search.run(operands.size() > 1 ? operands[1] : ".", operands.size() > 1);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error in grep pattern: " << e.what() << '\n';
+	}
+}
+
+void diskUsageCommand(const Tokens& tokens) {
+	int depth = 0;
+	bool fullScan = false;
+	std::string path;
+	for (size_t i = 1; i < tokens.size(); i++) {
+		std::string_view token = tokens[i];
+		if (token == "-f") {
+			fullScan = true;
+		}
+		else if (token == "-d") {
+			if (i + 1 >= tokens.size()) {
+				std::cerr << "ERROR: missing value for du -d" << '\n';
+				return;
+			}
+			depth = std::max(0, std::atoi(std::string(tokens[++i]).c_str()));
+		}
+		else if (path.empty()) {
+			path = std::string(token);
+		}
+		else {
+			std::cerr << "ERROR: du [-d depth] [-f] [path]" << '\n';
+			return;
+		}
+	}
+	try {
+		DiskUsage usage;
+		usage.run(path.empty() ? "." : path, depth, fullScan);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error in du: " << e.what() << '\n';
+	}
+}
+
+// "run <program> [args] [| <program> [args]]...": runs in the foreground with the shell's
+// console. When the shell reads commands from a pipe or file, the program gets an empty
+// stdin so it cannot consume the rest of the script. In a background job the output is
+// captured into the job instead, and killing the job stops the program.
+void runForeground(const std::vector<ProcessArgs>& stages) {
+	if (JobContext::current()) {
+		std::string output, errors, error;
+		int code = runCaptured(stages, output, errors, error);
+		std::cout << output;
+		std::cerr << errors;
+		if (code == -1 && !error.empty())
+			std::cerr << "Failed to execute: " << error << '\n';
+		else if (code != 0)
+			std::cerr << stages.back()[0] << " exited with code " << code << '\n';
+		return;
+	}
+	std::cout.flush();
+	platform::StdioHandles stdio;
+	if (!platform::stdinIsTerminal())
+		stdio.in = platform::openNullDevice();
+	ProcessPipeline pipeline(stages);
+	std::string error;
+	bool started = pipeline.start(stdio, error);
+	if (stdio.in != platform::InvalidFile)
+		platform::closeFile(stdio.in);
+	int code = pipeline.wait();
+	if (!started) {
+		// Something that is not a program (a document, a folder) is opened with its
+		// associated application, as run always did.
+		if (stages.size() == 1 && stages[0].size() == 1 && platform::openPath(stages[0][0]))
+			return;
+		std::cerr << "Failed to execute: " << error << '\n';
+	}
+	else if (code != 0) {
+		std::cerr << stages.back()[0] << " exited with code " << code << '\n';
+	}
+}
+
+// "run -j N <command>, <command>, ...": up to N commands (each may be a pipeline) run at a
+// time with their output captured. Each command's output is printed in order as soon as the
+// commands before it have finished, so outputs never interleave.
+void runBatch(const std::vector<std::vector<ProcessArgs>>& batch, size_t jobs) {
+	struct Result {
+		std::string output, errors, error;
+		int code = -1;
+		bool done = false;
+	};
+	auto start = std::chrono::steady_clock::now();
+	std::cout.flush();
+	std::vector<Result> results(batch.size());
+	std::mutex outputMutex;
+	size_t nextToWrite = 0, failed = 0;
+	parallelFor(batch.size(), [&](size_t i) {
+		Result& result = results[i];
+		result.code = runCaptured(batch[i], result.output, result.errors, result.error);
+		std::lock_guard<std::mutex> lock(outputMutex);
+		result.done = true;
+		for (; nextToWrite < results.size() && results[nextToWrite].done; nextToWrite++) {
+			Result& next = results[nextToWrite];
+			std::cout << next.output;
+			std::cout.flush();
+			std::cerr << next.errors;
+			if (next.code == -1 && !next.error.empty())
+				std::cerr << "Failed to execute: " << next.error << '\n';
+			else if (next.code != 0)
+				std::cerr << batch[nextToWrite].back()[0] << " exited with code " << next.code << '\n';
+			failed += next.code != 0;
+			next = Result();
+		}
+	}, jobs);
+	double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Ran " << batch.size() << " commands (" << failed << " failed) in " << milliseconds << " ms" << '\n';
+}
+
+void runCommand(const Tokens& tokens) {
+	const char* const usage = "ERROR: run [-j N] <program> [args] [| <program> [args]]... [, <command>]... or run -j N @<file>";
+	size_t first = 1, jobs = 0;
+	if (tokens.size() > 2 && tokens[1] == "-j") {
+		jobs = static_cast<size_t>(std::max(0, std::atoi(std::string(tokens[2]).c_str())));
+		if (jobs == 0) {
+			std::cerr << "ERROR: run -j needs a positive job count" << '\n';
+			return;
+		}
+		first = 3;
+	}
+	std::vector<std::vector<ProcessArgs>> batch;
+	std::vector<ProcessArgs> stages;
+	if (first + 1 == tokens.size() && tokens[first].size() > 1 && tokens[first][0] == '@') {
+		// One command per line; empty lines and lines starting with '#' are skipped.
+		std::string path(tokens[first].substr(1));
+		std::ifstream file(path);
+		if (!file) {
+			std::cerr << "Error: cannot open " << path << '\n';
+			return;
+		}
+		std::string line;
+		Tokens lineTokens;
+		for (size_t number = 1; std::getline(file, line); number++) {
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			CommandTokenizer::tokenize(line, lineTokens);
+			if (lineTokens.empty() || lineTokens[0][0] == '#')
+				continue;
+			if (!ProcessPipeline::parse(lineTokens, 0, lineTokens.size(), stages)) {
+				std::cerr << "Error: " << path << ":" << number << ": empty command in pipeline" << '\n';
+				return;
+			}
+			batch.push_back(stages);
+		}
+	}
+	else {
+		// Commands are separated by "," tokens.
+		for (size_t begin = first; begin < tokens.size();) {
+			size_t end = begin;
+			while (end < tokens.size() && tokens[end] != ",")
+				end++;
+			if (!ProcessPipeline::parse(tokens, begin, end, stages)) {
+				std::cerr << usage << '\n';
+				return;
+			}
+			batch.push_back(stages);
+			begin = end + 1;
+		}
+	}
+	if (batch.empty()) {
+		std::cerr << usage << '\n';
+		return;
+	}
+	if (batch.size() == 1 && jobs == 0)
+		runForeground(batch[0]);
+	else
+		runBatch(batch, jobs ? jobs : 1);
+}
+
+bool isVersionFlag(std::string_view arg) {
+	return arg == "-v" || arg == "v" || arg == "version";
+}
+
+// "<module> [args]" for a module found in the registry.
+void runModuleCommand(const CommandRegistry::Entry& entry, const Tokens& tokens) {
+	if (tokens.size() >= 2 && isVersionFlag(tokens[1])) {
+		std::cout << entry.name << " Version: " << entry.module->getVersion() << '\n';
+	}
+	else {
+		ModuleManager::getInstance().executeModule(entry.module, tokens, 1);
+	}
+}
+
+// A "|" token followed by a module name separates pipeline stages. Anything else, such as
+// the bars of "math | x - 1 |", stays an argument.
+bool isPipeSeparator(const Tokens& tokens, size_t i) {
+	if (tokens[i] != "|" || i + 1 >= tokens.size())
+		return false;
+	const CommandRegistry::Entry* entry = CommandRegistry::getInstance().find(tokens[i + 1]);
+	return entry && entry->module;
+}
+
+bool isModulePipeline(const Tokens& tokens) {
+	for (size_t i = 1; i < tokens.size(); i++) {
+		if (isPipeSeparator(tokens, i))
+			return true;
+	}
+	return false;
+}
+
+// "<module> [args] | <module> [args] | ...": resolves the stages and runs them with
+// runPipelineStages(), in a module worker while "isolate" is on.
+void runModulePipeline(const Tokens& tokens) {
+	std::vector<const CommandRegistry::Entry*> entries;
+	std::vector<size_t> firsts, ends;   // argument range of each stage in tokens
+	for (size_t i = 0; i <= tokens.size(); i++) {
+		if (i < tokens.size() && !(i > 0 && isPipeSeparator(tokens, i)))
+			continue;
+		size_t begin = entries.empty() ? 0 : ends.back() + 1;
+		const CommandRegistry::Entry* entry = CommandRegistry::getInstance().find(tokens[begin]);
+		if (!entry || !entry->module) {
+			std::cerr << "Error: pipeline stage '" << tokens[begin] << "' is not a module" << '\n';
+			return;
+		}
+		entries.push_back(entry);
+		firsts.push_back(begin + 1);
+		ends.push_back(i);
+	}
+
+	ModuleWorkers& workers = ModuleWorkers::getInstance();
+	if (workers.isEnabled()) {
+		std::vector<WorkerCall> calls;
+		for (size_t s = 0; s < entries.size(); s++)
+			calls.push_back(WorkerCall{ &entries[s]->module->getRecord(), entries[s]->name, tokens.data() + firsts[s], ends[s] - firsts[s] });
+		auto start = std::chrono::steady_clock::now();
+		TraceSpan span("runModulePipeline (isolated)");
+		if (workers.execute(calls)) {
+			// The stages overlap, so each is recorded with the time of the whole pipeline.
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			for (const CommandRegistry::Entry* entry : entries)
+				CommandStats::getInstance().record(CommandStats::ModuleCall, entry->module->getRecord().name, entry->module->getVersion(), elapsed);
+			return;
+		}
+	}
+
+	ModuleManager& manager = ModuleManager::getInstance();
+	std::vector<PipelinePart> parts;
+	for (size_t s = 0; s < entries.size(); s++) {
+		std::shared_ptr<LoadedModule> loaded = manager.acquire(entries[s]->module);
+		if (!loaded)
+			return;
+		parts.push_back(PipelinePart{ entries[s]->name, entries[s]->module->getRecord().name, loaded,
+			Tokens(tokens.begin() + firsts[s], tokens.begin() + ends[s]) });
+	}
+	runPipelineStages(parts, manager.getHostServices());
+}
+
+void watchCommand(const Tokens& tokens) {
+	ModuleManager& manager = ModuleManager::getInstance();
+	if (tokens.size() >= 2 && tokens[1] == "on") {
+		if (manager.startWatching())
+			std::cout << "Watching modules for changes" << '\n';
+	}
+	else if (tokens.size() >= 2 && tokens[1] == "off") {
+		manager.stopWatching();
+		std::cout << "Module watch stopped" << '\n';
+	}
+	else if (tokens.size() == 1) {
+		std::cout << "Module watch is " << (manager.isWatching() ? "on" : "off") << '\n';
+	}
+	else {
+		std::cerr << "ERROR: watch [on|off]" << '\n';
+	}
+}
+
+// Lines that do not start with a known command are read as a comma separated list of
+// module names, optionally followed by a version flag (e.g. "math, colstats -v").
+void runModuleList(const Tokens& tokens) {
+	bool versionFlag = false;
+	std::vector<std::string_view> moduleNames;
+	for (std::string_view token : tokens) {
+		if (token == ",")
+			continue;
+		if (isVersionFlag(token))
+			versionFlag = true;
+		else
+			moduleNames.push_back(token);
+	}
+	if (moduleNames.empty()) {
+		std::cerr << "ERROR: Invalid module command." << '\n';
+		return;
+	}
+	Tokens moduleTokens(1);
+	if (versionFlag)
+		moduleTokens.push_back("-v");
+	for (std::string_view mod : moduleNames) {
+		const CommandRegistry::Entry* entry = CommandRegistry::getInstance().find(mod);
+		if (!entry || !entry->module) {
+			std::cerr << "Error: Module not installed: " << mod << '\n';
+			continue;
+		}
+		moduleTokens[0] = mod;
+		runModuleCommand(*entry, moduleTokens);
+	}
+}
+
+// The tokenizer pipeline main() used before CommandTokenizer: whitespace split, re-join,
+// comma split and trim. Kept as the baseline for "bench tokenize".
+size_t legacyTokenize(const std::string& command) {
+	std::vector<std::string> tokens;
+	std::istringstream iss(command);
+	std::string token;
+	while (iss >> token) {
+		tokens.push_back(token);
+	}
+	std::string argsCombined;
+	for (size_t i = 0; i < tokens.size(); i++) {
+		if (!argsCombined.empty())
+			argsCombined += " ";
+		argsCombined += tokens[i];
+	}
+	std::istringstream argStream(argsCombined);
+	std::vector<std::string> parts;
+	while (std::getline(argStream, token, ',')) {
+		std::string part = trim(token);
+		if (!part.empty())
+			parts.push_back(part);
+	}
+	return parts.size();
+}
+
+// bench tokenize <command_log> [repeat]: replays a command log through both tokenizers.
+void benchCommand(const Tokens& tokens) {
+	if (tokens.size() < 3 || tokens[1] != "tokenize") {
+		std::cerr << "ERROR: bench tokenize <command_log> [repeat]" << '\n';
+		return;
+	}
+	std::ifstream log{ std::string(tokens[2]) };
+	if (!log) {
+		std::cerr << "Error: cannot open " << tokens[2] << '\n';
+		return;
+	}
+	int repeat = tokens.size() > 3 ? std::max(1, std::atoi(std::string(tokens[3]).c_str())) : 1;
+	std::vector<std::string> lines;
+	std::string line;
+	size_t bytes = 0;
+	while (std::getline(log, line)) {
+		bytes += line.size() + 1;
+		lines.push_back(line);
+	}
+	if (lines.empty()) {
+		std::cerr << "Error: command log is empty" << '\n';
+		return;
+	}
+
+	size_t checksum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeat; r++) {
+		for (const auto& l : lines) {
+			checksum += legacyTokenize(l);
+		}
+	}
+	double legacySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// The tokenizer rewrites its input, so each line is first copied into a reused buffer
+	// (the shell's own getline buffer plays that role in normal use).
+	std::string buffer;
+	Tokens parsed;
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeat; r++) {
+		for (const auto& l : lines) {
+			buffer.assign(l);
+			CommandTokenizer::tokenize(buffer, parsed);
+			checksum += parsed.size();
+		}
+	}
+	double newSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double total = static_cast<double>(lines.size()) * repeat;
+	std::cout << "Replayed " << lines.size() << " lines (" << bytes << " bytes) x " << repeat << '\n';
+	std::cout << "  legacy    : " << legacySeconds * 1e9 / total << " ns/line, " << total / legacySeconds << " lines/s" << '\n';
+	std::cout << "  tokenizer : " << newSeconds * 1e9 / total << " ns/line, " << total / newSeconds << " lines/s" << '\n';
+	std::cout << "  speedup   : " << legacySeconds / newSeconds << "x (checksum " << checksum << ")" << '\n';
+}
+
+// Run one tokenized command line. The registry lookup and any module calls happen under the
+// table lock (see ModuleManager::getTableLock); builtins run without it, since install,
+// delete and the like take it exclusively to change the module table. The time taken is
+// recorded for "stats" under the command name ("pipeline" and "module list" for those).
+void dispatchTokens(const Tokens& tokens) {
+	TraceSpan span("dispatch", tokens[0]);
+	auto start = std::chrono::steady_clock::now();
+	std::string name;
+	std::shared_lock<std::shared_mutex> table(ModuleManager::getInstance().getTableLock());
+	// One lookup resolves builtins, their aliases and loaded modules alike.
+	const CommandRegistry::Entry* entry = CommandRegistry::getInstance().find(tokens[0]);
+	if (entry && entry->handler) {
+		CommandRegistry::Handler handler = entry->handler;
+		name = entry->name;
+		table.unlock();
+		handler(tokens);
+	}
+	else if (entry && !(tokens.size() > 1 && tokens[1] == ",")) {
+		if (isModulePipeline(tokens)) {
+			name = "pipeline";
+			runModulePipeline(tokens);
+		}
+		else {
+			name = entry->name;
+			runModuleCommand(*entry, tokens);
+		}
+	}
+	else {
+		name = "module list";
+		runModuleList(tokens);
+	}
+	CommandStats::getInstance().record(CommandStats::Command, name, "", std::chrono::steady_clock::now() - start);
+}
+
+// "time <command>": wall time of the command, CPU time and peak memory of the shell process.
+// CPU time includes children the command waited for and any background jobs running alongside.
+void timeCommand(const Tokens& tokens) {
+	if (tokens.size() < 2) {
+		std::cerr << "ERROR: time <command>" << '\n';
+		return;
+	}
+	platform::ProcessUsage before, after;
+	bool haveUsage = platform::processUsage(before);
+	auto start = std::chrono::steady_clock::now();
+	dispatchTokens(Tokens(tokens.begin() + 1, tokens.end()));
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	haveUsage = haveUsage && platform::processUsage(after);
+
+	std::ostringstream text;
+	text << std::fixed << std::setprecision(3) << "real " << seconds << " s";
+	if (haveUsage) {
+		text << "  user " << after.userSeconds - before.userSeconds << " s"
+			<< "  sys " << after.systemSeconds - before.systemSeconds << " s"
+			<< std::setprecision(1) << "  peak RSS " << after.peakResident / 1048576.0 << " MiB";
+		if (after.peakResident > before.peakResident)
+			text << " (+" << (after.peakResident - before.peakResident) / 1048576.0 << " MiB)";
+	}
+	std::cout.flush();
+	std::cout << text.str() << '\n';
+}
+
+std::string formatNanoseconds(uint64_t nanoseconds) {
+	std::ostringstream text;
+	text << std::fixed << std::setprecision(1);
+	if (nanoseconds < 1000)
+		text << nanoseconds << " ns";
+	else if (nanoseconds < 1000000)
+		text << nanoseconds / 1e3 << " us";
+	else if (nanoseconds < 1000000000)
+		text << nanoseconds / 1e6 << " ms";
+	else
+		text << std::setprecision(2) << nanoseconds / 1e9 << " s";
+	return text.str();
+}
+
+std::string jsonString(const std::string& value) {
+	std::string text = "\"";
+	for (char c : value) {
+		if (c == '"' || c == '\\') {
+			text += '\\';
+			text += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20) {
+			char escape[8];
+			std::snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned>(c));
+			text += escape;
+		}
+		else {
+			text += c;
+		}
+	}
+	return text + "\"";
+}
+
+// "stats [json [file] | reset]": call counts and latency percentiles per command and per
+// module version since the shell started (or since the last reset).
+void statsCommand(const Tokens& tokens) {
+	if (tokens.size() >= 2 && tokens[1] == "reset") {
+		CommandStats::getInstance().reset();
+		return;
+	}
+	std::vector<CommandStats::Row> rows = CommandStats::getInstance().rows();
+	rows.erase(std::remove_if(rows.begin(), rows.end(),
+		[](const CommandStats::Row& row) { return row.histogram->count() == 0; }), rows.end());
+	if (tokens.size() >= 2 && tokens[1] == "json") {
+		std::ostringstream json;
+		json << "{";
+		const char* sections[] = { "commands", "modules" };
+		for (int kind = CommandStats::Command; kind <= CommandStats::ModuleCall; kind++) {
+			json << (kind ? "," : "") << "\n  \"" << sections[kind] << "\": [";
+			bool first = true;
+			for (const auto& row : rows) {
+				if (row.kind != kind)
+					continue;
+				const LatencyHistogram& h = *row.histogram;
+				json << (first ? "" : ",") << "\n    { \"name\": " << jsonString(row.name);
+				if (kind == CommandStats::ModuleCall)
+					json << ", \"version\": " << jsonString(row.version);
+				json << ", \"calls\": " << h.count() << ", \"total_ns\": " << h.total()
+					<< ", \"p50_ns\": " << h.percentile(0.5) << ", \"p90_ns\": " << h.percentile(0.9)
+					<< ", \"p99_ns\": " << h.percentile(0.99) << ", \"max_ns\": " << h.maximum() << " }";
+				first = false;
+			}
+			json << (first ? "]" : "\n  ]");
+		}
+		json << "\n}\n";
+		if (tokens.size() < 3) {
+			std::cout << json.str();
+			return;
+		}
+		std::ofstream file{ std::string(tokens[2]) };
+		if (!(file << json.str())) {
+			std::cerr << "Error: cannot write " << tokens[2] << '\n';
+			return;
+		}
+		std::cout << "Statistics written to " << tokens[2] << '\n';
+		return;
+	}
+	if (tokens.size() >= 2) {
+		std::cerr << "ERROR: stats [json [file] | reset]" << '\n';
+		return;
+	}
+
+	std::ostringstream text;
+	const char* titles[] = { "Commands", "Module calls" };
+	for (int kind = CommandStats::Command; kind <= CommandStats::ModuleCall; kind++) {
+		text << std::left << std::setw(22) << titles[kind] << std::right << std::setw(8) << "calls"
+			<< std::setw(11) << "p50" << std::setw(11) << "p99" << std::setw(11) << "max" << std::setw(11) << "total" << '\n';
+		for (const auto& row : rows) {
+			if (row.kind != kind)
+				continue;
+			const LatencyHistogram& h = *row.histogram;
+			text << "  " << std::left << std::setw(20) << row.name << std::right << std::setw(8) << h.count()
+				<< std::setw(11) << formatNanoseconds(h.percentile(0.5)) << std::setw(11) << formatNanoseconds(h.percentile(0.99))
+				<< std::setw(11) << formatNanoseconds(h.maximum()) << std::setw(11) << formatNanoseconds(h.total());
+			if (!row.version.empty())
+				text << "  " << row.version;
+			text << '\n';
+		}
+	}
+	std::cout << text.str();
+}
+
+// Stop tracing and write the trace in Chrome trace-event format (chrome://tracing, Perfetto).
+void finishTrace() {
+	std::string path;
+	uint64_t origin = 0;
+	std::vector<Tracer::Event> events = Tracer::getInstance().stop(path, origin);
+	std::ofstream file(path, std::ios::binary);
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << platform::processId()
+		<< ",\"args\":{\"name\":\"mini-shell\"}}";
+	file << std::fixed << std::setprecision(3);
+	for (const auto& event : events) {
+		file << ",\n{\"name\":" << jsonString(event.name) << ",\"cat\":\"" << (event.module ? "module" : "shell")
+			<< "\",\"ph\":\"X\",\"pid\":" << platform::processId() << ",\"tid\":" << event.thread
+			<< ",\"ts\":" << (event.start - origin) / 1e3 << ",\"dur\":" << (event.end - event.start) / 1e3;
+		if (event.detail[0])
+			file << ",\"args\":{\"detail\":" << jsonString(event.detail) << "}";
+		file << "}";
+	}
+	file << "\n]}\n";
+	if (!file) {
+		std::cerr << "Error: cannot write " << path << '\n';
+		return;
+	}
+	std::cout << "Trace written to " << path << " (" << events.size() << " spans)" << '\n';
+}
+
+// "trace on <file>" / "trace off".
+void traceCommand(const Tokens& tokens) {
+	if (tokens.size() == 3 && tokens[1] == "on") {
+		if (Tracer::enabled())
+			finishTrace();
+		Tracer::getInstance().start(std::string(tokens[2]));
+	}
+	else if (tokens.size() == 2 && tokens[1] == "off") {
+		if (!Tracer::enabled()) {
+			std::cerr << "Error: tracing is not on" << '\n';
+			return;
+		}
+		finishTrace();
+	}
+	else if (tokens.size() == 1) {
+		std::cout << "Tracing is " << (Tracer::enabled() ? "on" : "off") << '\n';
+	}
+	else {
+		std::cerr << "ERROR: trace on <file> | trace off" << '\n';
+	}
+}
+
+// "isolate [on [workers] | off | timeout <seconds> | bench [count] [bytes]]"
+void isolateCommand(const Tokens& tokens) {
+	ModuleWorkers& workers = ModuleWorkers::getInstance();
+	auto number = [&tokens](size_t i, double fallback) {
+		return tokens.size() > i ? std::atof(std::string(tokens[i]).c_str()) : fallback;
+	};
+	if (tokens.size() == 1) {
+		workers.printStatus();
+	}
+	else if (tokens[1] == "on" && tokens.size() <= 3 && number(2, 1) >= 1) {
+		workers.start(static_cast<size_t>(number(2, std::max(1u, std::thread::hardware_concurrency()))));
+	}
+	else if (tokens[1] == "off" && tokens.size() == 2) {
+		workers.stop();
+	}
+	else if (tokens[1] == "timeout" && tokens.size() == 3 && number(2, -1) >= 0) {
+		workers.setTimeout(number(2, 0));
+	}
+	else if (tokens[1] == "bench" && tokens.size() <= 4 && number(2, 1) >= 1 && number(3, 0) >= 0) {
+		size_t count = static_cast<size_t>(number(2, 10000));
+		size_t bytes = static_cast<size_t>(number(3, 0));
+		LatencyHistogram histogram;
+		unsigned long pid = 0;
+		workers.benchmark(count, bytes, histogram, pid);
+		if (histogram.count() == 0)
+			return;
+		double mean = static_cast<double>(histogram.total()) / histogram.count();
+		std::ostringstream text;
+		text << histogram.count() << " round trips to worker process " << pid << ", " << bytes << " bytes each way:" << '\n';
+		text << "  mean " << formatNanoseconds(static_cast<uint64_t>(mean)) << ", p50 " << formatNanoseconds(histogram.percentile(0.5))
+			<< ", p99 " << formatNanoseconds(histogram.percentile(0.99)) << ", max " << formatNanoseconds(histogram.maximum()) << '\n';
+		if (bytes > 0)
+			text << "  " << std::fixed << std::setprecision(0) << 2.0 * bytes / mean * 1e9 / 1048576.0 << " MiB/s through the rings" << '\n';
+		std::cout << text.str();
+	}
+	else {
+		std::cerr << "ERROR: isolate [on [workers] | off | timeout <seconds> | bench [count] [bytes]]" << '\n';
+	}
+}
+
+//------------------------------------------------------------
+// Line Editor
+//------------------------------------------------------------
+
+// Lines entered at the prompt, oldest first. The file (HistoryPath, one command per line) is
+// only ever appended to, so several shells can share it. On start-up it is mapped and the
+// entries are views into the mapping: finding the line starts is the only pass over it.
+// Reverse search goes through a trigram index (trigram -> ascending entry numbers) that is
+// built on the first search and extended as lines are added, so a search visits only the
+// entries containing the query's rarest trigram.
+// Only the main thread adds entries; add() and print() lock so that "history &" may read.
+class CommandHistory {
+public:
+	static constexpr const char* HistoryPath = "shell.history";
+	static const size_t NotFound = static_cast<size_t>(-1);
+
+	static CommandHistory& getInstance() {
+		static CommandHistory instance;
+		return instance;
+	}
+
+	void open() {
+		std::string error;
+		if (fs::exists(HistoryPath) && !file.open(HistoryPath, error)) {
+			std::cerr << "Warning: cannot read " << HistoryPath << ": " << error << '\n';
+		}
+		else if (file.data()) {
+			const char* p = file.data();
+			const char* end = p + file.size();
+			while (p < end) {
+				const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+				const char* lineEnd = newline ? newline : end;
+				size_t length = lineEnd - p;
+				if (length && p[length - 1] == '\r')
+					length--;
+				if (length)
+					entries.emplace_back(p, length);
+				p = newline ? newline + 1 : end;
+			}
+		}
+		out.open(HistoryPath, std::ios::app | std::ios::binary);
+	}
+
+	size_t size() const { return entries.size(); }
+	std::string_view at(size_t index) const { return entries[index]; }
+
+	// Blank lines and repeats of the previous entry are not recorded.
+	void add(const std::string& line) {
+		if (line.find_first_not_of(" \t") == std::string::npos || (!entries.empty() && entries.back() == line))
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		added.push_back(line);
+		entries.emplace_back(added.back());
+		if (indexed)
+			indexEntries();
+		if (out)
+			out << line << '\n' << std::flush;
+	}
+
+	// The newest entry before `before` that contains text, or NotFound.
+	size_t searchBackward(std::string_view text, size_t before) {
+		before = std::min(before, entries.size());
+		if (text.size() < 3) {
+			for (size_t i = before; i-- > 0;) {
+				if (entries[i].find(text) != std::string_view::npos)
+					return i;
+			}
+			return NotFound;
+		}
+		if (!indexed) {
+			TraceSpan span("history index");
+			trigrams.reserve(1 << 16);
+			indexEntries();
+		}
+		const std::vector<uint32_t>* rarest = nullptr;
+		for (size_t i = 0; i + 3 <= text.size(); i++) {
+			auto it = trigrams.find(trigram(text.data() + i));
+			if (it == trigrams.end())
+				return NotFound;
+			if (!rarest || it->second.size() < rarest->size())
+				rarest = &it->second;
+		}
+		auto last = std::lower_bound(rarest->begin(), rarest->end(), static_cast<uint32_t>(before));
+		while (last != rarest->begin()) {
+			uint32_t candidate = *--last;
+			if (entries[candidate].find(text) != std::string_view::npos)
+				return candidate;
+		}
+		return NotFound;
+	}
+
+	// "history [count]": the last count entries (default 20), numbered from 1.
+	void print(size_t count) {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t first = entries.size() > count ? entries.size() - count : 0;
+		std::ostringstream text;
+		for (size_t i = first; i < entries.size(); i++)
+			text << std::setw(6) << i + 1 << "  " << entries[i] << '\n';
+		std::cout << text.str();
+	}
+
+private:
+	CommandHistory() : indexed(0) {}
+	CommandHistory(const CommandHistory&) = delete;
+	CommandHistory& operator=(const CommandHistory&) = delete;
+
+	static uint32_t trigram(const char* p) {
+		return static_cast<uint32_t>(static_cast<unsigned char>(p[0])) << 16
+			| static_cast<uint32_t>(static_cast<unsigned char>(p[1])) << 8
+			| static_cast<unsigned char>(p[2]);
+	}
+
+	void indexEntries() {
+		for (; indexed < entries.size(); indexed++) {
+			std::string_view entry = entries[indexed];
+			uint32_t id = static_cast<uint32_t>(indexed);
+			for (size_t i = 0; i + 3 <= entry.size(); i++) {
+				std::vector<uint32_t>& list = trigrams[trigram(entry.data() + i)];
+				if (list.empty() || list.back() != id)
+					list.push_back(id);
+			}
+		}
+	}
+
+	platform::MappedFile file;
+	std::deque<std::string> added;           // entered in this session (deque: views stay valid)
+	std::vector<std::string_view> entries;   // into file, then into added
+	std::ofstream out;
+	std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams;
+	size_t indexed;                          // entries in trigrams (0: no index yet)
+	std::mutex mutex;
+};
+
+// Prefix trie over a sorted set of names, for tab completion. Nodes are 16 bytes (first child
+// and next sibling links, in byte order) and count the names below them, so completing a
+// prefix costs its length plus the common continuation, however many names share it.
+class PrefixTrie {
+public:
+	// items must be sorted by name without duplicates; kind is any nonzero tag of the name.
+	void build(const std::vector<std::pair<std::string, uint8_t>>& items) {
+		nodes.assign(1, Node());
+		nodes[0].count = static_cast<uint32_t>(items.size());
+		std::vector<uint32_t> path(1, 0); // nodes of the previous name, path[d] at depth d
+		const std::string* previous = nullptr;
+		for (const auto& item : items) {
+			const std::string& name = item.first;
+			size_t common = 0;
+			if (previous) {
+				size_t limit = std::min(previous->size(), name.size());
+				while (common < limit && (*previous)[common] == name[common])
+					common++;
+			}
+			// Sorted order: a new child always follows its parent's last child, the node the
+			// previous name went through just below the common prefix.
+			uint32_t sibling = path.size() > common + 1 ? path[common + 1] : None;
+			path.resize(common + 1);
+			for (size_t d = 1; d <= common; d++)
+				nodes[path[d]].count++;
+			for (size_t d = common; d < name.size(); d++) {
+				uint32_t index = static_cast<uint32_t>(nodes.size());
+				nodes.push_back(Node());
+				nodes[index].ch = name[d];
+				nodes[index].count = 1;
+				if (sibling != None)
+					nodes[sibling].nextSibling = index;
+				else
+					nodes[path.back()].firstChild = index;
+				sibling = None;
+				path.push_back(index);
+			}
+			nodes[path.back()].kind = item.second;
+			previous = &name;
+		}
+	}
+
+	// Number of names starting with prefix. extension receives what all of them have in common
+	// after the prefix, and kind the tag of the name when there is exactly one.
+	size_t complete(std::string_view prefix, std::string& extension, uint8_t& kind) const {
+		extension.clear();
+		uint32_t node = find(prefix);
+		if (node == None)
+			return 0;
+		while (nodes[node].kind == 0 && nodes[node].firstChild != None && nodes[nodes[node].firstChild].nextSibling == None) {
+			node = nodes[node].firstChild;
+			extension += nodes[node].ch;
+		}
+		kind = nodes[node].kind;
+		return nodes[node].count;
+	}
+
+	// Up to limit names starting with prefix, in order, with their tags.
+	void list(std::string_view prefix, size_t limit, std::vector<std::pair<std::string, uint8_t>>& names) const {
+		uint32_t node = find(prefix);
+		std::string name(prefix);
+		if (node != None)
+			collect(node, name, limit, names);
+	}
+
+private:
+	static const uint32_t None = 0xFFFFFFFFu;
+
+	struct Node {
+		uint32_t firstChild = None;
+		uint32_t nextSibling = None;
+		uint32_t count = 0;    // names ending here or below
+		char ch = 0;
+		uint8_t kind = 0;      // nonzero where a name ends
+	};
+
+	uint32_t find(std::string_view prefix) const {
+		if (nodes.empty())
+			return None;
+		uint32_t node = 0;
+		for (char c : prefix) {
+			uint32_t child = nodes[node].firstChild;
+			while (child != None && nodes[child].ch != c)
+				child = nodes[child].nextSibling;
+			if (child == None)
+				return None;
+			node = child;
+		}
+		return node;
+	}
+
+	void collect(uint32_t node, std::string& name, size_t limit, std::vector<std::pair<std::string, uint8_t>>& names) const {
+		if (nodes[node].kind && names.size() < limit)
+			names.emplace_back(name, nodes[node].kind);
+		for (uint32_t child = nodes[node].firstChild; child != None && names.size() < limit; child = nodes[child].nextSibling) {
+			name += nodes[child].ch;
+			collect(child, name, limit, names);
+			name.pop_back();
+		}
+	}
+
+	std::vector<Node> nodes;
+};
+
+// Directory listings for path completion, kept as tries and revalidated with the directory's
+// identity and write time like the disk usage cache, so pressing Tab again in a large
+// directory neither lists it nor sorts its names again. Names starting with '.' have their own
+// trie and are offered only for a prefix starting with '.'.
+class PathCompletionCache {
+public:
+	enum Kind : uint8_t { File = 1, Directory = 2 };
+
+	struct Listing {
+		unsigned long long id = 0;
+		long long mtime = 0;        // 0 never matches, so the directory is read again
+		PrefixTrie visible;
+		PrefixTrie hidden;
+	};
+
+	// The listing of directory, or nullptr if it cannot be read.
+	const Listing* find(const std::string& directory) {
+		unsigned long long id = 0;
+		long long mtime = 0;
+		if (!platform::statDirectory(directory, id, mtime))
+			return nullptr;
+		auto it = listings.find(directory);
+		if (it != listings.end() && mtime != 0 && it->second->mtime == mtime && it->second->id == id)
+			return it->second.get();
+
+		std::vector<platform::DirectoryEntry> entries;
+		std::string error;
+		if (!platform::readDirectory(directory, false, entries, error))
+			return nullptr;
+		std::vector<std::pair<std::string, uint8_t>> visible, hidden;
+		for (auto& entry : entries) {
+			bool isDirectory = entry.type == platform::DirectoryEntry::Directory;
+			if (entry.type == platform::DirectoryEntry::Link) {
+				std::error_code ec;
+				isDirectory = fs::is_directory(fs::path(directory) / entry.name, ec);
+			}
+			auto& items = entry.name[0] == '.' ? hidden : visible;
+			items.emplace_back(std::move(entry.name), isDirectory ? Directory : File);
+		}
+		std::sort(visible.begin(), visible.end());
+		std::sort(hidden.begin(), hidden.end());
+		if (listings.size() >= MaxListings && it == listings.end())
+			listings.clear();
+		std::unique_ptr<Listing>& listing = listings[directory];
+		listing.reset(new Listing());
+		listing->id = id;
+		long long now = static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count());
+		// Written to within the timestamp's resolution: may change again unnoticed.
+		listing->mtime = now - mtime < RacyWindow ? 0 : mtime;
+		listing->visible.build(visible);
+		listing->hidden.build(hidden);
+		return listing.get();
+	}
+
+private:
+	static const size_t MaxListings = 64;
+	static const long long RacyWindow = 2000000000LL;
+
+	std::unordered_map<std::string, std::unique_ptr<Listing>> listings;
+};
+
+// Interactive line editing for the prompt: cursor movement and editing keys, history (Up/Down,
+// Ctrl+R incremental reverse search) and tab completion of shell commands and module names at
+// the start of a command or pipeline stage and of file paths elsewhere.
+// Output for a key is gathered and written once the keys that arrived with it are handled, and
+// typing at the end of the line only echoes the character, which keeps a paste or a remote
+// console from redrawing the whole line per key.
+class LineEditor {
+public:
+	LineEditor() : history(CommandHistory::getInstance()), terminal(nullptr), width(80), cursorRow(0) {
+		history.open();
+	}
+
+	// Reads one line into line and records it in the history. Returns false at the end of the
+	// input (Ctrl+D on an empty line). Falls back to plain line input if the terminal cannot
+	// be switched to raw mode.
+	bool readLine(const std::string& prompt, std::string& line) {
+		platform::RawTerminal raw;
+		if (!raw.enable()) {
+			std::cout << prompt << std::flush;
+			if (!std::getline(std::cin, line))
+				return false;
+			history.add(line);
+			return true;
+		}
+		terminal = &raw;
+		width = raw.width();
+		cursorRow = 0;
+		buffer.clear();
+		cursor = 0;
+		browsing = history.size();
+		this->prompt = prompt;
+		write(prompt);
+		bool entered = edit();
+		terminal = nullptr;
+		if (!entered)
+			return false;
+		line = buffer;
+		history.add(line);
+		return true;
+	}
+
+private:
+	// Keys beyond single bytes, decoded from escape sequences.
+	enum Key { Up = 256, Down, Right, Left, Home, End, Delete, Unknown };
+
+	static const size_t ListLimit = 100;
+
+	bool edit() {
+		for (;;) {
+			int key = readKey();
+			switch (key) {
+			case -1:
+				flush();
+				if (buffer.empty())
+					return false;
+				// End of input after some text enters it.
+				[[fallthrough]];
+			case '\r':
+			case '\n':
+				moveTo(buffer.size());
+				write("\r\n");
+				flush();
+				return true;
+			case 4: // Ctrl+D
+				if (buffer.empty()) {
+					write("\r\n");
+					flush();
+					return false;
+				}
+				erase(cursor, nextChar(cursor));
+				break;
+			case 3: // Ctrl+C
+				moveTo(buffer.size());
+				write("^C\r\n");
+				buffer.clear();
+				cursor = 0;
+				cursorRow = 0;
+				browsing = history.size();
+				write(prompt);
+				break;
+			case 1: case Home: moveTo(0); break;
+			case 5: case End: moveTo(buffer.size()); break;
+			case 2: case Left: moveTo(previousChar(cursor)); break;
+			case 6: case Right: moveTo(nextChar(cursor)); break;
+			case 8: case 127: erase(previousChar(cursor), cursor); break;
+			case Delete: erase(cursor, nextChar(cursor)); break;
+			case 11: erase(cursor, buffer.size()); break; // Ctrl+K
+			case 21: erase(0, cursor); break;             // Ctrl+U
+			case 23: {                                    // Ctrl+W
+				size_t start = cursor;
+				while (start > 0 && buffer[start - 1] == ' ')
+					start--;
+				while (start > 0 && buffer[start - 1] != ' ')
+					start--;
+				erase(start, cursor);
+				break;
+			}
+			case 12: // Ctrl+L
+				write("\x1b[H\x1b[2J");
+				cursorRow = 0;
+				refresh(prompt, buffer, cursor);
+				break;
+			case 16: case Up: browse(-1); break;
+			case 14: case Down: browse(1); break;
+			case 9: complete(); break;
+			case 18: { // Ctrl+R
+				int next = reverseSearch();
+				if (next == '\r' || next == '\n') {
+					moveTo(buffer.size());
+					write("\r\n");
+					flush();
+					return true;
+				}
+				break;
+			}
+			default:
+				if (key >= 32 && key < 256)
+					insert(std::string(1, static_cast<char>(key)));
+				break;
+			}
+		}
+	}
+
+	// One key: a byte, or a Key for the escape sequences of cursor and editing keys. Output is
+	// written out before waiting for input.
+	int readKey() {
+		if (!terminal->pending())
+			flush();
+		int c = terminal->readByte();
+		if (c != 27)
+			return c;
+		int kind = terminal->readByte();
+		if (kind != '[' && kind != 'O')
+			return Unknown;
+		int number = 0;
+		int final = terminal->readByte();
+		while (final >= '0' && final <= '9') {
+			number = number * 10 + (final - '0');
+			final = terminal->readByte();
+		}
+		while (final == ';' || (final >= '0' && final <= '9')) // modifiers: ignored
+			final = terminal->readByte();
+		switch (final) {
+		case 'A': return Up;
+		case 'B': return Down;
+		case 'C': return Right;
+		case 'D': return Left;
+		case 'H': return Home;
+		case 'F': return End;
+		case '~':
+			if (number == 1 || number == 7)
+				return Home;
+			if (number == 4 || number == 8)
+				return End;
+			if (number == 3)
+				return Delete;
+			return Unknown;
+		default:
+			return final < 0 ? -1 : Unknown;
+		}
+	}
+
+	// Ctrl+R: typing narrows the search, Ctrl+R again finds the next older match, Backspace
+	// widens it again. Enter runs the match; Ctrl+G or Ctrl+C restores the line; any other key
+	// keeps the match for editing and is handled as usual. Returns that key.
+	int reverseSearch() {
+		std::string saved = buffer;
+		size_t savedCursor = cursor;
+		std::string query;
+		size_t match = CommandHistory::NotFound;
+		bool failed = false;
+		for (;;) {
+			std::string text = match == CommandHistory::NotFound ? std::string() : std::string(history.at(match));
+			size_t at = std::min(text.find(query), text.size());
+			refresh(std::string(failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`") + query + "': ", text, at);
+			int key = readKey();
+			if (key == 18 || (key >= 32 && key < 256) || key == 8 || key == 127) {
+				// A longer query can only match the current entry or older ones; a shorter one
+				// starts again from the newest.
+				size_t before = history.size();
+				if (key == 18) {
+					if (match != CommandHistory::NotFound)
+						before = match;
+				}
+				else if (key == 8 || key == 127) {
+					query.erase(previousChar(query, query.size()));
+				}
+				else {
+					query += static_cast<char>(key);
+					if (match != CommandHistory::NotFound)
+						before = match + 1;
+				}
+				if (query.empty()) {
+					match = CommandHistory::NotFound;
+					failed = false;
+					continue;
+				}
+				size_t found = history.searchBackward(query, before);
+				// Ctrl+R skips older copies of the command already shown.
+				while (key == 18 && found != CommandHistory::NotFound && match != CommandHistory::NotFound && history.at(found) == history.at(match))
+					found = history.searchBackward(query, found);
+				failed = found == CommandHistory::NotFound;
+				if (!failed)
+					match = found;
+				continue;
+			}
+			if (key == 7 || key == 3) {
+				buffer = saved;
+				cursor = savedCursor;
+			}
+			else if (match != CommandHistory::NotFound) {
+				buffer = text;
+				cursor = at;
+				browsing = history.size();
+			}
+			refresh(prompt, buffer, cursor);
+			return key == 7 || key == 3 ? 0 : key;
+		}
+	}
+
+	// Up/Down: older and newer entries; below the newest is the line that was being typed.
+	void browse(int direction) {
+		size_t target = browsing + direction;
+		if ((direction < 0 && browsing == 0) || target > history.size())
+			return;
+		if (browsing == history.size())
+			draft = buffer;
+		browsing = target;
+		buffer = browsing == history.size() ? draft : std::string(history.at(browsing));
+		cursor = buffer.size();
+		refresh(prompt, buffer, cursor);
+	}
+
+	// Tab: completes the word before the cursor as far as it is unambiguous, or lists the
+	// candidates when it cannot be extended.
+	void complete() {
+		size_t start = cursor;
+		while (start > 0 && !isSeparator(start - 1))
+			start--;
+		std::string word;
+		for (size_t i = start; i < cursor; i++) {
+			if (buffer[i] == '\\' && i + 1 < cursor && isEscapable(buffer[i + 1]))
+				i++;
+			word += buffer[i];
+		}
+		size_t before = buffer.find_last_not_of(" \t", start == 0 ? std::string::npos : start - 1);
+		bool commandPosition = start == 0 || before == std::string::npos || buffer[before] == '|';
+
+		PrefixTrie commands;
+		const PrefixTrie* trie = nullptr;
+		std::string prefix = word;
+		char separator = '/';
+		if (commandPosition) {
+			std::vector<std::pair<std::string, uint8_t>> names;
+			{
+				ModuleManager& manager = ModuleManager::getInstance();
+				std::shared_lock<std::shared_mutex> lock(manager.getTableLock());
+				for (auto& name : CommandRegistry::getInstance().names())
+					names.emplace_back(std::move(name), PathCompletionCache::File);
+				for (const auto& module : manager.getModules())
+					names.emplace_back(module.first, PathCompletionCache::File);
+			}
+			std::sort(names.begin(), names.end());
+			names.erase(std::unique(names.begin(), names.end()), names.end());
+			commands.build(names);
+			trie = &commands;
+		}
+		else {
+			size_t slash = word.find_last_of("/\\");
+			std::string directory = slash == std::string::npos ? "." : word.substr(0, slash + 1);
+			if (slash != std::string::npos)
+				separator = word[slash];
+			prefix = slash == std::string::npos ? word : word.substr(slash + 1);
+			if (const PathCompletionCache::Listing* listing = paths.find(directory))
+				trie = !prefix.empty() && prefix[0] == '.' ? &listing->hidden : &listing->visible;
+		}
+
+		std::string extension;
+		uint8_t kind = 0;
+		size_t count = trie ? trie->complete(prefix, extension, kind) : 0;
+		if (count == 0) {
+			write("\a");
+			return;
+		}
+		if (count == 1) {
+			insert(escape(extension) + (kind == PathCompletionCache::Directory ? separator : ' '));
+			return;
+		}
+		if (!extension.empty()) {
+			insert(escape(extension));
+			return;
+		}
+		std::vector<std::pair<std::string, uint8_t>> names;
+		trie->list(prefix, ListLimit, names);
+		listCandidates(names, count, separator);
+	}
+
+	void listCandidates(const std::vector<std::pair<std::string, uint8_t>>& names, size_t count, char separator) {
+		size_t longest = 0;
+		for (const auto& name : names)
+			longest = std::max(longest, columns(name.first) + 1);
+		size_t perRow = std::max<size_t>(1, width / (longest + 2));
+		moveTo(buffer.size());
+		std::string text = "\r\n";
+		for (size_t i = 0; i < names.size(); i++) {
+			std::string name = names[i].first;
+			if (names[i].second == PathCompletionCache::Directory)
+				name += separator;
+			text += name;
+			if ((i + 1) % perRow == 0 || i + 1 == names.size())
+				text += "\r\n";
+			else
+				text.append(longest + 2 - columns(name), ' ');
+		}
+		if (count > names.size())
+			text += "... and " + std::to_string(count - names.size()) + " more\r\n";
+		write(text);
+		cursorRow = 0;
+		refresh(prompt, buffer, cursor);
+	}
+
+	// Token boundary for completion: unescaped whitespace or ',' (see CommandTokenizer).
+	bool isSeparator(size_t i) const {
+		char c = buffer[i];
+		if (c != ' ' && c != '\t' && c != ',')
+			return false;
+		return i == 0 || buffer[i - 1] != '\\';
+	}
+
+	static bool isEscapable(char c) {
+		return c == '"' || c == '\'' || c == ',' || c == ' ' || c == '\t';
+	}
+
+	static std::string escape(const std::string& text) {
+		std::string result;
+		for (char c : text) {
+			if (isEscapable(c))
+				result += '\\';
+			result += c;
+		}
+		return result;
+	}
+
+	void insert(const std::string& text) {
+		buffer.insert(cursor, text);
+		cursor += text.size();
+		size_t total = columns(prompt) + columns(buffer);
+		if (cursor == buffer.size() && total % width != 0 && text.find('\x1b') == std::string::npos) {
+			write(text);
+			cursorRow = total / width;
+		}
+		else {
+			refresh(prompt, buffer, cursor);
+		}
+	}
+
+	void erase(size_t begin, size_t end) {
+		if (begin >= end)
+			return;
+		buffer.erase(begin, end - begin);
+		cursor = begin;
+		refresh(prompt, buffer, cursor);
+	}
+
+	void moveTo(size_t position) {
+		if (position == cursor)
+			return;
+		cursor = position;
+		refresh(prompt, buffer, cursor);
+	}
+
+	// Redraws the prompt and text from the row the prompt starts on, wrapping at the window
+	// width, and leaves the cursor on the text's cursor position.
+	void refresh(const std::string& lead, const std::string& text, size_t position) {
+		std::string out;
+		if (cursorRow > 0)
+			out += "\x1b[" + std::to_string(cursorRow) + "A";
+		out += '\r';
+		out += lead;
+		out += text;
+		out += "\x1b[J";
+		size_t total = columns(lead) + columns(text);
+		if (total > 0 && total % width == 0)
+			out += "\r\n"; // the terminal holds the cursor at the last column until more text
+		size_t at = columns(lead) + columns(std::string_view(text).substr(0, position));
+		size_t endRow = total / width, row = at / width, column = at % width;
+		if (endRow > row)
+			out += "\x1b[" + std::to_string(endRow - row) + "A";
+		out += '\r';
+		if (column > 0)
+			out += "\x1b[" + std::to_string(column) + "C";
+		cursorRow = row;
+		write(out);
+	}
+
+	// Display columns: UTF-8 continuation bytes take none.
+	static size_t columns(std::string_view text) {
+		size_t count = 0;
+		for (char c : text)
+			count += (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+		return count;
+	}
+
+	static size_t previousChar(const std::string& text, size_t position) {
+		while (position > 0 && (static_cast<unsigned char>(text[--position]) & 0xC0) == 0x80) {}
+		return position;
+	}
+
+	size_t previousChar(size_t position) const { return previousChar(buffer, position); }
+
+	size_t nextChar(size_t position) const {
+		if (position >= buffer.size())
+			return buffer.size();
+		while (++position < buffer.size() && (static_cast<unsigned char>(buffer[position]) & 0xC0) == 0x80) {}
+		return position;
+	}
+
+	void write(const std::string& text) { output += text; }
+
+	void flush() {
+		if (output.empty())
+			return;
+		std::cout.write(output.data(), static_cast<std::streamsize>(output.size()));
+		std::cout.flush();
+		output.clear();
+	}
+
+	CommandHistory& history;
+	PathCompletionCache paths;
+	platform::RawTerminal* terminal;    // while reading a line
+	size_t width;
+	size_t cursorRow;                   // rows between the prompt's first row and the cursor
+	std::string prompt;
+	std::string buffer;
+	size_t cursor = 0;                  // byte offset into buffer
+	size_t browsing = 0;                // history entry shown; size() for the line being typed
+	std::string draft;                  // the line being typed while browsing the history
+	std::string output;                 // written before the next wait for input
+};
+
+// "history [count]"
+void historyCommand(const Tokens& tokens) {
+	size_t count = 20;
+	if (tokens.size() > 2 || (tokens.size() == 2 && std::atoi(std::string(tokens[1]).c_str()) <= 0)) {
+		std::cerr << "ERROR: history [count]" << '\n';
+		return;
+	}
+	if (tokens.size() == 2)
+		count = static_cast<size_t>(std::atoi(std::string(tokens[1]).c_str()));
+	CommandHistory::getInstance().print(count);
+}
+
+//------------------------------------------------------------
+// Background Jobs
+//------------------------------------------------------------
+
+// Shared pool of worker threads for work that outlives the command line that started it.
+// Tasks run in submission order; when every worker is busy, new tasks wait in the queue.
+// The workers are started on first use.
+class Executor {
+public:
+	static Executor& getInstance() {
+		static Executor instance;
+		return instance;
+	}
+
+	~Executor() { shutdown(); }
+
+	size_t threadCount() const { return std::max(4u, std::thread::hardware_concurrency()); }
+
+	void submit(std::function<void()> task) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (workers.empty() && !stopping) {
+			for (size_t i = 0; i < threadCount(); i++)
+				workers.emplace_back(&Executor::work, this);
+		}
+		tasks.push_back(std::move(task));
+		available.notify_one();
+	}
+
+	// Run the queued tasks to the end and stop the workers.
+	void shutdown() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			available.notify_all();
+		}
+		for (auto& worker : workers)
+			worker.join();
+		workers.clear();
+	}
+
+private:
+	Executor() : stopping(false) {}
+
+	void work() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				available.wait(lock, [&]() { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable available;
+	std::deque<std::function<void()>> tasks;
+	std::vector<std::thread> workers;
+	bool stopping;
+};
+
+// "<command> &" runs any command line as a job on the Executor. A job's output is kept in its
+// JobContext and shown when it is waited for, brought to the foreground, or at the first
+// prompt after it finishes. "kill" cancels cooperatively: loops in the builtins and modules
+// poll the job's flag (ms::cancelled() in modules) and child processes are terminated.
+class JobManager {
+public:
+	static JobManager& getInstance() {
+		static JobManager instance;
+		return instance;
+	}
+
+	void start(const std::string& command) {
+		std::shared_ptr<Job> job = std::make_shared<Job>();
+		job->command = command;
+		job->started = std::chrono::steady_clock::now();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job->id = nextId++;
+			jobs[job->id] = job;
+		}
+		std::cout << "[" << job->id << "] " << command << '\n';
+		Executor::getInstance().submit([this, job]() { run(job); });
+	}
+
+	void list() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (jobs.empty()) {
+			std::cout << "No jobs" << '\n';
+			return;
+		}
+		for (const auto& entry : jobs) {
+			const Job& job = *entry.second;
+			const char* state = job.state == State::Queued ? "Queued" : job.state == State::Running ? "Running" : "Done";
+			if (job.state != State::Done && job.context.isCancelled())
+				state = "Killing";
+			// Formatted apart from std::cout, whose format flags other jobs' threads share.
+			std::ostringstream line;
+			line << "[" << job.id << "] " << std::left << std::setw(8) << state << std::right << " "
+				<< std::fixed << std::setprecision(1) << std::setw(7) << seconds(job) << " s  " << job.command << '\n';
+			std::cout << line.str();
+		}
+	}
+
+	// Block until the job has finished and show its output. With foreground, output is shown
+	// as the job writes it instead of at the end.
+	bool wait(int id, bool foreground) {
+		std::shared_ptr<Job> job = find(id);
+		if (!job)
+			return alreadyReported(id);
+		if (foreground) {
+			std::cout << job->command << '\n';
+			job->context.drain(true);
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&]() { return job->state == State::Done; });
+		lock.unlock();
+		report(job);
+		return true;
+	}
+
+	void waitAll() {
+		for (int id : ids())
+			wait(id, false);
+	}
+
+	bool kill(int id) {
+		std::shared_ptr<Job> job = find(id);
+		if (!job)
+			return alreadyReported(id);
+		job->context.cancel();
+		return true;
+	}
+
+	// Show the jobs that finished since the last call (before each prompt).
+	void reportFinished() {
+		std::vector<std::shared_ptr<Job>> finished;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (const auto& entry : jobs) {
+				if (entry.second->state == State::Done)
+					finished.push_back(entry.second);
+			}
+		}
+		for (const auto& job : finished)
+			report(job);
+	}
+
+	// Wait for every job (cancelling them first if cancel is set) and show their output.
+	void finishAll(bool cancel) {
+		if (cancel) {
+			for (int id : ids()) {
+				std::shared_ptr<Job> job = find(id);
+				if (job)
+					job->context.cancel();
+			}
+		}
+		waitAll();
+	}
+
+	// Id of the most recent job, or 0 if there is none (the default for "fg" and "wait").
+	int latest() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return jobs.empty() ? 0 : jobs.rbegin()->first;
+	}
+
+private:
+	enum class State { Queued, Running, Done };
+
+	struct Job {
+		int id = 0;
+		std::string command;
+		JobContext context;
+		State state = State::Queued;          // guarded by JobManager::mutex
+		std::chrono::steady_clock::time_point started, finished;
+	};
+
+	JobManager() : nextId(1) {}
+
+	void run(const std::shared_ptr<Job>& job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job->state = State::Running;
+		}
+		JobContext::Scope scope(&job->context);
+		if (!job->context.isCancelled()) {
+			try {
+				std::string line = job->command;
+				Tokens tokens;
+				CommandTokenizer::tokenize(line, tokens);
+				if (!tokens.empty())
+					dispatchTokens(tokens);
+			}
+			catch (const std::exception& e) {
+				std::cerr << "Exception in background job: " << e.what() << '\n';
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		job->finished = std::chrono::steady_clock::now();
+		job->state = State::Done;
+		changed.notify_all();
+	}
+
+	// Show the output of a finished job and forget it. Only the first caller reports.
+	void report(const std::shared_ptr<Job>& job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (jobs.erase(job->id) == 0)
+				return;
+		}
+		job->context.drain(false);
+		const char* outcome = job->context.isCancelled() ? "Killed" : job->context.wroteError() ? "Failed" : "Done";
+		std::ostringstream line;
+		line << "[" << job->id << "] " << outcome << " (" << std::fixed << std::setprecision(2) << seconds(*job)
+			<< " s)  " << job->command << '\n';
+		std::cout << line.str();
+	}
+
+	static double seconds(const Job& job) {
+		auto end = job.state == State::Done ? job.finished : std::chrono::steady_clock::now();
+		return std::chrono::duration<double>(end - job.started).count();
+	}
+
+	// Jobs leave the table once their output has been shown; asking for one of those again
+	// is not an error (a script cannot know whether a prompt came in between).
+	bool alreadyReported(int id) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (id > 0 && id < nextId)
+			return true;
+		std::cerr << "ERROR: no job " << id << '\n';
+		return false;
+	}
+
+	std::shared_ptr<Job> find(int id) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = jobs.find(id);
+		return it == jobs.end() ? nullptr : it->second;
+	}
+
+	std::vector<int> ids() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<int> result;
+		for (const auto& entry : jobs)
+			result.push_back(entry.first);
+		return result;
+	}
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::map<int, std::shared_ptr<Job>> jobs;   // running jobs and finished ones not yet reported
+	int nextId;
+};
+
+// "wait [id]", "fg [id]" and "kill <id>"; ids may be written as %N.
+bool parseJobId(const Tokens& tokens, bool required, int& id) {
+	if (tokens.size() < 2) {
+		id = JobManager::getInstance().latest();
+		if (required || id == 0) {
+			std::cerr << "ERROR: " << tokens[0] << (required ? " <job>" : ": no jobs") << '\n';
+			return false;
+		}
+		return true;
+	}
+	std::string_view text = tokens[1];
+	if (!text.empty() && text[0] == '%')
+		text.remove_prefix(1);
+	id = std::atoi(std::string(text).c_str());
+	if (id <= 0) {
+		std::cerr << "ERROR: invalid job id '" << tokens[1] << "'" << '\n';
+		return false;
+	}
+	return true;
+}
+
+void registerBuiltins(CommandRegistry& registry, bool& exitRequested) {
+	registry.registerBuiltin({ "exit" }, "exit", "Exit the shell",
+		[&exitRequested](const Tokens&) { exitRequested = true; });
+	registry.registerBuiltin({ "help", "h", "?" }, "help[/h/?]", "Display help",
+		[&registry](const Tokens&) { registry.printHelp(); });
+	registry.registerBuiltin({ "version", "v", "-v" }, "version[/v/-v]", "Display shell version",
+		[](const Tokens&) { std::cout << "Shell Version 1.2.0" << '\n'; });
+	registry.registerBuiltin({ "install", "dwl" }, "install[/dwl]", "Download module(s)",
+		[](const Tokens& tokens) {
+			runModuleBatchCommand(tokens, "install[/dwl]", &ModuleManager::installModules);
+		});
+	registry.registerBuiltin({ "load" }, "load", "Load module(s)",
+		[](const Tokens& tokens) {
+			runModuleListCommand(tokens, "load", &ModuleManager::loadModule, &ModuleManager::loadAllModules);
+		});
+	registry.registerBuiltin({ "update", "up" }, "update[/up]", "Update module(s)",
+		[](const Tokens& tokens) {
+			runModuleBatchCommand(tokens, "update/up", &ModuleManager::updateModules);
+		});
+	registry.registerBuiltin({ "versions" }, "versions <module_name>", "List the stored versions of a module", [](const Tokens& tokens) {
+		if (tokens.size() < 2) {
+			std::cerr << "ERROR: versions <module_name>" << '\n';
+			return;
+		}
+		ModuleManager::getInstance().listVersions(std::string(tokens[1]));
+	});
+	registry.registerBuiltin({ "rollback" }, "rollback <module_name>", "Switch a module back to its previous version", [](const Tokens& tokens) {
+		if (tokens.size() < 2) {
+			std::cerr << "ERROR: rollback <module_name>" << '\n';
+			return;
+		}
+		ModuleManager::getInstance().switchVersion(std::string(tokens[1]), "");
+	});
+	registry.registerBuiltin({ "switch" }, "switch <module_name> <version>", "Activate a stored version (digest prefix from 'versions')", [](const Tokens& tokens) {
+		if (tokens.size() < 3) {
+			std::cerr << "ERROR: switch <module_name> <version>" << '\n';
+			return;
+		}
+		ModuleManager::getInstance().switchVersion(std::string(tokens[1]), std::string(tokens[2]));
+	});
+	registry.registerBuiltin({ "gc" }, "gc", "Delete stored module versions that no module refers to",
+		[](const Tokens&) { ModuleManager::getInstance().collectGarbage(); });
+	registry.registerBuiltin({ "source" }, "source [url|folder|default]", "Show or set where modules are installed from",
+		sourceCommand, {
+		"     A local folder or file:// URL works as an offline mirror; a SHA256SUMS index there",
+		"     lets install/update skip unchanged modules and verify downloads." });
+	registry.registerBuiltin({ "delete", "del" }, "delete[/del]", "Delete module(s)",
+		[](const Tokens& tokens) {
+			runModuleListCommand(tokens, "delete/del", &ModuleManager::removeModule, &ModuleManager::removeAllModules);
+		});
+	registry.registerBuiltin({ "ls" }, "ls [options] [attribute]", "List modules or directory contents", listCommand, {
+		"     Use 'mods/modules/ext':  list modules.",
+		"     Use 'drive:' or 'd:'     followed by a drive letter (e.g. ls drive:C) to list a drive.",
+		"     Use 'loc:'               followed by a path (e.g. ls loc:\"C:\\My Folder\") to list that directory.",
+		"     Options: -R (recursive), -name <glob>, -type f|d|l, -size [+-]N[k|M|G],",
+		"              -mtime [+-]days, -sort name|size|time." });
+	registry.registerBuiltin({ "grep" }, "grep [options] <pattern> [path]", "Search files for lines matching a pattern", grepCommand, {
+		"     Searches a file, or every file below a directory (default: the current one).",
+		"     The pattern is an extended regular expression; -F treats it as plain text.",
+		"     Options: -i (ignore case), -n (line numbers), -l (file names only), -c (counts),",
+		"              -name <glob> (only search matching file names)." });
+	registry.registerBuiltin({ "du" }, "du [-d depth] [-f] [path]", "Show the size and file count of a directory tree", diskUsageCommand, {
+		"     -d N lists subdirectories down to N levels. Unchanged directories are taken from",
+		"     du.cache; -f rescans everything (needed after files are rewritten in place)." });
+	registry.registerBuiltin({ "run" }, "run <program> [args]", "Run a program and wait for it", runCommand, {
+		"     'a | b' connects the output of a to the input of b.",
+		"     Use '-j N' with commands separated by ',' (or '@file', one per line) to run up to",
+		"     N at a time; their output is captured and printed in order." });
+	registry.registerBuiltin({ "c", "clear" }, "c or clear", "Clear the screen",
+		[](const Tokens&) { platform::clearScreen(); });
+	registry.registerBuiltin({ "rb" }, "rb", "Reboot the shell (clear screen and reload modules)",
+		[](const Tokens&) {
+			platform::clearScreen();
+			std::cout << "Rebooting shell and reloading modules..." << '\n';
+			ModuleManager::getInstance().loadAllModules();
+		});
+	registry.registerBuiltin({ "watch" }, "watch [on|off]", "Reload modules automatically when their files change", watchCommand);
+	registry.registerBuiltin({ "flush" }, "flush", "Write out buffered output (script and pipe mode)",
+		[](const Tokens&) { std::cout.flush(); });
+	registry.registerBuiltin({ "bench" }, "bench tokenize <log>", "Benchmark the command tokenizer on a command log", benchCommand);
+	registry.registerBuiltin({ "time" }, "time <command>", "Run a command and show its wall time, CPU time and peak memory", timeCommand, {
+		"     CPU time and memory are those of the whole shell process, including background jobs." });
+	registry.registerBuiltin({ "trace" }, "trace on <file> | trace off", "Record spans of commands and module calls in Chrome trace format", traceCommand, {
+		"     Open the file in Perfetto (ui.perfetto.dev) or chrome://tracing. A trace still on at exit",
+		"     is written then." });
+	registry.registerBuiltin({ "isolate" }, "isolate [on [N] | off]", "Run module calls in N worker processes (default: one per core)", isolateCommand, {
+		"     A module that crashes or hangs then costs a worker, not the shell. A pipeline runs whole",
+		"     in one worker. 'isolate timeout <s>' stops calls that run longer (0: no limit);",
+		"     'isolate bench [count] [bytes]' measures the round trip to a worker." });
+	registry.registerBuiltin({ "stats" }, "stats [json [file] | reset]", "Show call counts and latency percentiles per command and module", statsCommand);
+	registry.registerBuiltin({ "history" }, "history [count]", "Show the last commands entered at the prompt (default 20)", historyCommand, {
+		"     Up/Down browse them, Ctrl+R searches them, Tab completes commands, modules and paths." });
+	registry.registerBuiltin({ "jobs" }, "jobs", "List background jobs",
+		[](const Tokens&) { JobManager::getInstance().list(); });
+	registry.registerBuiltin({ "wait" }, "wait [id|all]", "Wait for a background job (default: the latest) and show its output",
+		[](const Tokens& tokens) {
+			int id = 0;
+			if (tokens.size() >= 2 && tokens[1] == "all")
+				JobManager::getInstance().waitAll();
+			else if (parseJobId(tokens, false, id))
+				JobManager::getInstance().wait(id, false);
+		});
+	registry.registerBuiltin({ "fg" }, "fg [id]", "Show a background job's output as it runs and wait for it",
+		[](const Tokens& tokens) {
+			int id = 0;
+			if (parseJobId(tokens, false, id))
+				JobManager::getInstance().wait(id, true);
+		});
+	registry.registerBuiltin({ "kill" }, "kill <id>", "Cancel a background job",
+		[](const Tokens& tokens) {
+			int id = 0;
+			if (parseJobId(tokens, true, id))
+				JobManager::getInstance().kill(id);
+		});
+	registry.addHelpLine("<module_name> [args]", "Run a module with arguments (use -v for version)");
+	registry.addHelpLine("<command> &", "Run any command as a background job (see jobs, wait, fg, kill)");
+}
+
+// Counts the error lines written to std::cerr (see ErrorLineCounter), so a changed count
+// after a command tells the script runner that the command failed; warnings do not. Pipeline
+// stages and jobs write from their own threads: the counter is atomic, and each thread
+// tracks the line it is writing.
+class ErrorCountingBuffer : public std::streambuf {
+public:
+	explicit ErrorCountingBuffer(std::streambuf* target) : target(target), errors(0) {}
+
+	size_t count() const { return errors.load(std::memory_order_relaxed); }
+
+protected:
+	int overflow(int c) override {
+		if (c == EOF)
+			return 0;
+		char ch = static_cast<char>(c);
+		countErrors(&ch, 1);
+		return target->sputc(ch);
+	}
+
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		countErrors(s, static_cast<size_t>(n));
+		return target->sputn(s, n);
+	}
+
+	int sync() override {
+		return target->pubsync();
+	}
+
+private:
+	void countErrors(const char* data, size_t size) {
+		static thread_local ErrorLineCounter lines;
+		if (size_t found = lines.feed(data, size))
+			errors.fetch_add(found, std::memory_order_relaxed);
+	}
+
+	std::streambuf* target;
+	std::atomic<size_t> errors;
+};
+
+// Installed on std::cout and std::cerr while the shell runs. Output of threads that work for
+// a background job goes into the job (JobContext::write); everything else passes straight
+// through to target. It has no buffer of its own, so threads never share one.
+class JobOutputBuffer : public std::streambuf {
+public:
+	JobOutputBuffer(std::streambuf* target, bool error) : target(target), error(error) {}
+
+protected:
+	int overflow(int c) override {
+		if (c == EOF)
+			return 0;
+		char ch = static_cast<char>(c);
+		return xsputn(&ch, 1) == 1 ? c : EOF;
+	}
+
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		JobContext* job = JobContext::current();
+		if (!job)
+			return target->sputn(s, n);
+		job->write(error, s, static_cast<size_t>(n), target);
+		return n;
+	}
+
+	int sync() override {
+		return JobContext::current() ? 0 : target->pubsync();
+	}
+
+private:
+	std::streambuf* target;
+	bool error;
+};
+
+// Tokenize and dispatch one command line; a trailing "&" token starts it as a background job.
+void executeLine(std::string& command) {
+	static Tokens tokens;
+	ModuleManager::getInstance().applyWatchEvents();
+	// The tokenizer rewrites the line in place, so keep the text a job will run.
+	std::string jobCommand;
+	size_t last = command.find_last_not_of(" \t");
+	if (last != std::string::npos && command[last] == '&')
+		jobCommand = trim(command.substr(0, last));
+	{
+		TraceSpan span("tokenize");
+		CommandTokenizer::tokenize(command, tokens);
+	}
+	if (tokens.empty())
+		return;
+	if (!jobCommand.empty() && tokens.size() > 1 && tokens.back() == "&") {
+		JobManager::getInstance().start(jobCommand);
+		return;
+	}
+	dispatchTokens(tokens);
+}
+
+struct ShellOptions {
+	std::string scriptPath;    // -f <script>
+	bool stopOnError = false;  // -e
+	bool watchModules = false; // -w
+	std::string serveAddress;  // --serve <address>
+	size_t serveWorkers = 0;   // -j <count> with --serve (0: default)
+};
+
+// Output buffer used when no one is watching the prompt (script file or piped stdin).
+const size_t BatchOutputBufferSize = 1 << 20;
+
+void printUsage() {
+	std::cout << "Usage: Mini-Shell [-f <script>] [-e] [-w]" << '\n';
+	std::cout << "  -f <script>  Run the commands in <script> and exit" << '\n';
+	std::cout << "  -e           Stop at the first failing command and exit with status 1" << '\n';
+	std::cout << "  -w           Watch the modules folder and reload changed modules (same as 'watch on')" << '\n';
+	std::cout << "  --serve <address> [-j N]" << '\n';
+	std::cout << "               Run command lines sent by Mini-Shell-client over a local socket, with N" << '\n';
+	std::cout << "               workers; <address> is a socket path or tcp:<port> (loopback only)" << '\n';
+	std::cout << "Commands piped into stdin run the same way as a script." << '\n';
+}
+
+// Reads commands until exit or end of input. Interactive sessions show a prompt; batch
+// sessions (script or pipe) skip it and keep stdout fully buffered until the end or "flush".
+int runShell(std::istream& input, bool interactive, const ShellOptions& options, bool& exitRequested) {
+	ErrorCountingBuffer errors(std::cerr.rdbuf());
+	std::streambuf* originalErr = std::cerr.rdbuf(&errors);
+	JobOutputBuffer jobOut(std::cout.rdbuf(), false), jobErr(std::cerr.rdbuf(), true);
+	std::streambuf* originalOut = std::cout.rdbuf(&jobOut);
+	std::cerr.rdbuf(&jobErr);
+	JobManager& jobs = JobManager::getInstance();
+	int status = 0;
+	size_t lineNumber = 0;
+	std::string command;
+	std::unique_ptr<LineEditor> editor(interactive ? new LineEditor() : nullptr);
+	while (!exitRequested) {
+		size_t errorsBeforeReport = errors.count();
+		jobs.reportFinished();
+		if (options.stopOnError && errors.count() != errorsBeforeReport) {
+			std::cerr << "Stopped after a background job failed" << '\n';
+			status = 1;
+			break;
+		}
+		if (editor ? !editor->readLine("> ", command) : !std::getline(input, command))
+			break;
+		lineNumber++;
+		if (!command.empty() && command.back() == '\r')
+			command.pop_back();
+		size_t first = command.find_first_not_of(" \t");
+		if (first == std::string::npos || (!interactive && command[first] == '#'))
+			continue;
+
+		size_t errorsBefore = errors.count();
+		executeLine(command);
+		if (options.stopOnError && errors.count() != errorsBefore) {
+			std::cerr << "Stopped at line " << lineNumber << " after an error" << '\n';
+			status = 1;
+			break;
+		}
+	}
+	// "exit" cancels the jobs that are still running; the end of a script waits for them.
+	size_t errorsBeforeJobs = errors.count();
+	jobs.finishAll(exitRequested || status != 0);
+	if (options.stopOnError && errors.count() != errorsBeforeJobs)
+		status = 1;
+	std::cout.rdbuf(originalOut);
+	std::cerr.rdbuf(originalErr);
+	std::cout.flush();
+	return status;
+}
+
+//------------------------------------------------------------
+// Server Mode
+//------------------------------------------------------------
+
+// "--serve <address>": one warm shell process runs command lines for many clients, so a call
+// skips process start-up, the module scan and library loading (protocol in shell_ipc.h). A
+// fixed pool of workers serves the connections: a worker keeps a connection (a session) until
+// the client disconnects, and further connections wait until a worker is free. Each request
+// runs under its own JobContext, which collects its output for the reply and lets the server
+// cancel it when it stops (Ctrl+C, SIGTERM or a client's stop request).
+class ShellServer {
+public:
+	explicit ShellServer(size_t workerCount) : workerCount(workerCount), stopping(false) {}
+
+	int run(const std::string& address) {
+		std::string error;
+		ipc::Socket listener = ipc::startup() ? ipc::listenOn(address, error) : ipc::InvalidSocket;
+		if (listener == ipc::InvalidSocket) {
+			std::cerr << "Error: cannot serve on " << address << ": " << error << '\n';
+			return 1;
+		}
+		interruptRequested = 0;
+		std::signal(SIGINT, &ShellServer::interrupt);
+		std::signal(SIGTERM, &ShellServer::interrupt);
+		JobOutputBuffer jobOut(std::cout.rdbuf(), false), jobErr(std::cerr.rdbuf(), true);
+		std::streambuf* originalOut = std::cout.rdbuf(&jobOut);
+		std::streambuf* originalErr = std::cerr.rdbuf(&jobErr);
+		std::cout << "Serving on " << address << " with " << workerCount << " workers" << '\n';
+		std::cout.flush();
+
+		for (size_t i = 0; i < workerCount; i++)
+			workers.emplace_back(&ShellServer::work, this);
+		const int PollMilliseconds = 200;   // how often a stop request is noticed
+		while (!stopping && !interruptRequested) {
+			int ready = ipc::waitReadable(listener, PollMilliseconds);
+			if (ready < 0) {
+				std::cerr << "Error: " << ipc::lastError() << '\n';
+				break;
+			}
+			ipc::Socket client = ready ? ipc::acceptClient(listener) : ipc::InvalidSocket;
+			if (client == ipc::InvalidSocket)
+				continue;
+			std::lock_guard<std::mutex> lock(mutex);
+			waiting.push_back(client);
+			available.notify_one();
+		}
+		ipc::closeSocket(listener);
+		ipc::removeAddress(address);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			for (ipc::Socket client : waiting)
+				ipc::closeSocket(client);
+			waiting.clear();
+			for (auto& session : sessions) {
+				ipc::shutdownSocket(session.first);
+				if (session.second)
+					session.second->cancel();
+			}
+			available.notify_all();
+		}
+		for (auto& worker : workers)
+			worker.join();
+		workers.clear();
+		std::signal(SIGINT, SIG_DFL);
+		std::signal(SIGTERM, SIG_DFL);
+		std::cout << "Server stopped" << '\n';
+		std::cout.rdbuf(originalOut);
+		std::cerr.rdbuf(originalErr);
+		std::cout.flush();
+		return 0;
+	}
+
+private:
+	ShellServer(const ShellServer&) = delete;
+	ShellServer& operator=(const ShellServer&) = delete;
+
+	static void interrupt(int) { interruptRequested = 1; }
+
+	void work() {
+		for (;;) {
+			ipc::Socket client;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				available.wait(lock, [&]() { return stopping || !waiting.empty(); });
+				if (waiting.empty())
+					return;
+				client = waiting.front();
+				waiting.pop_front();
+				sessions[client] = nullptr;
+			}
+			serve(client);
+			std::lock_guard<std::mutex> lock(mutex);
+			sessions.erase(client);
+			ipc::closeSocket(client);
+		}
+	}
+
+	void serve(ipc::Socket client) {
+		uint8_t type = 0;
+		std::string line;
+		while (!stopping && ipc::readFrame(client, type, line)) {
+			if (type == ipc::Stop) {
+				stopping = true;
+				break;
+			}
+			if (type != ipc::Command || !runRequest(client, line))
+				break;
+		}
+	}
+
+	// Runs one command line and sends its output and status. False ends the session ("exit",
+	// or the client is gone).
+	bool runRequest(ipc::Socket client, std::string& line) {
+		if (trim(line) == "exit") {
+			ipc::writeStatus(client, 0);
+			return false;
+		}
+		JobContext job;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			sessions[client] = &job;
+		}
+		{
+			JobContext::Scope scope(&job);
+			runLine(line);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			sessions[client] = nullptr;
+		}
+		const size_t FrameBytes = 1 << 20;
+		for (const auto& chunk : job.takeOutput()) {
+			for (size_t offset = 0; offset < chunk.second.size(); offset += FrameBytes) {
+				size_t size = std::min(FrameBytes, chunk.second.size() - offset);
+				if (!ipc::writeFrame(client, chunk.first ? ipc::Err : ipc::Out, chunk.second.data() + offset, size))
+					return false;
+			}
+		}
+		return ipc::writeStatus(client, job.wroteError() ? 1 : 0);
+	}
+
+	// executeLine() for a session. Background jobs are refused: their output would arrive
+	// after the reply that ends the request.
+	static void runLine(std::string& line) {
+		ModuleManager::getInstance().applyWatchEvents();
+		Tokens tokens;
+		{
+			TraceSpan span("tokenize");
+			CommandTokenizer::tokenize(line, tokens);
+		}
+		if (tokens.size() > 1 && tokens.back() == "&") {
+			std::cerr << "Error: background jobs are not available in server sessions" << '\n';
+		}
+		else if (!tokens.empty()) {
+			try {
+				dispatchTokens(tokens);
+			}
+			catch (const std::exception& e) {
+				std::cerr << "Exception in server session: " << e.what() << '\n';
+			}
+		}
+	}
+
+	static volatile std::sig_atomic_t interruptRequested;
+
+	const size_t workerCount;
+	std::atomic<bool> stopping;
+	std::mutex mutex;
+	std::condition_variable available;
+	std::deque<ipc::Socket> waiting;                 // accepted, no worker yet
+	std::map<ipc::Socket, JobContext*> sessions;     // served, with the request running (if any)
+	std::vector<std::thread> workers;
+};
+
+volatile std::sig_atomic_t ShellServer::interruptRequested = 0;
+
+int main(int argc, char* argv[]) {
+	setlocale(LC_ALL, "English");
+	if (argc == 5 && std::string(argv[1]) == "--module-worker") // started by "isolate on"
+		return runModuleWorker(argv[2], static_cast<size_t>(std::atoi(argv[3])), std::strtoul(argv[4], nullptr, 10));
+	ShellOptions options;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-f" && i + 1 < argc) {
+			options.scriptPath = argv[++i];
+		}
+		else if (arg == "-e") {
+			options.stopOnError = true;
+		}
+		else if (arg == "-w") {
+			options.watchModules = true;
+		}
+		else if (arg == "--serve" && i + 1 < argc) {
+			options.serveAddress = argv[++i];
+		}
+		else if (arg == "-j" && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+			options.serveWorkers = static_cast<size_t>(std::atoi(argv[++i]));
+		}
+		else {
+			printUsage();
+			return arg == "-h" || arg == "--help" ? 0 : 2;
+		}
+	}
+
+	CommandRegistry& registry = CommandRegistry::getInstance();
+	bool exitRequested = false;
+	registerBuiltins(registry, exitRequested);
+	ModuleManager& manager = ModuleManager::getInstance(); // registers the installed modules (loaded on first use)
+	if (options.watchModules)
+		manager.startWatching();
+
+	bool interactive = options.scriptPath.empty() && platform::stdinIsTerminal();
+	if (!interactive) {
+		// Must happen before the first write to stdout.
+		std::setvbuf(stdout, nullptr, _IOFBF, BatchOutputBufferSize);
+		// Reading the next piped line must not flush stdout either.
+		std::cin.tie(nullptr);
+	}
+	int status = 0;
+	if (!options.serveAddress.empty()) {
+		size_t workers = options.serveWorkers ? options.serveWorkers : std::max<size_t>(8, std::thread::hardware_concurrency());
+		status = ShellServer(workers).run(options.serveAddress);
+	}
+	else if (!options.scriptPath.empty()) {
+		std::ifstream script(options.scriptPath);
+		if (!script) {
+			std::cerr << "Error: cannot open script " << options.scriptPath << '\n';
+			status = 2;
+		}
+		else {
+			status = runShell(script, false, options, exitRequested);
+		}
+	}
+	else {
+		status = runShell(std::cin, interactive, options, exitRequested);
+	}
+	Executor::getInstance().shutdown();
+	ModuleWorkers::getInstance().stop();
+	if (Tracer::enabled())
+		finishTrace();
+	manager.shutdown();
+	return status;
 }
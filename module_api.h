@@ -0,0 +1,546 @@
+#pragma once
+// Mini-Shell module ABI.
+//
+// Modules are shared libraries that export four C functions (see MS_DEFINE_MODULE for the C++
+// helper that generates them):
+//   int   ms_module_query(uint32_t host_abi_version, ms_module_info* info);
+//   void* ms_module_create(void);
+//   int   ms_module_execute(void* instance, const ms_call* call);
+//   void  ms_module_destroy(void* instance);
+//
+// Only C types cross the boundary: arguments are (ptr, len) pairs that point into the host's
+// command line, and output goes through a host callback, so modules built with a different
+// compiler or C++ runtime load safely. Structs start with struct_size so later revisions can
+// append fields; bump MS_MODULE_ABI_VERSION only for incompatible changes.
+//
+// In a pipeline ("math eval-range ... | colstats summary") the stages run concurrently and
+// pass typed column batches (ms_batch) through the read/emit callbacks of ms_call instead of
+// printing and re-parsing text. Modules opt in with MS_CAP_PIPE_INPUT / MS_CAP_PIPE_OUTPUT.
+//
+// Calls may run as background jobs ("math ... &"). Long-running commands should poll the
+// cancelled callback (ms::cancelled() in C++) and return early once it reports 1. The host
+// serializes calls on one instance, so a job and a foreground call never share instance
+// state at the same time. Modules without instance state declare MS_CAP_THREAD_SAFE to be
+// called concurrently, e.g. from several "--serve" sessions.
+//
+// For parallel work, modules use the host's thread pool (ms_call::services; ms::parallelFor
+// and ms::Task in C++) instead of starting their own threads, so that several modules running
+// at once share the cores instead of oversubscribing them.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MS_MODULE_ABI_VERSION 1
+
+#ifdef __cplusplus
+#define MS_EXTERN_C extern "C"
+#else
+#define MS_EXTERN_C
+#endif
+
+#ifdef _WIN32
+#define MS_MODULE_EXPORT MS_EXTERN_C __declspec(dllexport)
+#else
+#define MS_MODULE_EXPORT MS_EXTERN_C __attribute__((visibility("default")))
+#endif
+
+typedef struct ms_str {
+	const char* ptr;
+	size_t len;
+} ms_str;
+
+enum {
+	MS_STREAM_OUT = 1,
+	MS_STREAM_ERR = 2
+};
+
+// Writes len bytes to the given stream. data == NULL and len == 0 asks the host to flush.
+typedef void (*ms_write_fn)(void* host_ctx, int stream, const char* data, size_t len);
+
+enum {
+	MS_COLUMN_DOUBLE = 1,
+	MS_COLUMN_STRING = 2
+};
+
+// One column of a batch: rows values in doubles (MS_COLUMN_DOUBLE) or strings (MS_COLUMN_STRING).
+typedef struct ms_column {
+	ms_str name;
+	uint32_t type;
+	const double* doubles;
+	const ms_str* strings;
+} ms_column;
+
+// A table of rows passed between pipeline stages. A plain array of numbers is a batch with
+// one double column. Text that a stage writes to MS_STREAM_OUT reaches the next stage as
+// batches with one string column named "line".
+typedef struct ms_batch {
+	uint32_t struct_size;
+	size_t rows;
+	size_t column_count;
+	const ms_column* columns;
+} ms_batch;
+
+// Fills *batch with the next batch from the previous stage and returns 1, or returns 0 at the
+// end of the input. The batch stays valid until the next read or the end of the call.
+typedef int (*ms_read_fn)(void* host_ctx, ms_batch* batch);
+
+// Hands a batch to the next stage (the host copies it). Blocks while the next stage is behind.
+// Returns 0 once the next stage has stopped reading; the module may then stop producing.
+typedef int (*ms_emit_fn)(void* host_ctx, const ms_batch* batch);
+
+// Returns 1 once the user has asked to stop the call (e.g. "kill <job>"). Safe to call from
+// any thread while the call runs.
+typedef int (*ms_cancelled_fn)(void* host_ctx);
+
+typedef struct ms_task ms_task;   // opaque handle of a submitted task
+typedef void (*ms_task_fn)(void* arg);
+typedef void (*ms_range_fn)(void* arg, size_t begin, size_t end);
+
+// The host's work-stealing thread pool, one worker per core, shared by all modules. Tasks
+// may submit and wait for further tasks; a waiting thread runs queued work meanwhile. Once
+// the call is cancelled, parallel_for hands out no further chunks; ms_call::cancelled may be
+// polled from inside tasks. Tasks compute; write/read/emit stay on the calling thread.
+typedef struct ms_host_services {
+	uint32_t struct_size;
+	void* host;
+	uint32_t thread_count;
+	// Queues fn(arg). Returns a handle that must be passed to wait() exactly once, or NULL if
+	// the task could not be queued (the caller then runs it itself).
+	ms_task* (*submit)(void* host, ms_task_fn fn, void* arg);
+	// Blocks until the task has run and releases the handle.
+	void (*wait)(void* host, ms_task* task);
+	// Calls fn(arg, begin, end) for consecutive ranges of [0, count) of about grain elements,
+	// on the pool and the calling thread, and returns when all of them are done.
+	void (*parallel_for)(void* host, size_t count, size_t grain, ms_range_fn fn, void* arg);
+
+	// Tracing ("trace on"): tracing() is non-zero while spans are recorded, trace_now() reads
+	// the trace clock in nanoseconds and trace_span() records a finished span of the calling
+	// thread (the name is copied). Older hosts end the table before these fields.
+	int (*tracing)(void* host);
+	uint64_t (*trace_now)(void* host);
+	void (*trace_span)(void* host, const char* name, uint64_t start_ns, uint64_t end_ns);
+} ms_host_services;
+
+// One command invocation. argv excludes the module name.
+typedef struct ms_call {
+	uint32_t struct_size;
+	const ms_str* argv;
+	size_t argc;
+	void* host_ctx;
+	ms_write_fn write;
+	// Pipelines; NULL when there is no previous / next stage (and in hosts that predate them,
+	// whose struct_size ends before these fields).
+	ms_read_fn read;
+	ms_emit_fn emit;
+	// Cooperative cancellation; NULL if the call cannot be cancelled.
+	ms_cancelled_fn cancelled;
+	// Host thread pool; NULL if the host has none (work then runs on the calling thread).
+	const ms_host_services* services;
+} ms_call;
+
+enum {
+	MS_CAP_EXECUTE = 1 << 0,
+	MS_CAP_PIPE_INPUT = 1 << 1,   // reads batches from a previous pipeline stage
+	MS_CAP_PIPE_OUTPUT = 1 << 2,  // emits batches to the next pipeline stage
+	MS_CAP_THREAD_SAFE = 1 << 3   // execute may run on one instance from several threads at once
+};
+
+// Filled in by ms_module_query. Strings must stay valid while the library is loaded.
+typedef struct ms_module_info {
+	uint32_t struct_size;
+	uint32_t abi_version;   // MS_MODULE_ABI_VERSION the module was built against
+	uint32_t capabilities;  // MS_CAP_* bits
+	const char* name;
+	const char* version;
+} ms_module_info;
+
+typedef int (*ms_module_query_fn)(uint32_t host_abi_version, ms_module_info* info);
+typedef void* (*ms_module_create_fn)(void);
+typedef int (*ms_module_execute_fn)(void* instance, const ms_call* call);
+typedef void (*ms_module_destroy_fn)(void* instance);
+
+#ifdef __cplusplus
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string_view>
+
+// C++ convenience layer for module authors. Everything here is compiled into the module.
+namespace ms {
+
+// Read-only view of the call arguments; elements are std::string_view into host memory.
+class Args {
+public:
+	class iterator {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef std::string_view value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef void pointer;
+		typedef std::string_view reference;
+
+		explicit iterator(const ms_str* p) : p(p) {}
+		std::string_view operator*() const { return std::string_view(p->ptr, p->len); }
+		iterator& operator++() { ++p; return *this; }
+		iterator operator++(int) { iterator old = *this; ++p; return old; }
+		bool operator==(const iterator& other) const { return p == other.p; }
+		bool operator!=(const iterator& other) const { return p != other.p; }
+
+	private:
+		const ms_str* p;
+	};
+
+	Args(const ms_str* argv, size_t argc) : argv(argv), argc(argc) {}
+
+	size_t size() const { return argc; }
+	bool empty() const { return argc == 0; }
+	std::string_view operator[](size_t i) const { return std::string_view(argv[i].ptr, argv[i].len); }
+	iterator begin() const { return iterator(argv); }
+	iterator end() const { return iterator(argv + argc); }
+
+private:
+	const ms_str* argv;
+	size_t argc;
+};
+
+// streambuf that batches writes and hands them to the host's write callback.
+class SinkBuffer : public std::streambuf {
+public:
+	SinkBuffer(const ms_call* call, int stream) : call(call), stream(stream) {
+		setp(buffer, buffer + sizeof(buffer));
+	}
+	~SinkBuffer() { emit(); }
+
+protected:
+	int overflow(int c) override {
+		emit();
+		if (c != traits_type::eof()) {
+			*pptr() = static_cast<char>(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	int sync() override {
+		emit();
+		call->write(call->host_ctx, stream, nullptr, 0);
+		return 0;
+	}
+
+private:
+	void emit() {
+		if (pptr() > pbase()) {
+			call->write(call->host_ctx, stream, pbase(), static_cast<size_t>(pptr() - pbase()));
+			setp(buffer, buffer + sizeof(buffer));
+		}
+	}
+
+	const ms_call* call;
+	int stream;
+	char buffer[4096];
+};
+
+// Pipeline side of a call. hasInput() / hasOutput() tell whether a previous / next stage
+// is connected; without a next stage, results are printed as text as usual.
+class Pipe {
+public:
+	explicit Pipe(const ms_call* call) : call(call) {}
+
+	bool hasInput() const { return covers(offsetof(ms_call, read)) && call->read; }
+	bool hasOutput() const { return covers(offsetof(ms_call, emit)) && call->emit; }
+
+	// Next batch from the previous stage; false at the end of the input.
+	bool read(ms_batch& batch) const {
+		batch.struct_size = sizeof(ms_batch);
+		return hasInput() && call->read(call->host_ctx, &batch) != 0;
+	}
+
+	// False once the next stage has stopped reading.
+	bool emit(const ms_batch& batch) const {
+		return hasOutput() && call->emit(call->host_ctx, &batch) != 0;
+	}
+
+	// Emits count rows of double columns (values[c][row] for each named column).
+	bool emitDoubles(const char* const* names, const double* const* values, size_t columnCount, size_t count) const {
+		ms_column columns[8];
+		if (columnCount > sizeof(columns) / sizeof(columns[0]))
+			return false;
+		for (size_t c = 0; c < columnCount; c++) {
+			columns[c].name.ptr = names[c];
+			columns[c].name.len = std::strlen(names[c]);
+			columns[c].type = MS_COLUMN_DOUBLE;
+			columns[c].doubles = values[c];
+			columns[c].strings = nullptr;
+		}
+		ms_batch batch;
+		batch.struct_size = sizeof(batch);
+		batch.rows = count;
+		batch.column_count = columnCount;
+		batch.columns = columns;
+		return emit(batch);
+	}
+
+	// Index of the column called name, or of the 1-based column number it holds; -1 if none.
+	static long findColumn(const ms_batch& batch, std::string_view name) {
+		for (size_t c = 0; c < batch.column_count; c++) {
+			if (std::string_view(batch.columns[c].name.ptr, batch.columns[c].name.len) == name)
+				return static_cast<long>(c);
+		}
+		long number = 0;
+		for (char ch : name) {
+			if (ch < '0' || ch > '9')
+				return -1;
+			number = number * 10 + (ch - '0');
+		}
+		return number >= 1 && static_cast<size_t>(number) <= batch.column_count ? number - 1 : -1;
+	}
+
+private:
+	bool covers(size_t offset) const { return call->struct_size >= offset + sizeof(void*); }
+
+	const ms_call* call;
+};
+
+// Cancellation state of a call. Take it on the calling thread with ms::cancelToken() and
+// hand it to worker threads, which cannot use ms::cancelled() themselves.
+class CancelToken {
+public:
+	explicit CancelToken(const ms_call* call = nullptr) : call(call) {}
+
+	bool requested() const {
+		return call && call->struct_size >= offsetof(ms_call, cancelled) + sizeof(void*) &&
+			call->cancelled && call->cancelled(call->host_ctx) != 0;
+	}
+
+private:
+	const ms_call* call;
+};
+
+namespace detail {
+// The call being dispatched on this thread (see dispatch()).
+inline const ms_call*& currentCall() {
+	static thread_local const ms_call* call = nullptr;
+	return call;
+}
+} // namespace detail
+
+inline CancelToken cancelToken() { return CancelToken(detail::currentCall()); }
+
+// True once the running call has been cancelled; poll it in long loops and return early.
+inline bool cancelled() { return cancelToken().requested(); }
+
+// The host thread pool of the running call, or nullptr.
+inline const ms_host_services* hostServices() {
+	const ms_call* call = detail::currentCall();
+	if (!call || call->struct_size < offsetof(ms_call, services) + sizeof(void*) || !call->services)
+		return nullptr;
+	return call->services->struct_size >= offsetof(ms_host_services, tracing) ? call->services : nullptr;
+}
+
+// Threads that parallelFor() can use (1 without a host pool).
+inline size_t concurrency() {
+	const ms_host_services* services = hostServices();
+	return services && services->thread_count ? services->thread_count : 1;
+}
+
+namespace detail {
+// Runs work on a pool thread as part of call, so ms::cancelled() and nested parallelFor()
+// calls behave as on the calling thread. The first exception is kept for the caller.
+struct PoolWork {
+	const ms_call* call;
+	std::exception_ptr error;
+	std::mutex mutex;
+
+	template <class F> void run(F&& f) {
+		const ms_call* previous = currentCall();
+		currentCall() = call;
+		try {
+			f();
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error)
+				error = std::current_exception();
+		}
+		currentCall() = previous;
+	}
+};
+} // namespace detail
+
+// Calls body(begin, end) for ranges of [0, count) of about grain elements on the host pool.
+// Without a pool the whole range runs on the calling thread. Rethrows the first exception.
+template <class Body>
+void parallelFor(size_t count, size_t grain, Body body) {
+	const ms_host_services* services = hostServices();
+	if (!services || !services->parallel_for) {
+		body(size_t(0), count);
+		return;
+	}
+	struct Loop : detail::PoolWork {
+		Body* body;
+	} loop;
+	loop.call = detail::currentCall();
+	loop.body = &body;
+	services->parallel_for(services->host, count, grain, [](void* arg, size_t begin, size_t end) {
+		Loop* loop = static_cast<Loop*>(arg);
+		loop->run([&]() { (*loop->body)(begin, end); });
+	}, &loop);
+	if (loop.error)
+		std::rethrow_exception(loop.error);
+}
+
+// A function queued on the host pool (run at once without one). wait() blocks until it has
+// run and rethrows its exception; the destructor waits too.
+class Task {
+public:
+	template <class F>
+	explicit Task(F f) : state(new State()), services(hostServices()), task(nullptr) {
+		state->call = detail::currentCall();
+		state->fn = std::move(f);
+		if (services && services->submit)
+			task = services->submit(services->host, &Task::run, state.get());
+		if (!task)
+			run(state.get());
+	}
+
+	~Task() {
+		try {
+			wait();
+		}
+		catch (...) {
+		}
+	}
+
+	void wait() {
+		if (task) {
+			services->wait(services->host, task);
+			task = nullptr;
+		}
+		if (state->error) {
+			std::exception_ptr error = state->error;
+			state->error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+private:
+	struct State : detail::PoolWork {
+		std::function<void()> fn;
+	};
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	static void run(void* arg) {
+		State* state = static_cast<State*>(arg);
+		state->run(state->fn);
+	}
+
+	std::unique_ptr<State> state;
+	const ms_host_services* services;
+	ms_task* task;
+};
+
+// Records a span from construction to destruction in the host's trace while "trace on" is
+// active; otherwise it costs one call into the host.
+class TraceSpan {
+public:
+	explicit TraceSpan(const char* name) : services(tracingServices()), name(name), start(0) {
+		if (services)
+			start = services->trace_now(services->host);
+	}
+
+	~TraceSpan() {
+		if (services)
+			services->trace_span(services->host, name, start, services->trace_now(services->host));
+	}
+
+private:
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+	static const ms_host_services* tracingServices() {
+		const ms_host_services* services = hostServices();
+		if (!services || services->struct_size < sizeof(ms_host_services) || !services->tracing ||
+			!services->tracing(services->host))
+			return nullptr;
+		return services;
+	}
+
+	const ms_host_services* services;
+	const char* name;
+	uint64_t start;
+};
+
+// Base class for C++ modules. Return 0 on success; exceptions are caught at the boundary.
+// Modules that take part in pipelines override executeStage() and declare their
+// capabilities with MS_DEFINE_MODULE_WITH_CAPS.
+class Module {
+public:
+	virtual ~Module() {}
+	virtual int execute(Args args, std::ostream& out, std::ostream& err) = 0;
+	virtual int executeStage(Args args, const Pipe& pipe, std::ostream& out, std::ostream& err) {
+		(void)pipe;
+		return execute(args, out, err);
+	}
+};
+
+inline int fillInfo(ms_module_info* info, const char* name, const char* version, uint32_t capabilities) {
+	if (!info || info->struct_size < sizeof(ms_module_info))
+		return 1;
+	info->abi_version = MS_MODULE_ABI_VERSION;
+	info->capabilities = capabilities;
+	info->name = name;
+	info->version = version;
+	return 0;
+}
+
+inline int dispatch(Module* module, const ms_call* call) {
+	if (!call || call->struct_size < offsetof(ms_call, read))
+		return 1;
+	SinkBuffer outBuffer(call, MS_STREAM_OUT), errBuffer(call, MS_STREAM_ERR);
+	std::ostream out(&outBuffer), err(&errBuffer);
+	struct CurrentCall {
+		explicit CurrentCall(const ms_call* call) : previous(detail::currentCall()) { detail::currentCall() = call; }
+		~CurrentCall() { detail::currentCall() = previous; }
+		const ms_call* previous;
+	} current(call);
+	try {
+		return module->executeStage(Args(call->argv, call->argc), Pipe(call), out, err);
+	}
+	catch (const std::exception& e) {
+		err << "Exception in module: " << e.what() << '\n';
+	}
+	catch (...) {
+		err << "Unknown exception in module" << '\n';
+	}
+	return 1;
+}
+
+} // namespace ms
+
+// Defines the exported entry points for a module class derived from ms::Module.
+#define MS_DEFINE_MODULE(ModuleClass, moduleName, moduleVersion) \
+	MS_DEFINE_MODULE_WITH_CAPS(ModuleClass, moduleName, moduleVersion, MS_CAP_EXECUTE)
+
+// Same, for modules that also declare MS_CAP_PIPE_INPUT and/or MS_CAP_PIPE_OUTPUT.
+#define MS_DEFINE_MODULE_WITH_CAPS(ModuleClass, moduleName, moduleVersion, capabilities) \
+	MS_MODULE_EXPORT int ms_module_query(uint32_t, ms_module_info* info) { \
+		return ms::fillInfo(info, moduleName, moduleVersion, capabilities); \
+	} \
+	MS_MODULE_EXPORT void* ms_module_create(void) { \
+		try { return static_cast<ms::Module*>(new ModuleClass()); } \
+		catch (...) { return nullptr; } \
+	} \
+	MS_MODULE_EXPORT int ms_module_execute(void* instance, const ms_call* call) { \
+		return ms::dispatch(static_cast<ms::Module*>(instance), call); \
+	} \
+	MS_MODULE_EXPORT void ms_module_destroy(void* instance) { \
+		delete static_cast<ms::Module*>(instance); \
+	}
+#endif
@@ -0,0 +1,596 @@
+#include <ostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <limits>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "../../module_api.h" // Shared module ABI (ms::Module, MS_DEFINE_MODULE, ms::parallelFor)
+
+//------------------------------------------------------------
+// Memory-Mapped Input
+//------------------------------------------------------------
+
+// Read-only mapping of a whole file. data() is null for empty or unreadable files;
+// error() tells the two apart.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) : m_data(nullptr), m_size(0) {
+#ifdef _WIN32
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        m_mapping = nullptr;
+        if (m_file == INVALID_HANDLE_VALUE) {
+            m_error = "cannot open " + path;
+            return;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size)) {
+            m_error = "cannot stat " + path;
+            return;
+        }
+        m_size = static_cast<size_t>(size.QuadPart);
+        if (m_size == 0)
+            return;
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping)
+            m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!m_data)
+            m_error = "cannot map " + path;
+#else
+        m_fd = open(path.c_str(), O_RDONLY);
+        if (m_fd < 0) {
+            m_error = "cannot open " + path;
+            return;
+        }
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) {
+            m_error = "cannot stat " + path;
+            return;
+        }
+        m_size = static_cast<size_t>(st.st_size);
+        if (m_size == 0)
+            return;
+        void* mapped = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (mapped == MAP_FAILED) {
+            m_error = "cannot map " + path;
+            return;
+        }
+        madvise(mapped, m_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const char*>(mapped);
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+        if (m_data) munmap(const_cast<char*>(m_data), m_size);
+        if (m_fd >= 0) close(m_fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    const std::string& error() const { return m_error; }
+
+private:
+    const char* m_data;
+    size_t m_size;
+    std::string m_error;
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_fd;
+#endif
+};
+
+//------------------------------------------------------------
+// Sketches
+//------------------------------------------------------------
+
+// Merging t-digest (k1 scale function). Memory is bounded by the compression factor,
+// and two digests merge into one, so per-thread digests combine after a parallel pass.
+class TDigest {
+public:
+    explicit TDigest(double compression = 200.0)
+        : m_compression(compression), m_total(0),
+          m_min(std::numeric_limits<double>::infinity()), m_max(-std::numeric_limits<double>::infinity()) {
+    }
+
+    void add(double x) {
+        m_buffer.push_back({ x, 1.0 });
+        m_min = std::min(m_min, x);
+        m_max = std::max(m_max, x);
+        if (m_buffer.size() >= bufferLimit())
+            compress();
+    }
+
+    void merge(const TDigest& other) {
+        m_buffer.insert(m_buffer.end(), other.m_centroids.begin(), other.m_centroids.end());
+        m_buffer.insert(m_buffer.end(), other.m_buffer.begin(), other.m_buffer.end());
+        m_min = std::min(m_min, other.m_min);
+        m_max = std::max(m_max, other.m_max);
+        compress();
+    }
+
+    void compress() {
+        if (m_buffer.empty())
+            return;
+        m_buffer.insert(m_buffer.end(), m_centroids.begin(), m_centroids.end());
+        std::sort(m_buffer.begin(), m_buffer.end(),
+            [](const Centroid& a, const Centroid& b) { return a.mean < b.mean; });
+        double total = 0;
+        for (const auto& c : m_buffer)
+            total += c.weight;
+
+        m_centroids.clear();
+        Centroid current = m_buffer[0];
+        double weightSoFar = 0;
+        double limit = total * qLimit(0);
+        for (size_t i = 1; i < m_buffer.size(); i++) {
+            const Centroid& next = m_buffer[i];
+            if (weightSoFar + current.weight + next.weight <= limit) {
+                current.mean += (next.mean - current.mean) * next.weight / (current.weight + next.weight);
+                current.weight += next.weight;
+            }
+            else {
+                weightSoFar += current.weight;
+                m_centroids.push_back(current);
+                limit = total * qLimit(weightSoFar / total);
+                current = next;
+            }
+        }
+        m_centroids.push_back(current);
+        m_buffer.clear();
+        m_total = total;
+    }
+
+    // Both lookups expect compress() to have been called after the last add/merge.
+    double quantile(double q) const {
+        if (m_centroids.empty())
+            return std::numeric_limits<double>::quiet_NaN();
+        if (m_centroids.size() == 1)
+            return m_centroids[0].mean;
+        double target = q * m_total;
+        const Centroid& first = m_centroids.front();
+        if (target < first.weight / 2)
+            return m_min + (first.mean - m_min) * target / (first.weight / 2);
+        double cumulative = 0;
+        for (size_t i = 0; i + 1 < m_centroids.size(); i++) {
+            const Centroid& a = m_centroids[i];
+            const Centroid& b = m_centroids[i + 1];
+            double left = cumulative + a.weight / 2;
+            double right = cumulative + a.weight + b.weight / 2;
+            if (target <= right)
+                return a.mean + (b.mean - a.mean) * (target - left) / (right - left);
+            cumulative += a.weight;
+        }
+        const Centroid& last = m_centroids.back();
+        double fromEnd = m_total - target;
+        return m_max - (m_max - last.mean) * fromEnd / (last.weight / 2);
+    }
+
+    double cdf(double x) const {
+        if (m_centroids.empty() || x < m_min)
+            return 0.0;
+        if (x >= m_max)
+            return 1.0;
+        const Centroid& first = m_centroids.front();
+        if (x < first.mean)
+            return first.mean > m_min ? (x - m_min) / (first.mean - m_min) * first.weight / 2 / m_total : 0.0;
+        double cumulative = 0;
+        for (size_t i = 0; i + 1 < m_centroids.size(); i++) {
+            const Centroid& a = m_centroids[i];
+            const Centroid& b = m_centroids[i + 1];
+            if (x < b.mean) {
+                double left = cumulative + a.weight / 2;
+                double right = cumulative + a.weight + b.weight / 2;
+                double f = b.mean > a.mean ? (x - a.mean) / (b.mean - a.mean) : 0.0;
+                return (left + (right - left) * f) / m_total;
+            }
+            cumulative += a.weight;
+        }
+        const Centroid& last = m_centroids.back();
+        double f = m_max > last.mean ? (x - last.mean) / (m_max - last.mean) : 1.0;
+        return (m_total - last.weight / 2 + last.weight / 2 * f) / m_total;
+    }
+
+    size_t centroids() const { return m_centroids.size(); }
+
+private:
+    struct Centroid {
+        double mean;
+        double weight;
+    };
+
+    size_t bufferLimit() const { return static_cast<size_t>(m_compression) * 5; }
+
+    // Largest cumulative quantile a centroid starting at q may reach: k^-1(k(q) + 1) with
+    // k(q) = compression / (2 pi) * asin(2q - 1).
+    double qLimit(double q) const {
+        const double pi = 3.14159265358979323846;
+        double k = m_compression / (2 * pi) * std::asin(2 * q - 1) + 1;
+        if (k >= m_compression / 4)
+            return 1.0;
+        return (std::sin(k * 2 * pi / m_compression) + 1) / 2;
+    }
+
+    double m_compression;
+    double m_total;
+    double m_min, m_max;
+    std::vector<Centroid> m_centroids;
+    std::vector<Centroid> m_buffer;
+};
+
+// One-pass summary of a column: Welford moments, extremes and a t-digest.
+struct ColumnSketch {
+    uint64_t count = 0;
+    uint64_t invalid = 0;
+    double mean = 0;
+    double m2 = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    TDigest digest;
+
+    void add(double x) {
+        count++;
+        double delta = x - mean;
+        mean += delta / count;
+        m2 += delta * (x - mean);
+        min = std::min(min, x);
+        max = std::max(max, x);
+        digest.add(x);
+    }
+
+    // Chan et al. pairwise combination of the moments.
+    void merge(const ColumnSketch& other) {
+        invalid += other.invalid;
+        if (other.count == 0)
+            return;
+        if (count == 0) {
+            count = other.count;
+            mean = other.mean;
+            m2 = other.m2;
+        }
+        else {
+            uint64_t total = count + other.count;
+            double delta = other.mean - mean;
+            mean += delta * other.count / total;
+            m2 += other.m2 + delta * delta * (static_cast<double>(count) * other.count / total);
+            count = total;
+        }
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        digest.merge(other.digest);
+    }
+
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0.0; }
+};
+
+//------------------------------------------------------------
+// Column Scanning
+//------------------------------------------------------------
+
+struct ScanOptions {
+    size_t column = 0;    // zero based
+    std::string columnName = "1"; // col= as given; pipeline input also accepts column names
+    char separator = ',';
+    bool header = false;  // skip the first line
+    bool binary = false;  // raw little-endian float64 values
+    size_t bins = 10;
+};
+
+// Work is handed out to the host pool in chunks of this size.
+const size_t ChunkSize = size_t(32) << 20;
+
+// Parses one non-empty, trimmed text field.
+inline void addField(const char* field, const char* fieldEnd, ColumnSketch& sketch) {
+    if (*field == '+') field++;
+    double value;
+    auto result = std::from_chars(field, fieldEnd, value);
+    if (result.ec == std::errc() && result.ptr == fieldEnd && std::isfinite(value))
+        sketch.add(value);
+    else
+        sketch.invalid++;
+}
+
+// Parses the requested field of every line that starts inside [begin, end).
+void scanTextChunk(const char* data, size_t size, size_t begin, size_t end,
+    const ScanOptions& options, ColumnSketch& sketch) {
+    size_t pos = begin;
+    // A line belongs to the chunk where it starts; skip the tail of the previous one.
+    if (pos > 0 && data[pos - 1] != '\n') {
+        const void* nl = std::memchr(data + pos, '\n', size - pos);
+        pos = nl ? static_cast<const char*>(nl) - data + 1 : size;
+    }
+    while (pos < end) {
+        const char* line = data + pos;
+        const void* nl = std::memchr(line, '\n', size - pos);
+        const char* lineEnd = nl ? static_cast<const char*>(nl) : data + size;
+        pos = lineEnd - data + 1;
+
+        const char* field = line;
+        for (size_t c = 0; c < options.column && field < lineEnd; c++) {
+            const void* sep = std::memchr(field, options.separator, lineEnd - field);
+            field = sep ? static_cast<const char*>(sep) + 1 : lineEnd;
+        }
+        const void* sep = std::memchr(field, options.separator, lineEnd - field);
+        const char* fieldEnd = sep ? static_cast<const char*>(sep) : lineEnd;
+        while (field < fieldEnd && (*field == ' ' || *field == '\t' || *field == '"')) field++;
+        while (fieldEnd > field && (fieldEnd[-1] == ' ' || fieldEnd[-1] == '\r' || fieldEnd[-1] == '"')) fieldEnd--;
+        if (field == fieldEnd) {
+            if (lineEnd > line && !(lineEnd - line == 1 && *line == '\r'))
+                sketch.invalid++;
+            continue;
+        }
+        addField(field, fieldEnd, sketch);
+    }
+}
+
+void scanBinaryChunk(const char* data, size_t begin, size_t end, ColumnSketch& sketch) {
+    for (size_t pos = begin; pos + sizeof(double) <= end; pos += sizeof(double)) {
+        double value;
+        std::memcpy(&value, data + pos, sizeof(value));
+        if (std::isfinite(value))
+            sketch.add(value);
+        else
+            sketch.invalid++;
+    }
+}
+
+bool scanFile(const std::string& path, const ScanOptions& options, ColumnSketch& result, std::ostream& err) {
+    MappedFile file(path);
+    if (!file.error().empty()) {
+        err << "Error: " << file.error() << '\n';
+        return false;
+    }
+    const char* data = file.data();
+    size_t size = file.size();
+    size_t start = 0;
+    if (options.binary) {
+        size -= size % sizeof(double);
+    }
+    else if (options.header && size > 0) {
+        const void* nl = std::memchr(data, '\n', size);
+        start = nl ? static_cast<const char*>(nl) - data + 1 : size;
+    }
+
+    // The chunks are scanned on the host pool (or all here without one). Each chunk folds into
+    // its own sketch, and merging them in chunk order keeps the result independent of which
+    // thread scanned what.
+    size_t chunks = (size - start + ChunkSize - 1) / ChunkSize;
+    std::vector<ColumnSketch> sketches(chunks);
+    ms::CancelToken cancel = ms::cancelToken();
+    ms::parallelFor(chunks, 1, [&](size_t first, size_t last) {
+        for (size_t chunk = first; chunk < last && !cancel.requested(); chunk++) {
+            size_t begin = start + chunk * ChunkSize;
+            size_t end = std::min(size, begin + ChunkSize);
+            if (options.binary)
+                scanBinaryChunk(data, begin, end, sketches[chunk]);
+            else
+                scanTextChunk(data, size, begin, end, options, sketches[chunk]);
+        }
+    });
+
+    for (const auto& sketch : sketches)
+        result.merge(sketch);
+    result.digest.compress();
+    return true;
+}
+
+// Folds the batches of a previous pipeline stage into one sketch. Double columns are taken
+// as they are; string columns (such as the "line" rows of a text-only stage) are parsed like
+// fields of a text file.
+bool scanPipe(const ms::Pipe& pipe, const ScanOptions& options, ColumnSketch& result, std::ostream& err) {
+    ms_batch batch;
+    while (!ms::cancelled() && pipe.read(batch)) {
+        if (batch.rows == 0)
+            continue;
+        long index = ms::Pipe::findColumn(batch, options.columnName);
+        if (index < 0) {
+            err << "Error: input has no column '" << options.columnName << "'" << '\n';
+            return false;
+        }
+        const ms_column& column = batch.columns[index];
+        if (column.type == MS_COLUMN_DOUBLE) {
+            for (size_t r = 0; r < batch.rows; r++) {
+                if (std::isfinite(column.doubles[r]))
+                    result.add(column.doubles[r]);
+                else
+                    result.invalid++;
+            }
+            continue;
+        }
+        for (size_t r = 0; r < batch.rows; r++) {
+            const char* field = column.strings[r].ptr;
+            const char* fieldEnd = field + column.strings[r].len;
+            while (field < fieldEnd && (*field == ' ' || *field == '\t')) field++;
+            while (fieldEnd > field && (fieldEnd[-1] == ' ' || fieldEnd[-1] == '\t')) fieldEnd--;
+            if (field < fieldEnd)
+                addField(field, fieldEnd, result);
+        }
+    }
+    result.digest.compress();
+    return true;
+}
+
+//------------------------------------------------------------
+// ColStats Module Implementation
+//------------------------------------------------------------
+class ColStatsModule : public ms::Module {
+public:
+    ColStatsModule() {}
+    ~ColStatsModule() {}
+
+    int execute(ms::Args arguments, std::ostream& out, std::ostream& err) override {
+        std::vector<std::string> args(arguments.begin(), arguments.end());
+        if (args.empty()) {
+            printUsage(err);
+            return 1;
+        }
+        if (args[0] == "help" || args[0] == "h" || args[0] == "?") {
+            printHelp(out);
+            return 0;
+        }
+        if (args[0] == "summary") {
+            return summary(args, out, err);
+        }
+        err << "Error: unknown command '" << args[0] << "'" << '\n';
+        printUsage(err);
+        return 1;
+    }
+
+    // In a pipeline, "summary [options]" summarizes the output of the previous stage.
+    int executeStage(ms::Args arguments, const ms::Pipe& pipe, std::ostream& out, std::ostream& err) override {
+        if (!pipe.hasInput() || arguments.empty() || arguments[0] != "summary")
+            return execute(arguments, out, err);
+        std::vector<std::string> args(arguments.begin(), arguments.end());
+        ScanOptions options;
+        if (!parseOptions(args, 1, options, err))
+            return 1;
+        auto start = std::chrono::steady_clock::now();
+        ColumnSketch sketch;
+        if (!scanPipe(pipe, options, sketch, err))
+            return 1;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        print(sketch, options, out);
+        out << "Streamed in " << std::fixed << std::setprecision(3) << seconds * 1000 << " ms"
+            << std::defaultfloat << '\n';
+        return 0;
+    }
+
+private:
+    static void printUsage(std::ostream& err) {
+        err << "Usage:" << '\n';
+        err << "  help[/h/?]                  - Display detailed help" << '\n';
+        err << "  summary <file> [options]    - Summarize one column of a CSV or binary file" << '\n';
+    }
+
+    static void printHelp(std::ostream& out) {
+        out << "ColStats Module Help - Detailed Description:" << '\n';
+        out << "  summary <file> [col=N] [sep=C] [header] [bin] [bins=N]" << '\n';
+        out << "    col=N    1-based column of a delimited text file (default 1)" << '\n';
+        out << "    sep=C    field separator (default ','; use sep=tab for tabs)" << '\n';
+        out << "    header   skip the first line" << '\n';
+        out << "    bin      the file is raw little-endian float64 values" << '\n';
+        out << "    bins=N   number of histogram bins (default 10, 0 to disable)" << '\n';
+        out << "  <command> | summary [col=N|col=name] [bins=N]" << '\n';
+        out << "    summarizes the output of a previous pipeline stage, e.g." << '\n';
+        out << "    'math eval-range sin(x) 0 10 0.001 | colstats summary col=y'. Columns are" << '\n';
+        out << "    chosen by name or number; plain text arrives as the column 'line'." << '\n';
+        out << "The file is memory-mapped and scanned once in parallel chunks. Count, mean," << '\n';
+        out << "variance (Welford), min and max are exact; quantiles and the histogram come" << '\n';
+        out << "from a merged t-digest, so memory stays constant regardless of file size." << '\n';
+    }
+
+    static int summary(const std::vector<std::string>& args, std::ostream& out, std::ostream& err) {
+        if (args.size() < 2) {
+            err << "Error: summary <file> [col=N] [sep=C] [header] [bin] [bins=N]" << '\n';
+            return 1;
+        }
+        ScanOptions options;
+        if (!parseOptions(args, 2, options, err))
+            return 1;
+        if (std::atoi(options.columnName.c_str()) <= 0) {
+            err << "Error: col=N needs a column number for files" << '\n';
+            return 1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        ColumnSketch sketch;
+        if (!scanFile(args[1], options, sketch, err))
+            return 1;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        print(sketch, options, out);
+        out << "Scanned in " << std::fixed << std::setprecision(3) << seconds * 1000 << " ms"
+            << std::defaultfloat << '\n';
+        return 0;
+    }
+
+    static bool parseOptions(const std::vector<std::string>& args, size_t first, ScanOptions& options, std::ostream& err) {
+        for (size_t i = first; i < args.size(); i++) {
+            const std::string& opt = args[i];
+            if (opt.rfind("col=", 0) == 0 && opt.size() > 4) {
+                options.columnName = opt.substr(4);
+                if (std::atoi(opt.c_str() + 4) > 0)
+                    options.column = std::atoi(opt.c_str() + 4) - 1;
+            }
+            else if (opt == "sep=tab")
+                options.separator = '\t';
+            else if (opt.rfind("sep=", 0) == 0 && opt.size() == 5)
+                options.separator = opt[4];
+            else if (opt == "header")
+                options.header = true;
+            else if (opt == "bin")
+                options.binary = true;
+            else if (opt.rfind("bins=", 0) == 0)
+                options.bins = static_cast<size_t>(std::max(0, std::atoi(opt.c_str() + 5)));
+            else {
+                err << "Error: unknown option '" << opt << "'" << '\n';
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void print(const ColumnSketch& s, const ScanOptions& options, std::ostream& out) {
+        out << std::setprecision(10);
+        out << "count    : " << s.count << '\n';
+        if (s.invalid)
+            out << "invalid  : " << s.invalid << '\n';
+        if (s.count == 0)
+            return;
+        out << "mean     : " << s.mean << '\n';
+        out << "variance : " << s.variance() << '\n';
+        out << "stddev   : " << std::sqrt(s.variance()) << '\n';
+        out << "min      : " << s.min << '\n';
+        out << "max      : " << s.max << '\n';
+        const double quantiles[] = { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99 };
+        for (double q : quantiles)
+            out << "p" << std::left << std::setw(7) << q * 100 << std::right << ": " << s.digest.quantile(q) << '\n';
+
+        if (options.bins == 0 || s.max == s.min)
+            return;
+        // Bin counts are read off the digest's CDF, so they are approximate like the quantiles.
+        std::vector<double> counts(options.bins);
+        double width = (s.max - s.min) / options.bins;
+        double peak = 0;
+        for (size_t i = 0; i < options.bins; i++) {
+            double lo = s.digest.cdf(s.min + i * width);
+            double hi = i + 1 == options.bins ? 1.0 : s.digest.cdf(s.min + (i + 1) * width);
+            counts[i] = (hi - lo) * s.count;
+            peak = std::max(peak, counts[i]);
+        }
+        out << "histogram (approximate):" << '\n';
+        out << std::setprecision(4);
+        for (size_t i = 0; i < options.bins; i++) {
+            int bar = peak > 0 ? static_cast<int>(std::lround(counts[i] / peak * 40)) : 0;
+            out << "  [" << std::setw(11) << s.min + i * width << ", " << std::setw(11) << s.min + (i + 1) * width
+                << ") " << std::setw(12) << static_cast<uint64_t>(std::llround(counts[i])) << " " << std::string(bar, '#') << '\n';
+        }
+    }
+};
+
+// Exported entry points (module_api.h)
+MS_DEFINE_MODULE_WITH_CAPS(ColStatsModule, "colstats", "ColStats Module Version 1.2.0",
+    MS_CAP_EXECUTE | MS_CAP_PIPE_INPUT | MS_CAP_THREAD_SAFE)
@@ -12,7 +12,18 @@
 #include <algorithm>
 #include <cctype>
 #include <limits>
-#include "math.h" // Contains the Module interface (e.g. Module class definition)
+#include <unordered_map>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <conio.h>
+#else
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#endif
+#include "../../module_api.h" // Shared module ABI (ms::Module, MS_DEFINE_MODULE)
+#include "matrix.h"
 
 //------------------------------------------------------------
 // Expression Classes
@@ -26,6 +37,12 @@ public:
     virtual double evaluateWithX(double x) { return evaluate(); }
     virtual double evaluateWithXY(double x, double y) { return evaluate(); }
     virtual double evaluateWithXYZ(double x, double y, double z) { return evaluate(); }
+    // Evaluates the expression for n values of x at once (out[i] = f(xs[i])).
+    // Operator nodes override this to walk the tree once per block instead of once per value.
+    virtual void evaluateBatchX(const double* xs, double* out, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            out[i] = evaluateWithX(xs[i]);
+    }
 };
 
 // Multivariable expression (for graphing)
@@ -45,6 +62,7 @@ public:
     double evaluateWithX(double x) override { return x; }
     double evaluateWithXY(double x, double y) override { return x; }
     double evaluateWithXYZ(double x, double y, double z) override { return x; }
+    void evaluateBatchX(const double* xs, double* out, size_t n) override { std::copy(xs, xs + n, out); }
 };
 
 class VariableYExpression : public MultiVarExpression {
@@ -67,6 +85,7 @@ class ParameterTExpression : public MultiVarExpression {
 public:
     double evaluateWithX(double t) override { return t; }
     double evaluateWithXY(double x, double y) override { return x; } // Here x is treated as the parameter
+    void evaluateBatchX(const double* ts, double* out, size_t n) override { std::copy(ts, ts + n, out); }
 };
 
 // Number
@@ -77,6 +96,7 @@ public:
     double evaluateWithX(double x) override { return m_value; }
     double evaluateWithXY(double x, double y) override { return m_value; }
     double evaluateWithXYZ(double x, double y, double z) override { return m_value; }
+    void evaluateBatchX(const double* xs, double* out, size_t n) override { std::fill(out, out + n, m_value); }
 private:
     double m_value;
 };
@@ -125,8 +145,19 @@ public:
             m_right->evaluateWithX(x);
         return evaluateOperation(l, r);
     }
+    void evaluateBatchX(const double* xs, double* out, size_t n) override {
+        std::vector<double> right(n);
+        m_left->evaluateBatchX(xs, out, n);
+        m_right->evaluateBatchX(xs, right.data(), n);
+        evaluateOperationBatch(out, right.data(), n);
+    }
 protected:
     virtual double evaluateOperation(double left, double right) = 0;
+    // left[i] = op(left[i], right[i]); the arithmetic operators override this with a plain loop.
+    virtual void evaluateOperationBatch(double* left, const double* right, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            left[i] = evaluateOperation(left[i], right[i]);
+    }
     Expression* m_left;
     Expression* m_right;
 };
@@ -157,6 +188,11 @@ public:
             m_operand->evaluateWithX(x);
         return evaluateOperation(val);
     }
+    void evaluateBatchX(const double* xs, double* out, size_t n) override {
+        m_operand->evaluateBatchX(xs, out, n);
+        for (size_t i = 0; i < n; i++)
+            out[i] = evaluateOperation(out[i]);
+    }
 protected:
     virtual double evaluateOperation(double value) = 0;
     Expression* m_operand;
@@ -170,6 +206,9 @@ public:
     }
 protected:
     double evaluateOperation(double left, double right) override { return left + right; }
+    void evaluateOperationBatch(double* left, const double* right, size_t n) override {
+        for (size_t i = 0; i < n; i++) left[i] += right[i];
+    }
 };
 
 // Subtraction
@@ -180,6 +219,9 @@ public:
     }
 protected:
     double evaluateOperation(double left, double right) override { return left - right; }
+    void evaluateOperationBatch(double* left, const double* right, size_t n) override {
+        for (size_t i = 0; i < n; i++) left[i] -= right[i];
+    }
 };
 
 // Multiplication
@@ -190,6 +232,9 @@ public:
     }
 protected:
     double evaluateOperation(double left, double right) override { return left * right; }
+    void evaluateOperationBatch(double* left, const double* right, size_t n) override {
+        for (size_t i = 0; i < n; i++) left[i] *= right[i];
+    }
 };
 
 // Division
@@ -200,6 +245,9 @@ public:
     }
 protected:
     double evaluateOperation(double left, double right) override { return left / right; }
+    void evaluateOperationBatch(double* left, const double* right, size_t n) override {
+        for (size_t i = 0; i < n; i++) left[i] /= right[i];
+    }
 };
 
 // Power
@@ -323,6 +371,7 @@ public:
     }
 
     Expression* parse() {
+        ms::TraceSpan span("parse");
         removeWhitespace();
         Expression* expr = parseExpression();
         if (m_pos < m_expression.size()) {
@@ -534,28 +583,25 @@ private:
 // Graph Drawing
 //------------------------------------------------------------
 
-// 1D graph for functions of x only, with automatic y-range adjustment.
-void drawGraph1D(Expression* expr) {
-    double xMin = -10.0;
-    double xMax = 10.0;
-    const int width = 80;
-    const int height = 25;
-
-    std::vector<std::string> grid(height, std::string(width, ' '));
-
-    double yMin = std::numeric_limits<double>::max();
-    double yMax = std::numeric_limits<double>::lowest();
-    for (int i = 0; i < width; i++) {
-        double x = xMin + i * (xMax - xMin) / (width - 1);
-        double y = expr->evaluateWithX(x);
-        yMin = std::min(yMin, y);
-        yMax = std::max(yMax, y);
+// Writes a finished grid in one go instead of flushing every line.
+void printGrid(const std::vector<std::string>& grid, std::ostream& out) {
+    std::string buffer;
+    for (const auto& line : grid) {
+        buffer += line;
+        buffer += '\n';
     }
-    if (yMin == yMax) { yMin -= 1; yMax += 1; }
+    out << buffer << std::flush;
+}
 
-    for (int i = 0; i < width; i++) {
-        double x = xMin + i * (xMax - xMin) / (width - 1);
-        double y = expr->evaluateWithX(x);
+// Rasterizes the samples ys[i] (taken at evenly spaced x between xMin and xMax) into a grid,
+// including the axes when they are inside the visible range.
+std::vector<std::string> rasterizeGraph1D(const std::vector<double>& ys, double xMin, double xMax,
+    double yMin, double yMax, int width, int height) {
+    std::vector<std::string> grid(height, std::string(width, ' '));
+    for (int i = 0; i < width && i < static_cast<int>(ys.size()); i++) {
+        double y = ys[i];
+        if (!std::isfinite(y) || y < yMin || y > yMax)
+            continue;
         int row = static_cast<int>((y - yMin) / (yMax - yMin) * (height - 1));
         row = height - 1 - row;
         if (row >= 0 && row < height) {
@@ -578,27 +624,71 @@ void drawGraph1D(Expression* expr) {
                 grid[i][yAxisCol] = '|';
         }
     }
-    for (const auto& line : grid)
-        std::cout << line << std::endl;
+    return grid;
+}
+
+// Screen columns per task when a graph is sampled on the host thread pool.
+const size_t GraphColumnGrain = 8;
+
+// 1D graph for functions of x only, with automatic y-range adjustment.
+void drawGraph1D(Expression* expr, std::ostream& out) {
+    double xMin = -10.0;
+    double xMax = 10.0;
+    const int width = 80;
+    const int height = 25;
+
+    // Each column is evaluated once (on the host thread pool); the same samples drive the
+    // y-range and the plot.
+    std::vector<double> ys(width);
+    {
+        ms::TraceSpan span("graph sample");
+        ms::parallelFor(width, GraphColumnGrain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                ys[i] = expr->evaluateWithX(xMin + i * (xMax - xMin) / (width - 1));
+        });
+    }
+    double yMin = std::numeric_limits<double>::max();
+    double yMax = std::numeric_limits<double>::lowest();
+    for (int i = 0; i < width; i++) {
+        if (std::isfinite(ys[i])) {
+            yMin = std::min(yMin, ys[i]);
+            yMax = std::max(yMax, ys[i]);
+        }
+    }
+    if (yMin > yMax) { yMin = -1; yMax = 1; }
+    if (yMin == yMax) { yMin -= 1; yMax += 1; }
+
+    std::vector<std::string> grid;
+    {
+        ms::TraceSpan span("graph rasterize");
+        grid = rasterizeGraph1D(ys, xMin, xMax, yMin, yMax, width, height);
+    }
+    printGrid(grid, out);
 }
 
 // Implicit function graph for functions of x and y (f(x,y)=0)
-void drawGraphImplicit2D(Expression* expr) {
+void drawGraphImplicit2D(Expression* expr, std::ostream& out) {
     double xMin = -10.0, xMax = 10.0;
     double yMin = -10.0, yMax = 10.0;
     const int width = 80, height = 25;
     std::vector<std::string> grid(height, std::string(width, ' '));
 
     const double threshold = 0.5; // threshold for considering f(x,y) near zero
-    for (int i = 0; i < width; i++) {
-        double x = xMin + i * (xMax - xMin) / (width - 1);
-        for (int j = 0; j < height; j++) {
-            double y = yMax - j * (yMax - yMin) / (height - 1);
-            double val = expr->evaluateWithXY(x, y);
-            if (std::fabs(val) < threshold) {
-                grid[j][i] = '*';
+    // Columns are independent, so they are split across the host thread pool.
+    {
+        ms::TraceSpan span("graph sample");
+        ms::parallelFor(width, GraphColumnGrain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                double x = xMin + i * (xMax - xMin) / (width - 1);
+                for (int j = 0; j < height; j++) {
+                    double y = yMax - j * (yMax - yMin) / (height - 1);
+                    double val = expr->evaluateWithXY(x, y);
+                    if (std::fabs(val) < threshold) {
+                        grid[j][i] = '*';
+                    }
+                }
             }
-        }
+        });
     }
     // Draw x-axis
     if (yMin <= 0 && yMax >= 0) {
@@ -616,37 +706,498 @@ void drawGraphImplicit2D(Expression* expr) {
                 grid[j][yAxisCol] = '|';
         }
     }
-    for (const auto& line : grid)
-        std::cout << line << std::endl;
+    printGrid(grid, out);
 }
 
 // Basic 3D graph projection using isometric projection.
-void drawGraph3D(Expression* expr) {
-    std::cout << "3D graphing: Basic 3D projection (not fully implemented)." << std::endl;
+void drawGraph3D(Expression* expr, std::ostream& out) {
+    out << "3D graphing: Basic 3D projection (not fully implemented)." << '\n';
     const int width = 80, height = 25;
     std::vector<std::string> grid(height, std::string(width, ' '));
     double xMin = -5, xMax = 5, yMin = -5, yMax = 5, zMin = -5, zMax = 5;
 
     const double threshold = 0.5;
-    for (int i = 0; i < width; i++) {
-        double x = xMin + i * (xMax - xMin) / (width - 1);
-        for (int j = 0; j < height; j++) {
-            double y = yMax - j * (yMax - yMin) / (height - 1);
-            double z = 0; // For simplicity, using z=0 slice
-            double val = expr->evaluateWithXYZ(x, y, z);
-            if (std::fabs(val) < threshold) {
-                grid[j][i] = '*';
+    {
+        ms::TraceSpan span("graph sample");
+        ms::parallelFor(width, GraphColumnGrain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                double x = xMin + i * (xMax - xMin) / (width - 1);
+                for (int j = 0; j < height; j++) {
+                    double y = yMax - j * (yMax - yMin) / (height - 1);
+                    double z = 0; // For simplicity, using z=0 slice
+                    double val = expr->evaluateWithXYZ(x, y, z);
+                    if (std::fabs(val) < threshold) {
+                        grid[j][i] = '*';
+                    }
+                }
             }
+        });
+    }
+    printGrid(grid, out);
+}
+
+//------------------------------------------------------------
+// Parametric Curves
+//------------------------------------------------------------
+
+// Adaptive sampler for x(t), y(t). A coarse uniform block fixes the view; after that only
+// segments that span more than one screen cell are split, and a split stops as soon as the
+// midpoint lies on the chord (the curve is flat there and a straight line is exact enough).
+// All midpoints of one refinement level form a t-block that both coordinate expressions
+// evaluate in a single batched pass.
+class ParametricSampler {
+public:
+    ParametricSampler(Expression* xExpr, Expression* yExpr, int width, int height)
+        : m_xExpr(xExpr), m_yExpr(yExpr), m_width(width), m_height(height), m_evaluations(0) {
+    }
+
+    void sample(double tMin, double tMax) {
+        ms::TraceSpan span("graph sample");
+        std::vector<double> ts(InitialSamples);
+        for (int i = 0; i < InitialSamples; i++)
+            ts[i] = tMin + i * (tMax - tMin) / (InitialSamples - 1);
+        std::vector<double> xs, ys;
+        evaluateBlock(ts, xs, ys);
+        fitBounds(xs, ys);
+
+        m_points.clear();
+        for (size_t i = 0; i < ts.size(); i++)
+            m_points.push_back({ ts[i], xs[i], ys[i], false });
+
+        for (int depth = 0; depth < MaxDepth && m_evaluations < MaxEvaluations; depth++) {
+            ms::TraceSpan levelSpan("graph refine level");
+            // Collect the midpoints of every unresolved segment into one block.
+            std::vector<size_t> refined;
+            std::vector<double> mids;
+            for (size_t i = 0; i + 1 < m_points.size(); i++) {
+                if (m_points[i].resolved)
+                    continue;
+                if (screenDistance(m_points[i], m_points[i + 1]) <= 1.0) {
+                    m_points[i].resolved = true;
+                    continue;
+                }
+                refined.push_back(i);
+                mids.push_back((m_points[i].t + m_points[i + 1].t) / 2);
+            }
+            if (refined.empty())
+                break;
+            std::vector<double> midXs, midYs;
+            evaluateBlock(mids, midXs, midYs);
+
+            std::vector<Point> next;
+            next.reserve(m_points.size() + mids.size());
+            size_t r = 0;
+            for (size_t i = 0; i < m_points.size(); i++) {
+                next.push_back(m_points[i]);
+                if (r < refined.size() && refined[r] == i) {
+                    Point mid = { mids[r], midXs[r], midYs[r], false };
+                    bool flat = isFlat(m_points[i], mid, m_points[i + 1]);
+                    next.back().resolved = flat;
+                    mid.resolved = flat;
+                    next.push_back(mid);
+                    r++;
+                }
+            }
+            m_points.swap(next);
+        }
+    }
+
+    std::vector<std::string> render() const {
+        std::vector<std::string> grid(m_height, std::string(m_width, ' '));
+        // Axes first so the curve is drawn over them.
+        if (m_yMin <= 0 && m_yMax >= 0) {
+            int row = static_cast<int>(std::lround(rowOf(0)));
+            for (int i = 0; i < m_width; i++) grid[row][i] = '-';
+        }
+        if (m_xMin <= 0 && m_xMax >= 0) {
+            int col = static_cast<int>(std::lround(colOf(0)));
+            for (int j = 0; j < m_height; j++) grid[j][col] = '|';
+        }
+        for (size_t i = 0; i < m_points.size(); i++) {
+            const Point& p = m_points[i];
+            if (!finite(p))
+                continue;
+            plot(grid, colOf(p.x), rowOf(p.y));
+            // Resolved segments are connected; unresolved ones at the depth limit are jumps.
+            if (i + 1 < m_points.size() && p.resolved && finite(m_points[i + 1]))
+                drawLine(grid, p, m_points[i + 1]);
+        }
+        return grid;
+    }
+
+    size_t evaluations() const { return m_evaluations; }
+    size_t points() const { return m_points.size(); }
+
+private:
+    struct Point {
+        double t, x, y;
+        bool resolved; // the segment to the next point needs no further refinement
+    };
+
+    static const int InitialSamples = 64;
+    static const int MaxDepth = 16;
+    static const size_t MaxEvaluations = 200000;
+
+    void evaluateBlock(const std::vector<double>& ts, std::vector<double>& xs, std::vector<double>& ys) {
+        xs.resize(ts.size());
+        ys.resize(ts.size());
+        m_xExpr->evaluateBatchX(ts.data(), xs.data(), ts.size());
+        m_yExpr->evaluateBatchX(ts.data(), ys.data(), ts.size());
+        m_evaluations += ts.size();
+    }
+
+    void fitBounds(const std::vector<double>& xs, const std::vector<double>& ys) {
+        m_xMin = m_yMin = std::numeric_limits<double>::max();
+        m_xMax = m_yMax = std::numeric_limits<double>::lowest();
+        for (size_t i = 0; i < xs.size(); i++) {
+            if (!std::isfinite(xs[i]) || !std::isfinite(ys[i])) continue;
+            m_xMin = std::min(m_xMin, xs[i]);
+            m_xMax = std::max(m_xMax, xs[i]);
+            m_yMin = std::min(m_yMin, ys[i]);
+            m_yMax = std::max(m_yMax, ys[i]);
+        }
+        if (m_xMin > m_xMax) { m_xMin = m_yMin = -1; m_xMax = m_yMax = 1; }
+        if (m_xMin == m_xMax) { m_xMin -= 1; m_xMax += 1; }
+        if (m_yMin == m_yMax) { m_yMin -= 1; m_yMax += 1; }
+    }
+
+    static bool finite(const Point& p) { return std::isfinite(p.x) && std::isfinite(p.y); }
+    double colOf(double x) const { return (x - m_xMin) / (m_xMax - m_xMin) * (m_width - 1); }
+    double rowOf(double y) const { return (m_yMax - y) / (m_yMax - m_yMin) * (m_height - 1); }
+
+    double screenDistance(const Point& a, const Point& b) const {
+        if (!finite(a) || !finite(b))
+            return finite(a) != finite(b) ? 2.0 : 0.0; // refine towards the edge of the domain
+        return std::hypot(colOf(b.x) - colOf(a.x), rowOf(b.y) - rowOf(a.y));
+    }
+
+    // True when mid is within half a cell of the chord a-b.
+    bool isFlat(const Point& a, const Point& mid, const Point& b) const {
+        if (!finite(a) || !finite(mid) || !finite(b))
+            return false;
+        double ax = colOf(a.x), ay = rowOf(a.y);
+        double bx = colOf(b.x), by = rowOf(b.y);
+        double mx = colOf(mid.x), my = rowOf(mid.y);
+        double len = std::hypot(bx - ax, by - ay);
+        if (len == 0)
+            return std::hypot(mx - ax, my - ay) < 0.5;
+        double cross = std::fabs((bx - ax) * (my - ay) - (by - ay) * (mx - ax));
+        return cross / len < 0.5 && (mx - ax) * (bx - ax) + (my - ay) * (by - ay) >= 0
+            && (mx - bx) * (ax - bx) + (my - by) * (ay - by) >= 0;
+    }
+
+    void plot(std::vector<std::string>& grid, double col, double row) const {
+        int c = static_cast<int>(std::lround(col));
+        int r = static_cast<int>(std::lround(row));
+        if (c >= 0 && c < m_width && r >= 0 && r < m_height)
+            grid[r][c] = '*';
+    }
+
+    void drawLine(std::vector<std::string>& grid, const Point& a, const Point& b) const {
+        double ac = colOf(a.x), ar = rowOf(a.y), bc = colOf(b.x), br = rowOf(b.y);
+        int steps = static_cast<int>(std::ceil(std::max(std::fabs(bc - ac), std::fabs(br - ar))));
+        steps = std::min(steps, m_width + m_height);
+        for (int k = 1; k < steps; k++) {
+            double f = static_cast<double>(k) / steps;
+            plot(grid, ac + (bc - ac) * f, ar + (br - ar) * f);
         }
     }
-    for (const auto& line : grid)
-        std::cout << line << std::endl;
+
+    Expression* m_xExpr;
+    Expression* m_yExpr;
+    int m_width, m_height;
+    double m_xMin, m_xMax, m_yMin, m_yMax;
+    std::vector<Point> m_points;
+    size_t m_evaluations;
+};
+
+// Draws the curve (x(t), y(t)) for t in [tMin, tMax].
+void drawGraphParametric(Expression* xExpr, Expression* yExpr, double tMin, double tMax, std::ostream& out) {
+    ParametricSampler sampler(xExpr, yExpr, 80, 25);
+    sampler.sample(tMin, tMax);
+    std::vector<std::string> grid;
+    {
+        ms::TraceSpan span("graph render");
+        grid = sampler.render();
+    }
+    printGrid(grid, out);
+    out << sampler.points() << " samples, " << sampler.evaluations() << " evaluations per coordinate" << '\n';
 }
 
+//------------------------------------------------------------
+// Interactive Graph Viewport
+//------------------------------------------------------------
+
+enum ViewportKey {
+    KeyNone = 0,
+    KeyEscape = 1000,
+    KeyLeft,
+    KeyRight,
+    KeyUp,
+    KeyDown
+};
+
+// Puts the terminal into unbuffered, no-echo mode with ANSI escape support and restores it on exit.
+class TerminalSession {
+public:
+    explicit TerminalSession(std::ostream& out) : m_out(out) {
+#ifdef _WIN32
+        m_output = GetStdHandle(STD_OUTPUT_HANDLE);
+        m_restoreMode = GetConsoleMode(m_output, &m_oldMode) != 0;
+        if (m_restoreMode)
+            SetConsoleMode(m_output, m_oldMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+#else
+        m_restoreMode = tcgetattr(STDIN_FILENO, &m_oldMode) == 0;
+        if (m_restoreMode) {
+            termios raw = m_oldMode;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        }
+#endif
+        m_out << "\x1b[?25l" << std::flush; // hide cursor
+    }
+
+    ~TerminalSession() {
+        m_out << "\x1b[?25h" << std::flush; // show cursor
+#ifdef _WIN32
+        if (m_restoreMode)
+            SetConsoleMode(m_output, m_oldMode);
+#else
+        if (m_restoreMode)
+            tcsetattr(STDIN_FILENO, TCSANOW, &m_oldMode);
+#endif
+    }
+
+    // Blocks until a key is pressed. Arrow keys are reported as ViewportKey values,
+    // end of input as KeyEscape.
+    int readKey() {
+#ifdef _WIN32
+        int c = _getch();
+        if (c == 0 || c == 224) {
+            switch (_getch()) {
+            case 72: return KeyUp;
+            case 80: return KeyDown;
+            case 75: return KeyLeft;
+            case 77: return KeyRight;
+            default: return KeyNone;
+            }
+        }
+        return c == 27 ? KeyEscape : c;
+#else
+        unsigned char c;
+        if (read(STDIN_FILENO, &c, 1) != 1)
+            return KeyEscape;
+        if (c != 27)
+            return c;
+        // A lone ESC is the escape key; ESC [ A..D are the arrow keys.
+        pollfd pending = { STDIN_FILENO, POLLIN, 0 };
+        unsigned char seq[2];
+        if (poll(&pending, 1, 30) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1)
+            return KeyEscape;
+        if ((seq[0] != '[' && seq[0] != 'O') || read(STDIN_FILENO, &seq[1], 1) != 1)
+            return KeyNone;
+        switch (seq[1]) {
+        case 'A': return KeyUp;
+        case 'B': return KeyDown;
+        case 'C': return KeyRight;
+        case 'D': return KeyLeft;
+        default: return KeyNone;
+        }
+#endif
+    }
+
+private:
+    std::ostream& m_out;
+#ifdef _WIN32
+    HANDLE m_output;
+    DWORD m_oldMode;
+#else
+    termios m_oldMode;
+#endif
+    bool m_restoreMode;
+};
+
+// Redraws a frame by emitting only the cells that changed since the previous frame.
+class FrameDiffRenderer {
+public:
+    explicit FrameDiffRenderer(std::ostream& out) : m_out(out) {}
+
+    void draw(const std::vector<std::string>& frame) {
+        std::string buffer;
+        if (m_previous.size() != frame.size()) {
+            buffer += "\x1b[2J";
+            m_previous.assign(frame.size(), std::string());
+        }
+        for (size_t row = 0; row < frame.size(); row++) {
+            const std::string& current = frame[row];
+            const std::string& previous = m_previous[row];
+            size_t col = 0;
+            while (col < current.size()) {
+                if (col < previous.size() && previous[col] == current[col]) {
+                    col++;
+                    continue;
+                }
+                // Extend the run over short unchanged gaps; a cursor move costs about as much.
+                size_t start = col, end = col;
+                while (col < current.size() && col - end <= MaxMergedGap) {
+                    if (col >= previous.size() || previous[col] != current[col])
+                        end = col + 1;
+                    col++;
+                }
+                buffer += "\x1b[" + std::to_string(row + 1) + ";" + std::to_string(start + 1) + "H";
+                buffer.append(current, start, end - start);
+                col = end;
+            }
+        }
+        if (!buffer.empty())
+            m_out << buffer << std::flush;
+        m_previous = frame;
+    }
+
+    // Moves the cursor below the last drawn frame.
+    void finish() {
+        m_out << "\x1b[" << (m_previous.size() + 1) << ";1H" << std::flush;
+    }
+
+private:
+    static const size_t MaxMergedGap = 6;
+    std::ostream& m_out;
+    std::vector<std::string> m_previous;
+};
+
+// Keyboard driven explorer for functions of x. Samples are taken on a grid of world
+// coordinates (index * step, with step a power-of-two multiple of the base step), so
+// panning and zooming back and forth reuse cached samples and only newly exposed
+// columns are evaluated.
+class GraphViewport {
+public:
+    GraphViewport(Expression* expr, int width, int height, std::ostream& out)
+        : m_out(out), m_expr(expr), m_width(width), m_height(height),
+          m_baseStep(20.0 / (width - 1)), m_evaluations(0) {
+        reset();
+    }
+
+    void run() {
+        TerminalSession terminal(m_out);
+        FrameDiffRenderer renderer(m_out);
+        while (true) {
+            renderer.draw(renderFrame());
+            int key = terminal.readKey();
+            if (key == 'q' || key == 'Q' || key == KeyEscape)
+                break;
+            switch (key) {
+            case KeyLeft: case 'a': m_startIndex -= m_width / 8; break;
+            case KeyRight: case 'd': m_startIndex += m_width / 8; break;
+            case KeyUp: case 'w': panY(0.25); break;
+            case KeyDown: case 's': panY(-0.25); break;
+            case '+': case '=': zoom(-1); break;
+            case '-': case '_': zoom(1); break;
+            case 'f': fitY(); break;
+            case 'r': reset(); break;
+            default: break;
+            }
+        }
+        renderer.finish();
+    }
+
+private:
+    static const size_t MaxCachedSamples = 1 << 20;
+
+    double step() const { return std::ldexp(m_baseStep, m_zoom); }
+    double xAt(int column) const { return (m_startIndex + column) * step(); }
+
+    double sampleAt(double x) {
+        auto it = m_cache.find(x);
+        if (it != m_cache.end())
+            return it->second;
+        if (m_cache.size() >= MaxCachedSamples)
+            m_cache.clear();
+        m_evaluations++;
+        double y = m_expr->evaluateWithX(x);
+        m_cache.emplace(x, y);
+        return y;
+    }
+
+    std::vector<double> visibleSamples() {
+        std::vector<double> ys(m_width);
+        for (int i = 0; i < m_width; i++)
+            ys[i] = sampleAt(xAt(i));
+        return ys;
+    }
+
+    void reset() {
+        m_zoom = 0;
+        m_startIndex = -(m_width - 1) / 2;
+        fitY();
+    }
+
+    void fitY() {
+        std::vector<double> ys = visibleSamples();
+        m_yMin = std::numeric_limits<double>::max();
+        m_yMax = std::numeric_limits<double>::lowest();
+        for (double y : ys) {
+            if (!std::isfinite(y)) continue;
+            m_yMin = std::min(m_yMin, y);
+            m_yMax = std::max(m_yMax, y);
+        }
+        if (m_yMin > m_yMax) { m_yMin = -1; m_yMax = 1; }
+        if (m_yMin == m_yMax) { m_yMin -= 1; m_yMax += 1; }
+    }
+
+    void panY(double fraction) {
+        double shift = (m_yMax - m_yMin) * fraction;
+        m_yMin += shift;
+        m_yMax += shift;
+    }
+
+    // direction < 0 zooms in, > 0 zooms out; both axes scale by 2 around the view centre.
+    void zoom(int direction) {
+        long long centre = m_startIndex + m_width / 2;
+        if (direction < 0) {
+            m_zoom--;
+            centre *= 2;
+        }
+        else {
+            m_zoom++;
+            centre = static_cast<long long>(std::floor(centre / 2.0));
+        }
+        m_startIndex = centre - m_width / 2;
+        double yCentre = (m_yMin + m_yMax) / 2;
+        double yHalf = (m_yMax - m_yMin) / 2 * (direction < 0 ? 0.5 : 2.0);
+        m_yMin = yCentre - yHalf;
+        m_yMax = yCentre + yHalf;
+    }
+
+    std::vector<std::string> renderFrame() {
+        std::vector<std::string> frame = rasterizeGraph1D(visibleSamples(), xAt(0), xAt(m_width - 1),
+            m_yMin, m_yMax, m_width, m_height);
+        std::ostringstream status;
+        status << std::setprecision(4) << "x:[" << xAt(0) << ", " << xAt(m_width - 1) << "] y:["
+            << m_yMin << ", " << m_yMax << "] evals:" << m_evaluations
+            << "  arrows/wasd pan, +/- zoom, f fit, r reset, q quit";
+        std::string statusLine = status.str();
+        statusLine.resize(m_width, ' ');
+        frame.push_back(statusLine);
+        return frame;
+    }
+
+    std::ostream& m_out;
+    Expression* m_expr;
+    int m_width, m_height;
+    double m_baseStep;
+    int m_zoom;
+    long long m_startIndex;
+    double m_yMin, m_yMax;
+    std::unordered_map<double, double> m_cache;
+    size_t m_evaluations;
+};
+
 //------------------------------------------------------------
 // Math Module Implementation
 //------------------------------------------------------------
-class MathModule : public Module {
+class MathModule : public ms::Module {
 public:
     MathModule() {}
     ~MathModule() {}
@@ -657,73 +1208,116 @@ public:
     //    - If only x variable is used: 1D graph.
     //    - If x and y variables: implicit graph f(x,y)=0.
     //    - If x, y, and z variables: basic 3D projection.
-    // 3. Otherwise: evaluate the expression (old method).
-    void execute(const std::vector<std::string>& args) override {
+    //    - "graph -i" explores a function of x, "graph param" draws x(t), y(t).
+    // 3. "mat" command: matrix workspace.
+    // 4. Otherwise: evaluate the expression (old method).
+    int execute(ms::Args arguments, std::ostream& out, std::ostream& err) override {
+        std::vector<std::string> args(arguments.begin(), arguments.end());
         if (args.empty()) {
-            std::cerr << "Usage:" << std::endl;
-            std::cerr << "  help[/h/?]               - Display detailed help" << std::endl;
-            std::cerr << "  graph <expression>  - Draw graph of the expression" << std::endl;
-            std::cerr << "  <expression>        - Evaluate the expression" << std::endl;
-            return;
+            err << "Usage:" << '\n';
+            err << "  help[/h/?]               - Display detailed help" << '\n';
+            err << "  graph <expression>  - Draw graph of the expression" << '\n';
+            err << "  graph -i <expression> - Explore the graph interactively (pan/zoom)" << '\n';
+            err << "  graph param <x(t)>; <y(t)>[; <tMin>; <tMax>] - Draw a parametric curve" << '\n';
+            err << "  mat ...             - Matrix commands (see 'mat help')" << '\n';
+            err << "  eval-range <expression> <from> <to> <step> - Tabulate x and y" << '\n';
+            err << "  <command> | math map <expression> [col=name] - Apply to a piped column" << '\n';
+            err << "  <expression>        - Evaluate the expression" << '\n';
+            return 1;
         }
 
         // Help command: ?
         if (args[0] == "help" || args[0] == "h" || args[0] == "?") {
-            std::cout << "Math Module Help - Detailed Description:" << std::endl;
-            std::cout << "Supported operators: +, -, *, /, ^" << std::endl;
-            std::cout << "Supported functions:" << std::endl;
-            std::cout << "  sin(x), cos(x), tan(x), ctg(x)" << std::endl;
-            std::cout << "  arcsin(x), arccos(x), arctan(x), arcctg(x)" << std::endl;
-            std::cout << "  ln(x)   - natural logarithm" << std::endl;
-            std::cout << "  lg(x)   - base-10 logarithm" << std::endl;
-            std::cout << "  log<base>(x)  - logarithm with given base (e.g. log2(x))" << std::endl;
-            std::cout << "  V(x)    - square root (alternative notation)" << std::endl;
-            std::cout << "  |x|     - absolute value" << std::endl;
-            std::cout << "Variables:" << std::endl;
-            std::cout << "  x : independent variable" << std::endl;
-            std::cout << "  y : secondary variable (for implicit functions)" << std::endl;
-            std::cout << "  z : third variable (for 3D functions)" << std::endl;
-            std::cout << "  t : parameter (for parametric functions)" << std::endl;
-            std::cout << std::endl;
-            std::cout << "Usage:" << std::endl;
-            std::cout << "  To evaluate an expression, simply type it." << std::endl;
-            std::cout << "  To graph an expression, use:" << std::endl;
-            std::cout << "      graph <expression>" << std::endl;
-            std::cout << "  The graph command automatically adjusts the view based on function values." << std::endl;
-            std::cout << "  The module supports 2D graphs for explicit (y=f(x)) and implicit functions (f(x,y)=0)," << std::endl;
-            std::cout << "  and basic 3D projection for functions of three variables." << std::endl;
-            return;
+            out << "Math Module Help - Detailed Description:" << '\n';
+            out << "Supported operators: +, -, *, /, ^" << '\n';
+            out << "Supported functions:" << '\n';
+            out << "  sin(x), cos(x), tan(x), ctg(x)" << '\n';
+            out << "  arcsin(x), arccos(x), arctan(x), arcctg(x)" << '\n';
+            out << "  ln(x)   - natural logarithm" << '\n';
+            out << "  lg(x)   - base-10 logarithm" << '\n';
+            out << "  log<base>(x)  - logarithm with given base (e.g. log2(x))" << '\n';
+            out << "  V(x)    - square root (alternative notation)" << '\n';
+            out << "  |x|     - absolute value" << '\n';
+            out << "Variables:" << '\n';
+            out << "  x : independent variable" << '\n';
+            out << "  y : secondary variable (for implicit functions)" << '\n';
+            out << "  z : third variable (for 3D functions)" << '\n';
+            out << "  t : parameter (for parametric functions)" << '\n';
+            out << '\n';
+            out << "Usage:" << '\n';
+            out << "  To evaluate an expression, simply type it." << '\n';
+            out << "  To graph an expression, use:" << '\n';
+            out << "      graph <expression>" << '\n';
+            out << "  The graph command automatically adjusts the view based on function values." << '\n';
+            out << "  The module supports 2D graphs for explicit (y=f(x)) and implicit functions (f(x,y)=0)," << '\n';
+            out << "  and basic 3D projection for functions of three variables." << '\n';
+            out << "  To explore a function of x interactively, use:" << '\n';
+            out << "      graph -i <expression>" << '\n';
+            out << "  Arrow keys or w/a/s/d pan, +/- zoom, f fits the y-range, r resets, q quits." << '\n';
+            out << "  To draw a parametric curve (t defaults to [0, 2*m_PI]), use:" << '\n';
+            out << "      graph param <x(t)>; <y(t)>[; <tMin>; <tMax>]" << '\n';
+            out << "  To tabulate an expression of x, use:" << '\n';
+            out << "      eval-range <expression> <from> <to> <step>" << '\n';
+            out << "  It prints x and y, or passes them as columns \"x\" and \"y\" to the next" << '\n';
+            out << "  stage of a pipeline, e.g. eval-range sin(x) 0 10 0.001 | colstats summary col=y" << '\n';
+            out << "  Inside a pipeline, map <expression> [col=name] evaluates the expression for each" << '\n';
+            out << "  value of the piped column (default \"y\", else the first one) taken as x." << '\n';
+            out << '\n';
+            MatrixCommands::printHelp(out);
+            return 0;
+        }
+
+        // Matrix mode: "mat ..." works on the named matrix workspace
+        if (args[0] == "mat") {
+            return m_matrixCommands.execute(args, out, err);
         }
 
         // Graph mode: if first argument is "graph"
         if (args[0] == "graph") {
             if (args.size() < 2) {
-                std::cerr << "Error: graph command requires an expression." << std::endl;
-                return;
+                err << "Error: graph command requires an expression." << '\n';
+                return 1;
+            }
+            if (args[1] == "param") {
+                return graphParametric(args, out, err);
             }
+            bool interactive = args[1] == "-i";
+            size_t first = interactive ? 2 : 1;
             std::string exprStr;
-            for (size_t i = 1; i < args.size(); i++) {
+            for (size_t i = first; i < args.size(); i++) {
                 if (!exprStr.empty()) exprStr += " ";
                 exprStr += args[i];
             }
             ExpressionParser parser(exprStr);
             Expression* expr = parser.parse();
             if (!expr) {
-                std::cerr << "Error: Failed to parse expression." << std::endl;
-                return;
+                err << "Error: Failed to parse expression." << '\n';
+                return 1;
             }
-            std::cout << "Drawing graph for: " << exprStr << std::endl;
-            if (!parser.hasY() && !parser.hasZ()) {
-                drawGraph1D(expr);
-            }
-            else if (parser.hasY() && !parser.hasZ()) {
-                drawGraphImplicit2D(expr);
+            int status = 0;
+            if (interactive) {
+                if (parser.hasY() || parser.hasZ()) {
+                    err << "Error: interactive mode supports functions of x only." << '\n';
+                    status = 1;
+                }
+                else {
+                    GraphViewport(expr, 80, 25, out).run();
+                }
             }
-            else if (parser.hasZ()) {
-                drawGraph3D(expr);
+            else {
+                out << "Drawing graph for: " << exprStr << '\n';
+                if (!parser.hasY() && !parser.hasZ()) {
+                    drawGraph1D(expr, out);
+                }
+                else if (parser.hasY() && !parser.hasZ()) {
+                    drawGraphImplicit2D(expr, out);
+                }
+                else if (parser.hasZ()) {
+                    drawGraph3D(expr, out);
+                }
             }
             delete expr;
-            return;
+            return status;
         }
 
         // Default: evaluate the expression (old method)
@@ -735,19 +1329,233 @@ public:
         ExpressionParser parser(exprStr);
         Expression* expr = parser.parse();
         if (!expr) {
-            std::cerr << "Error: Failed to parse expression." << std::endl;
-            return;
+            err << "Error: Failed to parse expression." << '\n';
+            return 1;
+        }
+        out << std::fixed << std::setprecision(6) << expr->evaluate() << '\n';
+        delete expr;
+        return 0;
+    }
+
+    // Commands that produce columns x and y: passed on as batches when there is a next
+    // pipeline stage, printed as "x<TAB>y" lines otherwise.
+    int executeStage(ms::Args arguments, const ms::Pipe& pipe, std::ostream& out, std::ostream& err) override {
+        std::vector<std::string> args(arguments.begin(), arguments.end());
+        if (!args.empty() && args[0] == "eval-range") {
+            return evalRange(args, pipe, out, err);
         }
-        std::cout << std::fixed << std::setprecision(6) << expr->evaluate() << std::endl;
+        if (!args.empty() && args[0] == "map") {
+            return mapColumn(args, pipe, out, err);
+        }
+        return execute(arguments, out, err);
+    }
+
+private:
+    // Rows evaluated per step of eval-range; also the granularity of cancellation.
+    static constexpr size_t BlockRows = 4096;
+
+    // ys[i] = f(xs[i]), split into batched runs on the host thread pool.
+    static void evaluateBlock(Expression* expr, const double* xs, double* ys, size_t n) {
+        const size_t Grain = 1024;
+        ms::parallelFor(n, Grain, [&](size_t begin, size_t end) {
+            expr->evaluateBatchX(xs + begin, ys + begin, end - begin);
+        });
+    }
+
+    // Collects (x, y) rows and hands them on in batches.
+    class ColumnWriter {
+    public:
+        ColumnWriter(const ms::Pipe& pipe, std::ostream& out) : m_pipe(pipe), m_out(out), m_open(true) {
+            if (m_pipe.hasOutput()) {
+                m_x.reserve(BatchRows);
+                m_y.reserve(BatchRows);
+            }
+            else {
+                m_out << std::setprecision(10);
+            }
+        }
+
+        // False once the next stage has stopped reading.
+        bool add(double x, double y) {
+            if (!m_pipe.hasOutput()) {
+                m_out << x << '\t' << y << '\n';
+                return true;
+            }
+            m_x.push_back(x);
+            m_y.push_back(y);
+            return m_x.size() < BatchRows || flush();
+        }
+
+        bool flush() {
+            if (m_pipe.hasOutput() && !m_x.empty() && m_open) {
+                static const char* const names[] = { "x", "y" };
+                const double* values[] = { m_x.data(), m_y.data() };
+                m_open = m_pipe.emitDoubles(names, values, 2, m_x.size());
+            }
+            m_x.clear();
+            m_y.clear();
+            return m_open;
+        }
+
+    private:
+        static const size_t BatchRows = 4096;
+
+        const ms::Pipe& m_pipe;
+        std::ostream& m_out;
+        std::vector<double> m_x, m_y;
+        bool m_open;
+    };
+
+    // eval-range <expression> <from> <to> <step>
+    int evalRange(const std::vector<std::string>& args, const ms::Pipe& pipe, std::ostream& out, std::ostream& err) {
+        const double MaxRows = 1e9;
+        double from = 0, to = 0, step = 0;
+        if (args.size() < 5) {
+            err << "Error: eval-range <expression> <from> <to> <step>" << '\n';
+            return 1;
+        }
+        size_t last = args.size() - 3;
+        if (!evaluateConstant(args[last], from) || !evaluateConstant(args[last + 1], to) ||
+            !evaluateConstant(args[last + 2], step) || step == 0 || (to - from) / step < 0 || (to - from) / step > MaxRows) {
+            err << "Error: Invalid range." << '\n';
+            return 1;
+        }
+        std::string exprStr;
+        for (size_t i = 1; i < last; i++) {
+            if (!exprStr.empty()) exprStr += " ";
+            exprStr += args[i];
+        }
+        ExpressionParser parser(exprStr);
+        Expression* expr = parser.parse();
+        if (!expr || parser.hasY() || parser.hasZ()) {
+            err << "Error: eval-range needs an expression of x." << '\n';
+            delete expr;
+            return 1;
+        }
+        // Points are from + i * step, so rounding does not accumulate over long ranges.
+        size_t count = static_cast<size_t>(std::floor((to - from) / step + 1e-9)) + 1;
+        ColumnWriter writer(pipe, out);
+        std::vector<double> xs(BlockRows), ys(BlockRows);
+        bool open = true;
+        for (size_t block = 0; block < count && open && !ms::cancelled(); block += BlockRows) {
+            size_t n = std::min(BlockRows, count - block);
+            for (size_t i = 0; i < n; i++)
+                xs[i] = from + (block + i) * step;
+            evaluateBlock(expr, xs.data(), ys.data(), n);
+            for (size_t i = 0; i < n && open; i++)
+                open = writer.add(xs[i], ys[i]);
+        }
+        writer.flush();
+        delete expr;
+        return 0;
+    }
+
+    // map <expression> [col=name]: y = f(x) for every value x of a piped column.
+    int mapColumn(const std::vector<std::string>& args, const ms::Pipe& pipe, std::ostream& out, std::ostream& err) {
+        if (!pipe.hasInput()) {
+            err << "Error: map reads its input from a pipeline, e.g. eval-range x 0 1 0.1 | math map x^2" << '\n';
+            return 1;
+        }
+        std::string column;
+        std::string exprStr;
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i].rfind("col=", 0) == 0) {
+                column = args[i].substr(4);
+                continue;
+            }
+            if (!exprStr.empty()) exprStr += " ";
+            exprStr += args[i];
+        }
+        ExpressionParser parser(exprStr);
+        Expression* expr = parser.parse();
+        if (!expr || parser.hasY() || parser.hasZ()) {
+            err << "Error: map needs an expression of x." << '\n';
+            delete expr;
+            return 1;
+        }
+        ColumnWriter writer(pipe, out);
+        std::vector<double> ys;
+        ms_batch batch;
+        int status = 0;
+        bool open = true;
+        while (open && !ms::cancelled() && pipe.read(batch)) {
+            long index = ms::Pipe::findColumn(batch, column.empty() ? "y" : column);
+            if (index < 0 && column.empty() && batch.column_count > 0)
+                index = 0;
+            if (index < 0 || batch.columns[index].type != MS_COLUMN_DOUBLE) {
+                if (batch.rows == 0)
+                    continue;
+                if (index < 0)
+                    err << "Error: input has no column '" << column << "'" << '\n';
+                else
+                    err << "Error: map needs a numeric column." << '\n';
+                status = 1;
+                break;
+            }
+            const double* values = batch.columns[index].doubles;
+            ys.resize(batch.rows);
+            evaluateBlock(expr, values, ys.data(), batch.rows);
+            for (size_t r = 0; r < batch.rows && open; r++)
+                open = writer.add(values[r], ys[r]);
+        }
+        writer.flush();
         delete expr;
+        return status;
+    }
+
+    // graph param <x(t)>; <y(t)>[; <tMin>; <tMax>]
+    int graphParametric(const std::vector<std::string>& args, std::ostream& out, std::ostream& err) {
+        std::string joined;
+        for (size_t i = 2; i < args.size(); i++) {
+            if (!joined.empty()) joined += " ";
+            joined += args[i];
+        }
+        std::vector<std::string> parts;
+        std::istringstream stream(joined);
+        std::string part;
+        while (std::getline(stream, part, ';')) {
+            size_t first = part.find_first_not_of(" \t");
+            size_t last = part.find_last_not_of(" \t");
+            parts.push_back(first == std::string::npos ? "" : part.substr(first, last - first + 1));
+        }
+        if (parts.size() != 2 && parts.size() != 4) {
+            err << "Error: graph param <x(t)>; <y(t)>[; <tMin>; <tMax>]" << '\n';
+            return 1;
+        }
+        double tMin = 0, tMax = 2 * M_PI;
+        if (parts.size() == 4 && (!evaluateConstant(parts[2], tMin) || !evaluateConstant(parts[3], tMax) || !(tMin < tMax))) {
+            err << "Error: Invalid parameter range." << '\n';
+            return 1;
+        }
+        Expression* xExpr = ExpressionParser(parts[0]).parse();
+        Expression* yExpr = ExpressionParser(parts[1]).parse();
+        int status = 0;
+        if (!xExpr || !yExpr) {
+            err << "Error: Failed to parse expression." << '\n';
+            status = 1;
+        }
+        else {
+            out << "Drawing parametric curve x(t) = " << parts[0] << ", y(t) = " << parts[1]
+                << ", t in [" << tMin << ", " << tMax << "]" << '\n';
+            drawGraphParametric(xExpr, yExpr, tMin, tMax, out);
+        }
+        delete xExpr;
+        delete yExpr;
+        return status;
     }
 
-    std::string getVersion() const override {
-        return "Math Module Version 1.1.0";
+    static bool evaluateConstant(const std::string& text, double& value) {
+        Expression* expr = ExpressionParser(text).parse();
+        if (!expr)
+            return false;
+        value = expr->evaluate();
+        delete expr;
+        return std::isfinite(value);
     }
+
+    MatrixCommands m_matrixCommands;
 };
 
-// Exported function to create the module instance
-extern "C" __declspec(dllexport) Module* createModule() {
-    return new MathModule();
-}
+// Exported entry points (module_api.h)
+MS_DEFINE_MODULE_WITH_CAPS(MathModule, "math", "Math Module Version 1.5.0",
+    MS_CAP_EXECUTE | MS_CAP_PIPE_INPUT | MS_CAP_PIPE_OUTPUT)
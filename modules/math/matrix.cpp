@@ -0,0 +1,691 @@
+#include "matrix.h"
+#include "../../module_api.h" // ms::parallelFor (host thread pool)
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#include <immintrin.h>
+#define MATRIX_KERNEL_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MATRIX_KERNEL_SSE2
+#endif
+
+namespace {
+
+//------------------------------------------------------------
+// GEMM Kernels
+//------------------------------------------------------------
+
+// Register tile (MR x NR), and the cache blocks: an MC x KC panel of A stays in L2,
+// a KC x NR sliver of B in L1.
+const size_t MR = 4;
+#ifdef MATRIX_KERNEL_AVX2
+const size_t NR = 8;
+#else
+const size_t NR = 4;
+#endif
+const size_t MC = 128;
+const size_t KC = 256;
+const size_t NC = 2048;
+
+// Below this many multiply-adds a product runs on the calling thread.
+const size_t ParallelWorkThreshold = size_t(1) << 21;
+
+// c[MR x NR] += a-panel * b-panel over kc steps. a is packed MR values per step, b NR values.
+void microKernel(size_t kc, const double* a, const double* b, double* c, size_t ldc) {
+#if defined(MATRIX_KERNEL_AVX2)
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    for (size_t p = 0; p < kc; p++) {
+        __m256d b0 = _mm256_loadu_pd(b);
+        __m256d b1 = _mm256_loadu_pd(b + 4);
+        __m256d av = _mm256_broadcast_sd(a);
+        c00 = _mm256_fmadd_pd(av, b0, c00); c01 = _mm256_fmadd_pd(av, b1, c01);
+        av = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(av, b0, c10); c11 = _mm256_fmadd_pd(av, b1, c11);
+        av = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(av, b0, c20); c21 = _mm256_fmadd_pd(av, b1, c21);
+        av = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(av, b0, c30); c31 = _mm256_fmadd_pd(av, b1, c31);
+        a += MR;
+        b += NR;
+    }
+    __m256d acc[MR][2] = { { c00, c01 }, { c10, c11 }, { c20, c21 }, { c30, c31 } };
+    for (size_t i = 0; i < MR; i++) {
+        double* row = c + i * ldc;
+        _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), acc[i][0]));
+        _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), acc[i][1]));
+    }
+#elif defined(MATRIX_KERNEL_SSE2)
+    __m128d c00 = _mm_setzero_pd(), c01 = _mm_setzero_pd();
+    __m128d c10 = _mm_setzero_pd(), c11 = _mm_setzero_pd();
+    __m128d c20 = _mm_setzero_pd(), c21 = _mm_setzero_pd();
+    __m128d c30 = _mm_setzero_pd(), c31 = _mm_setzero_pd();
+    for (size_t p = 0; p < kc; p++) {
+        __m128d b0 = _mm_loadu_pd(b);
+        __m128d b1 = _mm_loadu_pd(b + 2);
+        __m128d av = _mm_set1_pd(a[0]);
+        c00 = _mm_add_pd(c00, _mm_mul_pd(av, b0)); c01 = _mm_add_pd(c01, _mm_mul_pd(av, b1));
+        av = _mm_set1_pd(a[1]);
+        c10 = _mm_add_pd(c10, _mm_mul_pd(av, b0)); c11 = _mm_add_pd(c11, _mm_mul_pd(av, b1));
+        av = _mm_set1_pd(a[2]);
+        c20 = _mm_add_pd(c20, _mm_mul_pd(av, b0)); c21 = _mm_add_pd(c21, _mm_mul_pd(av, b1));
+        av = _mm_set1_pd(a[3]);
+        c30 = _mm_add_pd(c30, _mm_mul_pd(av, b0)); c31 = _mm_add_pd(c31, _mm_mul_pd(av, b1));
+        a += MR;
+        b += NR;
+    }
+    __m128d acc[MR][2] = { { c00, c01 }, { c10, c11 }, { c20, c21 }, { c30, c31 } };
+    for (size_t i = 0; i < MR; i++) {
+        double* row = c + i * ldc;
+        _mm_storeu_pd(row, _mm_add_pd(_mm_loadu_pd(row), acc[i][0]));
+        _mm_storeu_pd(row + 2, _mm_add_pd(_mm_loadu_pd(row + 2), acc[i][1]));
+    }
+#else
+    double acc[MR][NR] = {};
+    for (size_t p = 0; p < kc; p++) {
+        for (size_t i = 0; i < MR; i++)
+            for (size_t j = 0; j < NR; j++)
+                acc[i][j] += a[i] * b[j];
+        a += MR;
+        b += NR;
+    }
+    for (size_t i = 0; i < MR; i++)
+        for (size_t j = 0; j < NR; j++)
+            c[i * ldc + j] += acc[i][j];
+#endif
+}
+
+// Packs rows [0, mc) x cols [0, kc) of a (scaled by alpha) into MR-row panels, zero padded.
+void packA(size_t mc, size_t kc, double alpha, const double* a, size_t lda, double* dst) {
+    for (size_t ir = 0; ir < mc; ir += MR) {
+        for (size_t p = 0; p < kc; p++) {
+            for (size_t i = 0; i < MR; i++)
+                *dst++ = ir + i < mc ? alpha * a[(ir + i) * lda + p] : 0.0;
+        }
+    }
+}
+
+// Packs rows [0, kc) x cols [0, nc) of b into NR-column panels, zero padded.
+void packB(size_t kc, size_t nc, const double* b, size_t ldb, double* dst) {
+    for (size_t jr = 0; jr < nc; jr += NR) {
+        for (size_t p = 0; p < kc; p++) {
+            const double* row = b + p * ldb + jr;
+            for (size_t j = 0; j < NR; j++)
+                *dst++ = jr + j < nc ? row[j] : 0.0;
+        }
+    }
+}
+
+// Blocked GEMM for rows [0, m) of C on the calling thread.
+void gemmSerial(size_t m, size_t n, size_t k, double alpha,
+    const double* a, size_t lda, const double* b, size_t ldb, double* c, size_t ldc) {
+    std::vector<double> packedA((std::min(MC, m) + MR - 1) / MR * MR * std::min(KC, k));
+    std::vector<double> packedB((std::min(NC, n) + NR - 1) / NR * NR * std::min(KC, k));
+    double edge[MR * NR];
+
+    for (size_t jc = 0; jc < n; jc += NC) {
+        size_t nc = std::min(NC, n - jc);
+        for (size_t pc = 0; pc < k; pc += KC) {
+            size_t kc = std::min(KC, k - pc);
+            packB(kc, nc, b + pc * ldb + jc, ldb, packedB.data());
+            for (size_t ic = 0; ic < m; ic += MC) {
+                size_t mc = std::min(MC, m - ic);
+                packA(mc, kc, alpha, a + ic * lda + pc, lda, packedA.data());
+                for (size_t jr = 0; jr < nc; jr += NR) {
+                    const double* bPanel = packedB.data() + jr * kc;
+                    for (size_t ir = 0; ir < mc; ir += MR) {
+                        const double* aPanel = packedA.data() + ir * kc;
+                        double* cTile = c + (ic + ir) * ldc + jc + jr;
+                        if (ir + MR <= mc && jr + NR <= nc) {
+                            microKernel(kc, aPanel, bPanel, cTile, ldc);
+                            continue;
+                        }
+                        // Edge tile: accumulate into scratch and copy back the valid part.
+                        std::fill(edge, edge + MR * NR, 0.0);
+                        microKernel(kc, aPanel, bPanel, edge, NR);
+                        for (size_t i = 0; i < MR && ir + i < mc; i++)
+                            for (size_t j = 0; j < NR && jr + j < nc; j++)
+                                cTile[i * ldc + j] += edge[i * NR + j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Threads of the host pool a product with this many rows can use.
+size_t workerCount(size_t rows) {
+    return std::max<size_t>(1, std::min(ms::concurrency(), rows / MR));
+}
+
+} // namespace
+
+void gemmAccumulate(size_t m, size_t n, size_t k, double alpha,
+    const double* a, size_t lda, const double* b, size_t ldb, double* c, size_t ldc) {
+    if (m == 0 || n == 0 || k == 0)
+        return;
+    size_t workers = m * n * k < ParallelWorkThreshold ? 1 : workerCount(m);
+    if (workers == 1) {
+        gemmSerial(m, n, k, alpha, a, lda, b, ldb, c, ldc);
+        return;
+    }
+    // Each task owns a contiguous band of C rows (a multiple of MR) and packs its own panels.
+    // The bands run on the host thread pool, shared with whatever else is running.
+    size_t band = ((m + workers - 1) / workers + MR - 1) / MR * MR;
+    size_t bands = (m + band - 1) / band;
+    ms::parallelFor(bands, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            size_t row = i * band;
+            gemmSerial(std::min(band, m - row), n, k, alpha, a + row * lda, lda, b, ldb, c + row * ldc, ldc);
+        }
+    });
+}
+
+//------------------------------------------------------------
+// Matrix Operations
+//------------------------------------------------------------
+
+const size_t Matrix::MaxElements;
+
+size_t Matrix::elementCount(size_t rows, size_t cols) {
+    // Checked by division so that rows * cols cannot wrap around.
+    if (cols != 0 && rows > MaxElements / cols)
+        throw std::runtime_error("matrix of " + std::to_string(rows) + " x " + std::to_string(cols)
+            + " exceeds " + std::to_string(MaxElements) + " elements");
+    return rows * cols;
+}
+
+Matrix Matrix::identity(size_t n) {
+    Matrix m(n, n);
+    for (size_t i = 0; i < n; i++)
+        m(i, i) = 1.0;
+    return m;
+}
+
+Matrix Matrix::random(size_t rows, size_t cols, unsigned seed) {
+    Matrix m(rows, cols);
+    std::mt19937_64 engine(seed);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    for (size_t i = 0; i < rows * cols; i++)
+        m.data()[i] = dist(engine);
+    return m;
+}
+
+Matrix multiply(const Matrix& a, const Matrix& b) {
+    if (a.cols() != b.rows())
+        throw std::runtime_error("dimension mismatch in multiply");
+    Matrix c(a.rows(), b.cols());
+    gemmAccumulate(a.rows(), b.cols(), a.cols(), 1.0, a.data(), a.cols(), b.data(), b.cols(), c.data(), c.cols());
+    return c;
+}
+
+Matrix multiplyNaive(const Matrix& a, const Matrix& b) {
+    if (a.cols() != b.rows())
+        throw std::runtime_error("dimension mismatch in multiply");
+    Matrix c(a.rows(), b.cols());
+    for (size_t i = 0; i < a.rows(); i++)
+        for (size_t j = 0; j < b.cols(); j++) {
+            double sum = 0.0;
+            for (size_t p = 0; p < a.cols(); p++)
+                sum += a(i, p) * b(p, j);
+            c(i, j) = sum;
+        }
+    return c;
+}
+
+Matrix transpose(const Matrix& a) {
+    Matrix t(a.cols(), a.rows());
+    // Tiled so that both the reads and the writes stay within a few cache lines.
+    const size_t tile = 32;
+    for (size_t i0 = 0; i0 < a.rows(); i0 += tile)
+        for (size_t j0 = 0; j0 < a.cols(); j0 += tile)
+            for (size_t i = i0; i < std::min(i0 + tile, a.rows()); i++)
+                for (size_t j = j0; j < std::min(j0 + tile, a.cols()); j++)
+                    t(j, i) = a(i, j);
+    return t;
+}
+
+LUDecomposition::LUDecomposition(const Matrix& a)
+    : m_lu(a), m_pivots(a.rows()), m_sign(1), m_singular(false) {
+    if (a.rows() != a.cols())
+        throw std::runtime_error("LU decomposition requires a square matrix");
+    const size_t n = a.rows();
+    const size_t panelWidth = 64;
+    double* lu = m_lu.data();
+    for (size_t i = 0; i < n; i++)
+        m_pivots[i] = i;
+
+    for (size_t j0 = 0; j0 < n; j0 += panelWidth) {
+        size_t jEnd = std::min(j0 + panelWidth, n);
+        // Factor the panel (columns j0..jEnd) with partial pivoting; swaps cover whole rows.
+        for (size_t j = j0; j < jEnd; j++) {
+            size_t pivot = j;
+            for (size_t i = j + 1; i < n; i++)
+                if (std::fabs(lu[i * n + j]) > std::fabs(lu[pivot * n + j]))
+                    pivot = i;
+            if (lu[pivot * n + j] == 0.0) {
+                m_singular = true;
+                continue;
+            }
+            if (pivot != j) {
+                std::swap_ranges(lu + j * n, lu + (j + 1) * n, lu + pivot * n);
+                std::swap(m_pivots[j], m_pivots[pivot]);
+                m_sign = -m_sign;
+            }
+            double inverse = 1.0 / lu[j * n + j];
+            for (size_t i = j + 1; i < n; i++) {
+                double l = lu[i * n + j] *= inverse;
+                for (size_t c = j + 1; c < jEnd; c++)
+                    lu[i * n + c] -= l * lu[j * n + c];
+            }
+        }
+        if (jEnd == n)
+            break;
+        // U12 = L11^-1 A12 (unit lower triangular solve on the panel rows).
+        for (size_t i = j0 + 1; i < jEnd; i++)
+            for (size_t r = j0; r < i; r++) {
+                double l = lu[i * n + r];
+                for (size_t c = jEnd; c < n; c++)
+                    lu[i * n + c] -= l * lu[r * n + c];
+            }
+        // A22 -= L21 * U12
+        gemmAccumulate(n - jEnd, n - jEnd, jEnd - j0, -1.0,
+            lu + jEnd * n + j0, n, lu + j0 * n + jEnd, n, lu + jEnd * n + jEnd, n);
+    }
+}
+
+double LUDecomposition::determinant() const {
+    if (m_singular)
+        return 0.0;
+    double det = m_sign;
+    for (size_t i = 0; i < m_lu.rows(); i++)
+        det *= m_lu(i, i);
+    return det;
+}
+
+Matrix LUDecomposition::solve(const Matrix& b) const {
+    const size_t n = m_lu.rows();
+    if (b.rows() != n)
+        throw std::runtime_error("dimension mismatch in solve");
+    if (m_singular)
+        throw std::runtime_error("matrix is singular");
+    const size_t m = b.cols();
+    Matrix x(n, m);
+    for (size_t i = 0; i < n; i++)
+        std::copy(b.data() + m_pivots[i] * m, b.data() + (m_pivots[i] + 1) * m, x.data() + i * m);
+    // Blocked forward substitution with unit L, then back substitution with U: the
+    // off-diagonal part of each block row goes through gemmAccumulate, the small
+    // triangular block is solved row by row.
+    const size_t block = 64;
+    const double* lu = m_lu.data();
+    for (size_t i0 = 0; i0 < n; i0 += block) {
+        size_t i1 = std::min(i0 + block, n);
+        gemmAccumulate(i1 - i0, m, i0, -1.0, lu + i0 * n, n, x.data(), m, x.data() + i0 * m, m);
+        for (size_t i = i0; i < i1; i++)
+            for (size_t r = i0; r < i; r++) {
+                double l = lu[i * n + r];
+                for (size_t c = 0; c < m; c++)
+                    x(i, c) -= l * x(r, c);
+            }
+    }
+    for (size_t i1 = n; i1 > 0;) {
+        size_t i0 = i1 > block ? i1 - block : 0;
+        gemmAccumulate(i1 - i0, m, n - i1, -1.0, lu + i0 * n + i1, n, x.data() + i1 * m, m, x.data() + i0 * m, m);
+        for (size_t i = i1; i-- > i0;) {
+            for (size_t r = i + 1; r < i1; r++) {
+                double u = lu[i * n + r];
+                for (size_t c = 0; c < m; c++)
+                    x(i, c) -= u * x(r, c);
+            }
+            double inverse = 1.0 / lu[i * n + i];
+            for (size_t c = 0; c < m; c++)
+                x(i, c) *= inverse;
+        }
+        i1 = i0;
+    }
+    return x;
+}
+
+//------------------------------------------------------------
+// Parsing and Files
+//------------------------------------------------------------
+
+namespace {
+
+// Parses one row of numbers separated by `separators`; returns the values read.
+std::vector<double> parseRow(const char* begin, const char* end, const char* separators) {
+    std::vector<double> values;
+    const char* p = begin;
+    while (p < end) {
+        while (p < end && (std::strchr(separators, *p) || std::isspace(static_cast<unsigned char>(*p))))
+            p++;
+        if (p >= end)
+            break;
+        char* next = nullptr;
+        double value = std::strtod(p, &next);
+        if (next == p || next > end)
+            throw std::runtime_error("invalid number near '" + std::string(p, std::min<size_t>(end - p, 16)) + "'");
+        values.push_back(value);
+        p = next;
+    }
+    return values;
+}
+
+Matrix fromRows(const std::vector<std::vector<double>>& rows) {
+    if (rows.empty())
+        throw std::runtime_error("empty matrix");
+    Matrix m(rows.size(), rows[0].size());
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (rows[i].size() != m.cols())
+            throw std::runtime_error("row " + std::to_string(i + 1) + " has " + std::to_string(rows[i].size())
+                + " values, expected " + std::to_string(m.cols()));
+        std::copy(rows[i].begin(), rows[i].end(), m.data() + i * m.cols());
+    }
+    return m;
+}
+
+bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+const char BinaryMagic[8] = { 'M', 'S', 'M', 'A', 'T', 'R', 'X', '1' };
+
+} // namespace
+
+Matrix parseMatrixLiteral(const std::string& text) {
+    size_t open = text.find('['), close = text.rfind(']');
+    if (open == std::string::npos || close == std::string::npos || close < open)
+        throw std::runtime_error("matrix literal must be enclosed in [ ]");
+    std::vector<std::vector<double>> rows;
+    size_t start = open + 1;
+    while (start <= close) {
+        size_t end = text.find(';', start);
+        if (end == std::string::npos || end > close)
+            end = close;
+        std::vector<double> row = parseRow(text.data() + start, text.data() + end, ",");
+        if (!row.empty())
+            rows.push_back(row);
+        start = end + 1;
+    }
+    return fromRows(rows);
+}
+
+Matrix loadMatrix(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("cannot open " + path);
+    if (!endsWith(path, ".csv")) {
+        char magic[8];
+        uint64_t rows = 0, cols = 0;
+        file.read(magic, sizeof(magic));
+        file.read(reinterpret_cast<char*>(&rows), sizeof(rows));
+        file.read(reinterpret_cast<char*>(&cols), sizeof(cols));
+        if (!file || std::memcmp(magic, BinaryMagic, sizeof(magic)) != 0)
+            throw std::runtime_error(path + " is not a binary matrix file");
+        // The header is not trusted: rows x cols doubles must fill the rest of the file exactly.
+        // The row test keeps rows * cols * 8 from overflowing in the last one.
+        std::streamoff header = file.tellg();
+        file.seekg(0, std::ios::end);
+        uint64_t payload = static_cast<uint64_t>(file.tellg() - header);
+        file.seekg(header);
+        // Both dimensions must be non-zero, or the first test would let any row count through.
+        if (rows == 0 || cols == 0 || rows > payload / sizeof(double) / cols || rows * cols * sizeof(double) != payload)
+            throw std::runtime_error(path + " has a size that does not match its header");
+        Matrix m(static_cast<size_t>(rows), static_cast<size_t>(cols));
+        file.read(reinterpret_cast<char*>(m.data()), static_cast<std::streamsize>(rows * cols * sizeof(double)));
+        if (!file)
+            throw std::runtime_error(path + " is truncated");
+        return m;
+    }
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::vector<std::vector<double>> rows;
+    size_t start = 0;
+    while (start < content.size()) {
+        size_t end = content.find('\n', start);
+        if (end == std::string::npos)
+            end = content.size();
+        std::vector<double> row = parseRow(content.data() + start, content.data() + end, ",;");
+        if (!row.empty())
+            rows.push_back(std::move(row));
+        start = end + 1;
+    }
+    return fromRows(rows);
+}
+
+void saveMatrix(const std::string& path, const Matrix& m) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+    if (!endsWith(path, ".csv")) {
+        uint64_t rows = m.rows(), cols = m.cols();
+        file.write(BinaryMagic, sizeof(BinaryMagic));
+        file.write(reinterpret_cast<const char*>(&rows), sizeof(rows));
+        file.write(reinterpret_cast<const char*>(&cols), sizeof(cols));
+        file.write(reinterpret_cast<const char*>(m.data()), static_cast<std::streamsize>(m.rows() * m.cols() * sizeof(double)));
+    }
+    else {
+        std::string line;
+        char number[32];
+        for (size_t i = 0; i < m.rows(); i++) {
+            line.clear();
+            for (size_t j = 0; j < m.cols(); j++) {
+                if (j) line += ',';
+                std::snprintf(number, sizeof(number), "%.17g", m(i, j));
+                line += number;
+            }
+            line += '\n';
+            file << line;
+        }
+    }
+    if (!file)
+        throw std::runtime_error("error writing " + path);
+}
+
+//------------------------------------------------------------
+// "mat" Command
+//------------------------------------------------------------
+
+namespace {
+
+// Splits the command into words; a bracketed literal is kept as one word.
+std::vector<std::string> splitWords(const std::vector<std::string>& args) {
+    std::string line;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (!line.empty()) line += " ";
+        line += args[i];
+    }
+    std::vector<std::string> words;
+    size_t i = 0;
+    while (i < line.size()) {
+        if (std::isspace(static_cast<unsigned char>(line[i]))) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        if (line[i] == '[') {
+            i = line.find(']', i);
+            if (i == std::string::npos)
+                throw std::runtime_error("unterminated matrix literal");
+            i++;
+        }
+        else {
+            while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i])))
+                i++;
+        }
+        words.push_back(line.substr(start, i - start));
+    }
+    return words;
+}
+
+size_t parseSize(const std::string& word) {
+    char* end = nullptr;
+    unsigned long long value = std::strtoull(word.c_str(), &end, 10);
+    if (word.empty() || *end != '\0' || value == 0)
+        throw std::runtime_error("expected a positive size, got '" + word + "'");
+    return static_cast<size_t>(value);
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+void MatrixCommands::printHelp(std::ostream& out) {
+    out << "Matrix commands (math mat ...):" << '\n';
+    out << "  mat <name> = <matrix>     - Store a matrix under a name" << '\n';
+    out << "  mat <matrix>              - Print a matrix" << '\n';
+    out << "  mat det <matrix>          - Determinant (LU with partial pivoting)" << '\n';
+    out << "  mat save <name> <file>    - Save as .csv or binary (any other extension)" << '\n';
+    out << "  mat list                  - List stored matrices" << '\n';
+    out << "  mat bench [n]             - Compare blocked and naive multiply (default n=512)" << '\n';
+    out << "  <matrix> is one of:" << '\n';
+    out << "    [1, 2; 3, 4]   literal       <name>           stored matrix" << '\n';
+    out << "    load <file>    .csv/binary   eye <n>, rand <rows> <cols>" << '\n';
+    out << "    t <A>          transpose     <A> * <B>, mul <A> <B>" << '\n';
+    out << "    solve <A> <B>  solve A X = B" << '\n';
+}
+
+int MatrixCommands::execute(const std::vector<std::string>& args, std::ostream& out, std::ostream& err) {
+    try {
+        std::vector<std::string> words = splitWords(args);
+        if (words.empty() || words[0] == "help" || words[0] == "?") {
+            printHelp(out);
+            return 0;
+        }
+        if (words[0] == "list") {
+            for (const auto& entry : m_matrices)
+                out << entry.first << " : " << entry.second.rows() << " x " << entry.second.cols() << '\n';
+            return 0;
+        }
+        if (words[0] == "bench") {
+            benchmark(words.size() > 1 ? parseSize(words[1]) : 512, out);
+            return 0;
+        }
+        if (words[0] == "det") {
+            Matrix m = evaluate(words, 1);
+            out << std::setprecision(10) << LUDecomposition(m).determinant() << '\n';
+            return 0;
+        }
+        if (words[0] == "save") {
+            if (words.size() != 3)
+                throw std::runtime_error("mat save <name> <file>");
+            saveMatrix(words[2], lookup(words[1]));
+            out << "Saved " << words[1] << " to " << words[2] << '\n';
+            return 0;
+        }
+        if (words.size() >= 3 && words[1] == "=") {
+            Matrix m = evaluate(words, 2);
+            out << words[0] << " : " << m.rows() << " x " << m.cols() << '\n';
+            m_matrices[words[0]] = std::move(m);
+            return 0;
+        }
+        print(evaluate(words, 0), out);
+        return 0;
+    }
+    catch (const std::exception& e) {
+        err << "Error: " << e.what() << '\n';
+        return 1;
+    }
+}
+
+Matrix MatrixCommands::evaluate(const std::vector<std::string>& words, size_t first) {
+    size_t count = words.size() - first;
+    auto operand = [&](size_t i) -> Matrix {
+        const std::string& word = words[first + i];
+        return word[0] == '[' ? parseMatrixLiteral(word) : lookup(word);
+    };
+    if (count == 0)
+        throw std::runtime_error("missing matrix");
+    const std::string& op = words[first];
+    if (count == 1)
+        return operand(0);
+    if (op == "load" && count == 2)
+        return loadMatrix(words[first + 1]);
+    if (op == "eye" && count == 2)
+        return Matrix::identity(parseSize(words[first + 1]));
+    if (op == "rand" && count == 3)
+        return Matrix::random(parseSize(words[first + 1]), parseSize(words[first + 2]), std::random_device()());
+    if (op == "t" && count == 2)
+        return transpose(operand(1));
+    if (op == "mul" && count == 3)
+        return multiply(operand(1), operand(2));
+    if (count == 3 && words[first + 1] == "*")
+        return multiply(operand(0), operand(2));
+    if (op == "solve" && count == 3)
+        return LUDecomposition(operand(1)).solve(operand(2));
+    throw std::runtime_error("unrecognized matrix expression (see 'math mat help')");
+}
+
+const Matrix& MatrixCommands::lookup(const std::string& name) const {
+    auto it = m_matrices.find(name);
+    if (it == m_matrices.end())
+        throw std::runtime_error("unknown matrix '" + name + "'");
+    return it->second;
+}
+
+void MatrixCommands::print(const Matrix& m, std::ostream& out) {
+    const size_t maxShown = 10;
+    std::ostringstream text;
+    text << m.rows() << " x " << m.cols() << "\n" << std::setprecision(6);
+    for (size_t i = 0; i < std::min(m.rows(), maxShown); i++) {
+        for (size_t j = 0; j < std::min(m.cols(), maxShown); j++)
+            text << std::setw(13) << m(i, j);
+        text << (m.cols() > maxShown ? "  ...\n" : "\n");
+    }
+    if (m.rows() > maxShown)
+        text << "  ...\n";
+    out << text.str();
+}
+
+void MatrixCommands::benchmark(size_t n, std::ostream& out) {
+    Matrix a = Matrix::random(n, n, 1), b = Matrix::random(n, n, 2);
+    double flops = 2.0 * n * n * n;
+    out << "GEMM " << n << " x " << n << " (" << workerCount(n) << " threads available)" << '\n';
+
+    auto start = std::chrono::steady_clock::now();
+    Matrix naive = multiplyNaive(a, b);
+    double naiveSeconds = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    Matrix blocked = multiply(a, b);
+    double blockedSeconds = secondsSince(start);
+
+    double maxDiff = 0.0;
+    for (size_t i = 0; i < n * n; i++)
+        maxDiff = std::max(maxDiff, std::fabs(naive.data()[i] - blocked.data()[i]));
+
+    out << std::fixed << std::setprecision(3);
+    out << "  naive   : " << naiveSeconds * 1000 << " ms, " << flops / naiveSeconds * 1e-9 << " GFLOP/s" << '\n';
+    out << "  blocked : " << blockedSeconds * 1000 << " ms, " << flops / blockedSeconds * 1e-9 << " GFLOP/s" << '\n';
+    out << "  speedup : " << naiveSeconds / blockedSeconds << "x, max |diff| = "
+        << std::scientific << maxDiff << std::fixed << '\n';
+
+    start = std::chrono::steady_clock::now();
+    LUDecomposition lu(a);
+    Matrix x = lu.solve(b);
+    double solveSeconds = secondsSince(start);
+    Matrix residual = multiply(a, x);
+    double maxResidual = 0.0;
+    for (size_t i = 0; i < n * n; i++)
+        maxResidual = std::max(maxResidual, std::fabs(residual.data()[i] - b.data()[i]));
+    out << "  LU solve: " << solveSeconds * 1000 << " ms, max |AX - B| = "
+        << std::scientific << maxResidual << std::defaultfloat << '\n';
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------
+// Dense Matrix
+//------------------------------------------------------------
+
+// Row-major dense matrix of doubles. Vectors are n x 1 matrices.
+class Matrix {
+public:
+    // Largest element count a matrix may hold (2 GiB of doubles); bigger sizes throw.
+    static const size_t MaxElements = size_t(1) << 28;
+
+    Matrix() : m_rows(0), m_cols(0) {}
+    Matrix(size_t rows, size_t cols, double fill = 0.0)
+        : m_rows(rows), m_cols(cols), m_data(elementCount(rows, cols), fill) {
+    }
+
+    static Matrix identity(size_t n);
+    static Matrix random(size_t rows, size_t cols, unsigned seed);
+
+    size_t rows() const { return m_rows; }
+    size_t cols() const { return m_cols; }
+    bool empty() const { return m_data.empty(); }
+    double* data() { return m_data.data(); }
+    const double* data() const { return m_data.data(); }
+    double& operator()(size_t r, size_t c) { return m_data[r * m_cols + c]; }
+    double operator()(size_t r, size_t c) const { return m_data[r * m_cols + c]; }
+
+private:
+    static size_t elementCount(size_t rows, size_t cols); // rows * cols, or throws if too large
+
+    size_t m_rows, m_cols;
+    std::vector<double> m_data;
+};
+
+// C += alpha * A * B for row-major operands with leading dimensions lda/ldb/ldc.
+// Cache-blocked with packed panels and a SIMD micro-kernel; large products are split
+// across the host thread pool (ms::parallelFor) by rows of C.
+void gemmAccumulate(size_t m, size_t n, size_t k, double alpha,
+    const double* a, size_t lda, const double* b, size_t ldb, double* c, size_t ldc);
+
+Matrix multiply(const Matrix& a, const Matrix& b);
+Matrix multiplyNaive(const Matrix& a, const Matrix& b); // plain triple loop, for benchmarking
+Matrix transpose(const Matrix& a);
+
+// LU factorization with partial pivoting (PA = LU), blocked so that the trailing
+// update runs through gemmAccumulate.
+class LUDecomposition {
+public:
+    explicit LUDecomposition(const Matrix& a);
+
+    bool isSingular() const { return m_singular; }
+    double determinant() const;
+    Matrix solve(const Matrix& b) const; // solves A X = B
+
+private:
+    Matrix m_lu;
+    std::vector<size_t> m_pivots; // row i of PA is row m_pivots[i] of A
+    int m_sign;
+    bool m_singular;
+};
+
+// Parses a literal such as "[1, 2; 3, 4]" (rows separated by ';', values by ',' or spaces).
+Matrix parseMatrixLiteral(const std::string& text);
+
+// Files ending in ".csv" are comma separated text, anything else uses the binary format
+// ("MSMATRX1", uint64 rows, uint64 cols, row-major doubles).
+Matrix loadMatrix(const std::string& path);
+void saveMatrix(const std::string& path, const Matrix& m);
+
+//------------------------------------------------------------
+// "mat" Command
+//------------------------------------------------------------
+
+// Named matrix workspace behind "math mat ...". Errors are thrown as std::runtime_error
+// and reported by execute(), which returns non-zero in that case.
+class MatrixCommands {
+public:
+    int execute(const std::vector<std::string>& args, std::ostream& out, std::ostream& err);
+    static void printHelp(std::ostream& out);
+
+private:
+    Matrix evaluate(const std::vector<std::string>& words, size_t first);
+    const Matrix& lookup(const std::string& name) const;
+    static void print(const Matrix& m, std::ostream& out);
+    static void benchmark(size_t n, std::ostream& out);
+
+    std::map<std::string, Matrix> m_matrices;
+};
@@ -0,0 +1,367 @@
+#pragma once
+// Local IPC between "Mini-Shell --serve <address>" and Mini-Shell-client (client/client.cpp).
+//
+// <address> is a filesystem path for a Unix domain socket, or tcp:<port> for a loopback TCP
+// port. Where Unix domain sockets are not available (older Windows), the server listens on a
+// free loopback port instead and writes "tcp:<port>" into the file at the path; clients that
+// cannot connect to the path as a socket read it from there.
+//
+// Every message is a frame: a uint32 length (little endian) of what follows, a type byte and
+// the payload.
+//   client -> server  'C'  one command line, run as if typed at the prompt
+//                     'Q'  stop the server
+//   server -> client  'O' / 'E'  output of the command (stdout / stderr), in write order
+//                     'S'  end of the response: uint32 status, 0 if nothing went to stderr
+// A connection is a session: its requests run one after another, each answered in full
+// before the next one is read.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace ipc {
+
+enum FrameType : uint8_t {
+	Command = 'C',
+	Stop = 'Q',
+	Out = 'O',
+	Err = 'E',
+	Status = 'S'
+};
+
+const uint32_t MaxFrame = 64u << 20;
+
+#ifdef _WIN32
+typedef SOCKET Socket;
+const Socket InvalidSocket = INVALID_SOCKET;
+
+inline void closeSocket(Socket socket) { closesocket(socket); }
+inline void shutdownSocket(Socket socket) { shutdown(socket, SD_BOTH); }
+inline bool interruptedCall() { return false; }
+
+inline std::string lastError() {
+	return "socket error " + std::to_string(WSAGetLastError());
+}
+
+inline bool startup() {
+	static bool started = []() {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+	return started;
+}
+#else
+typedef int Socket;
+const Socket InvalidSocket = -1;
+
+inline void closeSocket(Socket socket) { close(socket); }
+inline void shutdownSocket(Socket socket) { shutdown(socket, SHUT_RDWR); }
+inline bool interruptedCall() { return errno == EINTR; }
+inline std::string lastError() { return std::strerror(errno); }
+inline bool startup() { return true; }
+#endif
+
+// Writes to a closed connection must fail instead of raising SIGPIPE.
+#ifdef MSG_NOSIGNAL
+const int SendFlags = MSG_NOSIGNAL;
+#else
+const int SendFlags = 0;
+#endif
+
+inline bool sendAll(Socket socket, const char* data, size_t size) {
+	while (size > 0) {
+		int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+		auto sent = send(socket, data, chunk, SendFlags);
+		if (sent <= 0) {
+			if (sent < 0 && interruptedCall())
+				continue;
+			return false;
+		}
+		data += sent;
+		size -= static_cast<size_t>(sent);
+	}
+	return true;
+}
+
+inline bool receiveAll(Socket socket, char* data, size_t size) {
+	while (size > 0) {
+		int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+		auto received = recv(socket, data, chunk, 0);
+		if (received <= 0) {
+			if (received < 0 && interruptedCall())
+				continue;
+			return false;
+		}
+		data += received;
+		size -= static_cast<size_t>(received);
+	}
+	return true;
+}
+
+// Small frames go out in a single send, so a request or a short reply is one packet.
+inline bool writeFrame(Socket socket, uint8_t type, const char* data, size_t size) {
+	const size_t InlinePayload = 4096;
+	if (size + 1 > MaxFrame)
+		return false;
+	char frame[5 + InlinePayload];
+	uint32_t length = static_cast<uint32_t>(size + 1);
+	for (int i = 0; i < 4; i++)
+		frame[i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+	frame[4] = static_cast<char>(type);
+	if (size <= InlinePayload) {
+		if (size > 0)
+			std::memcpy(frame + 5, data, size);
+		return sendAll(socket, frame, 5 + size);
+	}
+	return sendAll(socket, frame, 5) && sendAll(socket, data, size);
+}
+
+inline bool writeStatus(Socket socket, uint32_t status) {
+	char payload[4];
+	for (int i = 0; i < 4; i++)
+		payload[i] = static_cast<char>((status >> (8 * i)) & 0xFF);
+	return writeFrame(socket, Status, payload, sizeof(payload));
+}
+
+inline uint32_t decodeStatus(const std::string& payload) {
+	uint32_t status = 0;
+	for (size_t i = 0; i < 4 && i < payload.size(); i++)
+		status |= static_cast<uint32_t>(static_cast<unsigned char>(payload[i])) << (8 * i);
+	return status;
+}
+
+// False at the end of the connection or on a malformed frame.
+inline bool readFrame(Socket socket, uint8_t& type, std::string& payload) {
+	unsigned char header[5];
+	if (!receiveAll(socket, reinterpret_cast<char*>(header), sizeof(header)))
+		return false;
+	uint32_t length = header[0] | (header[1] << 8) | (header[2] << 16) | (static_cast<uint32_t>(header[3]) << 24);
+	if (length == 0 || length > MaxFrame)
+		return false;
+	type = header[4];
+	payload.resize(length - 1);
+	return length == 1 || receiveAll(socket, &payload[0], length - 1);
+}
+
+// 1 if socket has data (or a connection) waiting, 0 after timeoutMs, -1 on error.
+inline int waitReadable(Socket socket, int timeoutMs) {
+#ifdef _WIN32
+	WSAPOLLFD entry = { socket, POLLRDNORM, 0 };
+	int ready = WSAPoll(&entry, 1, timeoutMs);
+#else
+	struct pollfd entry = { socket, POLLIN, 0 };
+	int ready = poll(&entry, 1, timeoutMs);
+	if (ready < 0 && interruptedCall())
+		return 0;
+#endif
+	return ready < 0 ? -1 : (ready > 0 ? 1 : 0);
+}
+
+inline bool parseTcpAddress(const std::string& address, unsigned short& port) {
+	if (address.compare(0, 4, "tcp:") != 0 || address.size() == 4)
+		return false;
+	char* end = nullptr;
+	unsigned long value = std::strtoul(address.c_str() + 4, &end, 10);
+	if (*end != '\0' || value > 65535)
+		return false;
+	port = static_cast<unsigned short>(value);
+	return true;
+}
+
+// Replies are written as soon as they are ready; Nagle's algorithm would hold them back on
+// TCP (the option simply fails on a Unix domain socket).
+inline void configureConnection(Socket socket) {
+	int on = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+#ifdef SO_NOSIGPIPE
+	setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+inline Socket listenTcp(unsigned short port, unsigned short& boundPort, std::string& error) {
+	Socket listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener == InvalidSocket) {
+		error = lastError();
+		return InvalidSocket;
+	}
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	socklen_t length = sizeof(address);
+	if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+		listen(listener, SOMAXCONN) != 0 ||
+		getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+		error = lastError();
+		closeSocket(listener);
+		return InvalidSocket;
+	}
+	boundPort = ntohs(address.sin_port);
+	return listener;
+}
+
+inline Socket connectTcp(unsigned short port, std::string& error) {
+	Socket connection = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (connection == InvalidSocket) {
+		error = lastError();
+		return InvalidSocket;
+	}
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	if (connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+		error = lastError();
+		closeSocket(connection);
+		return InvalidSocket;
+	}
+	configureConnection(connection);
+	return connection;
+}
+
+inline bool unixAddress(const std::string& path, sockaddr_un& address, std::string& error) {
+	address = sockaddr_un();
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		error = "socket path is too long";
+		return false;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+// Connects to a server (see the top of the file for the address forms).
+inline Socket connectTo(const std::string& address, std::string& error) {
+	unsigned short port = 0;
+	if (parseTcpAddress(address, port))
+		return connectTcp(port, error);
+	sockaddr_un unixPath;
+	if (!unixAddress(address, unixPath, error))
+		return InvalidSocket;
+	Socket connection = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connection != InvalidSocket) {
+		if (connect(connection, reinterpret_cast<sockaddr*>(&unixPath), sizeof(unixPath)) == 0) {
+			configureConnection(connection);
+			return connection;
+		}
+		error = lastError();
+		closeSocket(connection);
+	}
+	else {
+		error = lastError();
+	}
+	// A server without Unix domain sockets leaves its TCP address in the file.
+	std::ifstream file(address);
+	std::string redirect;
+	if (std::getline(file, redirect) && parseTcpAddress(redirect, port))
+		return connectTcp(port, error);
+	return InvalidSocket;
+}
+
+// True if path names a socket file or a "tcp:<port>" redirect file, which a new server may
+// replace; false if it names anything else.
+inline bool isAddressFile(const std::string& path) {
+	std::ifstream file(path);
+	std::string redirect;
+	unsigned short port = 0;
+	if (std::getline(file, redirect) && parseTcpAddress(redirect, port))
+		return true;
+#ifdef _WIN32
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT);
+#else
+	struct stat info;
+	return stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode);
+#endif
+}
+
+inline bool pathExists(const std::string& path) {
+#ifdef _WIN32
+	return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+	struct stat info;
+	return stat(path.c_str(), &info) == 0;
+#endif
+}
+
+// Listening socket for address. The file of a server that is gone is replaced; a running
+// server or any other file at the path is an error.
+inline Socket listenOn(const std::string& address, std::string& error) {
+	unsigned short port = 0, boundPort = 0;
+	if (parseTcpAddress(address, port))
+		return listenTcp(port, boundPort, error);
+	sockaddr_un unixPath;
+	if (!unixAddress(address, unixPath, error))
+		return InvalidSocket;
+	if (pathExists(address)) {
+		std::string ignored;
+		Socket running = connectTo(address, ignored);
+		if (running != InvalidSocket) {
+			closeSocket(running);
+			error = "another server is listening there";
+			return InvalidSocket;
+		}
+		if (!isAddressFile(address)) {
+			error = address + " exists and is not a socket";
+			return InvalidSocket;
+		}
+		std::remove(address.c_str());
+	}
+
+	Socket listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == InvalidSocket) {
+		Socket tcp = listenTcp(0, boundPort, error);
+		if (tcp == InvalidSocket)
+			return InvalidSocket;
+		std::ofstream file(address);
+		if (!(file << "tcp:" << boundPort << '\n')) {
+			error = "cannot write " + address;
+			closeSocket(tcp);
+			return InvalidSocket;
+		}
+		return tcp;
+	}
+	if (bind(listener, reinterpret_cast<sockaddr*>(&unixPath), sizeof(unixPath)) != 0 ||
+		listen(listener, SOMAXCONN) != 0) {
+		error = lastError();
+		closeSocket(listener);
+		return InvalidSocket;
+	}
+	return listener;
+}
+
+inline Socket acceptClient(Socket listener) {
+	Socket connection = accept(listener, nullptr, nullptr);
+	if (connection != InvalidSocket)
+		configureConnection(connection);
+	return connection;
+}
+
+// Removes the socket file (or the redirect file) of a path address.
+inline void removeAddress(const std::string& address) {
+	unsigned short port = 0;
+	if (!parseTcpAddress(address, port))
+		std::remove(address.c_str());
+}
+
+} // namespace ipc